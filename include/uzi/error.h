@@ -33,7 +33,13 @@
 
 #define ERROR_INVALID_HANDLE								0x00000006
 #define ERROR_INVALID_PARAMETER								0x00000057
+#define ERROR_ALREADY_EXISTS								0x000000B7
+#define ERROR_NOT_OWNER									0x00000120
+#define ERROR_TOO_MANY_POSTS								0x0000012A
+#define ERROR_NOT_FOUND									0x00000490
 #define ERROR_INTERNAL_ERROR								0x0000054F
+#define ERROR_NO_SYSTEM_RESOURCES							0x000005AA
+#define ERROR_TIMEOUT									0x000005B4
 
 #define WSAEINTR									0x00002714
 #define WSAEBADF									0x00002719
@@ -149,6 +149,7 @@ UZI_API LONG InterlockedIncrement(LONG volatile *Addend);
 UZI_API LONG InterlockedDecrement(LONG volatile *Addend);
 
 UZI_API LONG InterlockedExchange(LONG volatile *Target, LONG Value);
+UZI_API PVOID InterlockedExchangePointer(PVOID volatile *Target, PVOID Value);
 UZI_API LONG InterlockedExchangeAdd(LONG volatile *Addend, LONG Value);
 
 UZI_API LONG InterlockedCompareExchange(LONG volatile *Destination, LONG Exchange, LONG Comperand);
@@ -184,6 +185,12 @@ UZI_API LONGLONG InterlockedCompareExchange64(LONGLONG volatile *Destination, LO
 
 #endif
 
+#ifndef _WIN32
+
+UZI_API LONGLONG InterlockedExchangeAdd64(LONGLONG volatile *Addend, LONGLONG Value);
+
+#endif
+
 /* Doubly-Linked List */
 
 UZI_API VOID InitializeListHead(UZI_PLIST_ENTRY ListHead);
@@ -57,13 +57,10 @@ UZI_API BOOL ResetEvent(HANDLE hEvent);
 
 /* Critical Section */
 
-#if defined(__linux__)
 /**
- * Linux NPTL thread synchronization primitives are implemented using
- * the futex system calls ... we can't beat futex with a spin loop.
+ * Define UZI_CRITICAL_SECTION_DISABLE_SPINCOUNT when building libuzi to
+ * always block right away on a busy critical section instead of spinning.
  */
-#define UZI_CRITICAL_SECTION_DISABLE_SPINCOUNT
-#endif
 
 typedef struct _RTL_CRITICAL_SECTION
 {
@@ -92,6 +89,55 @@ UZI_API VOID LeaveCriticalSection(LPCRITICAL_SECTION lpCriticalSection);
 
 UZI_API VOID DeleteCriticalSection(LPCRITICAL_SECTION lpCriticalSection);
 
+/* Slim Reader/Writer (SRW) Lock */
+
+typedef struct _RTL_SRWLOCK
+{
+	PVOID Ptr;
+} RTL_SRWLOCK, *PRTL_SRWLOCK;
+
+#define RTL_SRWLOCK_INIT	{ 0 }
+
+typedef RTL_SRWLOCK SRWLOCK, *PSRWLOCK;
+
+#define SRWLOCK_INIT		RTL_SRWLOCK_INIT
+
+UZI_API VOID InitializeSRWLock(PSRWLOCK SRWLock);
+
+UZI_API VOID AcquireSRWLockExclusive(PSRWLOCK SRWLock);
+UZI_API VOID AcquireSRWLockShared(PSRWLOCK SRWLock);
+
+UZI_API BOOLEAN TryAcquireSRWLockExclusive(PSRWLOCK SRWLock);
+UZI_API BOOLEAN TryAcquireSRWLockShared(PSRWLOCK SRWLock);
+
+UZI_API VOID ReleaseSRWLockExclusive(PSRWLOCK SRWLock);
+UZI_API VOID ReleaseSRWLockShared(PSRWLOCK SRWLock);
+
+/* Condition Variable */
+
+typedef struct _RTL_CONDITION_VARIABLE
+{
+	PVOID Ptr;
+} RTL_CONDITION_VARIABLE, *PRTL_CONDITION_VARIABLE;
+
+#define RTL_CONDITION_VARIABLE_INIT		{ 0 }
+#define RTL_CONDITION_VARIABLE_LOCKMODE_SHARED	0x1
+
+typedef RTL_CONDITION_VARIABLE CONDITION_VARIABLE, *PCONDITION_VARIABLE;
+
+#define CONDITION_VARIABLE_INIT			RTL_CONDITION_VARIABLE_INIT
+#define CONDITION_VARIABLE_LOCKMODE_SHARED	RTL_CONDITION_VARIABLE_LOCKMODE_SHARED
+
+UZI_API VOID InitializeConditionVariable(PCONDITION_VARIABLE ConditionVariable);
+
+UZI_API BOOL SleepConditionVariableCS(PCONDITION_VARIABLE ConditionVariable,
+		PCRITICAL_SECTION CriticalSection, DWORD dwMilliseconds);
+UZI_API BOOL SleepConditionVariableSRW(PCONDITION_VARIABLE ConditionVariable,
+		PSRWLOCK SRWLock, DWORD dwMilliseconds, ULONG Flags);
+
+UZI_API VOID WakeConditionVariable(PCONDITION_VARIABLE ConditionVariable);
+UZI_API VOID WakeAllConditionVariable(PCONDITION_VARIABLE ConditionVariable);
+
 /* Sleep */
 
 UZI_API VOID Sleep(DWORD dwMilliseconds);
@@ -103,6 +149,7 @@ UZI_API DWORD SleepEx(DWORD dwMilliseconds, BOOL bAlertable);
 
 #define WAIT_OBJECT_0		0x00000000L
 #define WAIT_ABANDONED		0x00000080L
+#define WAIT_IO_COMPLETION	0x000000C0L
 
 #ifndef WAIT_TIMEOUT
 #define WAIT_TIMEOUT		0x00000102L
@@ -115,6 +162,17 @@ UZI_API DWORD SleepEx(DWORD dwMilliseconds, BOOL bAlertable);
 UZI_API DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds);
 UZI_API DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll, DWORD dwMilliseconds);
 
+/**
+ * Alertable waits (bAlertable TRUE) run the APCs queued to the calling
+ * thread with QueueUserAPC, and return WAIT_IO_COMPLETION when they ran
+ * any, before the handles are signaled or the timeout expires. Only threads
+ * created by CreateThread can be targeted by APCs.
+ */
+
+UZI_API DWORD WaitForSingleObjectEx(HANDLE hHandle, DWORD dwMilliseconds, BOOL bAlertable);
+UZI_API DWORD WaitForMultipleObjectsEx(DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll,
+		DWORD dwMilliseconds, BOOL bAlertable);
+
 /* Waitable Timer */
 
 #define CREATE_WAITABLE_TIMER_MANUAL_RESET		0x00000001
@@ -281,6 +339,87 @@ UZI_API int SetEventFileDescriptor(HANDLE hEvent, int FileDescriptor, ULONG mode
 
 UZI_API void* GetEventWaitObject(HANDLE hEvent);
 
+UZI_API BOOL IsEventSet(HANDLE hEvent);
+
+UZI_API BOOL SetEvents(DWORD nCount, const HANDLE* lpHandles);
+UZI_API BOOL ResetEvents(DWORD nCount, const HANDLE* lpHandles);
+
+/**
+ * WaitForSemaphoreN takes lCount permits at once, or none if the timeout
+ * expires first. On Windows, the permits are not taken atomically: they are
+ * taken one by one within the timeout and given back on failure, so waiters
+ * holding some permits while blocking for the others can starve each other.
+ */
+
+UZI_API DWORD WaitForSemaphoreN(HANDLE hSemaphore, LONG lCount, DWORD dwMilliseconds);
+
+/**
+ * The Until variants wait until an absolute deadline in nanoseconds of the
+ * monotonic clock (see GetMonotonicTimeNs) rather than for a relative
+ * timeout, so that a caller waiting in a loop keeps a fixed deadline and
+ * gets sub-millisecond precision. A deadline in the past only checks the
+ * handles, WAIT_DEADLINE_INFINITE never times out.
+ */
+
+#define WAIT_DEADLINE_INFINITE		((ULONGLONG) -1)
+
+UZI_API DWORD WaitForSingleObjectUntil(HANDLE hHandle, ULONGLONG DeadlineNs);
+UZI_API DWORD WaitForMultipleObjectsUntil(DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll,
+		ULONGLONG DeadlineNs);
+
+#ifndef _WIN32
+
+/**
+ * Wait sets keep a set of handles registered with the kernel, so that
+ * repeated waits on the same handles do not pay for them on each call.
+ * WaitSetWait returns WAIT_OBJECT_0 with the signaled handles (at most
+ * nCount) and their number, WAIT_TIMEOUT or WAIT_FAILED. Wait sets are
+ * closed with CloseHandle.
+ */
+
+UZI_API HANDLE CreateWaitSet(void);
+UZI_API BOOL WaitSetAdd(HANDLE hWaitSet, HANDLE hHandle);
+UZI_API BOOL WaitSetRemove(HANDLE hWaitSet, HANDLE hHandle);
+UZI_API DWORD WaitSetWait(HANDLE hWaitSet, HANDLE* lpHandles, DWORD nCount,
+		LPDWORD lpSignaledCount, DWORD dwMilliseconds);
+
+/**
+ * WaitForManyObjects waits on any number of handles and returns the indices
+ * of all the signaled handles (lpIndices must hold nCount indices). Calls
+ * on the same handles only pay for the handles which changed since the
+ * previous call of the thread, and for the signaled ones.
+ */
+
+UZI_API DWORD WaitForManyObjects(DWORD nCount, const HANDLE* lpHandles, LPDWORD lpIndices,
+		LPDWORD lpReadyCount, DWORD dwMilliseconds);
+
+/**
+ * WaitForMultipleObjectsReady waits like WaitForMultipleObjects in wait-any
+ * mode, but acquires all the signaled handles in one call and stores their
+ * indices in lpIndices (nCount entries), in handle order starting from
+ * dwStartIndex and wrapping around. Passing the index following the last
+ * handle served as the next start index serves busy handles round-robin
+ * instead of always preferring the first ones.
+ */
+
+UZI_API DWORD WaitForMultipleObjectsReady(DWORD nCount, const HANDLE* lpHandles, DWORD dwStartIndex,
+		LPDWORD lpIndices, LPDWORD lpReadyCount, DWORD dwMilliseconds);
+
+/**
+ * Spin-then-block waits: single-object waits on a handle with a spin count
+ * (or through WaitForSingleObjectSpin) check the object state in user space
+ * up to that many times before blocking in the kernel, which avoids the
+ * context switches of a handoff to a thread signaling within microseconds.
+ * Spinning applies to events, mutexes and semaphores (only to mutexes
+ * without futexes) and never happens on a single processor. A spin count
+ * of 0 disables spinning.
+ */
+
+UZI_API BOOL SetHandleSpinCount(HANDLE hHandle, DWORD dwSpinCount);
+UZI_API DWORD WaitForSingleObjectSpin(HANDLE hHandle, DWORD dwSpinCount, DWORD dwMilliseconds);
+
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -205,6 +205,13 @@ UZI_API ULONGLONG winpr_GetTickCount64(void);
 
 UZI_API DWORD GetTickCountPrecise(void);
 
+/**
+ * Nanoseconds of the monotonic clock (CLOCK_MONOTONIC), the clock of the
+ * absolute deadlines taken by WaitForSingleObjectUntil and
+ * WaitForMultipleObjectsUntil.
+ */
+UZI_API ULONGLONG GetMonotonicTimeNs(void);
+
 UZI_API BOOL IsProcessorFeaturePresentEx(DWORD ProcessorFeature);
 
 /* extended flags */
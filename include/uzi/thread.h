@@ -52,6 +52,12 @@ UZI_API BOOL SwitchToThread(void);
 
 UZI_API BOOL TerminateThread(HANDLE hThread, DWORD dwExitCode);
 
+/* Asynchronous Procedure Calls */
+
+typedef VOID (*PAPCFUNC)(ULONG_PTR Parameter);
+
+UZI_API DWORD QueueUserAPC(PAPCFUNC pfnAPC, HANDLE hThread, ULONG_PTR dwData);
+
 #else
 
 /*
@@ -44,21 +44,185 @@ typedef void* UZI_HANDLE;
 #define UZI_INFINITE			0xFFFFFFFF
 #define UZI_WAIT_OBJECT_0		0x00000000
 #define UZI_WAIT_ABANDONED		0x00000080
+#define UZI_WAIT_IO_COMPLETION		0x000000C0
 #define UZI_WAIT_TIMEOUT		0x00000102
 #define UZI_WAIT_FAILED			0xFFFFFFFF
 
 UZI_HANDLE UziCreateEvent(bool manualReset, bool initialState);
 bool UziSetEvent(UZI_HANDLE handle);
 bool UziResetEvent(UZI_HANDLE handle);
+bool UziSetEvents(uint32_t nCount, const UZI_HANDLE* handles);
+bool UziResetEvents(uint32_t nCount, const UZI_HANDLE* handles);
 bool UziEventIsSet(UZI_HANDLE handle);
 bool UziCloseHandle(UZI_HANDLE handle);
 
 uint32_t UziWaitSingle(UZI_HANDLE handle, uint32_t timeout);
 uint32_t UziWaitMulti(uint32_t nCount, const UZI_HANDLE* handles, bool waitAll, uint32_t timeout);
 
+/**
+ * The Until variants take an absolute deadline in nanoseconds of the
+ * monotonic clock returned by UziGetMonotonicTimeNs (UZI_DEADLINE_INFINITE
+ * never times out), for waits needing sub-millisecond precision.
+ */
+#define UZI_DEADLINE_INFINITE		((uint64_t) -1)
+
+uint64_t UziGetMonotonicTimeNs(void);
+uint32_t UziWaitSingleUntil(UZI_HANDLE handle, uint64_t deadline);
+uint32_t UziWaitMultiUntil(uint32_t nCount, const UZI_HANDLE* handles, bool waitAll, uint64_t deadline);
+
+/**
+ * UziWaitMany waits on any number of handles (UZI_MAX_HANDLES does not
+ * apply) and stores the indices of all the signaled handles in indices,
+ * which must hold nCount entries. It returns UZI_WAIT_OBJECT_0 with the
+ * number of indices in readyCount, UZI_WAIT_TIMEOUT or UZI_WAIT_FAILED.
+ */
+uint32_t UziWaitMany(uint32_t nCount, const UZI_HANDLE* handles, uint32_t* indices,
+	uint32_t* readyCount, uint32_t timeout);
+
+/**
+ * UziWaitReady waits on up to UZI_MAX_HANDLES handles and acquires all the
+ * signaled ones at once, storing their indices in indices in handle order
+ * starting from startIndex (round-robin when the caller advances it).
+ */
+uint32_t UziWaitReady(uint32_t nCount, const UZI_HANDLE* handles, uint32_t startIndex,
+	uint32_t* indices, uint32_t* readyCount, uint32_t timeout);
+
+/**
+ * Spin-then-block waits: UziWaitSingle on a handle given a spin count with
+ * UziSetSpinCount, or UziWaitSingleSpin, checks the handle up to spinCount
+ * times in user space before blocking in the kernel.
+ */
+bool UziSetSpinCount(UZI_HANDLE handle, uint32_t spinCount);
+uint32_t UziWaitSingleSpin(UZI_HANDLE handle, uint32_t spinCount, uint32_t timeout);
+
+typedef void (*UZI_APC_FUNC)(uintptr_t param);
+
+/**
+ * UziQueueAPC queues fn to run on a thread (a handle returned by
+ * CreateThread) during its next alertable wait: UziWaitSingleEx or
+ * UziSleepEx with alertable set, which return UZI_WAIT_IO_COMPLETION once
+ * they ran the queued calls.
+ */
+bool UziQueueAPC(UZI_HANDLE thread, UZI_APC_FUNC fn, uintptr_t param);
+uint32_t UziWaitSingleEx(UZI_HANDLE handle, uint32_t timeout, bool alertable);
+uint32_t UziSleepEx(uint32_t timeout, bool alertable);
+
+#define UZI_HANDLE_TYPE_ALL			0
+#define UZI_HANDLE_TYPE_PROCESS			1
+#define UZI_HANDLE_TYPE_THREAD			2
+#define UZI_HANDLE_TYPE_EVENT			3
+#define UZI_HANDLE_TYPE_MUTEX			4
+#define UZI_HANDLE_TYPE_SEMAPHORE		5
+#define UZI_HANDLE_TYPE_TIMER			6
+#define UZI_HANDLE_TYPE_TIMER_QUEUE		11
+#define UZI_HANDLE_TYPE_TIMER_QUEUE_TIMER	12
+#define UZI_HANDLE_TYPE_WAIT_SET		14
+
+/**
+ * Object pool counters, see UziGetPoolStats.
+ * The pool hit rate is hits / (hits + misses).
+ */
+
+struct uzi_pool_stats
+{
+	uint64_t hits; /* objects reused from a pool */
+	uint64_t misses; /* objects allocated because the pool was empty */
+	uint64_t releases; /* objects given back to a pool */
+	uint64_t trims; /* objects freed because the pool was full */
+	uint32_t shared; /* objects in the shared free list, thread caches excluded */
+};
+typedef struct uzi_pool_stats UZI_POOL_STATS;
+
+bool UziGetPoolStats(uint32_t handleType, UZI_POOL_STATS* stats);
+
+/**
+ * Handle counters, see UziGetHandleStats.
+ * UZI_HANDLE_TYPE_ALL returns the totals for all handle types.
+ */
+
+struct uzi_handle_stats
+{
+	uint32_t live; /* handles currently open */
+	uint32_t peak; /* highest number of handles open at the same time */
+	uint64_t created; /* handles created since startup */
+	uint32_t fds; /* file descriptors currently held by handles */
+	uint32_t peakFds; /* highest number of file descriptors held at the same time */
+};
+typedef struct uzi_handle_stats UZI_HANDLE_STATS;
+
+bool UziGetHandleStats(uint32_t handleType, UZI_HANDLE_STATS* stats);
+
+/**
+ * Spin wait counters, see UziGetSpinStats.
+ * UZI_HANDLE_TYPE_ALL returns the totals for all handle types.
+ */
+
+struct uzi_spin_stats
+{
+	uint64_t hits; /* waits satisfied while spinning */
+	uint64_t misses; /* waits which spun, then blocked in the kernel */
+};
+typedef struct uzi_spin_stats UZI_SPIN_STATS;
+
+bool UziGetSpinStats(uint32_t handleType, UZI_SPIN_STATS* stats);
+
+#define UZI_LOCK_CRITICAL_SECTION	1
+#define UZI_LOCK_MUTEX			2
+
+#define UZI_LOCK_STATS_HOLD_BUCKETS	16
+
+struct uzi_lock_stats
+{
+	uint32_t lockType; /* UZI_LOCK_CRITICAL_SECTION or UZI_LOCK_MUTEX */
+	const void* lock; /* address of the critical section or mutex object */
+	const void* callSite; /* return address of the call which created the lock */
+	uint64_t acquisitions;
+	uint64_t contended; /* acquisitions which had to wait */
+	uint64_t waitTotal; /* total wait time of contended acquisitions, in ns */
+	uint64_t waitMax; /* longest wait time, in ns */
+	uint64_t holdHistogram[UZI_LOCK_STATS_HOLD_BUCKETS]; /* bucket i counts holds shorter than 2^i us, the last one all longer holds */
+};
+typedef struct uzi_lock_stats UZI_LOCK_STATS;
+
+/**
+ * Lock profiling: critical sections and mutexes created while it is enabled
+ * record their acquisitions, contention and hold times. UziGetLockStats
+ * fills up to count entries, most contended locks first, and returns the
+ * number of entries filled. UziDumpLockStats prints them to stderr.
+ */
+bool UziSetLockProfiling(bool enabled);
+uint32_t UziGetLockStats(UZI_LOCK_STATS* stats, uint32_t count);
+void UziDumpLockStats(uint32_t count);
+
+#define UZI_WAIT_STATS_BUCKETS		16
+
+struct uzi_wait_stats
+{
+	uint64_t waits;
+	uint64_t immediate; /* waits which returned on the first check of their handles */
+	uint64_t blocked; /* waits which spun or blocked, whatever they returned */
+	uint64_t timeouts; /* waits which returned UZI_WAIT_TIMEOUT, blocked or not */
+	uint64_t spurious; /* wakeups on a handle another waiter consumed first */
+	uint64_t blockedTotal; /* total time spent in blocked waits, in ns */
+	uint64_t latencyHistogram[UZI_WAIT_STATS_BUCKETS]; /* bucket i counts blocked waits shorter than 2^i us, the last one all longer waits */
+};
+typedef struct uzi_wait_stats UZI_WAIT_STATS;
+
+/**
+ * Wait profiling: while it is enabled, threads count their waits on handles
+ * and how long the blocked ones took, per handle type. Waits on several
+ * handles are accounted to the handle which ended them, or to the first
+ * handle on timeouts. UziGetWaitStats and UziResetWaitStats work on the
+ * counters of the calling thread; UZI_HANDLE_TYPE_ALL returns the totals.
+ */
+bool UziSetWaitProfiling(bool enabled);
+bool UziGetWaitStats(uint32_t handleType, UZI_WAIT_STATS* stats);
+void UziResetWaitStats(void);
+
+/* large enough and aligned for a CRITICAL_SECTION (40 bytes on 64-bit) */
 struct uzi_cs
 {
-	uint8_t opaque[32];
+	uint64_t opaque[5];
 };
 typedef struct uzi_cs UZI_CS;
 
@@ -68,6 +232,86 @@ bool UziTryEnterCS(UZI_CS* cs);
 void UziLeaveCS(UZI_CS* cs);
 void UziDeleteCS(UZI_CS* cs);
 
+/**
+ * Fair queued lock (MCS lock): threads get the lock in the order they asked
+ * for it, each waiting thread spinning on its own cache line before
+ * blocking. Prefer it to a critical section for heavily contended sections
+ * where tail latency matters more than throughput. Not recursive, needs no
+ * teardown; UZI_QUEUE_LOCK_INIT initializes it statically.
+ */
+struct uzi_queue_lock
+{
+	void* volatile tail; /* queue node of the last thread which asked for the lock */
+	void* owner; /* queue node of the owning thread */
+};
+typedef struct uzi_queue_lock UZI_QUEUE_LOCK;
+
+#define UZI_QUEUE_LOCK_INIT	{ NULL, NULL }
+
+void UziInitQueueLock(UZI_QUEUE_LOCK* lock);
+void UziAcquireQueueLock(UZI_QUEUE_LOCK* lock);
+bool UziTryAcquireQueueLock(UZI_QUEUE_LOCK* lock);
+void UziReleaseQueueLock(UZI_QUEUE_LOCK* lock);
+
+/**
+ * Cache line alignment
+ *
+ * Locks and counters written by different threads must not share a cache
+ * line, or each write invalidates the line in the caches of the other cores
+ * (false sharing). The padded types below are aligned on and fill whole
+ * cache lines, so that neighbours in an array never share one.
+ *
+ * UziAlignedAlloc returns zeroed memory aligned on a cache line, rounded up
+ * to whole cache lines, to be freed with UziAlignedFree.
+ */
+#if defined(__APPLE__) && defined(__aarch64__)
+#define UZI_CACHE_LINE_SIZE	128
+#else
+#define UZI_CACHE_LINE_SIZE	64
+#endif
+
+#ifdef _MSC_VER
+#define UZI_CACHE_ALIGNED	__declspec(align(UZI_CACHE_LINE_SIZE))
+#else
+#define UZI_CACHE_ALIGNED	__attribute__((aligned(UZI_CACHE_LINE_SIZE)))
+#endif
+
+struct UZI_CACHE_ALIGNED uzi_cs_padded
+{
+	UZI_CS cs;
+};
+typedef struct uzi_cs_padded UZI_CS_PADDED;
+
+struct UZI_CACHE_ALIGNED uzi_queue_lock_padded
+{
+	UZI_QUEUE_LOCK lock;
+};
+typedef struct uzi_queue_lock_padded UZI_QUEUE_LOCK_PADDED;
+
+struct UZI_CACHE_ALIGNED uzi_counter_padded
+{
+	volatile int64_t value;
+};
+typedef struct uzi_counter_padded UZI_COUNTER_PADDED;
+
+void* UziAlignedAlloc(size_t size);
+void UziAlignedFree(void* ptr);
+
+/**
+ * Striped lock: an array of padded critical sections for sharding a data
+ * structure, each key always mapping to the same stripe. The number of
+ * stripes is rounded up to a power of two, keys are hashed so that
+ * sequential keys and pointers spread over all the stripes.
+ */
+typedef struct uzi_striped_lock UZI_STRIPED_LOCK;
+
+UZI_STRIPED_LOCK* UziStripedLockNew(uint32_t count, uint32_t spinCount);
+void UziStripedLockFree(UZI_STRIPED_LOCK* striped);
+uint32_t UziStripedLockCount(const UZI_STRIPED_LOCK* striped);
+UZI_CS* UziStripedLockGet(UZI_STRIPED_LOCK* striped, uint64_t key);
+void UziStripedLockEnter(UZI_STRIPED_LOCK* striped, uint64_t key);
+void UziStripedLockLeave(UZI_STRIPED_LOCK* striped, uint64_t key);
+
 int UziUtf8toUtf16(const uint8_t* src, int cchSrc, uint16_t* dst, int cchDst);
 int UziUtf16toUtf8(const uint16_t* src, int cchSrc, uint8_t* dst, int cchDst);
 
@@ -0,0 +1,196 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Condition Variables
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <uzi/synch.h>
+#include <uzi/error.h>
+#include <uzi/interlocked.h>
+
+#include "synch.h"
+
+#ifndef _WIN32
+
+#include <time.h>
+
+/**
+ * A condition variable is a pointer-sized word which needs neither
+ * allocation nor teardown. Its first 32 bits are a sequence number, which
+ * every wake increments and sleeping threads block on with a futex, so that
+ * a wake between the release of the lock and the futex wait is not lost.
+ * Like on Windows, threads may return without having been woken up.
+ *
+ * Requeue on wake all
+ *
+ * Waking up all the threads at once would make them all race for the lock
+ * they need to reacquire, only for one to get it and the others to block
+ * again. WakeAllConditionVariable instead moves the sleeping threads to a
+ * chain word with FUTEX_CMP_REQUEUE and wakes up only the first one. Every
+ * thread returning from a sleep wakes up the next thread of the chain once
+ * it has reacquired its lock, so the woken threads queue on the lock one at
+ * a time. Chain words are shared by the condition variables which hash to
+ * the same slot, at worst causing early returns.
+ *
+ * Without futex support, threads block through the parking lot, and both
+ * wake functions wake up all the threads sleeping on the condition variable.
+ */
+
+#define WINPR_CV_SEQUENCE(_cv)		((LONG volatile*) &(_cv)->Ptr)
+
+#ifdef WITH_FUTEX
+#define WINPR_CV_CHAINS			64
+
+struct winpr_cv_chain
+{
+	LONG volatile Word; /* futex word the threads are requeued to */
+	LONG volatile Pending; /* requeued threads not woken up yet */
+};
+typedef struct winpr_cv_chain WINPR_CV_CHAIN;
+
+static WINPR_CV_CHAIN g_ConditionChains[WINPR_CV_CHAINS];
+
+static WINPR_CV_CHAIN* winpr_cv_GetChain(PCONDITION_VARIABLE ConditionVariable)
+{
+	return &g_ConditionChains[(((ULONG_PTR) ConditionVariable) >> 3) % WINPR_CV_CHAINS];
+}
+
+/* Wakes up the next requeued thread, if any */
+
+static void winpr_cv_WakeChain(WINPR_CV_CHAIN* chain)
+{
+	LONG pending = chain->Pending;
+
+	if (pending <= 0)
+		return;
+
+	if (winpr_futex_wake(&chain->Word, 1) > 0)
+		InterlockedDecrement(&chain->Pending);
+	else /* the remaining threads timed out */
+		InterlockedCompareExchange(&chain->Pending, 0, pending);
+}
+#endif
+
+static BOOL winpr_cv_Sleep(PCONDITION_VARIABLE ConditionVariable, LONG sequence, DWORD dwMilliseconds)
+{
+	int status;
+	struct timespec deadline;
+	const struct timespec* pDeadline = ts_deadline_ms(&deadline, dwMilliseconds);
+
+#ifdef WITH_FUTEX
+	status = winpr_futex_wait(WINPR_CV_SEQUENCE(ConditionVariable), sequence, pDeadline);
+#else
+	status = winpr_parking_wait(WINPR_CV_SEQUENCE(ConditionVariable), sequence, pDeadline);
+#endif
+
+	if (status == ETIMEDOUT)
+	{
+		SetLastError(ERROR_TIMEOUT);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Called with the lock reacquired */
+
+static void winpr_cv_Resume(PCONDITION_VARIABLE ConditionVariable)
+{
+#ifdef WITH_FUTEX
+	winpr_cv_WakeChain(winpr_cv_GetChain(ConditionVariable));
+#endif
+}
+
+VOID InitializeConditionVariable(PCONDITION_VARIABLE ConditionVariable)
+{
+	ConditionVariable->Ptr = NULL;
+}
+
+BOOL SleepConditionVariableCS(PCONDITION_VARIABLE ConditionVariable,
+		PCRITICAL_SECTION CriticalSection, DWORD dwMilliseconds)
+{
+	BOOL status;
+	LONG sequence = *WINPR_CV_SEQUENCE(ConditionVariable);
+
+	LeaveCriticalSection(CriticalSection);
+	status = winpr_cv_Sleep(ConditionVariable, sequence, dwMilliseconds);
+	EnterCriticalSection(CriticalSection);
+
+	winpr_cv_Resume(ConditionVariable);
+	return status;
+}
+
+BOOL SleepConditionVariableSRW(PCONDITION_VARIABLE ConditionVariable,
+		PSRWLOCK SRWLock, DWORD dwMilliseconds, ULONG Flags)
+{
+	BOOL status;
+	LONG sequence = *WINPR_CV_SEQUENCE(ConditionVariable);
+
+	if (Flags & CONDITION_VARIABLE_LOCKMODE_SHARED)
+		ReleaseSRWLockShared(SRWLock);
+	else
+		ReleaseSRWLockExclusive(SRWLock);
+
+	status = winpr_cv_Sleep(ConditionVariable, sequence, dwMilliseconds);
+
+	if (Flags & CONDITION_VARIABLE_LOCKMODE_SHARED)
+		AcquireSRWLockShared(SRWLock);
+	else
+		AcquireSRWLockExclusive(SRWLock);
+
+	winpr_cv_Resume(ConditionVariable);
+	return status;
+}
+
+VOID WakeConditionVariable(PCONDITION_VARIABLE ConditionVariable)
+{
+	InterlockedIncrement(WINPR_CV_SEQUENCE(ConditionVariable));
+
+#ifdef WITH_FUTEX
+	winpr_futex_wake(WINPR_CV_SEQUENCE(ConditionVariable), 1);
+#else
+	winpr_parking_wake(WINPR_CV_SEQUENCE(ConditionVariable));
+#endif
+}
+
+VOID WakeAllConditionVariable(PCONDITION_VARIABLE ConditionVariable)
+{
+	LONG volatile* pSequence = WINPR_CV_SEQUENCE(ConditionVariable);
+#ifdef WITH_FUTEX
+	int moved;
+	LONG sequence;
+	WINPR_CV_CHAIN* chain = winpr_cv_GetChain(ConditionVariable);
+
+	sequence = InterlockedIncrement(pSequence);
+
+	/* another wake changed the sequence meanwhile, requeue its sleepers too */
+	while (((moved = winpr_futex_requeue(pSequence, sequence, &chain->Word)) < 0) && (errno == EAGAIN))
+		sequence = *pSequence;
+
+	if (moved <= 0)
+		return;
+
+	InterlockedExchangeAdd(&chain->Pending, moved);
+	winpr_cv_WakeChain(chain);
+#else
+	InterlockedIncrement(pSequence);
+	winpr_parking_wake(pSequence);
+#endif
+}
+
+#endif
@@ -28,6 +28,7 @@
 #include <uzi/thread.h>
 
 #include "synch.h"
+#include "lockstats.h"
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -37,12 +38,75 @@
 
 #define TAG "critical"
 
-VOID InitializeCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+#ifdef WITH_FUTEX
+/**
+ * With futex support no semaphore is allocated: the storage of the
+ * LockSemaphore field holds a futex word counting the wakeups handed over by
+ * LeaveCriticalSection which have not been taken by a waiting thread yet.
+ * The whole lock state stays inline and initialization cannot fail.
+ */
+#define WINPR_CS_WAKEUPS(_cs)	((LONG volatile*) &(_cs)->LockSemaphore)
+#endif
+
+#if !defined(UZI_CRITICAL_SECTION_DISABLE_SPINCOUNT)
+/**
+ * Adaptive spinning
+ *
+ * Before blocking on a busy critical section, EnterCriticalSection spins
+ * with the processor pause instruction, checking the lock after 1, 2, 4 ...
+ * pauses, up to WINPR_CS_BACKOFF_MAX pauses between two checks.
+ *
+ * The spin budget is learned per critical section, from the average number
+ * of pauses recent acquisitions spun before getting the lock, which follows
+ * the time the lock is held. Threads spin for twice that average, at least
+ * WINPR_CS_SPIN_MIN pauses and at most SpinCount pauses, so that short
+ * critical sections are entered without a system call while long ones
+ * quickly stop spinning.
+ */
+#define WINPR_CS_SPIN_MIN		16
+#define WINPR_CS_BACKOFF_MAX		64
+#endif
+
+/**
+ * DebugInfo
+ *
+ * When lock profiling was enabled at initialization, DebugInfo points to the
+ * WINPR_LOCK_STATS of the critical section, which also holds its spin
+ * estimate. Otherwise DebugInfo stores the spin estimate itself, shifted
+ * left by one with the low bit set so that it cannot be taken for a pointer.
+ */
+
+static WINPR_LOCK_STATS* _GetLockStats(LPCRITICAL_SECTION lpCriticalSection)
+{
+	ULONG_PTR value = (ULONG_PTR) lpCriticalSection->DebugInfo;
+
+	return (value & 1) ? NULL : (WINPR_LOCK_STATS*) value;
+}
+
+#if !defined(UZI_CRITICAL_SECTION_DISABLE_SPINCOUNT)
+static LONG _GetSpinEstimate(LPCRITICAL_SECTION lpCriticalSection)
 {
-	InitializeCriticalSectionEx(lpCriticalSection, 0, 0);
+	WINPR_LOCK_STATS* stats = _GetLockStats(lpCriticalSection);
+
+	if (stats)
+		return stats->SpinEstimate;
+
+	return (LONG) ((ULONG_PTR) lpCriticalSection->DebugInfo >> 1);
 }
 
-BOOL InitializeCriticalSectionEx(LPCRITICAL_SECTION lpCriticalSection, DWORD dwSpinCount, DWORD Flags)
+static void _SetSpinEstimate(LPCRITICAL_SECTION lpCriticalSection, LONG estimate)
+{
+	WINPR_LOCK_STATS* stats = _GetLockStats(lpCriticalSection);
+
+	if (stats)
+		stats->SpinEstimate = estimate;
+	else
+		lpCriticalSection->DebugInfo = (PVOID) (((ULONG_PTR) estimate << 1) | 1);
+}
+#endif
+
+static BOOL _InitializeCriticalSection(LPCRITICAL_SECTION lpCriticalSection, DWORD dwSpinCount,
+		DWORD Flags, const void* CallSite)
 {
 	/**
 	 * See http://msdn.microsoft.com/en-us/library/ff541979(v=vs.85).aspx
@@ -59,11 +123,17 @@ BOOL InitializeCriticalSectionEx(LPCRITICAL_SECTION lpCriticalSection, DWORD dwS
 		return FALSE;
 	}
 
-	lpCriticalSection->DebugInfo = NULL;
+	lpCriticalSection->DebugInfo = winpr_LockStats_New(UZI_LOCK_CRITICAL_SECTION, lpCriticalSection, CallSite);
 	lpCriticalSection->LockCount = -1;
 	lpCriticalSection->SpinCount = 0;
 	lpCriticalSection->RecursionCount = 0;
 	lpCriticalSection->OwningThread = NULL;
+#ifdef WITH_FUTEX
+	lpCriticalSection->LockSemaphore = NULL;
+	*WINPR_CS_WAKEUPS(lpCriticalSection) = 0;
+	SetCriticalSectionSpinCount(lpCriticalSection, dwSpinCount);
+	return TRUE;
+#else
 	lpCriticalSection->LockSemaphore = (winpr_sem_t*) malloc(sizeof(winpr_sem_t));
 	if (!lpCriticalSection->LockSemaphore)
 		return FALSE;
@@ -79,17 +149,36 @@ BOOL InitializeCriticalSectionEx(LPCRITICAL_SECTION lpCriticalSection, DWORD dwS
 
 out_fail:
 	free(lpCriticalSection->LockSemaphore);
+	winpr_LockStats_Free(_GetLockStats(lpCriticalSection));
+	lpCriticalSection->DebugInfo = NULL;
 	return FALSE;
+#endif
+}
+
+VOID InitializeCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+{
+	_InitializeCriticalSection(lpCriticalSection, 0, 0, __builtin_return_address(0));
+}
+
+BOOL InitializeCriticalSectionEx(LPCRITICAL_SECTION lpCriticalSection, DWORD dwSpinCount, DWORD Flags)
+{
+	return _InitializeCriticalSection(lpCriticalSection, dwSpinCount, Flags, __builtin_return_address(0));
 }
 
 BOOL InitializeCriticalSectionAndSpinCount(LPCRITICAL_SECTION lpCriticalSection, DWORD dwSpinCount)
 {
-	return InitializeCriticalSectionEx(lpCriticalSection, dwSpinCount, 0);
+	return _InitializeCriticalSection(lpCriticalSection, dwSpinCount, 0, __builtin_return_address(0));
+}
+
+BOOL winpr_InitializeCriticalSectionWithCallSite(LPCRITICAL_SECTION lpCriticalSection, DWORD dwSpinCount,
+		DWORD Flags, const void* CallSite)
+{
+	return _InitializeCriticalSection(lpCriticalSection, dwSpinCount, Flags, CallSite);
 }
 
 DWORD SetCriticalSectionSpinCount(LPCRITICAL_SECTION lpCriticalSection, DWORD dwSpinCount)
 {
-#if !defined(WINPR_CRITICAL_SECTION_DISABLE_SPINCOUNT)
+#if !defined(UZI_CRITICAL_SECTION_DISABLE_SPINCOUNT)
 	SYSTEM_INFO sysinfo;
 	DWORD dwPreviousSpinCount = lpCriticalSection->SpinCount;
 
@@ -111,7 +200,20 @@ DWORD SetCriticalSectionSpinCount(LPCRITICAL_SECTION lpCriticalSection, DWORD dw
 
 static VOID _WaitForCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
 {
-#if defined(__APPLE__)
+#if defined(WITH_FUTEX)
+	LONG wakeups;
+	LONG volatile* word = WINPR_CS_WAKEUPS(lpCriticalSection);
+
+	for (;;)
+	{
+		wakeups = *word;
+
+		if (!wakeups)
+			winpr_futex_wait(word, 0, NULL);
+		else if (InterlockedCompareExchange(word, wakeups - 1, wakeups) == wakeups)
+			return;
+	}
+#elif defined(__APPLE__)
 	semaphore_wait(*((winpr_sem_t*) lpCriticalSection->LockSemaphore));
 #else
 	sem_wait((winpr_sem_t*) lpCriticalSection->LockSemaphore);
@@ -120,45 +222,92 @@ static VOID _WaitForCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
 
 static VOID _UnWaitCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
 {
-#if defined __APPLE__
+#if defined(WITH_FUTEX)
+	InterlockedIncrement(WINPR_CS_WAKEUPS(lpCriticalSection));
+	winpr_futex_wake(WINPR_CS_WAKEUPS(lpCriticalSection), 1);
+#elif defined __APPLE__
 	semaphore_signal(*((winpr_sem_t*) lpCriticalSection->LockSemaphore));
 #else
 	sem_post((winpr_sem_t*) lpCriticalSection->LockSemaphore);
 #endif
 }
 
-VOID EnterCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+#if !defined(UZI_CRITICAL_SECTION_DISABLE_SPINCOUNT)
+/* Spins until the section is free or the spin budget is exhausted, returns TRUE if the lock was acquired */
+static BOOL _SpinForCriticalSection(LPCRITICAL_SECTION lpCriticalSection, ULONG SpinCount)
 {
-#if !defined(WINPR_CRITICAL_SECTION_DISABLE_SPINCOUNT)
-	ULONG SpinCount = lpCriticalSection->SpinCount;
+	ULONG index;
+	ULONG spins = 0;
+	ULONG pauses = 1;
+	LONG estimate = _GetSpinEstimate(lpCriticalSection);
+	ULONG budget = 2 * (ULONG) estimate + WINPR_CS_SPIN_MIN;
 
-	/* If we're lucky or if the current thread is already owner we can return early */
-	if (SpinCount && TryEnterCriticalSection(lpCriticalSection))
-		return;
+	if (budget > SpinCount)
+		budget = SpinCount;
 
-	/* Spin requested times but don't compete with another waiting thread */
-	while (SpinCount-- && lpCriticalSection->LockCount < 1)
+	/* Don't compete with another waiting thread */
+	while ((spins < budget) && (lpCriticalSection->LockCount < 1))
 	{
+		for (index = 0; index < pauses; index++)
+			winpr_cpu_relax();
+
+		spins += pauses;
+
 		/* Atomically try to acquire and check the if the section is free. */
-		if (InterlockedCompareExchange(&lpCriticalSection->LockCount, 0, -1) == -1)
+		if ((lpCriticalSection->LockCount == -1) &&
+			(InterlockedCompareExchange(&lpCriticalSection->LockCount, 0, -1) == -1))
 		{
 			lpCriticalSection->RecursionCount = 1;
 			lpCriticalSection->OwningThread = (HANDLE)(ULONG_PTR) GetCurrentThreadId();
-			return;
+			_SetSpinEstimate(lpCriticalSection, estimate + ((LONG) spins - estimate) / 8);
+			return TRUE;
 		}
 
-		/* Failed to get the lock. Let the scheduler know that we're spinning. */
-		if (sched_yield()!=0)
-		{
-			/**
-			 * On some operating systems sched_yield is a stub.
-			 * usleep should at least trigger a context switch if any thread is waiting.
-			 * A ThreadYield() would be nice in winpr ...
-			 */
-			usleep(1);
-		}
+		if (pauses < WINPR_CS_BACKOFF_MAX)
+			pauses <<= 1;
+	}
+
+	/* Spinning did not pay off, spin less next time */
+	_SetSpinEstimate(lpCriticalSection, estimate - estimate / 8);
+	return FALSE;
+}
+#endif
+
+static BOOL _TryEnterCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+{
+	HANDLE current_thread = (HANDLE)(ULONG_PTR) GetCurrentThreadId();
+
+	/* Atomically acquire the the lock if the section is free. */
+	if (InterlockedCompareExchange(&lpCriticalSection->LockCount, 0, -1) == -1)
+	{
+		lpCriticalSection->RecursionCount = 1;
+		lpCriticalSection->OwningThread = current_thread;
+		return TRUE;
+	}
+
+	/* Section is already locked. Check if it is owned by the current thread. */
+	if (lpCriticalSection->OwningThread == current_thread)
+	{
+		/* Recursion, return success */
+		lpCriticalSection->RecursionCount++;
+		InterlockedIncrement(&lpCriticalSection->LockCount);
+		return TRUE;
 	}
 
+	return FALSE;
+}
+
+static VOID _EnterCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+{
+#if !defined(UZI_CRITICAL_SECTION_DISABLE_SPINCOUNT)
+	ULONG SpinCount = lpCriticalSection->SpinCount;
+
+	/* If we're lucky or if the current thread is already owner we can return early */
+	if (SpinCount && _TryEnterCriticalSection(lpCriticalSection))
+		return;
+
+	if (SpinCount && _SpinForCriticalSection(lpCriticalSection, SpinCount))
+		return;
 #endif
 
 	/* First try the fastest possible path to get the lock. */
@@ -181,32 +330,45 @@ VOID EnterCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
 	lpCriticalSection->OwningThread = (HANDLE)(ULONG_PTR) GetCurrentThreadId();
 }
 
-BOOL TryEnterCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+VOID EnterCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
 {
-	HANDLE current_thread = (HANDLE)(ULONG_PTR) GetCurrentThreadId();
+	ULONGLONG waitStart;
+	WINPR_LOCK_STATS* stats = _GetLockStats(lpCriticalSection);
 
-	/* Atomically acquire the the lock if the section is free. */
-	if (InterlockedCompareExchange(&lpCriticalSection->LockCount, 0, -1) == -1)
+	if (!stats)
 	{
-		lpCriticalSection->RecursionCount = 1;
-		lpCriticalSection->OwningThread = current_thread;
-		return TRUE;
+		_EnterCriticalSection(lpCriticalSection);
+		return;
 	}
 
-	/* Section is already locked. Check if it is owned by the current thread. */
-	if (lpCriticalSection->OwningThread == current_thread)
-	{
-		/* Recursion, return success */
-		lpCriticalSection->RecursionCount++;
-		InterlockedIncrement(&lpCriticalSection->LockCount);
-		return TRUE;
-	}
+	if (TryEnterCriticalSection(lpCriticalSection))
+		return;
 
-	return FALSE;
+	waitStart = winpr_LockStats_Now();
+	_EnterCriticalSection(lpCriticalSection);
+	winpr_LockStats_Acquired(stats, waitStart);
+}
+
+BOOL TryEnterCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+{
+	WINPR_LOCK_STATS* stats;
+
+	if (!_TryEnterCriticalSection(lpCriticalSection))
+		return FALSE;
+
+	if ((lpCriticalSection->RecursionCount == 1) && (stats = _GetLockStats(lpCriticalSection)))
+		winpr_LockStats_Acquired(stats, 0);
+
+	return TRUE;
 }
 
 VOID LeaveCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
 {
+	WINPR_LOCK_STATS* stats;
+
+	if ((lpCriticalSection->RecursionCount == 1) && (stats = _GetLockStats(lpCriticalSection)))
+		winpr_LockStats_Released(stats);
+
 	/* Decrement RecursionCount and check if this is the last LeaveCriticalSection call ...*/
 	if (--lpCriticalSection->RecursionCount < 1)
 	{
@@ -227,11 +389,16 @@ VOID LeaveCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
 
 VOID DeleteCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
 {
+	winpr_LockStats_Free(_GetLockStats(lpCriticalSection));
+	lpCriticalSection->DebugInfo = NULL;
 	lpCriticalSection->LockCount = -1;
 	lpCriticalSection->SpinCount = 0;
 	lpCriticalSection->RecursionCount = 0;
 	lpCriticalSection->OwningThread = NULL;
 
+#ifdef WITH_FUTEX
+	*WINPR_CS_WAKEUPS(lpCriticalSection) = 0;
+#else
 	if (lpCriticalSection->LockSemaphore != NULL)
 	{
 #if defined __APPLE__
@@ -242,6 +409,7 @@ VOID DeleteCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
 		free(lpCriticalSection->LockSemaphore);
 		lpCriticalSection->LockSemaphore = NULL;
 	}
+#endif
 }
 
 #endif
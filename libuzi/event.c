@@ -28,6 +28,7 @@
 #include <stdlib.h>
 
 #include <uzi/synch.h>
+#include <uzi/interlocked.h>
 
 #ifndef _WIN32
 
@@ -44,6 +45,7 @@
 #include <errno.h>
 
 #include "handle.h"
+#include "pool.h"
 
 #define TAG "event"
 
@@ -62,7 +64,225 @@ static BOOL EventIsHandled(HANDLE handle)
 	return TRUE;
 }
 
+#ifdef HAVE_EVENTFD_H
+#if !defined(WITH_EVENTFD_READ_WRITE)
+static int eventfd_read(int fd, eventfd_t* value)
+{
+	return (read(fd, value, sizeof(*value)) == sizeof(*value)) ? 0 : -1;
+}
+
+static int eventfd_write(int fd, eventfd_t value)
+{
+	return (write(fd, &value, sizeof(value)) == sizeof(value)) ? 0 : -1;
+}
+#endif
+#endif
+
+static BOOL EventCreateFd(WINPR_EVENT* event)
+{
+#ifdef HAVE_EVENTFD_H
+	int fd = eventfd(0, EFD_NONBLOCK);
+
+	if (fd < 0)
+		return FALSE;
+
+	winpr_Handle_TrackFds(HANDLE_TYPE_EVENT, 1);
+#else
+	int fd;
+
+	if (pipe(event->pipe_fd) < 0)
+		return FALSE;
+
+	fd = event->pipe_fd[0];
+	winpr_Handle_TrackFds(HANDLE_TYPE_EVENT, 2);
+#endif
+	event->pipe_fd[0] = fd;
+	return TRUE;
+}
+
+/* Signals the event file descriptor */
+static BOOL EventFdSet(WINPR_EVENT* event)
+{
+	int length;
+#ifdef HAVE_EVENTFD_H
+	eventfd_t val = 1;
+
+	do
+	{
+		length = eventfd_write(event->pipe_fd[0], val);
+	}
+	while ((length < 0) && (errno == EINTR));
+
+	return (length == 0) ? TRUE : FALSE;
+#else
+	length = write(event->pipe_fd[1], "-", 1);
+	return (length == 1) ? TRUE : FALSE;
+#endif
+}
+
+/**
+ * Consumes the signal of the event file descriptor, returns WAIT_OBJECT_0
+ * on success or WAIT_TIMEOUT if the file descriptor was not signaled.
+ */
+static DWORD EventFdConsume(WINPR_EVENT* event)
+{
+	int length;
+
+	do
+	{
+#ifdef HAVE_EVENTFD_H
+		eventfd_t value;
+		length = eventfd_read(event->pipe_fd[0], &value);
+#else
+		char value;
+		length = read(event->pipe_fd[0], &value, 1);
+#endif
+	}
+	while ((length < 0) && (errno == EINTR));
+
+	if (length >= 0)
+		return WAIT_OBJECT_0;
+
+	return (errno == EAGAIN) ? WAIT_TIMEOUT : WAIT_FAILED;
+}
+
+static BOOL EventFdReset(WINPR_EVENT* event)
+{
+	return (EventFdConsume(event) != WAIT_FAILED) ? TRUE : FALSE;
+}
+
+/**
+ * Event State
+ *
+ * The signaled state of an event lives in its State word, so checking an
+ * event, setting a signaled event or resetting a nonsignaled one does not
+ * need any system call. With futex support, threads block on State itself
+ * and the event file descriptor is only created when it is requested, by
+ * GetEventFileDescriptor or by WaitForMultipleObjects. Without it, the file
+ * descriptor is created with the event and waiters poll it.
+ *
+ * The file descriptor mirrors State: the thread which changed State brings
+ * the file descriptor in line under fdLock, with a single write or read.
+ * A thread which changes State then checks for the file descriptor, and the
+ * thread creating the file descriptor publishes it before reading State, so
+ * at least one of them sees the other's change.
+ *
+ * An auto-reset event is consumed by the waiter which manages to switch
+ * State from 1 to 0, and SetEvent only wakes up one blocked waiter. Waiters
+ * woken up through the file descriptor consume the event in the same way,
+ * from the CleanupHandle operation.
+ *
+ * Events attached to an external file descriptor keep using it directly.
+ */
+
+/* Brings the file descriptor in line with State, called with fdLock held */
+static BOOL EventSyncFd(WINPR_EVENT* event)
+{
+	BOOL status;
+	BOOL signaled = event->State ? TRUE : FALSE;
+
+	if (signaled == event->bFdSignaled)
+		return TRUE;
+
+	status = signaled ? EventFdSet(event) : EventFdReset(event);
+
+	if (status)
+		event->bFdSignaled = signaled;
+
+	return status;
+}
+
+static BOOL EventUpdateFd(WINPR_EVENT* event)
+{
+	BOOL status;
+
+	if (event->pipe_fd[0] < 0)
+		return TRUE;
+
+	pthread_mutex_lock(&event->fdLock);
+	status = EventSyncFd(event);
+	pthread_mutex_unlock(&event->fdLock);
+
+	return status;
+}
+
 static int EventGetFd(HANDLE handle)
+{
+	int fd;
+	WINPR_EVENT* event = (WINPR_EVENT*)handle;
+
+	if (!EventIsHandled(handle))
+		return -1;
+
+	if ((fd = event->pipe_fd[0]) >= 0)
+		return fd;
+
+	pthread_mutex_lock(&event->fdLock);
+
+	if ((event->pipe_fd[0] < 0) && EventCreateFd(event))
+	{
+		/* publish the file descriptor before reading State */
+		__sync_synchronize();
+		EventSyncFd(event);
+	}
+
+	fd = event->pipe_fd[0];
+	pthread_mutex_unlock(&event->fdLock);
+
+	return fd;
+}
+
+/* Returns TRUE if the event is signaled, consuming it if it is an auto-reset event */
+static BOOL EventTryAcquire(WINPR_EVENT* event)
+{
+	if (!event->State)
+		return FALSE;
+
+	if (event->bManualReset)
+		return TRUE;
+
+	if (InterlockedCompareExchange(&event->State, 0, 1) != 1)
+		return FALSE;
+
+	EventUpdateFd(event);
+	return TRUE;
+}
+
+static DWORD EventCleanupHandle(HANDLE handle)
+{
+	WINPR_EVENT* event = (WINPR_EVENT*) handle;
+
+	/* another waiter consumed the event first, WAIT_TIMEOUT lets the caller wait again */
+	return EventTryAcquire(event) ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+}
+
+#ifdef WITH_FUTEX
+
+static DWORD EventWait(HANDLE handle, const struct timespec* deadline)
+{
+	int status;
+	WINPR_EVENT* event = (WINPR_EVENT*) handle;
+
+	for (;;)
+	{
+		if (EventTryAcquire(event))
+			return WAIT_OBJECT_0;
+
+		if (deadline && !deadline->tv_sec && !deadline->tv_nsec)
+			return WAIT_TIMEOUT;
+
+		InterlockedIncrement(&event->Waiters);
+		status = winpr_futex_wait(&event->State, 0, deadline);
+		InterlockedDecrement(&event->Waiters);
+
+		if (status == ETIMEDOUT)
+			return EventTryAcquire(event) ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+	}
+}
+
+#endif
+
+static int EventGetAttachedFd(HANDLE handle)
 {
 	WINPR_EVENT* event = (WINPR_EVENT*)handle;
 
@@ -72,6 +292,17 @@ static int EventGetFd(HANDLE handle)
 	return event->pipe_fd[0];
 }
 
+static DWORD EventCleanupAttachedHandle(HANDLE handle)
+{
+	WINPR_EVENT* event = (WINPR_EVENT*) handle;
+
+	/* external file descriptors are never consumed by a wait */
+	if (event->bManualReset || event->bAttached)
+		return WAIT_OBJECT_0;
+
+	return EventFdConsume(event);
+}
+
 static BOOL EventCloseHandle(HANDLE handle)
 {
 	WINPR_EVENT* event = (WINPR_EVENT*) handle;
@@ -85,16 +316,19 @@ static BOOL EventCloseHandle(HANDLE handle)
 		{
 			close(event->pipe_fd[0]);
 			event->pipe_fd[0] = -1;
+			winpr_Handle_TrackFds(HANDLE_TYPE_EVENT, -1);
 		}
 
 		if (event->pipe_fd[1] != -1)
 		{
 			close(event->pipe_fd[1]);
 			event->pipe_fd[1] = -1;
+			winpr_Handle_TrackFds(HANDLE_TYPE_EVENT, -1);
 		}
 	}
 
-	free(event);
+	pthread_mutex_destroy(&event->fdLock);
+	winpr_ObjectPool_Free(HANDLE_TYPE_EVENT, event);
 	return TRUE;
 }
 
@@ -103,45 +337,70 @@ static HANDLE_OPS ops =
 	EventIsHandled,
 	EventCloseHandle,
 	EventGetFd,
-	NULL /* CleanupHandle */
+	EventCleanupHandle,
+#ifdef WITH_FUTEX
+	NULL, /* GetFileSize */
+	NULL, /* FlushFileBuffers */
+	NULL, /* SetEndOfFile */
+	NULL, /* SetFilePointer */
+	NULL, /* SetFilePointerEx */
+	NULL, /* SetFileTime */
+	EventWait
+#endif
+};
+
+/* events attached to an external file descriptor */
+static HANDLE_OPS attachedOps =
+{
+	EventIsHandled,
+	EventCloseHandle,
+	EventGetAttachedFd,
+	EventCleanupAttachedHandle
 };
 
 HANDLE CreateEventW(LPSECURITY_ATTRIBUTES lpEventAttributes, BOOL bManualReset, BOOL bInitialState,
                     LPCWSTR lpName)
 {
-	WINPR_EVENT* event = (WINPR_EVENT*) calloc(1, sizeof(WINPR_EVENT));
+	HANDLE handle;
+	WINPR_EVENT* event = (WINPR_EVENT*) winpr_ObjectPool_New(HANDLE_TYPE_EVENT);
 
 	if (!event)
 		return NULL;
 
 	event->bAttached = FALSE;
 	event->bManualReset = bManualReset;
-	event->ops = &ops;
 	WINPR_HANDLE_SET_TYPE_AND_MODE(event, HANDLE_TYPE_EVENT, FD_READ);
 
-	if (!event->bManualReset)
-		return NULL;
-
 	event->pipe_fd[0] = -1;
 	event->pipe_fd[1] = -1;
 
-#ifdef HAVE_EVENTFD_H
-	event->pipe_fd[0] = eventfd(0, EFD_NONBLOCK);
+	event->ops = &ops;
 
-	if (event->pipe_fd[0] < 0)
+	if (pthread_mutex_init(&event->fdLock, NULL) != 0)
 		goto fail;
-#else
 
-	if (pipe(event->pipe_fd) < 0)
+#ifndef WITH_FUTEX
+	if (!EventCreateFd(event))
+	{
+		pthread_mutex_destroy(&event->fdLock);
 		goto fail;
+	}
 #endif
 
+	handle = winpr_Handle_Register((WINPR_HANDLE*) event);
+
+	if (!handle)
+	{
+		EventCloseHandle(event);
+		return NULL;
+	}
+
 	if (bInitialState)
-		SetEvent(event);
+		SetEvent(handle);
 
-	return (HANDLE)event;
+	return handle;
 fail:
-	free(event);
+	winpr_ObjectPool_Free(HANDLE_TYPE_EVENT, event);
 	return NULL;
 }
 
@@ -151,95 +410,150 @@ HANDLE CreateEventA(LPSECURITY_ATTRIBUTES lpEventAttributes, BOOL bManualReset,
 	return CreateEventW(lpEventAttributes, bManualReset, bInitialState, NULL);
 }
 
-#ifdef HAVE_EVENTFD_H
-#if !defined(WITH_EVENTFD_READ_WRITE)
-static int eventfd_read(int fd, eventfd_t* value)
+static BOOL EventSet(WINPR_EVENT* event)
 {
-	return (read(fd, value, sizeof(*value)) == sizeof(*value)) ? 0 : -1;
-}
+	BOOL status;
 
-static int eventfd_write(int fd, eventfd_t value)
-{
-	return (write(fd, &value, sizeof(value)) == sizeof(value)) ? 0 : -1;
-}
+	if (!event->bAttached)
+	{
+		/* already signaled, nothing to change */
+		if (event->State)
+			return TRUE;
+
+		if (InterlockedExchange(&event->State, 1) != 0)
+			return TRUE;
+
+#ifdef WITH_FUTEX
+		if (event->Waiters)
+			winpr_futex_wake(&event->State, event->bManualReset ? INT_MAX : 1);
 #endif
+		return EventUpdateFd(event);
+	}
+
+#ifdef HAVE_EVENTFD_H
+	status = EventFdSet(event);
+#else
+	status = TRUE;
+
+	if (winpr_Handle_Wait((WINPR_HANDLE*) event, 0) != WAIT_OBJECT_0)
+		status = EventFdSet(event);
 #endif
 
-BOOL SetEvent(HANDLE hEvent)
+	return status;
+}
+
+static BOOL EventReset(WINPR_EVENT* event)
 {
-	ULONG Type;
-	WINPR_HANDLE* Object;
-	int length;
-	BOOL status;
-	WINPR_EVENT* event;
-	status = FALSE;
+	BOOL status = TRUE;
 
-	if (winpr_Handle_GetInfo(hEvent, &Type, &Object))
+	if (!event->bAttached)
 	{
-		event = (WINPR_EVENT*) Object;
-#ifdef HAVE_EVENTFD_H
-		eventfd_t val = 1;
+		if (!event->State)
+			return TRUE;
 
-		do
-		{
-			length = eventfd_write(event->pipe_fd[0], val);
-		}
-		while ((length < 0) && (errno == EINTR));
+		if (InterlockedExchange(&event->State, 0) == 0)
+			return TRUE;
 
-		status = (length == 0) ? TRUE : FALSE;
-#else
+		return EventUpdateFd(event);
+	}
 
-		if (WaitForSingleObject(hEvent, 0) != WAIT_OBJECT_0)
-		{
-			length = write(event->pipe_fd[1], "-", 1);
+	while (status && winpr_Handle_Wait((WINPR_HANDLE*) event, 0) == WAIT_OBJECT_0)
+		status = EventFdReset(event);
 
-			if (length == 1)
-				status = TRUE;
-		}
-		else
-		{
-			status = TRUE;
-		}
+	return status;
+}
 
-#endif
-	}
+BOOL SetEvent(HANDLE hEvent)
+{
+	ULONG Type;
+	WINPR_HANDLE* Object;
 
-	return status;
+	if (!winpr_Handle_GetInfo(hEvent, &Type, &Object) || (Type != HANDLE_TYPE_EVENT))
+		return FALSE;
+
+	return EventSet((WINPR_EVENT*) Object);
 }
 
 BOOL ResetEvent(HANDLE hEvent)
 {
 	ULONG Type;
 	WINPR_HANDLE* Object;
-	int length;
+
+	if (!winpr_Handle_GetInfo(hEvent, &Type, &Object) || (Type != HANDLE_TYPE_EVENT))
+		return FALSE;
+
+	return EventReset((WINPR_EVENT*) Object);
+}
+
+/**
+ * SetEvents / ResetEvents
+ *
+ * Change the state of several events at once. All handles are looked up
+ * and validated once, before any event is changed. Events which are already in the requested
+ * state are skipped without a store, and a system call is only made for
+ * events which have blocked waiters or a file descriptor.
+ */
+
+static BOOL EventBatch(DWORD nCount, const HANDLE* lpHandles, BOOL (*fnApply)(WINPR_EVENT*))
+{
+	DWORD index;
+	ULONG Type;
 	BOOL status = TRUE;
-	WINPR_EVENT* event;
+	WINPR_HANDLE* Object;
+	WINPR_EVENT* stackEvents[MAXIMUM_WAIT_OBJECTS];
+	WINPR_EVENT** events = stackEvents;
 
-	if (!winpr_Handle_GetInfo(hEvent, &Type, &Object))
+	if (!lpHandles && nCount)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
 		return FALSE;
+	}
 
-	event = (WINPR_EVENT*) Object;
+	/* the events are looked up once and changed through these pointers */
+	if (nCount > MAXIMUM_WAIT_OBJECTS)
+	{
+		if (!(events = (WINPR_EVENT**) malloc(nCount * sizeof(WINPR_EVENT*))))
+		{
+			SetLastError(ERROR_NO_SYSTEM_RESOURCES);
+			return FALSE;
+		}
+	}
 
-	while (status && WaitForSingleObject(hEvent, 0) == WAIT_OBJECT_0)
+	for (index = 0; index < nCount; index++)
 	{
-		do
+		if (!winpr_Handle_GetInfo(lpHandles[index], &Type, &Object) || (Type != HANDLE_TYPE_EVENT))
 		{
-#ifdef HAVE_EVENTFD_H
-			eventfd_t value;
-			length = eventfd_read(event->pipe_fd[0], &value);
-#else
-			length = read(event->pipe_fd[0], &length, 1);
-#endif
+			SetLastError(ERROR_INVALID_HANDLE);
+			status = FALSE;
+			goto out;
 		}
-		while ((length < 0) && (errno == EINTR));
 
-		if (length < 0)
+		events[index] = (WINPR_EVENT*) Object;
+	}
+
+	for (index = 0; index < nCount; index++)
+	{
+		if (!fnApply(events[index]))
 			status = FALSE;
 	}
 
+out:
+	if (events != stackEvents)
+		free(events);
+
 	return status;
 }
 
+BOOL SetEvents(DWORD nCount, const HANDLE* lpHandles)
+{
+	return EventBatch(nCount, lpHandles, EventSet);
+}
+
+BOOL ResetEvents(DWORD nCount, const HANDLE* lpHandles)
+{
+	return EventBatch(nCount, lpHandles, EventReset);
+}
+
 #endif
 
 
@@ -250,7 +564,7 @@ HANDLE CreateFileDescriptorEventW(LPSECURITY_ATTRIBUTES lpEventAttributes,
 #ifndef _WIN32
 	WINPR_EVENT* event;
 	HANDLE handle = NULL;
-	event = (WINPR_EVENT*) calloc(1, sizeof(WINPR_EVENT));
+	event = (WINPR_EVENT*) winpr_ObjectPool_New(HANDLE_TYPE_EVENT);
 
 	if (event)
 	{
@@ -258,9 +572,13 @@ HANDLE CreateFileDescriptorEventW(LPSECURITY_ATTRIBUTES lpEventAttributes,
 		event->bManualReset = bManualReset;
 		event->pipe_fd[0] = FileDescriptor;
 		event->pipe_fd[1] = -1;
-		event->ops = &ops;
+		event->ops = &attachedOps;
 		WINPR_HANDLE_SET_TYPE_AND_MODE(event, HANDLE_TYPE_EVENT, mode);
-		handle = (HANDLE) event;
+		pthread_mutex_init(&event->fdLock, NULL);
+		handle = winpr_Handle_Register((WINPR_HANDLE*) event);
+
+		if (!handle)
+			winpr_ObjectPool_Free(HANDLE_TYPE_EVENT, event);
 	}
 
 	return handle;
@@ -304,14 +622,11 @@ int GetEventFileDescriptor(HANDLE hEvent)
 #ifndef _WIN32
 	ULONG Type;
 	WINPR_HANDLE* Object;
-	WINPR_EVENT* event;
 
-	if (!winpr_Handle_GetInfo(hEvent, &Type, &Object))
+	if (!winpr_Handle_GetInfo(hEvent, &Type, &Object) || (Type != HANDLE_TYPE_EVENT))
 		return -1;
 
-	event = (WINPR_EVENT*) Object;
-
-	return event->pipe_fd[0];
+	return winpr_Handle_getFd(Object);
 #else
 	return -1;
 #endif
@@ -329,15 +644,19 @@ int SetEventFileDescriptor(HANDLE hEvent, int FileDescriptor, ULONG mode)
 	WINPR_HANDLE* Object;
 	WINPR_EVENT* event;
 
-	if (!winpr_Handle_GetInfo(hEvent, &Type, &Object))
+	if (!winpr_Handle_GetInfo(hEvent, &Type, &Object) || (Type != HANDLE_TYPE_EVENT))
 		return -1;
 
 	event = (WINPR_EVENT*) Object;
 
 	if (!event->bAttached && event->pipe_fd[0] >= 0)
+	{
 		close(event->pipe_fd[0]);
+		winpr_Handle_TrackFds(HANDLE_TYPE_EVENT, -1);
+	}
 
 	event->bAttached = TRUE;
+	event->ops = &attachedOps;
 	event->Mode = mode;
 	event->pipe_fd[0] = FileDescriptor;
 	return 0;
@@ -369,3 +688,61 @@ void* GetEventWaitObject(HANDLE hEvent)
 #endif
 }
 
+/**
+ * Returns TRUE if the event is signaled, without consuming the signal of
+ * an auto-reset event. This does not need a system call unless the event
+ * is attached to an external file descriptor.
+ */
+
+BOOL IsEventSet(HANDLE hEvent)
+{
+#ifndef _WIN32
+	ULONG Type;
+	WINPR_HANDLE* Object;
+	WINPR_EVENT* event;
+
+	if (!winpr_Handle_GetInfo(hEvent, &Type, &Object) || (Type != HANDLE_TYPE_EVENT))
+		return FALSE;
+
+	event = (WINPR_EVENT*) Object;
+
+	if (event->bAttached)
+		return (winpr_Handle_Wait(Object, 0) == WAIT_OBJECT_0) ? TRUE : FALSE;
+
+	return event->State ? TRUE : FALSE;
+#else
+	return (WaitForSingleObject(hEvent, 0) == WAIT_OBJECT_0) ? TRUE : FALSE;
+#endif
+}
+
+#ifdef _WIN32
+
+BOOL SetEvents(DWORD nCount, const HANDLE* lpHandles)
+{
+	DWORD index;
+	BOOL status = TRUE;
+
+	for (index = 0; index < nCount; index++)
+	{
+		if (!SetEvent(lpHandles[index]))
+			status = FALSE;
+	}
+
+	return status;
+}
+
+BOOL ResetEvents(DWORD nCount, const HANDLE* lpHandles)
+{
+	DWORD index;
+	BOOL status = TRUE;
+
+	for (index = 0; index < nCount; index++)
+	{
+		if (!ResetEvent(lpHandles[index]))
+			status = FALSE;
+	}
+
+	return status;
+}
+
+#endif
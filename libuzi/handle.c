@@ -36,10 +36,247 @@
 #include <unistd.h>
 #endif
 
-#include <assert.h>
+#include <uzi/interlocked.h>
 
 #include "handle.h"
 
+WINPR_HANDLE_SLOT* volatile g_HandleTable[WINPR_HANDLE_MAX_PAGES];
+
+/**
+ * Free slots are kept in a lock-free stack. The head packs the index of the
+ * first free slot in the low 32 bits and a modification tag in the high
+ * 32 bits to protect against ABA. The next free index of a free slot is
+ * stored in its Type field.
+ */
+
+/**
+ * Handle statistics: one set of counters per handle type, the counters of
+ * HANDLE_TYPE_NONE hold the totals for all handle types.
+ */
+
+struct winpr_handle_stats
+{
+	LONG volatile Live;
+	LONG volatile Peak;
+	LONG volatile Fds;
+	LONG volatile PeakFds;
+	LONGLONG volatile Created;
+};
+typedef struct winpr_handle_stats WINPR_HANDLE_STATS;
+
+static WINPR_HANDLE_STATS g_HandleStats[HANDLE_TYPE_COUNT];
+
+static LONGLONG volatile g_FreeSlotHead = 0;
+static ULONG g_PageCount = 0;
+static pthread_mutex_t g_TableMutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define FREE_HEAD_INDEX(_head)	((ULONG) ((ULONGLONG) (_head) & 0xFFFFFFFF))
+#define FREE_HEAD_TAG(_head)	((ULONG) ((ULONGLONG) (_head) >> 32))
+#define FREE_HEAD(_tag, _index)	((LONGLONG) ((((ULONGLONG) (_tag)) << 32) | (_index)))
+
+static WINPR_HANDLE_SLOT* winpr_Handle_SlotFromIndex(ULONG index)
+{
+	return &g_HandleTable[index >> WINPR_HANDLE_PAGE_BITS][index & WINPR_HANDLE_PAGE_MASK];
+}
+
+static void winpr_Handle_PushFreeSlots(ULONG first, ULONG last)
+{
+	LONGLONG head;
+	WINPR_HANDLE_SLOT* slot = winpr_Handle_SlotFromIndex(last);
+
+	do
+	{
+		head = g_FreeSlotHead;
+		slot->Type = FREE_HEAD_INDEX(head);
+	}
+	while (InterlockedCompareExchange64(&g_FreeSlotHead,
+			FREE_HEAD(FREE_HEAD_TAG(head) + 1, first), head) != head);
+}
+
+static ULONG winpr_Handle_PopFreeSlot(void)
+{
+	ULONG index;
+	LONGLONG head;
+
+	do
+	{
+		head = g_FreeSlotHead;
+		index = FREE_HEAD_INDEX(head);
+
+		if (!index)
+			return 0;
+	}
+	while (InterlockedCompareExchange64(&g_FreeSlotHead,
+			FREE_HEAD(FREE_HEAD_TAG(head) + 1, winpr_Handle_SlotFromIndex(index)->Type), head) != head);
+
+	return index;
+}
+
+static BOOL winpr_Handle_GrowTable(void)
+{
+	ULONG index;
+	ULONG first;
+	ULONG last;
+	BOOL status = FALSE;
+	WINPR_HANDLE_SLOT* page;
+
+	pthread_mutex_lock(&g_TableMutex);
+
+	/* Another thread may have refilled the free list while we were waiting */
+	if (FREE_HEAD_INDEX(g_FreeSlotHead))
+	{
+		status = TRUE;
+		goto out;
+	}
+
+	if (g_PageCount >= WINPR_HANDLE_MAX_PAGES)
+		goto out;
+
+	page = (WINPR_HANDLE_SLOT*) calloc(WINPR_HANDLE_PAGE_SIZE, sizeof(WINPR_HANDLE_SLOT));
+
+	if (!page)
+		goto out;
+
+	first = g_PageCount << WINPR_HANDLE_PAGE_BITS;
+	last = first + WINPR_HANDLE_PAGE_SIZE - 1;
+
+	/* Slot 0 and the very last slot are reserved, see handle.h */
+	if (first == 0)
+		first = 1;
+
+	if (last == WINPR_HANDLE_INDEX_MASK)
+		last--;
+
+	for (index = first; index < last; index++)
+		page[index & WINPR_HANDLE_PAGE_MASK].Type = index + 1;
+
+	g_HandleTable[g_PageCount] = page;
+	g_PageCount++;
+
+	winpr_Handle_PushFreeSlots(first, last);
+	status = TRUE;
+out:
+	pthread_mutex_unlock(&g_TableMutex);
+	return status;
+}
+
+static void winpr_Handle_UpdatePeak(LONG volatile* peak, LONG value)
+{
+	LONG current;
+
+	while ((current = *peak) < value)
+	{
+		if (InterlockedCompareExchange(peak, value, current) == current)
+			break;
+	}
+}
+
+static void winpr_Handle_TrackLive(ULONG Type, LONG count)
+{
+	WINPR_HANDLE_STATS* stats;
+	WINPR_HANDLE_STATS* total = &g_HandleStats[HANDLE_TYPE_NONE];
+
+	if (Type >= HANDLE_TYPE_COUNT)
+		Type = HANDLE_TYPE_NONE;
+
+	stats = &g_HandleStats[Type];
+
+	if (count > 0)
+	{
+		winpr_Handle_UpdatePeak(&total->Peak, InterlockedExchangeAdd(&total->Live, count) + count);
+		InterlockedExchangeAdd64(&total->Created, count);
+
+		if (stats != total)
+		{
+			winpr_Handle_UpdatePeak(&stats->Peak, InterlockedExchangeAdd(&stats->Live, count) + count);
+			InterlockedExchangeAdd64(&stats->Created, count);
+		}
+	}
+	else
+	{
+		InterlockedExchangeAdd(&total->Live, count);
+
+		if (stats != total)
+			InterlockedExchangeAdd(&stats->Live, count);
+	}
+}
+
+void winpr_Handle_TrackFds(ULONG Type, LONG count)
+{
+	WINPR_HANDLE_STATS* stats;
+	WINPR_HANDLE_STATS* total = &g_HandleStats[HANDLE_TYPE_NONE];
+
+	if (Type >= HANDLE_TYPE_COUNT)
+		Type = HANDLE_TYPE_NONE;
+
+	stats = &g_HandleStats[Type];
+
+	winpr_Handle_UpdatePeak(&total->PeakFds, InterlockedExchangeAdd(&total->Fds, count) + count);
+
+	if (stats != total)
+		winpr_Handle_UpdatePeak(&stats->PeakFds, InterlockedExchangeAdd(&stats->Fds, count) + count);
+}
+
+HANDLE winpr_Handle_Register(WINPR_HANDLE* object)
+{
+	ULONG index;
+	ULONG generation;
+	WINPR_HANDLE_SLOT* slot;
+
+	if (!object)
+		return NULL;
+
+	while (!(index = winpr_Handle_PopFreeSlot()))
+	{
+		if (!winpr_Handle_GrowTable())
+		{
+			SetLastError(ERROR_NO_SYSTEM_RESOURCES);
+			return NULL;
+		}
+	}
+
+	slot = winpr_Handle_SlotFromIndex(index);
+	generation = ((ULONG) slot->Generation) & WINPR_HANDLE_GENERATION_MASK;
+	slot->Type = object->Type;
+	slot->Object = object;
+
+	winpr_Handle_TrackLive(object->Type, 1);
+
+	return (HANDLE) ((((ULONG_PTR) generation) << WINPR_HANDLE_INDEX_BITS) | index);
+}
+
+BOOL winpr_Handle_Unregister(HANDLE handle)
+{
+	LONG current;
+	ULONG generation;
+	WINPR_HANDLE_SLOT* slot;
+
+	if (handle == NULL || handle == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	slot = winpr_Handle_GetSlot(handle, &generation);
+
+	if (!slot)
+		return FALSE;
+
+	current = slot->Generation;
+
+	if (((ULONG) current & WINPR_HANDLE_GENERATION_MASK) != generation)
+		return FALSE;
+
+	/* Only one of several concurrent CloseHandle calls can win */
+	if (InterlockedCompareExchange(&slot->Generation, current + 1, current) != current)
+		return FALSE;
+
+	winpr_Handle_TrackLive(slot->Type, -1);
+
+	slot->Object = NULL;
+	winpr_Handle_PushFreeSlots((ULONG) ((ULONG_PTR) handle & WINPR_HANDLE_INDEX_MASK),
+			(ULONG) ((ULONG_PTR) handle & WINPR_HANDLE_INDEX_MASK));
+
+	return TRUE;
+}
+
 BOOL CloseHandle(HANDLE hObject)
 {
 	ULONG Type;
@@ -48,23 +285,91 @@ BOOL CloseHandle(HANDLE hObject)
 	if (!winpr_Handle_GetInfo(hObject, &Type, &Object))
 		return FALSE;
 
-	if (!Object)
+	if (!Object->ops || !Object->ops->CloseHandle)
 		return FALSE;
 
-	if (!Object->ops)
+	if (!winpr_Handle_Unregister(hObject))
 		return FALSE;
 
-	if (Object->ops->CloseHandle)
-		return Object->ops->CloseHandle(hObject);
+	/* other handles still refer to the object */
+	if (InterlockedDecrement(&Object->RefCount) > 0)
+		return TRUE;
 
-	return FALSE;
+	return Object->ops->CloseHandle(Object);
 }
 
 BOOL DuplicateHandle(HANDLE hSourceProcessHandle, HANDLE hSourceHandle, HANDLE hTargetProcessHandle,
 		LPHANDLE lpTargetHandle, DWORD dwDesiredAccess, BOOL bInheritHandle, DWORD dwOptions)
 {
-	*((ULONG_PTR*) lpTargetHandle) = (ULONG_PTR) hSourceHandle;
+	ULONG Type;
+	LONG refCount;
+	HANDLE handle;
+	WINPR_HANDLE* Object;
+
+	if (!lpTargetHandle)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	/* a duplicate must be closable, which rules out timer queues and their timers */
+	if (!winpr_Handle_GetInfo(hSourceHandle, &Type, &Object) ||
+	    !Object->ops || !Object->ops->CloseHandle)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+
+	/* only take a reference if the object is not being destroyed */
+	do
+	{
+		refCount = Object->RefCount;
+
+		if (refCount <= 0)
+		{
+			SetLastError(ERROR_INVALID_HANDLE);
+			return FALSE;
+		}
+	}
+	while (InterlockedCompareExchange(&Object->RefCount, refCount + 1, refCount) != refCount);
+
+	handle = winpr_Handle_Register(Object);
+
+	if (!handle)
+	{
+		if (InterlockedDecrement(&Object->RefCount) == 0)
+			Object->ops->CloseHandle(Object);
+
+		return FALSE;
+	}
+
+	if (dwOptions & DUPLICATE_CLOSE_SOURCE)
+		CloseHandle(hSourceHandle);
+
+	*((HANDLE*) lpTargetHandle) = handle;
 	return TRUE;
 }
 
 #endif
+
+bool UziGetHandleStats(uint32_t handleType, UZI_HANDLE_STATS* stats)
+{
+#ifndef _WIN32
+	WINPR_HANDLE_STATS* counters;
+
+	if (!stats || (handleType >= HANDLE_TYPE_COUNT))
+		return false;
+
+	counters = &g_HandleStats[handleType];
+
+	stats->live = (uint32_t) counters->Live;
+	stats->peak = (uint32_t) counters->Peak;
+	stats->created = (uint64_t) counters->Created;
+	stats->fds = (uint32_t) counters->Fds;
+	stats->peakFds = (uint32_t) counters->PeakFds;
+
+	return true;
+#else
+	return false;
+#endif
+}
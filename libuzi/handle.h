@@ -20,6 +20,8 @@
 #ifndef WINPR_HANDLE_PRIVATE_H
 #define WINPR_HANDLE_PRIVATE_H
 
+#include <time.h>
+
 #include <uzi/handle.h>
 
 #include <uzi/synch.h>
@@ -39,10 +41,14 @@
 #define HANDLE_TYPE_TIMER_QUEUE			11
 #define HANDLE_TYPE_TIMER_QUEUE_TIMER		12
 #define HANDLE_TYPE_COMM			13
+#define HANDLE_TYPE_WAIT_SET			14
+#define HANDLE_TYPE_COUNT			15
 
 #define WINPR_HANDLE_DEF() \
 	ULONG Type; \
 	ULONG Mode; \
+	LONG volatile RefCount; \
+	ULONG SpinCount; \
 	HANDLE_OPS *ops
 
 typedef BOOL (*pcIsHandled)(HANDLE handle);
@@ -58,6 +64,7 @@ typedef BOOL (*pcSetFilePointerEx)(HANDLE hFile, LARGE_INTEGER liDistanceToMove,
 		PLARGE_INTEGER lpNewFilePointer, DWORD dwMoveMethod);
 typedef BOOL (*pcSetFileTime)(HANDLE hFile, const FILETIME *lpCreationTime,
 		const FILETIME *lpLastAccessTime, const FILETIME *lpLastWriteTime);
+typedef DWORD (*pcWaitHandle)(HANDLE handle, const struct timespec* deadline);
 
 typedef struct _HANDLE_OPS
 {
@@ -71,6 +78,7 @@ typedef struct _HANDLE_OPS
 	pcSetFilePointer SetFilePointer;
 	pcSetFilePointerEx SetFilePointerEx;
 	pcSetFileTime SetFileTime;
+	pcWaitHandle Wait;
 } HANDLE_OPS;
 
 struct winpr_handle
@@ -79,6 +87,12 @@ struct winpr_handle
 };
 typedef struct winpr_handle WINPR_HANDLE;
 
+/**
+ * Objects start with a single reference, owned by the handle returned by
+ * their constructor. DuplicateHandle adds a reference for each new handle,
+ * and the object is destroyed when the last handle referring to it is closed.
+ */
+
 static inline void WINPR_HANDLE_SET_TYPE_AND_MODE(void* _handle,
 						 ULONG _type, ULONG _mode)
 {
@@ -86,45 +100,122 @@ static inline void WINPR_HANDLE_SET_TYPE_AND_MODE(void* _handle,
 
 	hdl->Type = _type;
 	hdl->Mode = _mode;
+	hdl->RefCount = 1;
+	hdl->SpinCount = 0;
+}
+
+/**
+ * Handle Table
+ *
+ * A HANDLE is not a pointer to the object it refers to, but an index into a
+ * process-wide table combined with the generation of the table slot:
+ *
+ * bits  0-19: slot index (slot 0 and the last slot are never used, so that
+ *             a handle can never be NULL or INVALID_HANDLE_VALUE)
+ * bits 20-xx: slot generation, incremented each time the slot is released
+ *
+ * The table is made of fixed-size pages which are allocated on demand and
+ * never freed, which makes lookups lock-free: a handle is resolved with a
+ * load from the (small, cache resident) page directory and a load from the
+ * slot. Slots carry the object type so that type checks do not need to
+ * dereference the object. A stale handle is rejected by the generation check.
+ *
+ * Handle operations (HANDLE_OPS) are always called with the object pointer,
+ * never with the encoded handle value.
+ */
+
+#define WINPR_HANDLE_INDEX_BITS			20
+#define WINPR_HANDLE_INDEX_MASK			((1UL << WINPR_HANDLE_INDEX_BITS) - 1)
+#define WINPR_HANDLE_GENERATION_MASK		((ULONG) (((ULONG_PTR) -1) >> WINPR_HANDLE_INDEX_BITS))
+
+#define WINPR_HANDLE_PAGE_BITS			10
+#define WINPR_HANDLE_PAGE_SIZE			(1UL << WINPR_HANDLE_PAGE_BITS)
+#define WINPR_HANDLE_PAGE_MASK			(WINPR_HANDLE_PAGE_SIZE - 1)
+#define WINPR_HANDLE_MAX_PAGES			(1UL << (WINPR_HANDLE_INDEX_BITS - WINPR_HANDLE_PAGE_BITS))
+
+struct winpr_handle_slot
+{
+	volatile LONG Generation;
+	ULONG Type; /* next free slot index while the slot is unused */
+	WINPR_HANDLE* volatile Object;
+};
+typedef struct winpr_handle_slot WINPR_HANDLE_SLOT;
+
+extern WINPR_HANDLE_SLOT* volatile g_HandleTable[WINPR_HANDLE_MAX_PAGES];
+
+HANDLE winpr_Handle_Register(WINPR_HANDLE* object);
+BOOL winpr_Handle_Unregister(HANDLE handle);
+
+/**
+ * Handle statistics are updated by winpr_Handle_Register and
+ * winpr_Handle_Unregister. File descriptors are accounted for explicitly
+ * by the code opening or closing them, with a positive or negative count.
+ */
+
+void winpr_Handle_TrackFds(ULONG Type, LONG count);
+
+static inline WINPR_HANDLE_SLOT* winpr_Handle_GetSlot(HANDLE handle, ULONG* pGeneration)
+{
+	ULONG index;
+	WINPR_HANDLE_SLOT* page;
+	ULONG_PTR value = (ULONG_PTR) handle;
+
+	index = (ULONG) (value & WINPR_HANDLE_INDEX_MASK);
+	page = g_HandleTable[index >> WINPR_HANDLE_PAGE_BITS];
+
+	if (!page)
+		return NULL;
+
+	*pGeneration = (ULONG) (value >> WINPR_HANDLE_INDEX_BITS);
+	return &page[index & WINPR_HANDLE_PAGE_MASK];
 }
 
 static inline BOOL winpr_Handle_GetInfo(HANDLE handle, ULONG* pType, WINPR_HANDLE** pObject)
 {
-	WINPR_HANDLE* wHandle;
+	ULONG generation;
+	WINPR_HANDLE* object;
+	WINPR_HANDLE_SLOT* slot;
 
 	if (handle == NULL || handle == INVALID_HANDLE_VALUE)
 		return FALSE;
 
-	wHandle = (WINPR_HANDLE*) handle;
+	slot = winpr_Handle_GetSlot(handle, &generation);
+
+	if (!slot)
+		return FALSE;
+
+	object = slot->Object;
 
-	*pType = wHandle->Type;
-	*pObject = handle;
+	if (!object || (((ULONG) slot->Generation & WINPR_HANDLE_GENERATION_MASK) != generation))
+		return FALSE;
+
+	*pType = slot->Type;
+	*pObject = object;
 
 	return TRUE;
 }
 
-static inline int winpr_Handle_getFd(HANDLE handle)
-{
-	WINPR_HANDLE *hdl;
-	ULONG type;
+/**
+ * Objects which can be waited on without a file descriptor implement the
+ * Wait operation, which waits until an absolute CLOCK_MONOTONIC deadline
+ * (NULL waits forever). A zero deadline only checks the object state.
+ * winpr_Handle_WaitUntil uses it when available, and polls the object
+ * file descriptor otherwise.
+ */
 
-	if (!winpr_Handle_GetInfo(handle, &type, &hdl))
-		return -1;
+DWORD winpr_Handle_Wait(WINPR_HANDLE* Object, DWORD dwMilliseconds);
+DWORD winpr_Handle_WaitUntil(WINPR_HANDLE* Object, const struct timespec* deadline);
 
+static inline int winpr_Handle_getFd(WINPR_HANDLE* hdl)
+{
 	if (!hdl || !hdl->ops || !hdl->ops->GetFd)
 		return -1;
 
-	return hdl->ops->GetFd(handle);
+	return hdl->ops->GetFd(hdl);
 }
 
-static inline DWORD winpr_Handle_cleanup(HANDLE handle)
+static inline DWORD winpr_Handle_cleanup(WINPR_HANDLE* hdl)
 {
-	WINPR_HANDLE *hdl;
-	ULONG type;
-
-	if (!winpr_Handle_GetInfo(handle, &type, &hdl))
-		return WAIT_FAILED;
-
 	if (!hdl || !hdl->ops)
 		return WAIT_FAILED;
 
@@ -132,7 +223,7 @@ static inline DWORD winpr_Handle_cleanup(HANDLE handle)
 	if (!hdl->ops->CleanupHandle)
 		return WAIT_OBJECT_0;
 
-	return hdl->ops->CleanupHandle(handle);
+	return hdl->ops->CleanupHandle(hdl);
 }
 
 #endif /* WINPR_HANDLE_PRIVATE_H */
@@ -210,7 +210,32 @@ LONG InterlockedDecrement(LONG volatile *Addend)
 LONG InterlockedExchange(LONG volatile *Target, LONG Value)
 {
 #ifdef __GNUC__
-	return __sync_val_compare_and_swap(Target, *Target, Value);
+	LONG previousValue;
+
+	do
+	{
+		previousValue = *Target;
+	}
+	while (__sync_val_compare_and_swap(Target, previousValue, Value) != previousValue);
+
+	return previousValue;
+#else
+	return 0;
+#endif
+}
+
+PVOID InterlockedExchangePointer(PVOID volatile *Target, PVOID Value)
+{
+#ifdef __GNUC__
+	PVOID previousValue;
+
+	do
+	{
+		previousValue = *Target;
+	}
+	while (__sync_val_compare_and_swap(Target, previousValue, Value) != previousValue);
+
+	return previousValue;
 #else
 	return 0;
 #endif
@@ -322,6 +347,27 @@ LONGLONG InterlockedCompareExchange64(LONGLONG volatile *Destination, LONGLONG E
 
 #endif
 
+#ifndef _WIN32
+
+LONGLONG InterlockedExchangeAdd64(LONGLONG volatile *Addend, LONGLONG Value)
+{
+#if defined(__GNUC__) && defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8) && !(defined(ANDROID) && ANDROID)
+	return __sync_fetch_and_add(Addend, Value);
+#else
+	LONGLONG previousValue;
+
+	do
+	{
+		previousValue = *Addend;
+	}
+	while (InterlockedCompareExchange64(Addend, previousValue + Value, previousValue) != previousValue);
+
+	return previousValue;
+#endif
+}
+
+#endif
+
 /* Doubly-Linked List */
 
 /**
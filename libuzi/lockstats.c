@@ -0,0 +1,256 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Lock Contention Profiling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <uzi/uzi.h>
+#include <uzi/wtypes.h>
+#include <uzi/interlocked.h>
+
+#ifndef _WIN32
+
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
+#include "lockstats.h"
+
+static BOOL g_LockProfiling = FALSE;
+
+static pthread_mutex_t g_LockStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static WINPR_LOCK_STATS* g_LockStatsList = NULL;
+
+WINPR_LOCK_STATS* winpr_LockStats_New(ULONG LockType, const void* Lock, const void* CallSite)
+{
+	WINPR_LOCK_STATS* stats;
+
+	if (!g_LockProfiling)
+		return NULL;
+
+	stats = (WINPR_LOCK_STATS*) calloc(1, sizeof(WINPR_LOCK_STATS));
+
+	if (!stats)
+		return NULL;
+
+	stats->LockType = LockType;
+	stats->Lock = Lock;
+	stats->CallSite = CallSite;
+
+	pthread_mutex_lock(&g_LockStatsMutex);
+	stats->next = g_LockStatsList;
+
+	if (g_LockStatsList)
+		g_LockStatsList->prev = stats;
+
+	g_LockStatsList = stats;
+	pthread_mutex_unlock(&g_LockStatsMutex);
+
+	return stats;
+}
+
+void winpr_LockStats_Free(WINPR_LOCK_STATS* stats)
+{
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&g_LockStatsMutex);
+
+	if (stats->prev)
+		stats->prev->next = stats->next;
+	else
+		g_LockStatsList = stats->next;
+
+	if (stats->next)
+		stats->next->prev = stats->prev;
+
+	pthread_mutex_unlock(&g_LockStatsMutex);
+
+	free(stats);
+}
+
+ULONGLONG winpr_LockStats_Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((ULONGLONG) ts.tv_sec * 1000000000ULL) + (ULONGLONG) ts.tv_nsec;
+}
+
+void winpr_LockStats_Acquired(WINPR_LOCK_STATS* stats, ULONGLONG waitStart)
+{
+	LONGLONG wait;
+	LONGLONG waitMax;
+
+	stats->AcquireTime = winpr_LockStats_Now();
+	InterlockedExchangeAdd64(&stats->Acquisitions, 1);
+
+	if (!waitStart)
+		return;
+
+	wait = (LONGLONG) (stats->AcquireTime - waitStart);
+	InterlockedExchangeAdd64(&stats->Contended, 1);
+	InterlockedExchangeAdd64(&stats->WaitTotal, wait);
+
+	/* only the owner updates WaitMax */
+	waitMax = stats->WaitMax;
+
+	if (wait > waitMax)
+		stats->WaitMax = wait;
+}
+
+void winpr_LockStats_Released(WINPR_LOCK_STATS* stats)
+{
+	int bucket = 0;
+	ULONGLONG hold = (winpr_LockStats_Now() - stats->AcquireTime) / 1000;
+
+	while (hold && (bucket < UZI_LOCK_STATS_HOLD_BUCKETS - 1))
+	{
+		hold >>= 1;
+		bucket++;
+	}
+
+	InterlockedExchangeAdd64(&stats->HoldHistogram[bucket], 1);
+}
+
+static void winpr_LockStats_Copy(UZI_LOCK_STATS* dst, const WINPR_LOCK_STATS* src)
+{
+	int index;
+
+	dst->lockType = src->LockType;
+	dst->lock = src->Lock;
+	dst->callSite = src->CallSite;
+	dst->acquisitions = (uint64_t) src->Acquisitions;
+	dst->contended = (uint64_t) src->Contended;
+	dst->waitTotal = (uint64_t) src->WaitTotal;
+	dst->waitMax = (uint64_t) src->WaitMax;
+
+	for (index = 0; index < UZI_LOCK_STATS_HOLD_BUCKETS; index++)
+		dst->holdHistogram[index] = (uint64_t) src->HoldHistogram[index];
+}
+
+/* most contended first, then longest total wait */
+static BOOL winpr_LockStats_Before(const WINPR_LOCK_STATS* a, const UZI_LOCK_STATS* b)
+{
+	if ((uint64_t) a->Contended != b->contended)
+		return ((uint64_t) a->Contended > b->contended) ? TRUE : FALSE;
+
+	return ((uint64_t) a->WaitTotal > b->waitTotal) ? TRUE : FALSE;
+}
+
+#endif
+
+bool UziSetLockProfiling(bool enabled)
+{
+#ifndef _WIN32
+	BOOL previous = g_LockProfiling;
+
+	g_LockProfiling = enabled ? TRUE : FALSE;
+	return previous ? true : false;
+#else
+	return false;
+#endif
+}
+
+uint32_t UziGetLockStats(UZI_LOCK_STATS* stats, uint32_t count)
+{
+#ifndef _WIN32
+	uint32_t index;
+	uint32_t filled = 0;
+	WINPR_LOCK_STATS* entry;
+
+	if (!stats || !count)
+		return 0;
+
+	pthread_mutex_lock(&g_LockStatsMutex);
+
+	/* insertion into the sorted top-N array */
+	for (entry = g_LockStatsList; entry; entry = entry->next)
+	{
+		index = filled;
+
+		while ((index > 0) && winpr_LockStats_Before(entry, &stats[index - 1]))
+			index--;
+
+		if (index >= count)
+			continue;
+
+		if (filled < count)
+			filled++;
+
+		memmove(&stats[index + 1], &stats[index], (filled - index - 1) * sizeof(UZI_LOCK_STATS));
+		winpr_LockStats_Copy(&stats[index], entry);
+	}
+
+	pthread_mutex_unlock(&g_LockStatsMutex);
+
+	return filled;
+#else
+	return 0;
+#endif
+}
+
+void UziDumpLockStats(uint32_t count)
+{
+#ifndef _WIN32
+	uint32_t index;
+	uint32_t filled;
+	UZI_LOCK_STATS* stats;
+#ifdef HAVE_EXECINFO_H
+	char** symbols;
+#endif
+
+	if (!count || !(stats = (UZI_LOCK_STATS*) calloc(count, sizeof(UZI_LOCK_STATS))))
+		return;
+
+	filled = UziGetLockStats(stats, count);
+
+	for (index = 0; index < filled; index++)
+	{
+		const char* callSite = "?";
+		uint64_t average = stats[index].contended ?
+			stats[index].waitTotal / stats[index].contended : 0;
+
+#ifdef HAVE_EXECINFO_H
+		symbols = backtrace_symbols((void* const*) &stats[index].callSite, 1);
+
+		if (symbols)
+			callSite = symbols[0];
+#endif
+
+		fprintf(stderr, "%s %p created at %s: %"PRIu64" acquisitions, %"PRIu64" contended, "
+			"wait average %"PRIu64" ns max %"PRIu64" ns\n",
+			(stats[index].lockType == UZI_LOCK_MUTEX) ? "mutex" : "critical section",
+			stats[index].lock, callSite, stats[index].acquisitions, stats[index].contended,
+			average, stats[index].waitMax);
+
+#ifdef HAVE_EXECINFO_H
+		free(symbols);
+#endif
+	}
+
+	free(stats);
+#endif
+}
@@ -0,0 +1,75 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Lock Contention Profiling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WINPR_LOCKSTATS_PRIVATE_H
+#define WINPR_LOCKSTATS_PRIVATE_H
+
+#include <uzi/uzi.h>
+#include <uzi/wtypes.h>
+#include <uzi/synch.h>
+
+#ifndef _WIN32
+
+/**
+ * Lock Contention Profiling
+ *
+ * While profiling is enabled with UziSetLockProfiling, every critical
+ * section and mutex created gets a stats block, registered in a global list
+ * until the lock is deleted. Locks created while profiling is disabled have
+ * none and only pay for a NULL check.
+ *
+ * The owner of a lock updates the hold time fields, other fields are
+ * updated atomically. Times are in nanoseconds.
+ */
+
+struct winpr_lock_stats
+{
+	struct winpr_lock_stats* prev;
+	struct winpr_lock_stats* next;
+
+	ULONG LockType; /* UZI_LOCK_CRITICAL_SECTION or UZI_LOCK_MUTEX */
+	const void* Lock;
+	const void* CallSite;
+
+	LONG SpinEstimate; /* see critical.c */
+	ULONGLONG AcquireTime; /* when the current owner acquired the lock */
+
+	LONGLONG volatile Acquisitions;
+	LONGLONG volatile Contended;
+	LONGLONG volatile WaitTotal;
+	LONGLONG volatile WaitMax;
+	LONGLONG volatile HoldHistogram[UZI_LOCK_STATS_HOLD_BUCKETS];
+};
+typedef struct winpr_lock_stats WINPR_LOCK_STATS;
+
+/* Returns NULL when profiling is disabled */
+WINPR_LOCK_STATS* winpr_LockStats_New(ULONG LockType, const void* Lock, const void* CallSite);
+void winpr_LockStats_Free(WINPR_LOCK_STATS* stats);
+
+ULONGLONG winpr_LockStats_Now(void);
+
+/* waitStart is the time the caller started waiting for a contended lock, 0 otherwise */
+void winpr_LockStats_Acquired(WINPR_LOCK_STATS* stats, ULONGLONG waitStart);
+void winpr_LockStats_Released(WINPR_LOCK_STATS* stats);
+
+/* InitializeCriticalSectionEx recording CallSite, for wrappers to report their own caller */
+BOOL winpr_InitializeCriticalSectionWithCallSite(LPCRITICAL_SECTION lpCriticalSection, DWORD dwSpinCount,
+		DWORD Flags, const void* CallSite);
+
+#endif
+
+#endif /* WINPR_LOCKSTATS_PRIVATE_H */
@@ -28,11 +28,41 @@
 #ifndef _WIN32
 
 #include <errno.h>
+#include <fcntl.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <uzi/interlocked.h>
 
 #include "handle.h"
+#include "thread.h"
+#include "pool.h"
+#include "lockstats.h"
 
 #define TAG "mutex"
 
+/**
+ * Mutexes
+ *
+ * A mutex is owned by the thread whose lock id is stored in Owner, so that
+ * acquiring a free mutex or releasing it with nobody waiting is a single
+ * atomic operation. Threads block on Owner with a futex, or on a condition
+ * variable without futex support.
+ *
+ * To be waited on by WaitForMultipleObjects, a mutex creates a file
+ * descriptor on demand, which is signaled while the mutex is free. It is
+ * kept in line with Owner under fdLock by the threads which acquire or
+ * release the mutex, following the same rules as the event file descriptor.
+ * A waiter woken up through it takes ownership in the CleanupHandle
+ * operation, with the same compare-and-swap as any other acquisition.
+ */
+
 static BOOL MutexCloseHandle(HANDLE handle);
 
 static BOOL MutexIsHandled(HANDLE handle)
@@ -48,34 +78,212 @@ static BOOL MutexIsHandled(HANDLE handle)
 	return TRUE;
 }
 
+static BOOL MutexCreateFd(WINPR_MUTEX* mutex)
+{
+#ifdef HAVE_EVENTFD_H
+	int fd = eventfd(0, EFD_NONBLOCK);
+
+	if (fd < 0)
+		return FALSE;
+
+	winpr_Handle_TrackFds(HANDLE_TYPE_MUTEX, 1);
+#else
+	int fd;
+
+	if (pipe(mutex->pipe_fd) < 0)
+		return FALSE;
+
+	fd = mutex->pipe_fd[0];
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	winpr_Handle_TrackFds(HANDLE_TYPE_MUTEX, 2);
+#endif
+	mutex->pipe_fd[0] = fd;
+	return TRUE;
+}
+
+/* Brings the file descriptor in line with Owner, called with fdLock held */
+static BOOL MutexSyncFd(WINPR_MUTEX* mutex)
+{
+	int status;
+	BOOL signaled = mutex->Owner ? FALSE : TRUE;
+
+	if (signaled == mutex->bFdSignaled)
+		return TRUE;
+
+	do
+	{
+#ifdef HAVE_EVENTFD_H
+		eventfd_t value = 1;
+
+		if (signaled)
+			status = eventfd_write(mutex->pipe_fd[0], value);
+		else
+			status = eventfd_read(mutex->pipe_fd[0], &value);
+#else
+		char value = '-';
+
+		if (signaled)
+			status = (write(mutex->pipe_fd[1], &value, 1) == 1) ? 0 : -1;
+		else
+			status = (read(mutex->pipe_fd[0], &value, 1) == 1) ? 0 : -1;
+#endif
+	}
+	while ((status < 0) && (errno == EINTR));
+
+	if (status < 0)
+		return FALSE;
+
+	mutex->bFdSignaled = signaled;
+	return TRUE;
+}
+
+static BOOL MutexUpdateFd(WINPR_MUTEX* mutex)
+{
+	BOOL status;
+
+	if (mutex->pipe_fd[0] < 0)
+		return TRUE;
+
+	pthread_mutex_lock(&mutex->fdLock);
+	status = MutexSyncFd(mutex);
+	pthread_mutex_unlock(&mutex->fdLock);
+
+	return status;
+}
+
 static int MutexGetFd(HANDLE handle)
 {
-	WINPR_MUTEX *mux = (WINPR_MUTEX *)handle;
+	int fd;
+	WINPR_MUTEX *mutex = (WINPR_MUTEX *)handle;
+
 	if (!MutexIsHandled(handle))
 		return -1;
 
-	/* TODO: Mutex does not support file handles... */
-	(void)mux;
-	return -1;
+	if ((fd = mutex->pipe_fd[0]) >= 0)
+		return fd;
+
+	pthread_mutex_lock(&mutex->fdLock);
+
+	if ((mutex->pipe_fd[0] < 0) && MutexCreateFd(mutex))
+	{
+		/* publish the file descriptor before reading Owner */
+		__sync_synchronize();
+		MutexSyncFd(mutex);
+	}
+
+	fd = mutex->pipe_fd[0];
+	pthread_mutex_unlock(&mutex->fdLock);
+
+	return fd;
+}
+
+/**
+ * Takes ownership of the mutex if it is free or already owned by the calling
+ * thread. waitStart is the time the caller started to wait for the mutex, for
+ * lock profiling, or 0.
+ */
+static BOOL MutexTryAcquire(WINPR_MUTEX* mutex, LONG self, ULONGLONG waitStart)
+{
+	if (mutex->Owner == self)
+	{
+		mutex->RecursionCount++;
+		return TRUE;
+	}
+
+	if (InterlockedCompareExchange(&mutex->Owner, self, 0) != 0)
+		return FALSE;
+
+	mutex->RecursionCount = 1;
+
+	if (mutex->Stats)
+		winpr_LockStats_Acquired(mutex->Stats, waitStart);
+
+	MutexUpdateFd(mutex);
+	return TRUE;
+}
+
+static DWORD MutexCleanupHandle(HANDLE handle)
+{
+	WINPR_MUTEX* mutex = (WINPR_MUTEX*) handle;
+
+	/* another thread took the mutex first, WAIT_TIMEOUT lets the caller wait again */
+	return MutexTryAcquire(mutex, winpr_GetCurrentThreadLockId(), 0) ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+}
+
+static DWORD MutexWait(HANDLE handle, const struct timespec* deadline)
+{
+	int status = 0;
+	LONG owner;
+	ULONGLONG waitStart = 0;
+	LONG self = winpr_GetCurrentThreadLockId();
+	WINPR_MUTEX* mutex = (WINPR_MUTEX*) handle;
+
+	for (;;)
+	{
+		if (MutexTryAcquire(mutex, self, waitStart))
+			return WAIT_OBJECT_0;
+
+		if (status == ETIMEDOUT)
+			return WAIT_TIMEOUT;
+
+		if (deadline && !deadline->tv_sec && !deadline->tv_nsec)
+			return WAIT_TIMEOUT;
+
+		if (mutex->Stats && !waitStart)
+			waitStart = winpr_LockStats_Now();
+
+		if (!(owner = mutex->Owner))
+			continue;
+
+#ifdef WITH_FUTEX
+		InterlockedIncrement(&mutex->Waiters);
+		status = winpr_futex_wait(&mutex->Owner, owner, deadline);
+		InterlockedDecrement(&mutex->Waiters);
+#else
+		pthread_mutex_lock(&mutex->fdLock);
+		InterlockedIncrement(&mutex->Waiters);
+
+		if (mutex->Owner == owner)
+			status = winpr_cond_wait(&mutex->cond, &mutex->fdLock, deadline);
+
+		InterlockedDecrement(&mutex->Waiters);
+		pthread_mutex_unlock(&mutex->fdLock);
+#endif
+	}
 }
 
 BOOL MutexCloseHandle(HANDLE handle)
 {
 	WINPR_MUTEX* mutex = (WINPR_MUTEX*) handle;
-	int rc;
 
 	if (!MutexIsHandled(handle))
 		return FALSE;
 
-	if ((rc = pthread_mutex_destroy(&mutex->mutex)))
+	/**
+	 * Note: CloseHandle(hmutex) on Windows always seems to succeed
+	 * independently of the mutex object locking state
+	 */
+
+	if (mutex->pipe_fd[0] != -1)
 	{
-		/**
-		 * Note: unfortunately we may not return FALSE here since CloseHandle(hmutex) on
-		 * Windows always seems to succeed independently of the mutex object locking state
-		 */
+		close(mutex->pipe_fd[0]);
+		mutex->pipe_fd[0] = -1;
+		winpr_Handle_TrackFds(HANDLE_TYPE_MUTEX, -1);
 	}
 
-	free(handle);
+	if (mutex->pipe_fd[1] != -1)
+	{
+		close(mutex->pipe_fd[1]);
+		mutex->pipe_fd[1] = -1;
+		winpr_Handle_TrackFds(HANDLE_TYPE_MUTEX, -1);
+	}
+
+#ifndef WITH_FUTEX
+	pthread_cond_destroy(&mutex->cond);
+#endif
+	pthread_mutex_destroy(&mutex->fdLock);
+	winpr_LockStats_Free(mutex->Stats);
+	winpr_ObjectPool_Free(HANDLE_TYPE_MUTEX, mutex);
 
 	return TRUE;
 }
@@ -85,60 +293,113 @@ static HANDLE_OPS ops =
 	MutexIsHandled,
 	MutexCloseHandle,
 	MutexGetFd,
-	NULL /* CleanupHandle */
+	MutexCleanupHandle,
+	NULL, /* GetFileSize */
+	NULL, /* FlushFileBuffers */
+	NULL, /* SetEndOfFile */
+	NULL, /* SetFilePointer */
+	NULL, /* SetFilePointerEx */
+	NULL, /* SetFileTime */
+	MutexWait
 };
 
-HANDLE CreateMutexW(LPSECURITY_ATTRIBUTES lpMutexAttributes, BOOL bInitialOwner, LPCWSTR lpName)
+static HANDLE MutexCreate(BOOL bInitialOwner, const void* CallSite)
 {
 	HANDLE handle = NULL;
 	WINPR_MUTEX* mutex;
 
-	mutex = (WINPR_MUTEX*) calloc(1, sizeof(WINPR_MUTEX));
+	mutex = (WINPR_MUTEX*) winpr_ObjectPool_New(HANDLE_TYPE_MUTEX);
+
+	if (!mutex)
+		return NULL;
+
+	mutex->pipe_fd[0] = -1;
+	mutex->pipe_fd[1] = -1;
+	mutex->bFdSignaled = FALSE;
+
+	if (pthread_mutex_init(&mutex->fdLock, NULL) != 0)
+		goto fail;
 
-	if (mutex)
+#ifndef WITH_FUTEX
+	if (winpr_cond_init(&mutex->cond) != 0)
 	{
-		pthread_mutexattr_t attr;
-		pthread_mutexattr_init(&attr);
-		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-		pthread_mutex_init(&mutex->mutex, &attr);
+		pthread_mutex_destroy(&mutex->fdLock);
+		goto fail;
+	}
+#endif
 
-		WINPR_HANDLE_SET_TYPE_AND_MODE(mutex, HANDLE_TYPE_MUTEX, UZI_FD_READ);
-		mutex->ops = &ops;
+	mutex->Stats = winpr_LockStats_New(UZI_LOCK_MUTEX, mutex, CallSite);
 
-		handle = (HANDLE) mutex;
+	if (bInitialOwner)
+	{
+		mutex->Owner = winpr_GetCurrentThreadLockId();
+		mutex->RecursionCount = 1;
 
-		if (bInitialOwner)
-			pthread_mutex_lock(&mutex->mutex);
+		if (mutex->Stats)
+			winpr_LockStats_Acquired(mutex->Stats, 0);
 	}
 
+	WINPR_HANDLE_SET_TYPE_AND_MODE(mutex, HANDLE_TYPE_MUTEX, UZI_FD_READ);
+	mutex->ops = &ops;
+
+	handle = winpr_Handle_Register((WINPR_HANDLE*) mutex);
+
+	if (!handle)
+		MutexCloseHandle(mutex);
+
 	return handle;
+fail:
+	winpr_ObjectPool_Free(HANDLE_TYPE_MUTEX, mutex);
+	return NULL;
+}
+
+HANDLE CreateMutexW(LPSECURITY_ATTRIBUTES lpMutexAttributes, BOOL bInitialOwner, LPCWSTR lpName)
+{
+	return MutexCreate(bInitialOwner, __builtin_return_address(0));
 }
 
 HANDLE CreateMutexA(LPSECURITY_ATTRIBUTES lpMutexAttributes, BOOL bInitialOwner, LPCSTR lpName)
 {
-	return CreateMutexW(lpMutexAttributes, bInitialOwner, NULL);
+	return MutexCreate(bInitialOwner, __builtin_return_address(0));
 }
 
 BOOL ReleaseMutex(HANDLE hMutex)
 {
 	ULONG Type;
 	WINPR_HANDLE* Object;
+	WINPR_MUTEX* mutex;
 
-	if (!winpr_Handle_GetInfo(hMutex, &Type, &Object))
+	if (!winpr_Handle_GetInfo(hMutex, &Type, &Object) || (Type != HANDLE_TYPE_MUTEX))
 		return FALSE;
 
-	if (Type == HANDLE_TYPE_MUTEX)
+	mutex = (WINPR_MUTEX*) Object;
+
+	if (mutex->Owner != winpr_GetCurrentThreadLockId())
 	{
-		WINPR_MUTEX* mutex = (WINPR_MUTEX*) Object;
-		int rc = pthread_mutex_unlock(&mutex->mutex);
-		if (rc)
-		{
-			return FALSE;
-		}
+		SetLastError(ERROR_NOT_OWNER);
+		return FALSE;
+	}
+
+	if (--mutex->RecursionCount)
 		return TRUE;
+
+	if (mutex->Stats)
+		winpr_LockStats_Released(mutex->Stats);
+
+	InterlockedExchange(&mutex->Owner, 0);
+
+	if (mutex->Waiters)
+	{
+#ifdef WITH_FUTEX
+		winpr_futex_wake(&mutex->Owner, 1);
+#else
+		pthread_mutex_lock(&mutex->fdLock);
+		pthread_cond_broadcast(&mutex->cond);
+		pthread_mutex_unlock(&mutex->fdLock);
+#endif
 	}
 
-	return FALSE;
+	return MutexUpdateFd(mutex);
 }
 
 #endif
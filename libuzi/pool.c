@@ -0,0 +1,381 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Handle Object Pools
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <uzi/uzi.h>
+#include <uzi/interlocked.h>
+
+#ifndef _WIN32
+
+#include <pthread.h>
+
+#include "synch.h"
+#include "pool.h"
+
+/* a free object stores the pointer to the next free object in its first bytes */
+struct winpr_pool_entry
+{
+	struct winpr_pool_entry* next;
+};
+typedef struct winpr_pool_entry WINPR_POOL_ENTRY;
+
+/* the counters are only written by the owning thread, and read by UziGetPoolStats */
+struct winpr_pool_cache
+{
+	WINPR_POOL_ENTRY* head;
+	ULONG count;
+
+	ULONGLONG volatile Hits;
+	ULONGLONG volatile Misses;
+	ULONGLONG volatile Releases;
+};
+typedef struct winpr_pool_cache WINPR_POOL_CACHE;
+
+/* pools of different types are used by different threads, do not share cache lines */
+struct UZI_CACHE_ALIGNED winpr_object_pool
+{
+	ULONG Type;
+	size_t size;
+
+	pthread_mutex_t mutex;
+	WINPR_POOL_ENTRY* head;
+	ULONG count;
+
+	/* counters of the threads which exited, protected by g_PoolThreadsMutex */
+	ULONGLONG Hits;
+	ULONGLONG Misses;
+	ULONGLONG Releases;
+
+	LONGLONG volatile Trims;
+};
+typedef struct winpr_object_pool WINPR_OBJECT_POOL;
+
+#define WINPR_POOL(_type, _struct) \
+	{ _type, sizeof(_struct), PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0 }
+
+#define WINPR_POOL_EVENT		0
+#define WINPR_POOL_MUTEX		1
+#define WINPR_POOL_SEMAPHORE		2
+#define WINPR_POOL_TIMER		3
+#define WINPR_POOL_TIMER_QUEUE_TIMER	4
+#define WINPR_POOL_COUNT		5
+
+static WINPR_OBJECT_POOL g_ObjectPools[WINPR_POOL_COUNT] =
+{
+	WINPR_POOL(HANDLE_TYPE_EVENT, WINPR_EVENT),
+	WINPR_POOL(HANDLE_TYPE_MUTEX, WINPR_MUTEX),
+	WINPR_POOL(HANDLE_TYPE_SEMAPHORE, WINPR_SEMAPHORE),
+	WINPR_POOL(HANDLE_TYPE_TIMER, WINPR_TIMER),
+	WINPR_POOL(HANDLE_TYPE_TIMER_QUEUE_TIMER, WINPR_TIMER_QUEUE_TIMER)
+};
+
+struct winpr_pool_thread
+{
+	WINPR_POOL_CACHE caches[WINPR_POOL_COUNT];
+
+	BOOL registered;
+	struct winpr_pool_thread* prev;
+	struct winpr_pool_thread* next;
+};
+typedef struct winpr_pool_thread WINPR_POOL_THREAD;
+
+static __thread WINPR_POOL_THREAD t_PoolThread;
+
+/* the threads which use the pools, so that UziGetPoolStats can sum their counters */
+static pthread_mutex_t g_PoolThreadsMutex = PTHREAD_MUTEX_INITIALIZER;
+static WINPR_POOL_THREAD* g_PoolThreads = NULL;
+
+static pthread_once_t g_PoolKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_PoolKey;
+
+static WINPR_OBJECT_POOL* winpr_ObjectPool_Get(ULONG Type, WINPR_POOL_CACHE** ppCache)
+{
+	int index;
+
+	switch (Type)
+	{
+		case HANDLE_TYPE_EVENT:
+			index = WINPR_POOL_EVENT;
+			break;
+
+		case HANDLE_TYPE_MUTEX:
+			index = WINPR_POOL_MUTEX;
+			break;
+
+		case HANDLE_TYPE_SEMAPHORE:
+			index = WINPR_POOL_SEMAPHORE;
+			break;
+
+		case HANDLE_TYPE_TIMER:
+			index = WINPR_POOL_TIMER;
+			break;
+
+		case HANDLE_TYPE_TIMER_QUEUE_TIMER:
+			index = WINPR_POOL_TIMER_QUEUE_TIMER;
+			break;
+
+		default:
+			return NULL;
+	}
+
+	if (ppCache)
+		*ppCache = &t_PoolThread.caches[index];
+
+	return &g_ObjectPools[index];
+}
+
+/* Moves up to count entries from the head of a list to the head of another one */
+static ULONG winpr_ObjectPool_MoveEntries(WINPR_POOL_ENTRY** pSrc, WINPR_POOL_ENTRY** pDst, ULONG count)
+{
+	ULONG moved = 0;
+	WINPR_POOL_ENTRY* entry;
+
+	while ((moved < count) && (entry = *pSrc))
+	{
+		*pSrc = entry->next;
+		entry->next = *pDst;
+		*pDst = entry;
+		moved++;
+	}
+
+	return moved;
+}
+
+/* Gives back count entries of a thread cache to the shared free list */
+static void winpr_ObjectPool_Drain(WINPR_OBJECT_POOL* pool, WINPR_POOL_CACHE* cache, ULONG count)
+{
+	ULONG moved;
+	ULONG trimmed = 0;
+	WINPR_POOL_ENTRY* entry;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->count < WINPR_POOL_SHARED_MAX)
+	{
+		moved = WINPR_POOL_SHARED_MAX - pool->count;
+
+		if (moved > count)
+			moved = count;
+
+		moved = winpr_ObjectPool_MoveEntries(&cache->head, &pool->head, moved);
+		pool->count += moved;
+		cache->count -= moved;
+		count -= moved;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	while (count && (entry = cache->head))
+	{
+		cache->head = entry->next;
+		cache->count--;
+		count--;
+		free(entry);
+		trimmed++;
+	}
+
+	if (trimmed)
+		InterlockedExchangeAdd64(&pool->Trims, trimmed);
+}
+
+static void winpr_ObjectPool_ThreadExit(void* arg)
+{
+	int index;
+	WINPR_OBJECT_POOL* pool;
+	WINPR_POOL_CACHE* cache;
+	WINPR_POOL_THREAD* thread = &t_PoolThread;
+
+	pthread_mutex_lock(&g_PoolThreadsMutex);
+
+	if (thread->prev)
+		thread->prev->next = thread->next;
+	else
+		g_PoolThreads = thread->next;
+
+	if (thread->next)
+		thread->next->prev = thread->prev;
+
+	for (index = 0; index < WINPR_POOL_COUNT; index++)
+	{
+		pool = &g_ObjectPools[index];
+		cache = &thread->caches[index];
+
+		pool->Hits += cache->Hits;
+		pool->Misses += cache->Misses;
+		pool->Releases += cache->Releases;
+		cache->Hits = cache->Misses = cache->Releases = 0;
+	}
+
+	pthread_mutex_unlock(&g_PoolThreadsMutex);
+
+	for (index = 0; index < WINPR_POOL_COUNT; index++)
+	{
+		cache = &thread->caches[index];
+
+		if (cache->count)
+			winpr_ObjectPool_Drain(&g_ObjectPools[index], cache, cache->count);
+	}
+
+	thread->prev = thread->next = NULL;
+	thread->registered = FALSE;
+}
+
+static void winpr_ObjectPool_InitKey(void)
+{
+	pthread_key_create(&g_PoolKey, winpr_ObjectPool_ThreadExit);
+}
+
+/* Makes sure the thread caches are given back and counted when the thread exits */
+static void winpr_ObjectPool_RegisterThread(void)
+{
+	WINPR_POOL_THREAD* thread = &t_PoolThread;
+
+	if (thread->registered)
+		return;
+
+	pthread_once(&g_PoolKeyOnce, winpr_ObjectPool_InitKey);
+	pthread_setspecific(g_PoolKey, (void*) thread);
+
+	pthread_mutex_lock(&g_PoolThreadsMutex);
+	thread->prev = NULL;
+	thread->next = g_PoolThreads;
+
+	if (g_PoolThreads)
+		g_PoolThreads->prev = thread;
+
+	g_PoolThreads = thread;
+	pthread_mutex_unlock(&g_PoolThreadsMutex);
+
+	thread->registered = TRUE;
+}
+
+void* winpr_ObjectPool_New(ULONG Type)
+{
+	ULONG moved;
+	WINPR_POOL_ENTRY* entry;
+	WINPR_POOL_CACHE* cache;
+	WINPR_OBJECT_POOL* pool;
+
+	pool = winpr_ObjectPool_Get(Type, &cache);
+
+	if (!pool)
+		return NULL;
+
+	winpr_ObjectPool_RegisterThread();
+
+	if (!cache->head && pool->count)
+	{
+		pthread_mutex_lock(&pool->mutex);
+		moved = winpr_ObjectPool_MoveEntries(&pool->head, &cache->head, WINPR_POOL_CACHE_SIZE / 2);
+		pool->count -= moved;
+		cache->count += moved;
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	entry = cache->head;
+
+	if (!entry)
+	{
+		cache->Misses++;
+		return calloc(1, pool->size);
+	}
+
+	cache->head = entry->next;
+	cache->count--;
+	cache->Hits++;
+
+	memset(entry, 0, pool->size);
+	return entry;
+}
+
+void winpr_ObjectPool_Free(ULONG Type, void* object)
+{
+	WINPR_POOL_ENTRY* entry;
+	WINPR_POOL_CACHE* cache;
+	WINPR_OBJECT_POOL* pool;
+
+	if (!object)
+		return;
+
+	pool = winpr_ObjectPool_Get(Type, &cache);
+
+	if (!pool)
+	{
+		free(object);
+		return;
+	}
+
+	winpr_ObjectPool_RegisterThread();
+
+	if (cache->count >= WINPR_POOL_CACHE_SIZE)
+		winpr_ObjectPool_Drain(pool, cache, WINPR_POOL_CACHE_SIZE / 2);
+
+	entry = (WINPR_POOL_ENTRY*) object;
+	entry->next = cache->head;
+	cache->head = entry;
+	cache->count++;
+
+	cache->Releases++;
+}
+
+#endif
+
+bool UziGetPoolStats(uint32_t handleType, UZI_POOL_STATS* stats)
+{
+#ifndef _WIN32
+	int index;
+	WINPR_OBJECT_POOL* pool;
+	WINPR_POOL_THREAD* thread;
+	const WINPR_POOL_CACHE* cache;
+
+	if (!stats)
+		return false;
+
+	pool = winpr_ObjectPool_Get(handleType, NULL);
+
+	if (!pool)
+		return false;
+
+	index = (int) (pool - g_ObjectPools);
+
+	pthread_mutex_lock(&g_PoolThreadsMutex);
+
+	stats->hits = (uint64_t) pool->Hits;
+	stats->misses = (uint64_t) pool->Misses;
+	stats->releases = (uint64_t) pool->Releases;
+
+	for (thread = g_PoolThreads; thread; thread = thread->next)
+	{
+		cache = &thread->caches[index];
+		stats->hits += (uint64_t) cache->Hits;
+		stats->misses += (uint64_t) cache->Misses;
+		stats->releases += (uint64_t) cache->Releases;
+	}
+
+	pthread_mutex_unlock(&g_PoolThreadsMutex);
+
+	stats->trims = (uint64_t) pool->Trims;
+	stats->shared = (uint32_t) pool->count;
+
+	return true;
+#else
+	return false;
+#endif
+}
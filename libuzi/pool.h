@@ -0,0 +1,53 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Handle Object Pools
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WINPR_POOL_PRIVATE_H
+#define WINPR_POOL_PRIVATE_H
+
+#include <uzi/uzi.h>
+#include <uzi/wtypes.h>
+
+#ifndef _WIN32
+
+/**
+ * Object Pools
+ *
+ * Objects of the handle types created at high rates (events, mutexes,
+ * semaphores, waitable timers and timer queue timers) are recycled through
+ * one pool per handle type instead of going back to the allocator.
+ *
+ * Each thread keeps a small cache of free objects per type, so that the
+ * common create/close sequence does not take any lock. When a thread cache
+ * runs empty or full, half of its capacity is moved from or to a shared
+ * free list protected by a mutex. The shared free list is bounded, objects
+ * beyond that limit are given back to the allocator.
+ *
+ * The hit, miss and release counters live in the thread caches as well, and
+ * UziGetPoolStats sums them over the running threads and the exited ones.
+ *
+ * winpr_ObjectPool_New returns zeroed memory, like calloc.
+ */
+
+#define WINPR_POOL_CACHE_SIZE		32
+#define WINPR_POOL_SHARED_MAX		1024
+
+void* winpr_ObjectPool_New(ULONG Type);
+void winpr_ObjectPool_Free(ULONG Type, void* object);
+
+#endif
+
+#endif /* WINPR_POOL_PRIVATE_H */
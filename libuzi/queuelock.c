@@ -0,0 +1,240 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Fair Queued Locks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <uzi/uzi.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/interlocked.h>
+
+#include "synch.h"
+
+#ifndef _WIN32
+
+#include <sched.h>
+#include <unistd.h>
+
+/**
+ * MCS lock
+ *
+ * A thread asking for the lock appends a queue node to the tail of the lock
+ * with a single atomic exchange, then waits on its own node until its
+ * predecessor hands the lock over, so waiting threads never touch a shared
+ * cache line and get the lock in arrival order. A thread arriving late
+ * cannot barge past the queued ones, unlike with critical sections.
+ *
+ * A waiting thread spins on its node for WINPR_QUEUE_SPIN_COUNT checks (not
+ * at all on a single processor, where its predecessor cannot run meanwhile),
+ * then marks it blocked and sleeps on it with a futex (or in the parking
+ * lot). The releasing thread only makes a system call when its successor
+ * blocked.
+ *
+ * Queue nodes must outlive the wait, as the successor links itself to the
+ * node of its predecessor: each thread owns WINPR_QUEUE_NODES cache-aligned
+ * nodes, enough for that many queue locks held at once, beyond which nodes
+ * are allocated.
+ */
+
+#define WINPR_QUEUE_NODES		8
+#define WINPR_QUEUE_SPIN_COUNT		1000
+
+#define WINPR_QUEUE_WAITING		1
+#define WINPR_QUEUE_BLOCKED		2
+
+struct UZI_CACHE_ALIGNED winpr_queue_node
+{
+	struct winpr_queue_node* volatile Next;
+	LONG volatile Locked; /* 0 once the lock was handed over */
+	BOOL bInUse;
+	BOOL bAllocated;
+};
+typedef struct winpr_queue_node WINPR_QUEUE_NODE;
+
+static __thread WINPR_QUEUE_NODE t_QueueNodes[WINPR_QUEUE_NODES];
+
+static LONG g_QueueSpinCount = -1;
+
+static LONG winpr_QueueLock_GetSpinCount(void)
+{
+	if (g_QueueSpinCount < 0)
+		g_QueueSpinCount = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? WINPR_QUEUE_SPIN_COUNT : 0;
+
+	return g_QueueSpinCount;
+}
+
+static WINPR_QUEUE_NODE* winpr_QueueLock_NewNode(void)
+{
+	int index;
+	WINPR_QUEUE_NODE* node;
+
+	for (index = 0; index < WINPR_QUEUE_NODES; index++)
+	{
+		node = &t_QueueNodes[index];
+
+		if (!node->bInUse)
+		{
+			node->bInUse = TRUE;
+			break;
+		}
+	}
+
+	if (index == WINPR_QUEUE_NODES)
+	{
+		/* acquiring a lock cannot fail, wait for memory to be available */
+		while (!(node = (WINPR_QUEUE_NODE*) _aligned_malloc(sizeof(WINPR_QUEUE_NODE), UZI_CACHE_LINE_SIZE)))
+			sched_yield();
+
+		node->bInUse = TRUE;
+		node->bAllocated = TRUE;
+	}
+
+	node->Next = NULL;
+	node->Locked = WINPR_QUEUE_WAITING;
+
+	return node;
+}
+
+static void winpr_QueueLock_FreeNode(WINPR_QUEUE_NODE* node)
+{
+	if (node->bAllocated)
+		_aligned_free(node);
+	else
+		node->bInUse = FALSE;
+}
+
+static void winpr_QueueLock_Wait(WINPR_QUEUE_NODE* node)
+{
+	LONG spins;
+	LONG spinCount = winpr_QueueLock_GetSpinCount();
+
+	for (spins = 0; spins < spinCount; spins++)
+	{
+		if (!node->Locked)
+			return;
+
+		winpr_cpu_relax();
+	}
+
+	if (InterlockedCompareExchange(&node->Locked, WINPR_QUEUE_BLOCKED, WINPR_QUEUE_WAITING) != WINPR_QUEUE_WAITING)
+		return;
+
+	while (node->Locked)
+	{
+#ifdef WITH_FUTEX
+		winpr_futex_wait(&node->Locked, WINPR_QUEUE_BLOCKED, NULL);
+#else
+		winpr_parking_wait(&node->Locked, WINPR_QUEUE_BLOCKED, NULL);
+#endif
+	}
+}
+
+static void winpr_QueueLock_Wake(WINPR_QUEUE_NODE* node)
+{
+	if (InterlockedExchange(&node->Locked, 0) != WINPR_QUEUE_BLOCKED)
+		return;
+
+#ifdef WITH_FUTEX
+	winpr_futex_wake(&node->Locked, 1);
+#else
+	winpr_parking_wake(&node->Locked);
+#endif
+}
+
+#endif
+
+void UziInitQueueLock(UZI_QUEUE_LOCK* lock)
+{
+	lock->tail = NULL;
+	lock->owner = NULL;
+}
+
+void UziAcquireQueueLock(UZI_QUEUE_LOCK* lock)
+{
+#ifndef _WIN32
+	WINPR_QUEUE_NODE* node;
+	WINPR_QUEUE_NODE* prev;
+
+	node = winpr_QueueLock_NewNode();
+	prev = (WINPR_QUEUE_NODE*) InterlockedExchangePointer(&lock->tail, node);
+
+	if (prev)
+	{
+		prev->Next = node;
+		winpr_QueueLock_Wait(node);
+	}
+
+	lock->owner = node;
+#else
+	/* not fair, but the lock stays usable */
+	AcquireSRWLockExclusive((PSRWLOCK) &lock->tail);
+#endif
+}
+
+bool UziTryAcquireQueueLock(UZI_QUEUE_LOCK* lock)
+{
+#ifndef _WIN32
+	WINPR_QUEUE_NODE* node;
+
+	if (lock->tail)
+		return false;
+
+	node = winpr_QueueLock_NewNode();
+
+	if (InterlockedCompareExchangePointer(&lock->tail, node, NULL) != NULL)
+	{
+		winpr_QueueLock_FreeNode(node);
+		return false;
+	}
+
+	lock->owner = node;
+	return true;
+#else
+	return TryAcquireSRWLockExclusive((PSRWLOCK) &lock->tail) ? true : false;
+#endif
+}
+
+void UziReleaseQueueLock(UZI_QUEUE_LOCK* lock)
+{
+#ifndef _WIN32
+	WINPR_QUEUE_NODE* next;
+	WINPR_QUEUE_NODE* node = (WINPR_QUEUE_NODE*) lock->owner;
+
+	lock->owner = NULL;
+	next = node->Next;
+
+	if (!next)
+	{
+		if (InterlockedCompareExchangePointer(&lock->tail, NULL, node) == node)
+		{
+			winpr_QueueLock_FreeNode(node);
+			return;
+		}
+
+		/* a thread is queuing, wait until it has linked its node */
+		while (!(next = node->Next))
+			winpr_cpu_relax();
+	}
+
+	winpr_QueueLock_Wake(next);
+	winpr_QueueLock_FreeNode(node);
+#else
+	ReleaseSRWLockExclusive((PSRWLOCK) &lock->tail);
+#endif
+}
@@ -32,10 +32,41 @@
 #ifndef _WIN32
 
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#ifdef HAVE_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <uzi/interlocked.h>
+
 #include "handle.h"
+#include "pool.h"
 
 #define TAG "semaphore"
 
+/**
+ * Semaphores
+ *
+ * The semaphore count lives in Count, so that acquiring an available permit
+ * or releasing permits with nobody waiting is a single compare-and-swap.
+ * With futex support, threads block on Count itself and the file descriptor
+ * is only created when it is requested, by WaitForMultipleObjects. Without
+ * it, the file descriptor is created with the semaphore and waiters poll it.
+ *
+ * The file descriptor is signaled while Count is not zero. It is kept in
+ * line with Count under fdLock by the threads which move Count from or to
+ * zero, following the same rules as the event file descriptor. Waiters
+ * woken up through it take their permit from Count in the CleanupHandle
+ * operation.
+ *
+ * WaitForSemaphoreN takes several permits at once, only when all of them
+ * are available. Threads waiting for several permits are counted apart in
+ * MultiWaiters, since a release must then wake up all waiters instead of
+ * one per released permit.
+ */
+
 static BOOL SemaphoreCloseHandle(HANDLE handle);
 
 static BOOL SemaphoreIsHandled(HANDLE handle)
@@ -51,34 +82,187 @@ static BOOL SemaphoreIsHandled(HANDLE handle)
 	return TRUE;
 }
 
+static BOOL SemaphoreCreateFd(WINPR_SEMAPHORE* semaphore)
+{
+#ifdef HAVE_EVENTFD_H
+	int fd = eventfd(0, EFD_NONBLOCK);
+
+	if (fd < 0)
+		return FALSE;
+
+	winpr_Handle_TrackFds(HANDLE_TYPE_SEMAPHORE, 1);
+#else
+	int fd;
+
+	if (pipe(semaphore->pipe_fd) < 0)
+		return FALSE;
+
+	fd = semaphore->pipe_fd[0];
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	winpr_Handle_TrackFds(HANDLE_TYPE_SEMAPHORE, 2);
+#endif
+	semaphore->pipe_fd[0] = fd;
+	return TRUE;
+}
+
+/* Brings the file descriptor in line with Count, called with fdLock held */
+static BOOL SemaphoreSyncFd(WINPR_SEMAPHORE* semaphore)
+{
+	int status;
+	BOOL signaled = (semaphore->Count > 0) ? TRUE : FALSE;
+
+	if (signaled == semaphore->bFdSignaled)
+		return TRUE;
+
+	do
+	{
+#ifdef HAVE_EVENTFD_H
+		eventfd_t value = 1;
+
+		if (signaled)
+			status = eventfd_write(semaphore->pipe_fd[0], value);
+		else
+			status = eventfd_read(semaphore->pipe_fd[0], &value);
+#else
+		char value = '-';
+
+		if (signaled)
+			status = (write(semaphore->pipe_fd[1], &value, 1) == 1) ? 0 : -1;
+		else
+			status = (read(semaphore->pipe_fd[0], &value, 1) == 1) ? 0 : -1;
+#endif
+	}
+	while ((status < 0) && (errno == EINTR));
+
+	if (status < 0)
+		return FALSE;
+
+	semaphore->bFdSignaled = signaled;
+	return TRUE;
+}
+
+static BOOL SemaphoreUpdateFd(WINPR_SEMAPHORE* semaphore)
+{
+	BOOL status;
+
+	if (semaphore->pipe_fd[0] < 0)
+		return TRUE;
+
+	pthread_mutex_lock(&semaphore->fdLock);
+	status = SemaphoreSyncFd(semaphore);
+	pthread_mutex_unlock(&semaphore->fdLock);
+
+	return status;
+}
+
 static int SemaphoreGetFd(HANDLE handle)
 {
-	WINPR_SEMAPHORE *sem = (WINPR_SEMAPHORE *)handle;
+	int fd;
+	WINPR_SEMAPHORE *semaphore = (WINPR_SEMAPHORE *)handle;
 
 	if (!SemaphoreIsHandled(handle))
 		return -1;
 
-	return sem->pipe_fd[0];
+	if ((fd = semaphore->pipe_fd[0]) >= 0)
+		return fd;
+
+	pthread_mutex_lock(&semaphore->fdLock);
+
+	if ((semaphore->pipe_fd[0] < 0) && SemaphoreCreateFd(semaphore))
+	{
+		/* publish the file descriptor before reading Count */
+		__sync_synchronize();
+		SemaphoreSyncFd(semaphore);
+	}
+
+	fd = semaphore->pipe_fd[0];
+	pthread_mutex_unlock(&semaphore->fdLock);
+
+	return fd;
+}
+
+/* Takes count permits if they are all available */
+static BOOL SemaphoreTryAcquire(WINPR_SEMAPHORE* semaphore, LONG count)
+{
+	LONG current;
+
+	do
+	{
+		current = semaphore->Count;
+
+		if (current < count)
+			return FALSE;
+	}
+	while (InterlockedCompareExchange(&semaphore->Count, current - count, current) != current);
+
+	if (current == count)
+		SemaphoreUpdateFd(semaphore);
+
+	return TRUE;
 }
 
 static DWORD SemaphoreCleanupHandle(HANDLE handle)
 {
-	int length;
-	WINPR_SEMAPHORE *sem = (WINPR_SEMAPHORE *)handle;
+	WINPR_SEMAPHORE *semaphore = (WINPR_SEMAPHORE *)handle;
 
-	if (!SemaphoreIsHandled(handle))
-		return WAIT_FAILED;
+	/* another waiter took the last permit first, WAIT_TIMEOUT lets the caller wait again */
+	return SemaphoreTryAcquire(semaphore, 1) ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+}
 
-	length = read(sem->pipe_fd[0], &length, 1);
+/**
+ * Waits until count permits can be taken or until the deadline, an absolute
+ * CLOCK_MONOTONIC time. NULL waits forever, a zero deadline only tries once.
+ */
+static DWORD SemaphoreAcquire(WINPR_SEMAPHORE* semaphore, LONG count, const struct timespec* deadline)
+{
+	int status = 0;
+	LONG current;
+	LONG volatile* waiters = (count > 1) ? &semaphore->MultiWaiters : &semaphore->Waiters;
 
-	if (length != 1)
+	for (;;)
 	{
-		return WAIT_FAILED;
+		if (SemaphoreTryAcquire(semaphore, count))
+			return WAIT_OBJECT_0;
+
+		if (status == ETIMEDOUT)
+			return WAIT_TIMEOUT;
+
+		if (deadline && !deadline->tv_sec && !deadline->tv_nsec)
+			return WAIT_TIMEOUT;
+
+		current = semaphore->Count;
+
+		if (current >= count)
+			continue;
+
+#ifdef WITH_FUTEX
+		InterlockedIncrement(waiters);
+		status = winpr_futex_wait(&semaphore->Count, current, deadline);
+		InterlockedDecrement(waiters);
+#else
+		pthread_mutex_lock(&semaphore->fdLock);
+		InterlockedIncrement(waiters);
+
+		if (semaphore->Count == current)
+		{
+			status = winpr_cond_wait(&semaphore->cond, &semaphore->fdLock, deadline);
+		}
+
+		InterlockedDecrement(waiters);
+		pthread_mutex_unlock(&semaphore->fdLock);
+#endif
 	}
+}
+
+#ifdef WITH_FUTEX
 
-	return WAIT_OBJECT_0;
+static DWORD SemaphoreWait(HANDLE handle, const struct timespec* deadline)
+{
+	return SemaphoreAcquire((WINPR_SEMAPHORE*) handle, 1, deadline);
 }
 
+#endif
+
 BOOL SemaphoreCloseHandle(HANDLE handle)
 {
 	WINPR_SEMAPHORE* semaphore = (WINPR_SEMAPHORE*) handle;
@@ -86,28 +270,25 @@ BOOL SemaphoreCloseHandle(HANDLE handle)
 	if (!SemaphoreIsHandled(handle))
 		return FALSE;
 
-#ifdef WINPR_PIPE_SEMAPHORE
-
 	if (semaphore->pipe_fd[0] != -1)
 	{
 		close(semaphore->pipe_fd[0]);
 		semaphore->pipe_fd[0] = -1;
+		winpr_Handle_TrackFds(HANDLE_TYPE_SEMAPHORE, -1);
+	}
 
-		if (semaphore->pipe_fd[1] != -1)
-		{
-			close(semaphore->pipe_fd[1]);
-			semaphore->pipe_fd[1] = -1;
-		}
+	if (semaphore->pipe_fd[1] != -1)
+	{
+		close(semaphore->pipe_fd[1]);
+		semaphore->pipe_fd[1] = -1;
+		winpr_Handle_TrackFds(HANDLE_TYPE_SEMAPHORE, -1);
 	}
 
-#else
-#if defined __APPLE__
-	semaphore_destroy(mach_task_self(), *((winpr_sem_t*) semaphore->sem));
-#else
-	sem_destroy((winpr_sem_t*) semaphore->sem);
-#endif
+#ifndef WITH_FUTEX
+	pthread_cond_destroy(&semaphore->cond);
 #endif
-	free(semaphore);
+	pthread_mutex_destroy(&semaphore->fdLock);
+	winpr_ObjectPool_Free(HANDLE_TYPE_SEMAPHORE, semaphore);
 	return TRUE;
 }
 
@@ -116,7 +297,16 @@ static HANDLE_OPS ops =
 	SemaphoreIsHandled,
 	SemaphoreCloseHandle,
 	SemaphoreGetFd,
-	SemaphoreCleanupHandle
+	SemaphoreCleanupHandle,
+#ifdef WITH_FUTEX
+	NULL, /* GetFileSize */
+	NULL, /* FlushFileBuffers */
+	NULL, /* SetEndOfFile */
+	NULL, /* SetFilePointer */
+	NULL, /* SetFilePointerEx */
+	NULL, /* SetFileTime */
+	SemaphoreWait
+#endif
 };
 
 HANDLE CreateSemaphoreW(LPSECURITY_ATTRIBUTES lpSemaphoreAttributes, LONG lInitialCount, LONG lMaximumCount, LPCWSTR lpName)
@@ -124,59 +314,51 @@ HANDLE CreateSemaphoreW(LPSECURITY_ATTRIBUTES lpSemaphoreAttributes, LONG lIniti
 	HANDLE handle;
 	WINPR_SEMAPHORE* semaphore;
 
-	semaphore = (WINPR_SEMAPHORE*) calloc(1, sizeof(WINPR_SEMAPHORE));
+	if ((lMaximumCount <= 0) || (lInitialCount < 0) || (lInitialCount > lMaximumCount))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+
+	semaphore = (WINPR_SEMAPHORE*) winpr_ObjectPool_New(HANDLE_TYPE_SEMAPHORE);
 
 	if (!semaphore)
 		return NULL;
 
 	semaphore->pipe_fd[0] = -1;
 	semaphore->pipe_fd[1] = -1;
-	semaphore->sem = (winpr_sem_t*) NULL;
+	semaphore->Count = lInitialCount;
+	semaphore->MaximumCount = lMaximumCount;
 	semaphore->ops = &ops;
 
-#ifdef WINPR_PIPE_SEMAPHORE
-
-	if (pipe(semaphore->pipe_fd) < 0)
-	{
-		free(semaphore);
-		return NULL;
-	}
+	if (pthread_mutex_init(&semaphore->fdLock, NULL) != 0)
+		goto fail;
 
-	while (lInitialCount > 0)
+#ifndef WITH_FUTEX
+	if (winpr_cond_init(&semaphore->cond) != 0)
 	{
-		if (write(semaphore->pipe_fd[1], "-", 1) != 1)
-		{
-			close(semaphore->pipe_fd[0]);
-			close(semaphore->pipe_fd[1]);
-			free(semaphore);
-			return NULL;
-		}
-
-		lInitialCount--;
+		pthread_mutex_destroy(&semaphore->fdLock);
+		goto fail;
 	}
 
-#else
-	semaphore->sem = (winpr_sem_t*) malloc(sizeof(winpr_sem_t));
-	if (!semaphore->sem)
+	if (!SemaphoreCreateFd(semaphore) || !SemaphoreSyncFd(semaphore))
 	{
-		free(semaphore);
-		return NULL;
-	}
-#if defined __APPLE__
-	if (semaphore_create(mach_task_self(), semaphore->sem, SYNC_POLICY_FIFO, lMaximumCount) != KERN_SUCCESS)
-#else
-	if (sem_init(semaphore->sem, 0, lMaximumCount) == -1)
-#endif
-	{
-		free(semaphore->sem);
-		free(semaphore);
+		WINPR_HANDLE_SET_TYPE_AND_MODE(semaphore, HANDLE_TYPE_SEMAPHORE, UZI_FD_READ);
+		SemaphoreCloseHandle(semaphore);
 		return NULL;
 	}
 #endif
 
 	WINPR_HANDLE_SET_TYPE_AND_MODE(semaphore, HANDLE_TYPE_SEMAPHORE, UZI_FD_READ);
-	handle = (HANDLE) semaphore;
+	handle = winpr_Handle_Register((WINPR_HANDLE*) semaphore);
+
+	if (!handle)
+		SemaphoreCloseHandle(semaphore);
+
 	return handle;
+fail:
+	winpr_ObjectPool_Free(HANDLE_TYPE_SEMAPHORE, semaphore);
+	return NULL;
 }
 
 HANDLE CreateSemaphoreA(LPSECURITY_ATTRIBUTES lpSemaphoreAttributes, LONG lInitialCount, LONG lMaximumCount, LPCSTR lpName)
@@ -187,37 +369,117 @@ HANDLE CreateSemaphoreA(LPSECURITY_ATTRIBUTES lpSemaphoreAttributes, LONG lIniti
 BOOL ReleaseSemaphore(HANDLE hSemaphore, LONG lReleaseCount, LPLONG lpPreviousCount)
 {
 	ULONG Type;
+	LONG count;
 	WINPR_HANDLE* Object;
 	WINPR_SEMAPHORE* semaphore;
 
-	if (!winpr_Handle_GetInfo(hSemaphore, &Type, &Object))
+	if (!winpr_Handle_GetInfo(hSemaphore, &Type, &Object) || (Type != HANDLE_TYPE_SEMAPHORE))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
 		return FALSE;
+	}
 
-	if (Type == HANDLE_TYPE_SEMAPHORE)
+	if (lReleaseCount <= 0)
 	{
-		semaphore = (WINPR_SEMAPHORE*) Object;
-#ifdef WINPR_PIPE_SEMAPHORE
-		if (semaphore->pipe_fd[0] != -1)
-		{
-			while (lReleaseCount > 0)
-			{
-				if (write(semaphore->pipe_fd[1], "-", 1) != 1)
-					return FALSE;
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	semaphore = (WINPR_SEMAPHORE*) Object;
 
-				lReleaseCount--;
-			}
+	do
+	{
+		count = semaphore->Count;
+
+		if (count > semaphore->MaximumCount - lReleaseCount)
+		{
+			SetLastError(ERROR_TOO_MANY_POSTS);
+			return FALSE;
 		}
+	}
+	while (InterlockedCompareExchange(&semaphore->Count, count + lReleaseCount, count) != count);
+
+	if (lpPreviousCount)
+		*lpPreviousCount = count;
+
+	if (semaphore->Waiters || semaphore->MultiWaiters)
+	{
+#ifdef WITH_FUTEX
+		winpr_futex_wake(&semaphore->Count, semaphore->MultiWaiters ? INT_MAX : lReleaseCount);
 #else
-#if defined __APPLE__
-		semaphore_signal(*((winpr_sem_t*) semaphore->sem));
-#else
-		sem_post((winpr_sem_t*) semaphore->sem);
+		pthread_mutex_lock(&semaphore->fdLock);
+		pthread_cond_broadcast(&semaphore->cond);
+		pthread_mutex_unlock(&semaphore->fdLock);
 #endif
-#endif
-		return TRUE;
 	}
 
-	return FALSE;
+	if (count == 0)
+		return SemaphoreUpdateFd(semaphore);
+
+	return TRUE;
+}
+
+DWORD WaitForSemaphoreN(HANDLE hSemaphore, LONG lCount, DWORD dwMilliseconds)
+{
+	ULONG Type;
+	WINPR_HANDLE* Object;
+	WINPR_SEMAPHORE* semaphore;
+	struct timespec deadline;
+
+	if (!winpr_Handle_GetInfo(hSemaphore, &Type, &Object) || (Type != HANDLE_TYPE_SEMAPHORE))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return WAIT_FAILED;
+	}
+
+	semaphore = (WINPR_SEMAPHORE*) Object;
+
+	/* a count above the maximum could never be satisfied */
+	if ((lCount <= 0) || (lCount > semaphore->MaximumCount))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return WAIT_FAILED;
+	}
+
+	return SemaphoreAcquire(semaphore, lCount, ts_deadline_ms(&deadline, dwMilliseconds));
+}
+
+#else
+
+DWORD WaitForSemaphoreN(HANDLE hSemaphore, LONG lCount, DWORD dwMilliseconds)
+{
+	LONG index;
+	DWORD timeout = dwMilliseconds;
+	DWORD status = WAIT_OBJECT_0;
+	ULONGLONG elapsed;
+	ULONGLONG start = GetTickCount64();
+
+	if (lCount <= 0)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return WAIT_FAILED;
+	}
+
+	/* permits are taken one by one and given back if they cannot all be taken */
+	for (index = 0; index < lCount; index++)
+	{
+		/* all the permits share the timeout */
+		if (index && (dwMilliseconds != INFINITE))
+		{
+			elapsed = GetTickCount64() - start;
+			timeout = (elapsed < dwMilliseconds) ? (DWORD) (dwMilliseconds - elapsed) : 0;
+		}
+
+		status = WaitForSingleObject(hSemaphore, timeout);
+
+		if (status != WAIT_OBJECT_0)
+			break;
+	}
+
+	if ((status != WAIT_OBJECT_0) && index)
+		ReleaseSemaphore(hSemaphore, index, NULL);
+
+	return status;
 }
 
 #endif
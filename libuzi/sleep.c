@@ -36,6 +36,8 @@
 #include <unistd.h>
 #endif
 
+#include "thread.h"
+
 VOID Sleep(DWORD dwMilliseconds)
 {
 	usleep(dwMilliseconds * 1000);
@@ -43,8 +45,11 @@ VOID Sleep(DWORD dwMilliseconds)
 
 DWORD SleepEx(DWORD dwMilliseconds, BOOL bAlertable)
 {
+	if (bAlertable)
+		return winpr_SleepAlertable(dwMilliseconds);
+
 	usleep(dwMilliseconds * 1000);
-	return TRUE;
+	return 0;
 }
 
 #endif
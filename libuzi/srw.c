@@ -0,0 +1,524 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Slim Reader/Writer (SRW) Locks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <uzi/synch.h>
+#include <uzi/interlocked.h>
+
+#include "synch.h"
+
+#ifndef _WIN32
+
+#include <sched.h>
+#include <unistd.h>
+
+/**
+ * Lock word
+ *
+ * An SRW lock is a single pointer-sized word which needs neither allocation
+ * nor teardown. Its first 32 bits hold the lock state, which is also the
+ * futex word threads block on:
+ *
+ * WINPR_SRW_WRITER:	the lock is held exclusively
+ * WINPR_SRW_WAITERS:	threads are blocked, releasing the lock wakes them all
+ * WINPR_SRW_BIAS:	readers may acquire through the visible reader table
+ * upper bits:		number of readers counted in the lock word
+ *
+ * New readers do not enter while WINPR_SRW_WAITERS is set, so that a blocked
+ * writer is not starved by a continuous flow of readers.
+ */
+
+#define WINPR_SRW_WRITER		0x00000001
+#define WINPR_SRW_WAITERS		0x00000002
+#define WINPR_SRW_BIAS			0x00000004
+#define WINPR_SRW_READER		0x00000008
+
+#define WINPR_SRW_READERS(_state)	(((ULONG) (_state)) >> 3)
+
+#define WINPR_SRW_STATE(_lock)		((LONG volatile*) &(_lock)->Ptr)
+
+/* number of lock checks before blocking */
+#define WINPR_SRW_SPIN_COUNT		64
+
+#if defined(__LP64__) || defined(_WIN64)
+/**
+ * Visible reader table
+ *
+ * Counting readers in the lock word makes every shared acquisition bounce
+ * the cache line of the lock between the cores. When the lock is biased
+ * towards readers, a reader instead publishes the address of the lock in
+ * one of the slots of a row of a global table owned by its thread, so that
+ * concurrent readers only write to their own cache line.
+ *
+ * A writer first takes WINPR_SRW_WRITER, then clears WINPR_SRW_BIAS and
+ * waits until no slot of the table holds the lock anymore. Readers check
+ * WINPR_SRW_BIAS again after publishing their slot, and fall back to the
+ * lock word when it was cleared meanwhile.
+ *
+ * Since revoking the bias scans the whole table, it is only set again once
+ * WINPR_SRW_BIAS_DELAY readers went through the lock word. That counter
+ * lives in the second half of the lock, which is why the table is only
+ * used where pointers are 64 bits wide.
+ */
+#define WITH_SRW_READER_BIAS		1
+
+#define WINPR_SRW_READER_ROWS		64
+#define WINPR_SRW_READER_SLOTS		8
+#define WINPR_SRW_BIAS_DELAY		64
+
+#define WINPR_SRW_INHIBIT(_lock)	(((LONG volatile*) &(_lock)->Ptr) + 1)
+
+struct UZI_CACHE_ALIGNED winpr_srw_reader_row
+{
+	PSRWLOCK volatile Slots[WINPR_SRW_READER_SLOTS];
+};
+typedef struct winpr_srw_reader_row WINPR_SRW_READER_ROW;
+
+static WINPR_SRW_READER_ROW g_SRWReaderRows[WINPR_SRW_READER_ROWS];
+static LONG volatile g_SRWReaderRowOwners[WINPR_SRW_READER_ROWS];
+
+/* row index plus one, -1 when all rows were taken */
+static __thread LONG t_SRWReaderRow = 0;
+
+static pthread_once_t g_SRWReaderKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_SRWReaderKey;
+#endif
+
+#ifndef WITH_FUTEX
+/**
+ * Without futex support, blocked threads wait on one of a fixed set of
+ * condition variables, selected from the address of the word.
+ */
+#define WINPR_PARKING_SLOTS		64
+
+struct winpr_parking_slot
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+typedef struct winpr_parking_slot WINPR_PARKING_SLOT;
+
+static WINPR_PARKING_SLOT g_ParkingSlots[WINPR_PARKING_SLOTS];
+static pthread_once_t g_ParkingOnce = PTHREAD_ONCE_INIT;
+
+static void winpr_parking_init(void)
+{
+	int index;
+
+	for (index = 0; index < WINPR_PARKING_SLOTS; index++)
+	{
+		pthread_mutex_init(&g_ParkingSlots[index].mutex, NULL);
+		winpr_cond_init(&g_ParkingSlots[index].cond);
+	}
+}
+
+static WINPR_PARKING_SLOT* winpr_parking_slot(LONG volatile* addr)
+{
+	pthread_once(&g_ParkingOnce, winpr_parking_init);
+	return &g_ParkingSlots[(((ULONG_PTR) addr) >> 4) % WINPR_PARKING_SLOTS];
+}
+
+int winpr_parking_wait(LONG volatile* addr, LONG value, const struct timespec* deadline)
+{
+	int status = 0;
+	WINPR_PARKING_SLOT* slot = winpr_parking_slot(addr);
+
+	pthread_mutex_lock(&slot->mutex);
+
+	if (*addr == value)
+		status = winpr_cond_wait(&slot->cond, &slot->mutex, deadline);
+
+	pthread_mutex_unlock(&slot->mutex);
+
+	return (status == ETIMEDOUT) ? ETIMEDOUT : 0;
+}
+
+void winpr_parking_wake(LONG volatile* addr)
+{
+	WINPR_PARKING_SLOT* slot = winpr_parking_slot(addr);
+
+	pthread_mutex_lock(&slot->mutex);
+	pthread_cond_broadcast(&slot->cond);
+	pthread_mutex_unlock(&slot->mutex);
+}
+#endif
+
+static void winpr_srw_Park(LONG volatile* state, LONG value)
+{
+#ifdef WITH_FUTEX
+	winpr_futex_wait(state, value, NULL);
+#else
+	winpr_parking_wait(state, value, NULL);
+#endif
+}
+
+static void winpr_srw_Unpark(LONG volatile* state)
+{
+#ifdef WITH_FUTEX
+	winpr_futex_wake(state, INT_MAX);
+#else
+	winpr_parking_wake(state);
+#endif
+}
+
+/**
+ * Waits for a busy lock: spins for a while, then sets WINPR_SRW_WAITERS and
+ * blocks until the lock word changes.
+ */
+
+static void winpr_srw_Wait(PSRWLOCK SRWLock, LONG state, DWORD* pSpins)
+{
+	LONG volatile* pState = WINPR_SRW_STATE(SRWLock);
+
+	if (*pSpins < WINPR_SRW_SPIN_COUNT)
+	{
+		(*pSpins)++;
+		winpr_cpu_relax();
+		return;
+	}
+
+	if (!(state & WINPR_SRW_WAITERS))
+	{
+		/* the state changed meanwhile, let the caller check it again */
+		if (InterlockedCompareExchange(pState, state | WINPR_SRW_WAITERS, state) != state)
+			return;
+
+		state |= WINPR_SRW_WAITERS;
+	}
+
+	winpr_srw_Park(pState, state);
+}
+
+#ifdef WITH_SRW_READER_BIAS
+static void winpr_srw_ReleaseReaderRow(void* arg)
+{
+	LONG row = (LONG) (ULONG_PTR) arg;
+
+	InterlockedExchange(&g_SRWReaderRowOwners[row - 1], 0);
+}
+
+static void winpr_srw_InitReaderKey(void)
+{
+	pthread_key_create(&g_SRWReaderKey, winpr_srw_ReleaseReaderRow);
+}
+
+static LONG winpr_srw_AssignReaderRow(void)
+{
+	LONG row;
+
+	pthread_once(&g_SRWReaderKeyOnce, winpr_srw_InitReaderKey);
+
+	for (row = 0; row < WINPR_SRW_READER_ROWS; row++)
+	{
+		if (g_SRWReaderRowOwners[row])
+			continue;
+
+		if (InterlockedCompareExchange(&g_SRWReaderRowOwners[row], 1, 0) == 0)
+		{
+			t_SRWReaderRow = row + 1;
+			pthread_setspecific(g_SRWReaderKey, (void*) (ULONG_PTR) t_SRWReaderRow);
+			return t_SRWReaderRow;
+		}
+	}
+
+	t_SRWReaderRow = -1;
+	return t_SRWReaderRow;
+}
+
+static PSRWLOCK volatile* winpr_srw_GetReaderSlot(PSRWLOCK SRWLock, LONG row)
+{
+	ULONG_PTR hash = ((ULONG_PTR) SRWLock) * 0x9E3779B97F4A7C15ULL;
+
+	return &g_SRWReaderRows[row - 1].Slots[hash >> 61];
+}
+
+static BOOL winpr_srw_TryAcquireBiased(PSRWLOCK SRWLock)
+{
+	LONG row;
+	PSRWLOCK volatile* slot;
+	LONG volatile* pState = WINPR_SRW_STATE(SRWLock);
+
+	if (!(*pState & WINPR_SRW_BIAS))
+		return FALSE;
+
+	row = t_SRWReaderRow;
+
+	if (!row)
+		row = winpr_srw_AssignReaderRow();
+
+	if (row < 0)
+		return FALSE;
+
+	slot = winpr_srw_GetReaderSlot(SRWLock, row);
+
+	/* the slot is used by another lock, or by this one recursively */
+	if (*slot)
+		return FALSE;
+
+	*slot = SRWLock;
+	__sync_synchronize();
+
+	if (*pState & WINPR_SRW_BIAS)
+		return TRUE;
+
+	*slot = NULL;
+	return FALSE;
+}
+
+static BOOL winpr_srw_ReleaseBiased(PSRWLOCK SRWLock)
+{
+	PSRWLOCK volatile* slot;
+
+	if (t_SRWReaderRow <= 0)
+		return FALSE;
+
+	slot = winpr_srw_GetReaderSlot(SRWLock, t_SRWReaderRow);
+
+	if (*slot != SRWLock)
+		return FALSE;
+
+	__sync_synchronize();
+	*slot = NULL;
+	return TRUE;
+}
+
+/**
+ * Called by the writer holding WINPR_SRW_WRITER. When bWait is FALSE, returns
+ * FALSE instead of waiting for the readers still holding a slot.
+ */
+
+static BOOL winpr_srw_RevokeBias(PSRWLOCK SRWLock, BOOL bWait)
+{
+	LONG row;
+	LONG slot;
+	LONG state;
+	DWORD spins = 0;
+	LONG volatile* pState = WINPR_SRW_STATE(SRWLock);
+
+	do
+	{
+		state = *pState;
+	}
+	while (InterlockedCompareExchange(pState, state & ~WINPR_SRW_BIAS, state) != state);
+
+	*WINPR_SRW_INHIBIT(SRWLock) = WINPR_SRW_BIAS_DELAY;
+	__sync_synchronize();
+
+	for (row = 0; row < WINPR_SRW_READER_ROWS; row++)
+	{
+		if (!g_SRWReaderRowOwners[row])
+			continue;
+
+		for (slot = 0; slot < WINPR_SRW_READER_SLOTS; slot++)
+		{
+			while (g_SRWReaderRows[row].Slots[slot] == SRWLock)
+			{
+				if (!bWait)
+					return FALSE;
+
+				/* readers in the table cannot wake the writer, back off gradually */
+				if (spins < WINPR_SRW_SPIN_COUNT)
+					winpr_cpu_relax();
+				else if (spins < (WINPR_SRW_SPIN_COUNT * 2))
+					sched_yield();
+				else
+					usleep(100);
+
+				spins++;
+			}
+		}
+	}
+
+	__sync_synchronize();
+	return TRUE;
+}
+#endif
+
+/* Acquires the lock shared through the reader count of the lock word */
+
+static BOOL winpr_srw_TryAcquireCounted(PSRWLOCK SRWLock, LONG state)
+{
+	LONG value = state + WINPR_SRW_READER;
+	LONG volatile* pState = WINPR_SRW_STATE(SRWLock);
+#ifdef WITH_SRW_READER_BIAS
+	LONG volatile* pInhibit = WINPR_SRW_INHIBIT(SRWLock);
+
+	if (!(state & WINPR_SRW_BIAS) && (*pInhibit <= 0))
+		value |= WINPR_SRW_BIAS;
+#endif
+
+	if (InterlockedCompareExchange(pState, value, state) != state)
+		return FALSE;
+
+#ifdef WITH_SRW_READER_BIAS
+	if (!(value & WINPR_SRW_BIAS) && (*pInhibit > 0))
+		InterlockedDecrement(pInhibit);
+#endif
+
+	return TRUE;
+}
+
+VOID InitializeSRWLock(PSRWLOCK SRWLock)
+{
+	SRWLock->Ptr = NULL;
+}
+
+VOID AcquireSRWLockExclusive(PSRWLOCK SRWLock)
+{
+	LONG state;
+	DWORD spins = 0;
+	LONG volatile* pState = WINPR_SRW_STATE(SRWLock);
+
+	for (;;)
+	{
+		state = *pState;
+
+		if (!(state & WINPR_SRW_WRITER) && !WINPR_SRW_READERS(state))
+		{
+			if (InterlockedCompareExchange(pState, state | WINPR_SRW_WRITER, state) == state)
+				break;
+
+			continue;
+		}
+
+		winpr_srw_Wait(SRWLock, state, &spins);
+	}
+
+#ifdef WITH_SRW_READER_BIAS
+	if (state & WINPR_SRW_BIAS)
+		winpr_srw_RevokeBias(SRWLock, TRUE);
+#endif
+}
+
+VOID AcquireSRWLockShared(PSRWLOCK SRWLock)
+{
+	LONG state;
+	DWORD spins = 0;
+	LONG volatile* pState = WINPR_SRW_STATE(SRWLock);
+
+#ifdef WITH_SRW_READER_BIAS
+	if (winpr_srw_TryAcquireBiased(SRWLock))
+		return;
+#endif
+
+	for (;;)
+	{
+		state = *pState;
+
+		if (!(state & (WINPR_SRW_WRITER | WINPR_SRW_WAITERS)))
+		{
+			if (winpr_srw_TryAcquireCounted(SRWLock, state))
+				return;
+
+			continue;
+		}
+
+		winpr_srw_Wait(SRWLock, state, &spins);
+	}
+}
+
+BOOLEAN TryAcquireSRWLockExclusive(PSRWLOCK SRWLock)
+{
+	LONG state;
+	LONG volatile* pState = WINPR_SRW_STATE(SRWLock);
+
+	do
+	{
+		state = *pState;
+
+		if ((state & WINPR_SRW_WRITER) || WINPR_SRW_READERS(state))
+			return FALSE;
+	}
+	while (InterlockedCompareExchange(pState, state | WINPR_SRW_WRITER, state) != state);
+
+#ifdef WITH_SRW_READER_BIAS
+	if ((state & WINPR_SRW_BIAS) && !winpr_srw_RevokeBias(SRWLock, FALSE))
+	{
+		/**
+		 * Readers are still in the table: give the lock back biased,
+		 * since writers only scan the table of a biased lock.
+		 */
+		if (InterlockedExchange(pState, WINPR_SRW_BIAS) & WINPR_SRW_WAITERS)
+			winpr_srw_Unpark(pState);
+
+		return FALSE;
+	}
+#endif
+
+	return TRUE;
+}
+
+BOOLEAN TryAcquireSRWLockShared(PSRWLOCK SRWLock)
+{
+	LONG state;
+	LONG volatile* pState = WINPR_SRW_STATE(SRWLock);
+
+#ifdef WITH_SRW_READER_BIAS
+	if (winpr_srw_TryAcquireBiased(SRWLock))
+		return TRUE;
+#endif
+
+	do
+	{
+		state = *pState;
+
+		if (state & (WINPR_SRW_WRITER | WINPR_SRW_WAITERS))
+			return FALSE;
+	}
+	while (!winpr_srw_TryAcquireCounted(SRWLock, state));
+
+	return TRUE;
+}
+
+VOID ReleaseSRWLockExclusive(PSRWLOCK SRWLock)
+{
+	LONG volatile* pState = WINPR_SRW_STATE(SRWLock);
+
+	/* no reader is counted and the bias was revoked while the lock is held exclusively */
+	if (InterlockedExchange(pState, 0) & WINPR_SRW_WAITERS)
+		winpr_srw_Unpark(pState);
+}
+
+VOID ReleaseSRWLockShared(PSRWLOCK SRWLock)
+{
+	LONG state;
+	LONG value;
+	LONG volatile* pState = WINPR_SRW_STATE(SRWLock);
+
+#ifdef WITH_SRW_READER_BIAS
+	if (winpr_srw_ReleaseBiased(SRWLock))
+		return;
+#endif
+
+	do
+	{
+		state = *pState;
+		value = state - WINPR_SRW_READER;
+
+		if (!WINPR_SRW_READERS(value))
+			value &= ~WINPR_SRW_WAITERS;
+	}
+	while (InterlockedCompareExchange(pState, value, state) != state);
+
+	if (!WINPR_SRW_READERS(value) && (state & WINPR_SRW_WAITERS))
+		winpr_srw_Unpark(pState);
+}
+
+#endif
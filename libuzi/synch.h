@@ -32,11 +32,55 @@
 #define WITH_POSIX_TIMER	1
 #endif
 
+#if defined(__linux__) && defined(HAVE_LINUX_FUTEX_H)
+#define WITH_FUTEX		1
+#endif
+
 #include "handle.h"
 
 #ifndef _WIN32
 
-#define WINPR_PIPE_SEMAPHORE	1
+#ifdef WITH_FUTEX
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * Futex helpers
+ *
+ * winpr_futex_wait blocks as long as *addr == value, until woken up or until
+ * the deadline, an absolute CLOCK_MONOTONIC time (NULL waits forever), has
+ * passed. It returns 0 when woken up or when *addr != value, ETIMEDOUT when
+ * the deadline has passed, or EINTR. Futexes are process private.
+ *
+ * winpr_futex_wake returns the number of threads woken up. As long as
+ * *addr == value, winpr_futex_requeue moves the threads blocked on addr to
+ * target without waking them up, and returns how many were moved; it
+ * returns -1 with errno set to EAGAIN when *addr != value.
+ */
+
+static inline int winpr_futex_wait(LONG volatile* addr, LONG value, const struct timespec* deadline)
+{
+	if (syscall(SYS_futex, addr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, value,
+			deadline, NULL, FUTEX_BITSET_MATCH_ANY) == 0)
+		return 0;
+
+	return (errno == EAGAIN) ? 0 : errno;
+}
+
+static inline int winpr_futex_wake(LONG volatile* addr, int count)
+{
+	return (int) syscall(SYS_futex, addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, NULL, NULL, 0);
+}
+
+static inline int winpr_futex_requeue(LONG volatile* addr, LONG value, LONG volatile* target)
+{
+	return (int) syscall(SYS_futex, addr, FUTEX_CMP_REQUEUE | FUTEX_PRIVATE_FLAG, 0,
+			(void*) (ULONG_PTR) INT_MAX, target, value);
+}
+#endif
 
 #if defined __APPLE__
 #include <pthread.h>
@@ -52,11 +96,201 @@
 #define winpr_sem_t sem_t
 #endif
 
+/**
+ * Tells the processor that the calling thread is busy waiting, which saves
+ * power and lets the other hardware thread of the core run.
+ */
+
+static inline void winpr_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__("pause" ::: "memory");
+#elif defined(__aarch64__) || (defined(__arm__) && (__ARM_ARCH >= 7))
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+#include <time.h>
+#include <limits.h>
+
+/**
+ * Deadlines
+ *
+ * Waits run until an absolute CLOCK_MONOTONIC deadline, NULL when they
+ * never time out, so that waiting again after a spurious wakeup or after
+ * a handle was consumed by another waiter does not need to account for
+ * the time already spent. A relative timeout of 0 gives a zero deadline,
+ * which objects implementing the Wait operation treat as a state check.
+ *
+ * Millisecond timeouts computed by ts_remaining_ms are capped at INT_MAX,
+ * about 24.8 days: a poll-like call returning after such a timeout has to
+ * check the deadline again before reporting a timeout.
+ */
+
+static inline void ts_add_ms(struct timespec* ts, DWORD dwMilliseconds)
+{
+	ts->tv_sec += dwMilliseconds / 1000L;
+	ts->tv_nsec += (dwMilliseconds % 1000L) * 1000000L;
+	ts->tv_sec += ts->tv_nsec / 1000000000L;
+	ts->tv_nsec = ts->tv_nsec % 1000000000L;
+}
+
+static inline const struct timespec* ts_deadline_ms(struct timespec* deadline, DWORD dwMilliseconds)
+{
+	if (dwMilliseconds == INFINITE)
+		return NULL;
+
+	deadline->tv_sec = 0;
+	deadline->tv_nsec = 0;
+
+	if (dwMilliseconds)
+	{
+		clock_gettime(CLOCK_MONOTONIC, deadline);
+		ts_add_ms(deadline, dwMilliseconds);
+	}
+
+	return deadline;
+}
+
+static inline const struct timespec* ts_deadline_ns(struct timespec* deadline, ULONGLONG DeadlineNs)
+{
+	if (DeadlineNs == WAIT_DEADLINE_INFINITE)
+		return NULL;
+
+	deadline->tv_sec = (time_t) (DeadlineNs / 1000000000ULL);
+	deadline->tv_nsec = (long) (DeadlineNs % 1000000000ULL);
+
+	return deadline;
+}
+
+/* Time left before the deadline, zero once it has passed */
+static inline void ts_remaining(const struct timespec* deadline, struct timespec* remaining)
+{
+	long long diff;
+	struct timespec timenow;
+
+	clock_gettime(CLOCK_MONOTONIC, &timenow);
+	diff = (deadline->tv_sec - timenow.tv_sec) * 1000000000LL + (deadline->tv_nsec - timenow.tv_nsec);
+
+	if (diff < 0)
+		diff = 0;
+
+	remaining->tv_sec = (time_t) (diff / 1000000000LL);
+	remaining->tv_nsec = (long) (diff % 1000000000LL);
+}
+
+/* Milliseconds left before the deadline rounded up, for poll-like timeouts: -1 for NULL */
+static inline int ts_remaining_ms(const struct timespec* deadline)
+{
+	long long ms;
+	struct timespec remaining;
+
+	if (!deadline)
+		return -1;
+
+	ts_remaining(deadline, &remaining);
+	ms = (long long) remaining.tv_sec * 1000LL + (remaining.tv_nsec + 999999) / 1000000;
+
+	return (ms > INT_MAX) ? INT_MAX : (int) ms;
+}
+
+/* Deadline of a wait which only checks the object state */
+static inline BOOL ts_is_nowait(const struct timespec* deadline)
+{
+	return (deadline && !deadline->tv_sec && !deadline->tv_nsec) ? TRUE : FALSE;
+}
+
+#ifndef WITH_FUTEX
+#include <errno.h>
+#include <time.h>
+
+/**
+ * Condition helpers
+ *
+ * Without futex support, threads block on a condition variable instead.
+ * winpr_cond_wait takes the same absolute CLOCK_MONOTONIC deadline as
+ * winpr_futex_wait (NULL waits forever) and returns 0 or ETIMEDOUT.
+ */
+
+static inline int winpr_cond_init(pthread_cond_t* cond)
+{
+	int status;
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+#ifndef __APPLE__
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+	status = pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return status;
+}
+
+static inline int winpr_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+		const struct timespec* deadline)
+{
+#ifdef __APPLE__
+	struct timespec now;
+	struct timespec timeout;
+#endif
+
+	if (!deadline)
+		return pthread_cond_wait(cond, mutex);
+
+#ifdef __APPLE__
+	/* the condition clock cannot be changed, wait for the remaining time instead */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timeout.tv_sec = deadline->tv_sec - now.tv_sec;
+	timeout.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+
+	if (timeout.tv_nsec < 0)
+	{
+		timeout.tv_sec--;
+		timeout.tv_nsec += 1000000000;
+	}
+
+	if (timeout.tv_sec < 0)
+		return ETIMEDOUT;
+
+	return pthread_cond_timedwait_relative_np(cond, mutex, &timeout);
+#else
+	return pthread_cond_timedwait(cond, mutex, deadline);
+#endif
+}
+
+/**
+ * Parking lot
+ *
+ * Blocks on an arbitrary 32-bit word, like a futex, for the objects which
+ * cannot embed a condition variable. winpr_parking_wait blocks as long as
+ * *addr == value, until woken up or until the deadline, and returns 0 or
+ * ETIMEDOUT. winpr_parking_wake wakes up all the threads blocked on addr,
+ * and possibly threads blocked on other words sharing the same slot.
+ */
+
+int winpr_parking_wait(LONG volatile* addr, LONG value, const struct timespec* deadline);
+void winpr_parking_wake(LONG volatile* addr);
+#endif
+
 struct winpr_mutex
 {
 	WINPR_HANDLE_DEF();
 
-	pthread_mutex_t mutex;
+	int pipe_fd[2];
+	LONG volatile Owner; /* lock id of the owning thread, 0 when free */
+	LONG RecursionCount;
+
+	LONG volatile Waiters; /* threads blocked on Owner */
+	BOOL bFdSignaled; /* state of the file descriptor, see MutexSyncFd */
+	pthread_mutex_t fdLock;
+#ifndef WITH_FUTEX
+	pthread_cond_t cond; /* signaled on release when threads are blocked */
+#endif
+
+	struct winpr_lock_stats* Stats; /* set when lock profiling is enabled */
 };
 typedef struct winpr_mutex WINPR_MUTEX;
 
@@ -65,7 +299,16 @@ struct winpr_semaphore
 	WINPR_HANDLE_DEF();
 
 	int pipe_fd[2];
-	winpr_sem_t* sem;
+	LONG volatile Count;
+	LONG MaximumCount;
+
+	LONG volatile Waiters; /* threads blocked for a single permit */
+	LONG volatile MultiWaiters; /* threads blocked in WaitForSemaphoreN */
+	BOOL bFdSignaled; /* state of the file descriptor, see SemaphoreSyncFd */
+	pthread_mutex_t fdLock;
+#ifndef WITH_FUTEX
+	pthread_cond_t cond; /* signaled on release when threads are blocked */
+#endif
 };
 typedef struct winpr_semaphore WINPR_SEMAPHORE;
 
@@ -76,6 +319,11 @@ struct winpr_event
 	int pipe_fd[2];
 	BOOL bAttached;
 	BOOL bManualReset;
+
+	LONG volatile State; /* 1 when signaled, not used by attached events */
+	LONG volatile Waiters; /* threads blocked on the State futex */
+	BOOL bFdSignaled; /* state of the file descriptor, see EventSyncFd */
+	pthread_mutex_t fdLock;
 };
 typedef struct winpr_event WINPR_EVENT;
 
@@ -138,6 +386,7 @@ struct winpr_timer_queue_timer
 	struct timespec StartTime;
 	struct timespec ExpirationTime;
 
+	HANDLE handle;
 	WINPR_TIMER_QUEUE* timerQueue;
 	WINPR_TIMER_QUEUE_TIMER* next;
 };
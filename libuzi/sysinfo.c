@@ -55,6 +55,10 @@ defined(__OpenBSD__) || defined(__DragonFly__)
 #include <sys/sysctl.h>
 #endif
 
+#if defined(__MACH__) && !defined(CLOCK_MONOTONIC)
+#include <mach/mach_time.h>
+#endif
+
 static DWORD GetProcessorArchitecture(void)
 {
 	DWORD cpuArch = PROCESSOR_ARCHITECTURE_UNKNOWN;
@@ -601,6 +605,32 @@ DWORD GetTickCountPrecise(void)
 #endif
 }
 
+ULONGLONG GetMonotonicTimeNs(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER freq;
+	LARGE_INTEGER current;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&current);
+	return (ULONGLONG) (current.QuadPart / freq.QuadPart) * 1000000000ULL +
+		(ULONGLONG) (current.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#elif defined(__MACH__) && !defined(CLOCK_MONOTONIC)
+	static mach_timebase_info_data_t timebase;
+
+	if (!timebase.denom)
+		mach_timebase_info(&timebase);
+
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return (ULONGLONG) ts.tv_sec * 1000000000ULL + (ULONGLONG) ts.tv_nsec;
+#endif
+}
+
 BOOL IsProcessorFeaturePresentEx(DWORD ProcessorFeature)
 {
 	BOOL ret = FALSE;
@@ -0,0 +1,200 @@
+
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/handle.h>
+
+#define TEST_HANDLE_COUNT	4096
+
+int TestHandle(int argc, char* argv[])
+{
+	int i;
+	HANDLE event;
+	HANDLE stale;
+	HANDLE duplicate;
+	HANDLE* events;
+	UZI_HANDLE_STATS before;
+	UZI_HANDLE_STATS after;
+
+	event = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+	if (!event)
+	{
+		printf("CreateEvent failure\n");
+		return -1;
+	}
+
+	if (!CloseHandle(event))
+	{
+		printf("CloseHandle failure\n");
+		return -1;
+	}
+
+	/* A closed handle must be rejected, not dereferenced */
+	stale = event;
+
+	if (CloseHandle(stale))
+	{
+		printf("CloseHandle unexpectedly succeeded on a closed handle\n");
+		return -1;
+	}
+
+	if (SetEvent(stale))
+	{
+		printf("SetEvent unexpectedly succeeded on a closed handle\n");
+		return -1;
+	}
+
+	if (WaitForSingleObject(stale, 0) != WAIT_FAILED)
+	{
+		printf("WaitForSingleObject unexpectedly succeeded on a closed handle\n");
+		return -1;
+	}
+
+	/* The slot gets reused, but the stale handle must stay invalid */
+	event = CreateEventA(NULL, TRUE, TRUE, NULL);
+
+	if (!event || (event == stale))
+	{
+		printf("CreateEvent returned a handle equal to a closed one\n");
+		return -1;
+	}
+
+	if (ResetEvent(stale))
+	{
+		printf("ResetEvent unexpectedly succeeded on a closed handle\n");
+		return -1;
+	}
+
+	if (WaitForSingleObject(event, 0) != WAIT_OBJECT_0)
+	{
+		printf("Event state was modified through a closed handle\n");
+		return -1;
+	}
+
+	CloseHandle(event);
+
+	/* Handles of the wrong type must be rejected */
+	event = CreateSemaphoreA(NULL, 0, 1, NULL);
+
+	if (!event || SetEvent(event))
+	{
+		printf("SetEvent unexpectedly succeeded on a semaphore\n");
+		return -1;
+	}
+
+	CloseHandle(event);
+
+	/* Duplicated handles keep the object alive until the last one is closed */
+	event = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+	if (!event || !DuplicateHandle(NULL, event, NULL,
+			&duplicate, 0, FALSE, DUPLICATE_SAME_ACCESS))
+	{
+		printf("DuplicateHandle failure\n");
+		return -1;
+	}
+
+	if ((duplicate == event) || !CloseHandle(event))
+	{
+		printf("DuplicateHandle returned an unexpected handle\n");
+		return -1;
+	}
+
+	if (!SetEvent(duplicate) || (WaitForSingleObject(duplicate, 0) != WAIT_OBJECT_0))
+	{
+		printf("duplicated handle unusable after closing the source handle\n");
+		return -1;
+	}
+
+	if (!DuplicateHandle(NULL, duplicate, NULL,
+			&event, 0, FALSE, DUPLICATE_CLOSE_SOURCE))
+	{
+		printf("DuplicateHandle with DUPLICATE_CLOSE_SOURCE failure\n");
+		return -1;
+	}
+
+	if (CloseHandle(duplicate))
+	{
+		printf("DUPLICATE_CLOSE_SOURCE did not close the source handle\n");
+		return -1;
+	}
+
+	if ((WaitForSingleObject(event, 0) != WAIT_OBJECT_0) || !CloseHandle(event))
+	{
+		printf("duplicated handle failure\n");
+		return -1;
+	}
+
+	if (DuplicateHandle(NULL, event, NULL,
+			&duplicate, 0, FALSE, DUPLICATE_SAME_ACCESS))
+	{
+		printf("DuplicateHandle unexpectedly succeeded on a closed handle\n");
+		return -1;
+	}
+
+	if (!UziGetHandleStats(UZI_HANDLE_TYPE_EVENT, &before))
+	{
+		printf("UziGetHandleStats failure\n");
+		return -1;
+	}
+
+	events = (HANDLE*) calloc(TEST_HANDLE_COUNT, sizeof(HANDLE));
+
+	if (!events)
+	{
+		printf("Problem allocating memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < TEST_HANDLE_COUNT; i++)
+	{
+		if (!(events[i] = CreateEventA(NULL, TRUE, FALSE, NULL)))
+		{
+			printf("CreateEvent #%d failure\n", i);
+			return -1;
+		}
+	}
+
+	/* event file descriptors may be created lazily */
+	if (GetEventFileDescriptor(events[0]) < 0)
+	{
+		printf("GetEventFileDescriptor failure\n");
+		return -1;
+	}
+
+	if (!UziGetHandleStats(UZI_HANDLE_TYPE_EVENT, &after) ||
+	    (after.live < TEST_HANDLE_COUNT) || (after.peak < after.live) ||
+	    (after.created < TEST_HANDLE_COUNT) || (after.fds < 1))
+	{
+		printf("unexpected event statistics: live %u peak %u fds %u\n",
+		       after.live, after.peak, after.fds);
+		return -1;
+	}
+
+	for (i = 0; i < TEST_HANDLE_COUNT; i++)
+	{
+		if (!CloseHandle(events[i]))
+		{
+			printf("CloseHandle #%d failure\n", i);
+			return -1;
+		}
+	}
+
+	free(events);
+
+	if (!UziGetHandleStats(UZI_HANDLE_TYPE_EVENT, &after) || (after.live != before.live) ||
+	    (after.fds != before.fds) || (after.created != before.created + TEST_HANDLE_COUNT))
+	{
+		printf("unexpected event statistics after close: live %u fds %u\n",
+		       after.live, after.fds);
+		return -1;
+	}
+
+	if (!UziGetHandleStats(UZI_HANDLE_TYPE_ALL, &after) || (after.peak < TEST_HANDLE_COUNT))
+	{
+		printf("unexpected total handle statistics: peak %u\n", after.peak);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,133 @@
+
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/thread.h>
+
+#define TEST_POOL_OBJECTS	100
+
+static BOOL test_create_close_events(int count)
+{
+	int i;
+	HANDLE events[TEST_POOL_OBJECTS];
+
+	for (i = 0; i < count; i++)
+	{
+		if (!(events[i] = CreateEventA(NULL, TRUE, FALSE, NULL)))
+			return FALSE;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (!CloseHandle(events[i]))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static DWORD WINAPI test_pool_thread(LPVOID arg)
+{
+	return test_create_close_events(TEST_POOL_OBJECTS) ? 0 : 1;
+}
+
+int TestHandlePool(int argc, char* argv[])
+{
+	HANDLE thread;
+	HANDLE mutex;
+	DWORD exitCode = 1;
+	UZI_POOL_STATS before;
+	UZI_POOL_STATS after;
+
+	if (UziGetPoolStats(UZI_HANDLE_TYPE_THREAD, &before))
+	{
+		printf("UziGetPoolStats unexpectedly succeeded for threads\n");
+		return -1;
+	}
+
+	if (!test_create_close_events(TEST_POOL_OBJECTS))
+	{
+		printf("failed to create and close events\n");
+		return -1;
+	}
+
+	if (!UziGetPoolStats(UZI_HANDLE_TYPE_EVENT, &before))
+	{
+		printf("UziGetPoolStats failure\n");
+		return -1;
+	}
+
+	if (before.releases < TEST_POOL_OBJECTS)
+	{
+		printf("closed events were not released to the pool\n");
+		return -1;
+	}
+
+	/* In steady state, all objects must come from the pool */
+	if (!test_create_close_events(TEST_POOL_OBJECTS))
+	{
+		printf("failed to create and close events\n");
+		return -1;
+	}
+
+	UziGetPoolStats(UZI_HANDLE_TYPE_EVENT, &after);
+
+	if ((after.hits - before.hits) != TEST_POOL_OBJECTS || (after.misses != before.misses))
+	{
+		printf("unexpected pool misses: hits %d misses %d\n",
+		       (int) (after.hits - before.hits), (int) (after.misses - before.misses));
+		return -1;
+	}
+
+	/* Objects cached by a thread must be given back when it exits */
+	if (!(thread = CreateThread(NULL, 0, test_pool_thread, NULL, 0, NULL)))
+	{
+		printf("CreateThread failure\n");
+		return -1;
+	}
+
+	WaitForSingleObject(thread, INFINITE);
+	GetExitCodeThread(thread, &exitCode);
+	CloseHandle(thread);
+
+	if (exitCode != 0)
+	{
+		printf("failed to create and close events in a thread\n");
+		return -1;
+	}
+
+	UziGetPoolStats(UZI_HANDLE_TYPE_EVENT, &after);
+
+	if (after.shared == 0)
+	{
+		printf("thread cache was not given back to the shared pool\n");
+		return -1;
+	}
+
+	/* The counters of other threads are included */
+	if ((after.releases - before.releases) < 2 * TEST_POOL_OBJECTS)
+	{
+		printf("releases of the exited thread were not counted\n");
+		return -1;
+	}
+
+	/* Recycled objects must be reinitialized */
+	mutex = CreateMutexA(NULL, TRUE, NULL);
+
+	if (!mutex || !ReleaseMutex(mutex) || !CloseHandle(mutex))
+	{
+		printf("mutex failure\n");
+		return -1;
+	}
+
+	mutex = CreateMutexA(NULL, FALSE, NULL);
+
+	if (!mutex || (WaitForSingleObject(mutex, 0) != WAIT_OBJECT_0) || !ReleaseMutex(mutex))
+	{
+		printf("recycled mutex failure\n");
+		return -1;
+	}
+
+	CloseHandle(mutex);
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/thread.h>
+#include <uzi/uzi.h>
+
+static CRITICAL_SECTION gProfiledCritical;
+static HANDLE gProfiledMutex = NULL;
+
+static DWORD WINAPI TestLockProfiling_Thread(LPVOID arg)
+{
+	EnterCriticalSection(&gProfiledCritical);
+	LeaveCriticalSection(&gProfiledCritical);
+
+	if (WaitForSingleObject(gProfiledMutex, INFINITE) != WAIT_OBJECT_0)
+		return 1;
+
+	return ReleaseMutex(gProfiledMutex) ? 0 : 1;
+}
+
+static BOOL TestLockProfiling_Check(const UZI_LOCK_STATS* stats, uint32_t lockType, const void* lock)
+{
+	int index;
+	uint64_t holds = 0;
+
+	if ((stats->lockType != lockType) || (lock && (stats->lock != lock)))
+	{
+		printf("LockProfiling failure: unexpected lock %p of type %"PRIu32"\n", stats->lock, stats->lockType);
+		return FALSE;
+	}
+
+	if ((stats->acquisitions != 2) || (stats->contended != 1) || !stats->waitTotal || !stats->callSite)
+	{
+		printf("LockProfiling failure: %"PRIu64" acquisitions, %"PRIu64" contended, wait %"PRIu64" ns\n",
+			stats->acquisitions, stats->contended, stats->waitTotal);
+		return FALSE;
+	}
+
+	for (index = 0; index < UZI_LOCK_STATS_HOLD_BUCKETS; index++)
+		holds += stats->holdHistogram[index];
+
+	if (holds != stats->acquisitions)
+	{
+		printf("LockProfiling failure: %"PRIu64" holds recorded for %"PRIu64" acquisitions\n",
+			holds, stats->acquisitions);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+int TestLockProfiling(int argc, char* argv[])
+{
+	HANDLE hThread;
+	CRITICAL_SECTION unprofiled;
+	UZI_LOCK_STATS stats[4];
+	UZI_CS cs[2];
+
+	/* locks created before profiling is enabled are not profiled */
+	InitializeCriticalSection(&unprofiled);
+
+	if (UziSetLockProfiling(true))
+		return -1;
+
+	InitializeCriticalSection(&gProfiledCritical);
+	gProfiledMutex = CreateMutexA(NULL, FALSE, NULL);
+
+	if (!gProfiledMutex)
+		return -1;
+
+	UziSetLockProfiling(false);
+
+	EnterCriticalSection(&unprofiled);
+	LeaveCriticalSection(&unprofiled);
+
+	/* hold both locks while the thread tries to take them */
+	EnterCriticalSection(&gProfiledCritical);
+	WaitForSingleObject(gProfiledMutex, INFINITE);
+
+	if (!(hThread = CreateThread(NULL, 0, TestLockProfiling_Thread, NULL, 0, NULL)))
+		return -1;
+
+	Sleep(50);
+	LeaveCriticalSection(&gProfiledCritical);
+	Sleep(100);
+	ReleaseMutex(gProfiledMutex);
+
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(hThread);
+
+	if (UziGetLockStats(stats, 4) != 2)
+	{
+		printf("LockProfiling failure: expected 2 profiled locks\n");
+		return -1;
+	}
+
+	/* both were contended once, the mutex was waited for longer */
+	if (!TestLockProfiling_Check(&stats[0], UZI_LOCK_MUTEX, NULL))
+		return -1;
+
+	if (!TestLockProfiling_Check(&stats[1], UZI_LOCK_CRITICAL_SECTION, &gProfiledCritical))
+		return -1;
+
+	UziDumpLockStats(4);
+
+	DeleteCriticalSection(&gProfiledCritical);
+	CloseHandle(gProfiledMutex);
+	DeleteCriticalSection(&unprofiled);
+
+	if (UziGetLockStats(stats, 4) != 0)
+	{
+		printf("LockProfiling failure: stats left after the locks were deleted\n");
+		return -1;
+	}
+
+	/* locks created through UziInitCS are reported where it was called */
+	UziSetLockProfiling(true);
+
+	if (!UziInitCS(&cs[0], 0, 0))
+		return -1;
+
+	if (!UziInitCS(&cs[1], 0, 0))
+		return -1;
+
+	UziSetLockProfiling(false);
+
+	if ((UziGetLockStats(stats, 4) != 2) || !stats[0].callSite || (stats[0].callSite == stats[1].callSite))
+	{
+		printf("LockProfiling failure: UziInitCS call sites not told apart\n");
+		return -1;
+	}
+
+	UziDeleteCS(&cs[0]);
+	UziDeleteCS(&cs[1]);
+
+	return 0;
+}
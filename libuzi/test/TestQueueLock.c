@@ -0,0 +1,257 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/sysinfo.h>
+#include <uzi/thread.h>
+#include <uzi/interlocked.h>
+#include <uzi/uzi.h>
+
+/**
+ * Besides checking mutual exclusion and arrival order, this test runs a
+ * short fairness benchmark: threads repeatedly take a critical section and
+ * a queue lock for a fixed time, and the total number of acquisitions
+ * (throughput) is printed with the ratio between the least and the most
+ * served thread (fairness, 1.0 when all threads got the lock equally often).
+ * Only correctness makes the test fail, timings depend on the machine.
+ */
+
+#define TEST_QUEUE_LOCK_THREADS		4
+#define TEST_QUEUE_LOCK_ITERATIONS	50000
+#define TEST_QUEUE_LOCK_BENCH_MS	300
+
+static UZI_QUEUE_LOCK gQueueLock = UZI_QUEUE_LOCK_INIT;
+static CRITICAL_SECTION gBenchCritical;
+static BOOL gBenchQueueLock = FALSE;
+static BOOL volatile gBenchRunning = FALSE;
+static HANDLE gBenchStartEvent = NULL;
+
+static LONG gCounter = 0;
+static LONG gInside = 0;
+static LONG gErrors = 0;
+
+static LONG gOrder[3];
+static LONG gOrderCount = 0;
+
+static DWORD WINAPI TestQueueLock_Thread(LPVOID arg)
+{
+	int index;
+
+	for (index = 0; index < TEST_QUEUE_LOCK_ITERATIONS; index++)
+	{
+		UziAcquireQueueLock(&gQueueLock);
+
+		if (InterlockedIncrement(&gInside) != 1)
+			InterlockedIncrement(&gErrors);
+
+		gCounter++;
+
+		InterlockedDecrement(&gInside);
+		UziReleaseQueueLock(&gQueueLock);
+	}
+
+	return 0;
+}
+
+static DWORD WINAPI TestQueueLock_OrderThread(LPVOID arg)
+{
+	UziAcquireQueueLock(&gQueueLock);
+	gOrder[gOrderCount++] = (LONG) (ULONG_PTR) arg;
+	UziReleaseQueueLock(&gQueueLock);
+
+	return 0;
+}
+
+static DWORD WINAPI TestQueueLock_BenchThread(LPVOID arg)
+{
+	ULONGLONG* pAcquisitions = (ULONGLONG*) arg;
+
+	WaitForSingleObject(gBenchStartEvent, INFINITE);
+
+	while (gBenchRunning)
+	{
+		if (gBenchQueueLock)
+		{
+			UziAcquireQueueLock(&gQueueLock);
+			(*pAcquisitions)++;
+			UziReleaseQueueLock(&gQueueLock);
+		}
+		else
+		{
+			EnterCriticalSection(&gBenchCritical);
+			(*pAcquisitions)++;
+			LeaveCriticalSection(&gBenchCritical);
+		}
+	}
+
+	return 0;
+}
+
+static BOOL TestQueueLock_Exclusion(void)
+{
+	int index;
+	HANDLE hThreads[TEST_QUEUE_LOCK_THREADS];
+
+	if (!UziTryAcquireQueueLock(&gQueueLock))
+	{
+		printf("QueueLock failure: UziTryAcquireQueueLock failed on a free lock\n");
+		return FALSE;
+	}
+
+	if (UziTryAcquireQueueLock(&gQueueLock))
+	{
+		printf("QueueLock failure: UziTryAcquireQueueLock succeeded on a held lock\n");
+		return FALSE;
+	}
+
+	UziReleaseQueueLock(&gQueueLock);
+
+	for (index = 0; index < TEST_QUEUE_LOCK_THREADS; index++)
+	{
+		if (!(hThreads[index] = CreateThread(NULL, 0, TestQueueLock_Thread, NULL, 0, NULL)))
+		{
+			printf("QueueLock failure: CreateThread failed\n");
+			return FALSE;
+		}
+	}
+
+	for (index = 0; index < TEST_QUEUE_LOCK_THREADS; index++)
+	{
+		WaitForSingleObject(hThreads[index], INFINITE);
+		CloseHandle(hThreads[index]);
+	}
+
+	if (gErrors || (gCounter != TEST_QUEUE_LOCK_THREADS * TEST_QUEUE_LOCK_ITERATIONS))
+	{
+		printf("QueueLock failure: %"PRId32" exclusion errors, counter is %"PRId32"\n", gErrors, gCounter);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL TestQueueLock_Order(void)
+{
+	LONG index;
+	HANDLE hThreads[3];
+
+	UziAcquireQueueLock(&gQueueLock);
+
+	/* queue the threads one after the other while the lock is held */
+	for (index = 0; index < 3; index++)
+	{
+		if (!(hThreads[index] = CreateThread(NULL, 0, TestQueueLock_OrderThread,
+				(LPVOID) (ULONG_PTR) index, 0, NULL)))
+		{
+			printf("QueueLock failure: CreateThread failed\n");
+			return FALSE;
+		}
+
+		Sleep(50);
+	}
+
+	UziReleaseQueueLock(&gQueueLock);
+
+	for (index = 0; index < 3; index++)
+	{
+		WaitForSingleObject(hThreads[index], INFINITE);
+		CloseHandle(hThreads[index]);
+	}
+
+	for (index = 0; index < 3; index++)
+	{
+		if (gOrder[index] != index)
+		{
+			printf("QueueLock failure: thread %"PRId32" got the lock in position %"PRId32"\n",
+				gOrder[index], index);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static BOOL TestQueueLock_Bench(BOOL bQueueLock, DWORD dwThreadCount)
+{
+	DWORD index;
+	ULONGLONG total = 0;
+	ULONGLONG minimum = (ULONGLONG) -1;
+	ULONGLONG maximum = 0;
+	HANDLE hThreads[TEST_QUEUE_LOCK_THREADS];
+	ULONGLONG acquisitions[TEST_QUEUE_LOCK_THREADS] = { 0 };
+
+	if (!InitializeCriticalSectionAndSpinCount(&gBenchCritical, 4000))
+		return FALSE;
+
+	if (!(gBenchStartEvent = CreateEventA(NULL, TRUE, FALSE, NULL)))
+		return FALSE;
+
+	gBenchQueueLock = bQueueLock;
+	gBenchRunning = TRUE;
+
+	for (index = 0; index < dwThreadCount; index++)
+	{
+		if (!(hThreads[index] = CreateThread(NULL, 0, TestQueueLock_BenchThread, &acquisitions[index], 0, NULL)))
+		{
+			printf("QueueLock failure: CreateThread failed\n");
+			return FALSE;
+		}
+	}
+
+	SetEvent(gBenchStartEvent);
+	Sleep(TEST_QUEUE_LOCK_BENCH_MS);
+	gBenchRunning = FALSE;
+
+	for (index = 0; index < dwThreadCount; index++)
+	{
+		WaitForSingleObject(hThreads[index], INFINITE);
+		CloseHandle(hThreads[index]);
+
+		total += acquisitions[index];
+
+		if (acquisitions[index] < minimum)
+			minimum = acquisitions[index];
+
+		if (acquisitions[index] > maximum)
+			maximum = acquisitions[index];
+	}
+
+	printf("QueueLock benchmark: %-16s %"PRIu32" threads: %10"PRIu64" acquisitions, fairness %.3f\n",
+		bQueueLock ? "queue lock," : "critical section,", dwThreadCount, total,
+		maximum ? (double) minimum / (double) maximum : 0.0);
+
+	CloseHandle(gBenchStartEvent);
+	DeleteCriticalSection(&gBenchCritical);
+
+	return TRUE;
+}
+
+int TestQueueLock(int argc, char* argv[])
+{
+	SYSTEM_INFO sysinfo;
+	DWORD dwThreadCount;
+
+	if (!TestQueueLock_Exclusion())
+		return -1;
+
+	if (!TestQueueLock_Order())
+		return -1;
+
+	GetNativeSystemInfo(&sysinfo);
+
+	dwThreadCount = sysinfo.dwNumberOfProcessors;
+
+	if (dwThreadCount < 2)
+		dwThreadCount = 2;
+
+	if (dwThreadCount > TEST_QUEUE_LOCK_THREADS)
+		dwThreadCount = TEST_QUEUE_LOCK_THREADS;
+
+	if (!TestQueueLock_Bench(FALSE, dwThreadCount))
+		return -1;
+
+	if (!TestQueueLock_Bench(TRUE, dwThreadCount))
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,227 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/sysinfo.h>
+#include <uzi/thread.h>
+#include <uzi/interlocked.h>
+#include <uzi/uzi.h>
+
+/**
+ * Checks the padded types, cache-aligned allocations and striped locks,
+ * then prints how long threads take to update their own counter when the
+ * counters are packed in a plain array (false sharing) and when they are
+ * padded to a cache line each. Only correctness makes the test fail.
+ */
+
+#define TEST_STRIPED_LOCK_THREADS	4
+#define TEST_STRIPED_LOCK_KEYS		1024
+#define TEST_STRIPED_LOCK_ITERATIONS	100000
+#define TEST_STRIPED_LOCK_COUNTER_ITERATIONS	5000000
+
+static UZI_STRIPED_LOCK* gStriped = NULL;
+static LONG gShards[TEST_STRIPED_LOCK_KEYS];
+
+static LONG volatile gPackedCounters[TEST_STRIPED_LOCK_THREADS];
+static UZI_COUNTER_PADDED gPaddedCounters[TEST_STRIPED_LOCK_THREADS];
+static BOOL gBenchPadded = FALSE;
+
+static DWORD WINAPI TestStripedLock_Thread(LPVOID arg)
+{
+	int index;
+	uint64_t key;
+	ULONG seed = (ULONG) (ULONG_PTR) arg;
+
+	for (index = 0; index < TEST_STRIPED_LOCK_ITERATIONS; index++)
+	{
+		seed = seed * 1103515245 + 12345;
+		key = (seed >> 8) % TEST_STRIPED_LOCK_KEYS;
+
+		UziStripedLockEnter(gStriped, key);
+		gShards[key]++;
+		UziStripedLockLeave(gStriped, key);
+	}
+
+	return 0;
+}
+
+static DWORD WINAPI TestStripedLock_CounterThread(LPVOID arg)
+{
+	int index;
+	ULONG_PTR slot = (ULONG_PTR) arg;
+
+	for (index = 0; index < TEST_STRIPED_LOCK_COUNTER_ITERATIONS; index++)
+	{
+		if (gBenchPadded)
+			gPaddedCounters[slot].value++;
+		else
+			gPackedCounters[slot]++;
+	}
+
+	return 0;
+}
+
+static BOOL TestStripedLock_Alignment(void)
+{
+	int index;
+	BYTE* ptr;
+
+	if ((sizeof(UZI_CS_PADDED) % UZI_CACHE_LINE_SIZE) || (sizeof(UZI_QUEUE_LOCK_PADDED) % UZI_CACHE_LINE_SIZE) ||
+			(sizeof(UZI_COUNTER_PADDED) % UZI_CACHE_LINE_SIZE))
+	{
+		printf("StripedLock failure: padded types do not fill whole cache lines\n");
+		return FALSE;
+	}
+
+	if (((ULONG_PTR) &gPaddedCounters[1]) % UZI_CACHE_LINE_SIZE)
+	{
+		printf("StripedLock failure: padded counters are not cache-aligned\n");
+		return FALSE;
+	}
+
+	if (!(ptr = (BYTE*) UziAlignedAlloc(100)))
+	{
+		printf("StripedLock failure: UziAlignedAlloc failed\n");
+		return FALSE;
+	}
+
+	if (((ULONG_PTR) ptr) % UZI_CACHE_LINE_SIZE)
+	{
+		printf("StripedLock failure: UziAlignedAlloc returned unaligned memory\n");
+		return FALSE;
+	}
+
+	/* rounded up to whole cache lines and zeroed */
+	for (index = 0; index < 2 * UZI_CACHE_LINE_SIZE; index++)
+	{
+		if (ptr[index])
+		{
+			printf("StripedLock failure: UziAlignedAlloc returned dirty memory\n");
+			return FALSE;
+		}
+	}
+
+	UziAlignedFree(ptr);
+	return TRUE;
+}
+
+static BOOL TestStripedLock_Stripes(void)
+{
+	DWORD index;
+	LONG total = 0;
+	HANDLE hThreads[TEST_STRIPED_LOCK_THREADS];
+
+	if (UziStripedLockNew(0, 0))
+	{
+		printf("StripedLock failure: created a striped lock without stripes\n");
+		return FALSE;
+	}
+
+	if (!(gStriped = UziStripedLockNew(12, 0)))
+	{
+		printf("StripedLock failure: UziStripedLockNew failed\n");
+		return FALSE;
+	}
+
+	if (UziStripedLockCount(gStriped) != 16)
+	{
+		printf("StripedLock failure: %"PRIu32" stripes instead of 16\n", UziStripedLockCount(gStriped));
+		return FALSE;
+	}
+
+	if (UziStripedLockGet(gStriped, 42) != UziStripedLockGet(gStriped, 42))
+	{
+		printf("StripedLock failure: a key maps to different stripes\n");
+		return FALSE;
+	}
+
+	for (index = 0; index < TEST_STRIPED_LOCK_THREADS; index++)
+	{
+		if (!(hThreads[index] = CreateThread(NULL, 0, TestStripedLock_Thread,
+				(LPVOID) (ULONG_PTR) (index + 1), 0, NULL)))
+		{
+			printf("StripedLock failure: CreateThread failed\n");
+			return FALSE;
+		}
+	}
+
+	for (index = 0; index < TEST_STRIPED_LOCK_THREADS; index++)
+	{
+		WaitForSingleObject(hThreads[index], INFINITE);
+		CloseHandle(hThreads[index]);
+	}
+
+	for (index = 0; index < TEST_STRIPED_LOCK_KEYS; index++)
+		total += gShards[index];
+
+	UziStripedLockFree(gStriped);
+
+	if (total != TEST_STRIPED_LOCK_THREADS * TEST_STRIPED_LOCK_ITERATIONS)
+	{
+		printf("StripedLock failure: %"PRId32" updates recorded\n", total);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL TestStripedLock_Bench(BOOL bPadded, DWORD dwThreadCount)
+{
+	DWORD index;
+	ULONGLONG start;
+	HANDLE hThreads[TEST_STRIPED_LOCK_THREADS];
+
+	gBenchPadded = bPadded;
+	start = GetTickCount64();
+
+	for (index = 0; index < dwThreadCount; index++)
+	{
+		if (!(hThreads[index] = CreateThread(NULL, 0, TestStripedLock_CounterThread,
+				(LPVOID) (ULONG_PTR) index, 0, NULL)))
+		{
+			printf("StripedLock failure: CreateThread failed\n");
+			return FALSE;
+		}
+	}
+
+	for (index = 0; index < dwThreadCount; index++)
+	{
+		WaitForSingleObject(hThreads[index], INFINITE);
+		CloseHandle(hThreads[index]);
+	}
+
+	printf("StripedLock benchmark: %"PRIu32" threads, %s counters: %"PRIu64" ms\n",
+		dwThreadCount, bPadded ? "padded" : "packed", GetTickCount64() - start);
+
+	return TRUE;
+}
+
+int TestStripedLock(int argc, char* argv[])
+{
+	SYSTEM_INFO sysinfo;
+	DWORD dwThreadCount;
+
+	if (!TestStripedLock_Alignment())
+		return -1;
+
+	if (!TestStripedLock_Stripes())
+		return -1;
+
+	GetNativeSystemInfo(&sysinfo);
+
+	dwThreadCount = sysinfo.dwNumberOfProcessors;
+
+	if (dwThreadCount < 2)
+		dwThreadCount = 2;
+
+	if (dwThreadCount > TEST_STRIPED_LOCK_THREADS)
+		dwThreadCount = TEST_STRIPED_LOCK_THREADS;
+
+	if (!TestStripedLock_Bench(FALSE, dwThreadCount))
+		return -1;
+
+	if (!TestStripedLock_Bench(TRUE, dwThreadCount))
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,228 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/thread.h>
+
+/**
+ * Checks that APCs run on the thread they were queued to, in queuing order,
+ * only in alertable waits, and that alertable waits return
+ * WAIT_IO_COMPLETION after running them, blocked or not, without keeping
+ * the handles they acquired.
+ */
+
+#define TEST_ALERTABLE_APCS	8
+
+static HANDLE gStep = NULL;
+static HANDLE gGo[2] = { NULL, NULL };
+static DWORD gWorkerId = 0;
+static LONG volatile gCount = 0;
+static ULONG_PTR gOrder[TEST_ALERTABLE_APCS];
+static BOOL gWrongThread = FALSE;
+
+static VOID TestAlertable_APC(ULONG_PTR Parameter)
+{
+	if (GetCurrentThreadId() != gWorkerId)
+		gWrongThread = TRUE;
+
+	if (gCount < TEST_ALERTABLE_APCS)
+		gOrder[gCount] = Parameter;
+
+	gCount++;
+}
+
+static DWORD WINAPI TestAlertable_Thread(LPVOID arg)
+{
+	DWORD status;
+
+	gWorkerId = GetCurrentThreadId();
+
+	/* APCs queued while the thread was suspended */
+	if ((status = SleepEx(INFINITE, TRUE)) != WAIT_IO_COMPLETION)
+	{
+		printf("Alertable failure: SleepEx returned 0x%08"PRIX32"\n", status);
+		return 1;
+	}
+
+	if (gCount != 3)
+	{
+		printf("Alertable failure: %"PRId32" APCs ran instead of 3\n", gCount);
+		return 1;
+	}
+
+	/* non-alertable waits leave APCs queued */
+	SetEvent(gStep);
+
+	if (WaitForSingleObject(gGo[0], INFINITE) != WAIT_OBJECT_0)
+	{
+		printf("Alertable failure: non-alertable wait failed\n");
+		return 1;
+	}
+
+	if (gCount != 3)
+	{
+		printf("Alertable failure: APC ran in a non-alertable wait\n");
+		return 1;
+	}
+
+	/* queued APCs run even when the wait would not block */
+	if ((status = WaitForSingleObjectEx(gGo[0], 0, TRUE)) != WAIT_IO_COMPLETION)
+	{
+		printf("Alertable failure: WaitForSingleObjectEx with APCs queued returned 0x%08"PRIX32"\n", status);
+		return 1;
+	}
+
+	/* blocked alertable waits are interrupted by APCs */
+	SetEvent(gStep);
+
+	if ((status = WaitForSingleObjectEx(gGo[0], INFINITE, TRUE)) != WAIT_IO_COMPLETION)
+	{
+		printf("Alertable failure: blocked WaitForSingleObjectEx returned 0x%08"PRIX32"\n", status);
+		return 1;
+	}
+
+	SetEvent(gStep);
+
+	if ((status = WaitForMultipleObjectsEx(2, gGo, TRUE, INFINITE, TRUE)) != WAIT_IO_COMPLETION)
+	{
+		printf("Alertable failure: blocked WaitForMultipleObjectsEx returned 0x%08"PRIX32"\n", status);
+		return 1;
+	}
+
+	/* the event acquired before the APC was given back */
+	if (WaitForSingleObject(gGo[0], 0) != WAIT_OBJECT_0)
+	{
+		printf("Alertable failure: event kept by an interrupted wait for all handles\n");
+		return 1;
+	}
+
+	/* signaled handles without APCs */
+	SetEvent(gStep);
+
+	if ((status = WaitForMultipleObjectsEx(2, gGo, TRUE, INFINITE, TRUE)) != WAIT_OBJECT_0)
+	{
+		printf("Alertable failure: WaitForMultipleObjectsEx returned 0x%08"PRIX32"\n", status);
+		return 1;
+	}
+
+	if ((status = SleepEx(10, TRUE)) != 0)
+	{
+		printf("Alertable failure: SleepEx without APCs returned 0x%08"PRIX32"\n", status);
+		return 1;
+	}
+
+	return 0;
+}
+
+static BOOL TestAlertable_Queue(HANDLE hThread, ULONG_PTR Parameter)
+{
+	if (!QueueUserAPC(TestAlertable_APC, hThread, Parameter))
+	{
+		printf("Alertable failure: QueueUserAPC failed\n");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+int TestSynchAlertable(int argc, char* argv[])
+{
+	DWORD index;
+	DWORD exitCode;
+	HANDLE hThread;
+
+	gStep = CreateEventA(NULL, FALSE, FALSE, NULL);
+	gGo[0] = CreateEventA(NULL, FALSE, FALSE, NULL);
+	gGo[1] = CreateEventA(NULL, FALSE, FALSE, NULL);
+
+	if (!gStep || !gGo[0] || !gGo[1])
+	{
+		printf("Alertable failure: CreateEvent failed\n");
+		return -1;
+	}
+
+	if (QueueUserAPC(TestAlertable_APC, gStep, 0) || QueueUserAPC(NULL, gStep, 0))
+	{
+		printf("Alertable failure: QueueUserAPC accepted invalid parameters\n");
+		return -1;
+	}
+
+	/* this thread was not created by CreateThread and cannot receive APCs */
+	if ((SleepEx(10, TRUE) != 0) || (WaitForSingleObjectEx(gGo[0], 10, TRUE) != WAIT_TIMEOUT))
+	{
+		printf("Alertable failure: alertable waits of the main thread\n");
+		return -1;
+	}
+
+	if (!(hThread = CreateThread(NULL, 0, TestAlertable_Thread, NULL, CREATE_SUSPENDED, NULL)))
+	{
+		printf("Alertable failure: CreateThread failed\n");
+		return -1;
+	}
+
+	for (index = 1; index <= 3; index++)
+	{
+		if (!TestAlertable_Queue(hThread, index))
+			return -1;
+	}
+
+	ResumeThread(hThread);
+
+	WaitForSingleObject(gStep, INFINITE);
+
+	if (!TestAlertable_Queue(hThread, 4))
+		return -1;
+
+	SetEvent(gGo[0]);
+
+	/* let the thread block before queuing */
+	WaitForSingleObject(gStep, INFINITE);
+	Sleep(20);
+
+	if (!TestAlertable_Queue(hThread, 5))
+		return -1;
+
+	WaitForSingleObject(gStep, INFINITE);
+	Sleep(20);
+
+	/* the thread acquires gGo[0], then gets the APC while waiting for gGo[1] */
+	SetEvent(gGo[0]);
+	Sleep(20);
+
+	if (!TestAlertable_Queue(hThread, 6))
+		return -1;
+
+	WaitForSingleObject(gStep, INFINITE);
+	SetEvent(gGo[0]);
+	SetEvent(gGo[1]);
+
+	WaitForSingleObject(hThread, INFINITE);
+	GetExitCodeThread(hThread, &exitCode);
+	CloseHandle(hThread);
+
+	if (exitCode != 0)
+		return -1;
+
+	if ((gCount != 6) || gWrongThread)
+	{
+		printf("Alertable failure: %"PRId32" APCs ran, %s\n", gCount,
+			gWrongThread ? "on the wrong thread" : "on the right thread");
+		return -1;
+	}
+
+	for (index = 0; index < 6; index++)
+	{
+		if (gOrder[index] != index + 1)
+		{
+			printf("Alertable failure: APC %"PRIu32" ran at position %"PRIu32"\n",
+				(DWORD) gOrder[index], index);
+			return -1;
+		}
+	}
+
+	CloseHandle(gStep);
+	CloseHandle(gGo[0]);
+	CloseHandle(gGo[1]);
+
+	return 0;
+}
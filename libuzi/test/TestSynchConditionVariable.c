@@ -0,0 +1,202 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/thread.h>
+#include <uzi/error.h>
+#include <uzi/interlocked.h>
+
+#define TEST_SYNC_CV_CONSUMERS		4
+#define TEST_SYNC_CV_ITEMS		10000
+#define TEST_SYNC_CV_SLEEPERS		8
+
+static CRITICAL_SECTION gQueueLock;
+static CONDITION_VARIABLE gQueueNotEmpty = CONDITION_VARIABLE_INIT;
+static LONG gQueued = 0;
+static LONG gConsumed = 0;
+static BOOL gProducerDone = FALSE;
+
+static SRWLOCK gStartLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE gStartCondition = CONDITION_VARIABLE_INIT;
+static BOOL gStarted = FALSE;
+static LONG gSleepers = 0;
+
+static DWORD WINAPI TestSynchConditionVariable_Consumer(LPVOID arg)
+{
+	for (;;)
+	{
+		EnterCriticalSection(&gQueueLock);
+
+		while (!gQueued && !gProducerDone)
+			SleepConditionVariableCS(&gQueueNotEmpty, &gQueueLock, INFINITE);
+
+		if (!gQueued)
+		{
+			LeaveCriticalSection(&gQueueLock);
+			return 0;
+		}
+
+		gQueued--;
+		gConsumed++;
+		LeaveCriticalSection(&gQueueLock);
+	}
+}
+
+static DWORD WINAPI TestSynchConditionVariable_Sleeper(LPVOID arg)
+{
+	ULONG flags = arg ? CONDITION_VARIABLE_LOCKMODE_SHARED : 0;
+
+	if (flags)
+		AcquireSRWLockShared(&gStartLock);
+	else
+		AcquireSRWLockExclusive(&gStartLock);
+
+	InterlockedIncrement(&gSleepers);
+
+	while (!gStarted)
+		SleepConditionVariableSRW(&gStartCondition, &gStartLock, INFINITE, flags);
+
+	InterlockedDecrement(&gSleepers);
+
+	if (flags)
+		ReleaseSRWLockShared(&gStartLock);
+	else
+		ReleaseSRWLockExclusive(&gStartLock);
+
+	return 0;
+}
+
+static BOOL TestSynchConditionVariable_Timeout(void)
+{
+	BOOL status;
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE condition;
+
+	InitializeCriticalSection(&lock);
+	InitializeConditionVariable(&condition);
+
+	EnterCriticalSection(&lock);
+	SetLastError(0);
+	status = SleepConditionVariableCS(&condition, &lock, 50);
+
+	if (status || (GetLastError() != ERROR_TIMEOUT))
+	{
+		printf("ConditionVariable failure: sleep did not time out\n");
+		return FALSE;
+	}
+
+	if (lock.RecursionCount != 1)
+	{
+		printf("ConditionVariable failure: lock not reacquired after a timeout\n");
+		return FALSE;
+	}
+
+	LeaveCriticalSection(&lock);
+	DeleteCriticalSection(&lock);
+	return TRUE;
+}
+
+static BOOL TestSynchConditionVariable_ProducerConsumer(void)
+{
+	int index;
+	HANDLE hThreads[TEST_SYNC_CV_CONSUMERS];
+
+	InitializeCriticalSection(&gQueueLock);
+
+	for (index = 0; index < TEST_SYNC_CV_CONSUMERS; index++)
+	{
+		if (!(hThreads[index] = CreateThread(NULL, 0, TestSynchConditionVariable_Consumer, NULL, 0, NULL)))
+		{
+			printf("ConditionVariable failure: CreateThread failed\n");
+			return FALSE;
+		}
+	}
+
+	for (index = 0; index < TEST_SYNC_CV_ITEMS; index++)
+	{
+		EnterCriticalSection(&gQueueLock);
+		gQueued++;
+		LeaveCriticalSection(&gQueueLock);
+		WakeConditionVariable(&gQueueNotEmpty);
+	}
+
+	EnterCriticalSection(&gQueueLock);
+	gProducerDone = TRUE;
+	LeaveCriticalSection(&gQueueLock);
+	WakeAllConditionVariable(&gQueueNotEmpty);
+
+	for (index = 0; index < TEST_SYNC_CV_CONSUMERS; index++)
+	{
+		if (WaitForSingleObject(hThreads[index], 10000) != WAIT_OBJECT_0)
+		{
+			printf("ConditionVariable failure: consumer %d did not finish\n", index);
+			return FALSE;
+		}
+
+		CloseHandle(hThreads[index]);
+	}
+
+	DeleteCriticalSection(&gQueueLock);
+
+	if (gConsumed != TEST_SYNC_CV_ITEMS)
+	{
+		printf("ConditionVariable failure: %"PRId32" items consumed\n", gConsumed);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL TestSynchConditionVariable_WakeAll(void)
+{
+	int index;
+	HANDLE hThreads[TEST_SYNC_CV_SLEEPERS];
+
+	for (index = 0; index < TEST_SYNC_CV_SLEEPERS; index++)
+	{
+		/* half of the sleepers hold the lock shared */
+		if (!(hThreads[index] = CreateThread(NULL, 0, TestSynchConditionVariable_Sleeper,
+				(LPVOID) (ULONG_PTR) (index % 2), 0, NULL)))
+		{
+			printf("ConditionVariable failure: CreateThread failed\n");
+			return FALSE;
+		}
+	}
+
+	while (gSleepers != TEST_SYNC_CV_SLEEPERS)
+		Sleep(1);
+
+	Sleep(50);
+
+	AcquireSRWLockExclusive(&gStartLock);
+	gStarted = TRUE;
+	WakeAllConditionVariable(&gStartCondition);
+	ReleaseSRWLockExclusive(&gStartLock);
+
+	for (index = 0; index < TEST_SYNC_CV_SLEEPERS; index++)
+	{
+		if (WaitForSingleObject(hThreads[index], 10000) != WAIT_OBJECT_0)
+		{
+			printf("ConditionVariable failure: sleeper %d was not woken up\n", index);
+			return FALSE;
+		}
+
+		CloseHandle(hThreads[index]);
+	}
+
+	return TRUE;
+}
+
+int TestSynchConditionVariable(int argc, char* argv[])
+{
+	if (!TestSynchConditionVariable_Timeout())
+		return -1;
+
+	if (!TestSynchConditionVariable_ProducerConsumer())
+		return -1;
+
+	if (!TestSynchConditionVariable_WakeAll())
+		return -1;
+
+	return 0;
+}
@@ -6,6 +6,7 @@
 #include <uzi/sysinfo.h>
 #include <uzi/thread.h>
 #include <uzi/interlocked.h>
+#include <uzi/uzi.h>
 
 #define TEST_SYNC_CRITICAL_TEST1_RUNTIME_MS 500
 #define TEST_SYNC_CRITICAL_TEST1_RUNS 4
@@ -116,7 +117,7 @@ static PVOID TestSynchCritical_Main(PVOID arg)
 	/**
 	 * Test SpinCount in SetCriticalSectionSpinCount, InitializeCriticalSectionEx and InitializeCriticalSectionAndSpinCount
 	 * SpinCount must be forced to be zero on on uniprocessor systems and on systems
-	 * where WINPR_CRITICAL_SECTION_DISABLE_SPINCOUNT is defined
+	 * where UZI_CRITICAL_SECTION_DISABLE_SPINCOUNT is defined
 	 */
 
 	dwSpinCount = 100;
@@ -125,7 +126,7 @@ static PVOID TestSynchCritical_Main(PVOID arg)
 	{
 		dwPreviousSpinCount = SetCriticalSectionSpinCount(&critical, dwSpinCount);
 		dwSpinCountExpected = 0;
-#if !defined(WINPR_CRITICAL_SECTION_DISABLE_SPINCOUNT)
+#if !defined(UZI_CRITICAL_SECTION_DISABLE_SPINCOUNT)
 		if (sysinfo.dwNumberOfProcessors > 1)
 			dwSpinCountExpected = dwSpinCount+1;
 #endif
@@ -297,6 +298,76 @@ fail:
 }
 
 
+#define TEST_SYNC_CRITICAL_EMBEDDED_COUNT 4096
+
+struct test_critical_connection
+{
+	int id;
+	UZI_CS lock;
+	CRITICAL_SECTION section;
+};
+
+/* critical sections embedded in many objects must initialize without failing */
+static BOOL TestSynchCritical_Embedded(void)
+{
+	int i;
+	BOOL status = TRUE;
+	struct test_critical_connection* connections;
+
+	connections = calloc(TEST_SYNC_CRITICAL_EMBEDDED_COUNT, sizeof(struct test_critical_connection));
+
+	if (!connections)
+		return FALSE;
+
+	for (i = 0; i < TEST_SYNC_CRITICAL_EMBEDDED_COUNT; i++)
+	{
+		connections[i].id = i;
+
+		if (!UziInitCS(&connections[i].lock, 0, 0) ||
+			!InitializeCriticalSectionEx(&connections[i].section, 0, 0))
+		{
+			printf("CriticalSection failure: initialization #%d failed\n", i);
+			status = FALSE;
+			break;
+		}
+	}
+
+	for (i = 0; status && (i < TEST_SYNC_CRITICAL_EMBEDDED_COUNT); i++)
+	{
+		UziEnterCS(&connections[i].lock);
+		EnterCriticalSection(&connections[i].section);
+
+		if (!UziTryEnterCS(&connections[i].lock))
+		{
+			printf("CriticalSection failure: recursive UziTryEnterCS failed\n");
+			status = FALSE;
+		}
+		else
+		{
+			UziLeaveCS(&connections[i].lock);
+		}
+
+		LeaveCriticalSection(&connections[i].section);
+		UziLeaveCS(&connections[i].lock);
+
+		/* neighbouring objects must not have been overwritten */
+		if (connections[i].id != i)
+		{
+			printf("CriticalSection failure: UZI_CS overflowed into object #%d\n", i);
+			status = FALSE;
+		}
+	}
+
+	for (i = 0; i < TEST_SYNC_CRITICAL_EMBEDDED_COUNT; i++)
+	{
+		UziDeleteCS(&connections[i].lock);
+		DeleteCriticalSection(&connections[i].section);
+	}
+
+	free(connections);
+	return status;
+}
+
 int TestSynchCritical(int argc, char* argv[])
 {
 	BOOL bThreadTerminated = FALSE;
@@ -305,6 +376,9 @@ int TestSynchCritical(int argc, char* argv[])
 	DWORD dwDeadLockDetectionTimeMs;
 	DWORD i;
 
+	if (!TestSynchCritical_Embedded())
+		return -1;
+
 	dwDeadLockDetectionTimeMs = 2 * TEST_SYNC_CRITICAL_TEST1_RUNTIME_MS * TEST_SYNC_CRITICAL_TEST1_RUNS;
 
 	printf("Deadlock will be assumed after %"PRIu32" ms.\n", dwDeadLockDetectionTimeMs);
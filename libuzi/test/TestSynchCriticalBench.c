@@ -0,0 +1,138 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/sysinfo.h>
+#include <uzi/thread.h>
+#include <uzi/interlocked.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+/**
+ * Contention benchmark for critical sections
+ *
+ * Several threads enter the same critical section to run a very short
+ * critical section, once with spinning disabled (SpinCount 0, the default of
+ * InitializeCriticalSection) and once with the spin count used by UziInitCS.
+ * The elapsed time and the number of voluntary context switches, which
+ * counts how often threads blocked in the kernel, are printed for both runs.
+ * Only the correctness of the protected counter makes the test fail, timings
+ * depend too much on the machine.
+ */
+
+#define TEST_CRITICAL_BENCH_ITERATIONS	200000
+#define TEST_CRITICAL_BENCH_MAX_THREADS	4
+
+static CRITICAL_SECTION gBenchCritical;
+static HANDLE gBenchStartEvent = NULL;
+static ULONG gBenchCounter = 0;
+
+static DWORD WINAPI TestSynchCriticalBench_Thread(LPVOID arg)
+{
+	int i;
+
+	WaitForSingleObject(gBenchStartEvent, INFINITE);
+
+	for (i = 0; i < TEST_CRITICAL_BENCH_ITERATIONS; i++)
+	{
+		EnterCriticalSection(&gBenchCritical);
+		gBenchCounter++;
+		LeaveCriticalSection(&gBenchCritical);
+	}
+
+	return 0;
+}
+
+static long TestSynchCriticalBench_ContextSwitches(void)
+{
+#ifndef _WIN32
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+
+	return usage.ru_nvcsw;
+#else
+	return 0;
+#endif
+}
+
+static BOOL TestSynchCriticalBench_Run(DWORD dwThreadCount, DWORD dwSpinCount)
+{
+	DWORD i;
+	long switches;
+	ULONGLONG start;
+	ULONGLONG elapsed;
+	HANDLE hThreads[TEST_CRITICAL_BENCH_MAX_THREADS];
+
+	if (!InitializeCriticalSectionAndSpinCount(&gBenchCritical, dwSpinCount))
+		return FALSE;
+
+	if (!(gBenchStartEvent = CreateEventA(NULL, TRUE, FALSE, NULL)))
+		return FALSE;
+
+	gBenchCounter = 0;
+
+	for (i = 0; i < dwThreadCount; i++)
+	{
+		if (!(hThreads[i] = CreateThread(NULL, 0, TestSynchCriticalBench_Thread, NULL, 0, NULL)))
+		{
+			printf("CriticalSection benchmark failure: CreateThread failed\n");
+			return FALSE;
+		}
+	}
+
+	switches = TestSynchCriticalBench_ContextSwitches();
+	start = GetTickCount64();
+	SetEvent(gBenchStartEvent);
+
+	for (i = 0; i < dwThreadCount; i++)
+	{
+		WaitForSingleObject(hThreads[i], INFINITE);
+		CloseHandle(hThreads[i]);
+	}
+
+	elapsed = GetTickCount64() - start;
+	switches = TestSynchCriticalBench_ContextSwitches() - switches;
+
+	printf("CriticalSection benchmark: %"PRIu32" threads, SpinCount %5"PRIu32": %5"PRIu64" ms, %ld context switches\n",
+		dwThreadCount, dwSpinCount, elapsed, switches);
+
+	CloseHandle(gBenchStartEvent);
+	DeleteCriticalSection(&gBenchCritical);
+
+	if (gBenchCounter != dwThreadCount * TEST_CRITICAL_BENCH_ITERATIONS)
+	{
+		printf("CriticalSection benchmark failure: counter is %"PRIu32", expected %"PRIu32"\n",
+			gBenchCounter, dwThreadCount * TEST_CRITICAL_BENCH_ITERATIONS);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+int TestSynchCriticalBench(int argc, char* argv[])
+{
+	SYSTEM_INFO sysinfo;
+	DWORD dwThreadCount;
+
+	GetNativeSystemInfo(&sysinfo);
+
+	dwThreadCount = sysinfo.dwNumberOfProcessors;
+
+	if (dwThreadCount < 2)
+		dwThreadCount = 2;
+
+	if (dwThreadCount > TEST_CRITICAL_BENCH_MAX_THREADS)
+		dwThreadCount = TEST_CRITICAL_BENCH_MAX_THREADS;
+
+	if (!TestSynchCriticalBench_Run(dwThreadCount, 0))
+		return -1;
+
+	if (!TestSynchCriticalBench_Run(dwThreadCount, 4000))
+		return -1;
+
+	return 0;
+}
@@ -1,6 +1,296 @@
 
 #include <uzi/crt.h>
 #include <uzi/synch.h>
+#include <uzi/thread.h>
+#include <uzi/interlocked.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+static DWORD WINAPI test_set_event_thread(LPVOID arg)
+{
+	Sleep(100);
+	return SetEvent((HANDLE) arg) ? 0 : 1;
+}
+
+static BOOL test_event_fd_signaled(HANDLE event)
+{
+#ifndef _WIN32
+	struct pollfd pfd;
+
+	pfd.fd = GetEventFileDescriptor(event);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return (poll(&pfd, 1, 0) == 1) ? TRUE : FALSE;
+#else
+	return WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+#endif
+}
+
+#define TEST_AUTO_RESET_WAITERS	4
+
+static LONG volatile g_AutoResetReleased = 0;
+
+static DWORD WINAPI test_auto_reset_thread(LPVOID arg)
+{
+	if (WaitForSingleObject((HANDLE) arg, INFINITE) != WAIT_OBJECT_0)
+		return 1;
+
+	InterlockedIncrement(&g_AutoResetReleased);
+	return 0;
+}
+
+static int test_auto_reset_event(void)
+{
+	int i;
+	HANDLE event;
+	HANDLE threads[TEST_AUTO_RESET_WAITERS];
+
+	event = CreateEventA(NULL, FALSE, TRUE, NULL);
+
+	if (!event)
+	{
+		printf("CreateEvent failure with auto-reset event\n");
+		return -1;
+	}
+
+	/* querying the state must not consume the signal */
+	if (!IsEventSet(event) || !IsEventSet(event))
+	{
+		printf("IsEventSet failure with signaled auto-reset event\n");
+		return -1;
+	}
+
+	if (WaitForSingleObject(event, 0) != WAIT_OBJECT_0)
+	{
+		printf("WaitForSingleObject failure with signaled auto-reset event\n");
+		return -1;
+	}
+
+	if (IsEventSet(event))
+	{
+		printf("IsEventSet failure with consumed auto-reset event\n");
+		return -1;
+	}
+
+	if (WaitForSingleObject(event, 0) != WAIT_TIMEOUT)
+	{
+		printf("auto-reset event not reset by a successful wait\n");
+		return -1;
+	}
+
+	if (!SetEvent(event) || (WaitForMultipleObjects(1, &event, FALSE, 0) != WAIT_OBJECT_0))
+	{
+		printf("WaitForMultipleObjects failure with signaled auto-reset event\n");
+		return -1;
+	}
+
+	if (WaitForMultipleObjects(1, &event, FALSE, 0) != WAIT_TIMEOUT)
+	{
+		printf("auto-reset event not reset by WaitForMultipleObjects\n");
+		return -1;
+	}
+
+	/* each SetEvent must release exactly one waiter */
+	for (i = 0; i < TEST_AUTO_RESET_WAITERS; i++)
+	{
+		if (!(threads[i] = CreateThread(NULL, 0, test_auto_reset_thread, event, 0, NULL)))
+		{
+			printf("CreateThread failure\n");
+			return -1;
+		}
+	}
+
+	for (i = 0; i < TEST_AUTO_RESET_WAITERS; i++)
+	{
+		Sleep(100);
+
+		if (g_AutoResetReleased != i)
+		{
+			printf("auto-reset event released %d waiters instead of %d\n", (int) g_AutoResetReleased, i);
+			return -1;
+		}
+
+		SetEvent(event);
+	}
+
+	for (i = 0; i < TEST_AUTO_RESET_WAITERS; i++)
+	{
+		if (WaitForSingleObject(threads[i], 5000) != WAIT_OBJECT_0)
+		{
+			printf("auto-reset event waiters were not all released\n");
+			return -1;
+		}
+
+		CloseHandle(threads[i]);
+	}
+
+	if (WaitForSingleObject(event, 0) != WAIT_TIMEOUT)
+	{
+		printf("auto-reset event still signaled after releasing a waiter\n");
+		return -1;
+	}
+
+	CloseHandle(event);
+	return 0;
+}
+
+#define TEST_BATCH_EVENTS	256
+
+static int test_event_batch(void)
+{
+	int i;
+	HANDLE invalid[2];
+	HANDLE events[TEST_BATCH_EVENTS];
+
+	for (i = 0; i < TEST_BATCH_EVENTS; i++)
+	{
+		/* some events are already signaled, some are auto-reset */
+		if (!(events[i] = CreateEventA(NULL, (i % 3) ? TRUE : FALSE, (i % 2) ? TRUE : FALSE, NULL)))
+		{
+			printf("CreateEvent failure\n");
+			return -1;
+		}
+	}
+
+	/* with a file descriptor in use, it must follow the batch as well */
+	if (GetEventFileDescriptor(events[0]) < 0)
+	{
+		printf("GetEventFileDescriptor failure\n");
+		return -1;
+	}
+
+	if (!SetEvents(TEST_BATCH_EVENTS, events))
+	{
+		printf("SetEvents failure\n");
+		return -1;
+	}
+
+	if (WaitForMultipleObjects(1, &events[0], FALSE, 0) != WAIT_OBJECT_0)
+	{
+		printf("SetEvents did not signal the event file descriptor\n");
+		return -1;
+	}
+
+	SetEvent(events[0]);
+
+	for (i = 0; i < TEST_BATCH_EVENTS; i++)
+	{
+		if (!IsEventSet(events[i]))
+		{
+			printf("SetEvents did not signal event %d\n", i);
+			return -1;
+		}
+	}
+
+	if (!ResetEvents(TEST_BATCH_EVENTS, events))
+	{
+		printf("ResetEvents failure\n");
+		return -1;
+	}
+
+	for (i = 0; i < TEST_BATCH_EVENTS; i++)
+	{
+		if (WaitForSingleObject(events[i], 0) != WAIT_TIMEOUT)
+		{
+			printf("ResetEvents did not reset event %d\n", i);
+			return -1;
+		}
+	}
+
+	/* an invalid handle must fail the whole batch before any event is changed */
+	invalid[0] = events[1];
+	invalid[1] = NULL;
+
+	if (SetEvents(2, invalid) || IsEventSet(events[1]))
+	{
+		printf("SetEvents unexpectedly succeeded with an invalid handle\n");
+		return -1;
+	}
+
+	for (i = 0; i < TEST_BATCH_EVENTS; i++)
+		CloseHandle(events[i]);
+
+	return 0;
+}
+
+static int test_event_fd(void)
+{
+	HANDLE event;
+	HANDLE thread;
+
+	event = CreateEventA(NULL, TRUE, TRUE, NULL);
+
+	if (!event)
+	{
+		printf("CreateEvent failure\n");
+		return -1;
+	}
+
+	/* the file descriptor must reflect the state set before it was requested */
+	if (!test_event_fd_signaled(event))
+	{
+		printf("event file descriptor not signaled\n");
+		return -1;
+	}
+
+	if (!ResetEvent(event) || test_event_fd_signaled(event))
+	{
+		printf("event file descriptor still signaled after ResetEvent\n");
+		return -1;
+	}
+
+	if (WaitForMultipleObjects(1, &event, FALSE, 0) != WAIT_TIMEOUT)
+	{
+		printf("WaitForMultipleObjects failure with nonsignaled event object\n");
+		return -1;
+	}
+
+	if (!SetEvent(event) || !SetEvent(event) || !test_event_fd_signaled(event))
+	{
+		printf("event file descriptor not signaled after SetEvent\n");
+		return -1;
+	}
+
+	if (WaitForMultipleObjects(1, &event, FALSE, 0) != WAIT_OBJECT_0)
+	{
+		printf("WaitForMultipleObjects failure with signaled event object\n");
+		return -1;
+	}
+
+	if (!ResetEvent(event) || test_event_fd_signaled(event))
+	{
+		printf("event file descriptor still signaled after ResetEvent\n");
+		return -1;
+	}
+
+	/* a blocked waiter must be woken up by another thread */
+	if (!(thread = CreateThread(NULL, 0, test_set_event_thread, event, 0, NULL)))
+	{
+		printf("CreateThread failure\n");
+		return -1;
+	}
+
+	if (WaitForSingleObject(event, 5000) != WAIT_OBJECT_0)
+	{
+		printf("WaitForSingleObject failure with event set by another thread\n");
+		return -1;
+	}
+
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+
+	if (!ResetEvent(event) || (WaitForSingleObject(event, 10) != WAIT_TIMEOUT))
+	{
+		printf("WaitForSingleObject timeout failure\n");
+		return -1;
+	}
+
+	CloseHandle(event);
+	return 0;
+}
 
 int TestSynchEvent(int argc, char* argv[])
 {
@@ -90,5 +380,11 @@ int TestSynchEvent(int argc, char* argv[])
 
 	CloseHandle(event);
 
-	return 0;
+	if (test_event_fd() < 0)
+		return -1;
+
+	if (test_auto_reset_event() < 0)
+		return -1;
+
+	return test_event_batch();
 }
@@ -230,6 +230,213 @@ fail:
 	return FALSE;
 }
 
+HANDLE thread2_handles[2];
+DWORD  thread2_status = WAIT_FAILED;
+
+DWORD WINAPI test_mutex_thread2(LPVOID lpParam)
+{
+	/* thread2_handles[0] is an event, thread2_handles[1] is a mutex */
+	thread2_status = WaitForMultipleObjects(2, thread2_handles, FALSE, 5000);
+
+	if ((thread2_status == WAIT_OBJECT_0 + 1) && !ReleaseMutex(thread2_handles[1]))
+		thread2_status = WAIT_FAILED;
+
+	return 0;
+}
+
+DWORD WINAPI test_mutex_thread3(LPVOID lpParam)
+{
+	thread2_status = WaitForSingleObject(thread2_handles[1], 100);
+
+	if ((thread2_status == WAIT_OBJECT_0) && !ReleaseMutex(thread2_handles[1]))
+		thread2_status = WAIT_FAILED;
+
+	return 0;
+}
+
+BOOL test_mutex_wait_multiple()
+{
+	DWORD rc;
+	HANDLE hThread;
+
+	if (!(thread2_handles[0] = CreateEventA(NULL, TRUE, FALSE, NULL)))
+		return FALSE;
+
+	if (!(thread2_handles[1] = CreateMutexA(NULL, TRUE, NULL)))
+		return FALSE;
+
+	/* the owner of a mutex acquires it again without blocking */
+	rc = WaitForMultipleObjects(2, thread2_handles, FALSE, 0);
+	if (rc != WAIT_OBJECT_0 + 1)
+	{
+		printf("%s: WaitForMultipleObjects on an owned mutex returned %"PRIu32"\n", __FUNCTION__, rc);
+		return FALSE;
+	}
+
+	if (!ReleaseMutex(thread2_handles[1]))
+	{
+		printf("%s: ReleaseMutex failed after a recursive wait\n", __FUNCTION__);
+		return FALSE;
+	}
+
+	if (!(hThread = CreateThread(NULL, 0, test_mutex_thread2, NULL, 0, NULL)))
+		return FALSE;
+
+	Sleep(100);
+
+	if (!ReleaseMutex(thread2_handles[1]))
+	{
+		printf("%s: ReleaseMutex failed\n", __FUNCTION__);
+		return FALSE;
+	}
+
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(hThread);
+
+	if (thread2_status != WAIT_OBJECT_0 + 1)
+	{
+		printf("%s: WaitForMultipleObjects in thread returned %"PRIu32"\n", __FUNCTION__, thread2_status);
+		return FALSE;
+	}
+
+	/* the mutex must have been released by the thread */
+	if (WaitForSingleObject(thread2_handles[1], 0) != WAIT_OBJECT_0)
+	{
+		printf("%s: mutex still owned after the thread released it\n", __FUNCTION__);
+		return FALSE;
+	}
+
+	if (!ReleaseMutex(thread2_handles[1]))
+		return FALSE;
+
+	/* a timed out wait for all handles must not keep the mutex */
+	rc = WaitForMultipleObjects(2, thread2_handles, TRUE, 50);
+	if (rc != WAIT_TIMEOUT)
+	{
+		printf("%s: WaitForMultipleObjects for all handles returned %"PRIu32"\n", __FUNCTION__, rc);
+		return FALSE;
+	}
+
+	if (!(hThread = CreateThread(NULL, 0, test_mutex_thread3, NULL, 0, NULL)))
+		return FALSE;
+
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(hThread);
+
+	if (thread2_status != WAIT_OBJECT_0)
+	{
+		printf("%s: mutex still owned after a timed out wait for all handles\n", __FUNCTION__);
+		return FALSE;
+	}
+
+	if (ReleaseMutex(thread2_handles[1]))
+	{
+		printf("%s: released a mutex after a timed out wait for all handles\n", __FUNCTION__);
+		return FALSE;
+	}
+
+	/* the lowest signaled index wins, even over a mutex checked without its file descriptor */
+	if (!(hThread = CreateThread(NULL, 0, test_mutex_thread3, NULL, 0, NULL)))
+		return FALSE;
+
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(thread2_handles[0]);
+	thread2_handles[0] = hThread;
+
+	rc = WaitForMultipleObjects(2, thread2_handles, FALSE, 0);
+	if (rc != WAIT_OBJECT_0)
+	{
+		printf("%s: WaitForMultipleObjects on an exited thread and a mutex returned %"PRIu32"\n",
+			__FUNCTION__, rc);
+		return FALSE;
+	}
+
+	if (ReleaseMutex(thread2_handles[1]))
+	{
+		printf("%s: mutex acquired with a lower signaled handle\n", __FUNCTION__);
+		return FALSE;
+	}
+
+	CloseHandle(hThread);
+	CloseHandle(thread2_handles[1]);
+	return TRUE;
+}
+
+#define TEST_WAIT_ALL_ITERATIONS	500000
+
+HANDLE wait_all_mutexes[2];
+DWORD  wait_all_status[2];
+
+DWORD WINAPI test_mutex_wait_all_thread(LPVOID lpParam)
+{
+	int i;
+	DWORD rc;
+	int first = (int) (size_t) lpParam;
+	HANDLE handles[2];
+
+	/* both threads wait for the same mutexes, in opposite orders */
+	handles[0] = wait_all_mutexes[first];
+	handles[1] = wait_all_mutexes[1 - first];
+	wait_all_status[first] = WAIT_OBJECT_0;
+
+	for (i = 0; i < TEST_WAIT_ALL_ITERATIONS; i++)
+	{
+		rc = WaitForMultipleObjects(2, handles, TRUE, 5000);
+
+		if (rc != WAIT_OBJECT_0)
+		{
+			wait_all_status[first] = rc;
+			break;
+		}
+
+		if (!ReleaseMutex(handles[0]) || !ReleaseMutex(handles[1]))
+		{
+			wait_all_status[first] = WAIT_FAILED;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+BOOL test_mutex_wait_all_order()
+{
+	int i;
+	HANDLE hThreads[2];
+
+	for (i = 0; i < 2; i++)
+	{
+		if (!(wait_all_mutexes[i] = CreateMutexA(NULL, FALSE, NULL)))
+			return FALSE;
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		if (!(hThreads[i] = CreateThread(NULL, 0, test_mutex_wait_all_thread, (LPVOID) (size_t) i, 0, NULL)))
+			return FALSE;
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		WaitForSingleObject(hThreads[i], INFINITE);
+		CloseHandle(hThreads[i]);
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		if (wait_all_status[i] != WAIT_OBJECT_0)
+		{
+			printf("%s: WaitForMultipleObjects for all mutexes in thread %d returned %"PRIu32"\n",
+				__FUNCTION__, i, wait_all_status[i]);
+			return FALSE;
+		}
+	}
+
+	CloseHandle(wait_all_mutexes[0]);
+	CloseHandle(wait_all_mutexes[1]);
+	return TRUE;
+}
+
 int TestSynchMutex(int argc, char* argv[])
 {
 	if (!test_mutex_basic())
@@ -241,6 +448,12 @@ int TestSynchMutex(int argc, char* argv[])
 	if (!test_mutex_threading())
 		return 3;
 
+	if (!test_mutex_wait_multiple())
+		return 4;
+
+	if (!test_mutex_wait_all_order())
+		return 5;
+
 	printf("TestSynchMutex succeeded\n");
 	return 0;
 }
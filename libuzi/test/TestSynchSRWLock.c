@@ -0,0 +1,228 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/thread.h>
+#include <uzi/interlocked.h>
+
+#define TEST_SYNC_SRWLOCK_THREADS	4
+#define TEST_SYNC_SRWLOCK_LOOPS		20000
+
+static SRWLOCK gSRWLock = SRWLOCK_INIT;
+
+static LONG gActiveReaders = 0;
+static LONG gMaxReaders = 0;
+static LONG gActiveWriters = 0;
+static LONG gValueA = 0;
+static LONG gValueB = 0;
+static LONG gErrors = 0;
+
+static DWORD WINAPI TestSynchSRWLock_Reader(LPVOID arg)
+{
+	LONG active;
+
+	AcquireSRWLockShared(&gSRWLock);
+
+	active = InterlockedIncrement(&gActiveReaders);
+
+	if (active > gMaxReaders)
+		InterlockedExchange(&gMaxReaders, active);
+
+	Sleep(50);
+	InterlockedDecrement(&gActiveReaders);
+
+	ReleaseSRWLockShared(&gSRWLock);
+	return 0;
+}
+
+static DWORD WINAPI TestSynchSRWLock_Worker(LPVOID arg)
+{
+	int index;
+	DWORD id = (DWORD) (ULONG_PTR) arg;
+
+	for (index = 0; index < TEST_SYNC_SRWLOCK_LOOPS; index++)
+	{
+		if (((index + id) % 8) == 0)
+		{
+			AcquireSRWLockExclusive(&gSRWLock);
+
+			if ((InterlockedIncrement(&gActiveWriters) != 1) || gActiveReaders)
+				InterlockedIncrement(&gErrors);
+
+			gValueA++;
+			gValueB++;
+
+			InterlockedDecrement(&gActiveWriters);
+			ReleaseSRWLockExclusive(&gSRWLock);
+		}
+		else
+		{
+			AcquireSRWLockShared(&gSRWLock);
+			InterlockedIncrement(&gActiveReaders);
+
+			if (gActiveWriters || (gValueA != gValueB))
+				InterlockedIncrement(&gErrors);
+
+			InterlockedDecrement(&gActiveReaders);
+			ReleaseSRWLockShared(&gSRWLock);
+		}
+	}
+
+	return 0;
+}
+
+static BOOL TestSynchSRWLock_Try(void)
+{
+	SRWLOCK lock;
+
+	InitializeSRWLock(&lock);
+
+	if (!TryAcquireSRWLockExclusive(&lock))
+	{
+		printf("SRWLock failure: TryAcquireSRWLockExclusive failed on a free lock\n");
+		return FALSE;
+	}
+
+	if (TryAcquireSRWLockExclusive(&lock) || TryAcquireSRWLockShared(&lock))
+	{
+		printf("SRWLock failure: lock acquired while held exclusively\n");
+		return FALSE;
+	}
+
+	ReleaseSRWLockExclusive(&lock);
+
+	if (!TryAcquireSRWLockShared(&lock) || !TryAcquireSRWLockShared(&lock))
+	{
+		printf("SRWLock failure: TryAcquireSRWLockShared failed on a shared lock\n");
+		return FALSE;
+	}
+
+	if (TryAcquireSRWLockExclusive(&lock))
+	{
+		printf("SRWLock failure: lock acquired exclusively while held shared\n");
+		return FALSE;
+	}
+
+	ReleaseSRWLockShared(&lock);
+	ReleaseSRWLockShared(&lock);
+
+	if (!TryAcquireSRWLockExclusive(&lock))
+	{
+		printf("SRWLock failure: TryAcquireSRWLockExclusive failed after the readers left\n");
+		return FALSE;
+	}
+
+	ReleaseSRWLockExclusive(&lock);
+	return TRUE;
+}
+
+static BOOL TestSynchSRWLock_Readers(void)
+{
+	int index;
+	HANDLE hThreads[TEST_SYNC_SRWLOCK_THREADS];
+
+	/* go through the lock word enough times for the readers to get biased */
+	for (index = 0; index < 1000; index++)
+	{
+		AcquireSRWLockShared(&gSRWLock);
+		ReleaseSRWLockShared(&gSRWLock);
+	}
+
+	for (index = 0; index < TEST_SYNC_SRWLOCK_THREADS; index++)
+	{
+		if (!(hThreads[index] = CreateThread(NULL, 0, TestSynchSRWLock_Reader, NULL, 0, NULL)))
+		{
+			printf("SRWLock failure: CreateThread failed\n");
+			return FALSE;
+		}
+	}
+
+	Sleep(10);
+
+	/* readers published in the reader table must keep writers out */
+	if (gActiveReaders && TryAcquireSRWLockExclusive(&gSRWLock))
+	{
+		printf("SRWLock failure: lock acquired exclusively while readers hold it\n");
+		return FALSE;
+	}
+
+	AcquireSRWLockExclusive(&gSRWLock);
+
+	if (gActiveReaders)
+	{
+		printf("SRWLock failure: %"PRId32" readers active in exclusive mode\n", gActiveReaders);
+		return FALSE;
+	}
+
+	ReleaseSRWLockExclusive(&gSRWLock);
+
+	for (index = 0; index < TEST_SYNC_SRWLOCK_THREADS; index++)
+	{
+		WaitForSingleObject(hThreads[index], INFINITE);
+		CloseHandle(hThreads[index]);
+	}
+
+	if (gMaxReaders < 2)
+	{
+		printf("SRWLock failure: readers were serialized\n");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL TestSynchSRWLock_Mixed(void)
+{
+	int index;
+	HANDLE hThreads[TEST_SYNC_SRWLOCK_THREADS];
+
+	for (index = 0; index < TEST_SYNC_SRWLOCK_THREADS; index++)
+	{
+		if (!(hThreads[index] = CreateThread(NULL, 0, TestSynchSRWLock_Worker,
+				(LPVOID) (ULONG_PTR) index, 0, NULL)))
+		{
+			printf("SRWLock failure: CreateThread failed\n");
+			return FALSE;
+		}
+	}
+
+	for (index = 0; index < TEST_SYNC_SRWLOCK_THREADS; index++)
+	{
+		WaitForSingleObject(hThreads[index], INFINITE);
+		CloseHandle(hThreads[index]);
+	}
+
+	if (gErrors)
+	{
+		printf("SRWLock failure: %"PRId32" exclusion errors\n", gErrors);
+		return FALSE;
+	}
+
+	if (gValueA != (TEST_SYNC_SRWLOCK_THREADS * TEST_SYNC_SRWLOCK_LOOPS / 8))
+	{
+		printf("SRWLock failure: %"PRId32" exclusive updates recorded\n", gValueA);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+int TestSynchSRWLock(int argc, char* argv[])
+{
+	if (sizeof(SRWLOCK) != sizeof(PVOID))
+	{
+		printf("SRWLock failure: SRWLOCK is %d bytes wide\n", (int) sizeof(SRWLOCK));
+		return -1;
+	}
+
+	if (!TestSynchSRWLock_Try())
+		return -1;
+
+	if (!TestSynchSRWLock_Readers())
+		return -1;
+
+	if (!TestSynchSRWLock_Mixed())
+		return -1;
+
+	return 0;
+}
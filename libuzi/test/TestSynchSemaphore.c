@@ -1,6 +1,188 @@
 
 #include <uzi/crt.h>
 #include <uzi/synch.h>
+#include <uzi/thread.h>
+
+static BOOL test_semaphore_maximum(void)
+{
+	LONG previous = -1;
+	HANDLE semaphore;
+
+	if (CreateSemaphoreA(NULL, 2, 1, NULL))
+	{
+		printf("CreateSemaphore accepted an initial count above the maximum\n");
+		return FALSE;
+	}
+
+	semaphore = CreateSemaphoreA(NULL, 1, 3, NULL);
+
+	if (!semaphore)
+		return FALSE;
+
+	if (!ReleaseSemaphore(semaphore, 1, &previous) || (previous != 1))
+	{
+		printf("ReleaseSemaphore previous count %d, expected 1\n", (int) previous);
+		return FALSE;
+	}
+
+	if (ReleaseSemaphore(semaphore, 2, &previous) || (GetLastError() != ERROR_TOO_MANY_POSTS))
+	{
+		printf("ReleaseSemaphore went beyond the maximum count\n");
+		return FALSE;
+	}
+
+	if (!ReleaseSemaphore(semaphore, 1, &previous) || (previous != 2))
+	{
+		printf("ReleaseSemaphore previous count %d, expected 2\n", (int) previous);
+		return FALSE;
+	}
+
+	if (WaitForSingleObject(semaphore, 0) != WAIT_OBJECT_0)
+		return FALSE;
+
+	if (!ReleaseSemaphore(semaphore, 1, &previous) || (previous != 2))
+	{
+		printf("ReleaseSemaphore previous count %d after a wait, expected 2\n", (int) previous);
+		return FALSE;
+	}
+
+	CloseHandle(semaphore);
+	return TRUE;
+}
+
+static BOOL test_semaphore_large_release(void)
+{
+	int index;
+	LONG previous = -1;
+	HANDLE semaphore;
+
+	semaphore = CreateSemaphoreA(NULL, 0, 10000, NULL);
+
+	if (!semaphore)
+		return FALSE;
+
+	if (!ReleaseSemaphore(semaphore, 10000, &previous) || (previous != 0))
+	{
+		printf("ReleaseSemaphore failed to release 10000 permits\n");
+		return FALSE;
+	}
+
+	for (index = 0; index < 10000; index++)
+	{
+		if (WaitForSingleObject(semaphore, 0) != WAIT_OBJECT_0)
+		{
+			printf("WaitForSingleObject failed on permit %d\n", index);
+			return FALSE;
+		}
+	}
+
+	if (WaitForSingleObject(semaphore, 0) != WAIT_TIMEOUT)
+	{
+		printf("WaitForSingleObject took more permits than released\n");
+		return FALSE;
+	}
+
+	CloseHandle(semaphore);
+	return TRUE;
+}
+
+static BOOL test_semaphore_wait_multiple(void)
+{
+	DWORD status;
+	HANDLE handles[2];
+
+	handles[0] = CreateSemaphoreA(NULL, 0, 1, NULL);
+	handles[1] = CreateSemaphoreA(NULL, 1, 1, NULL);
+
+	if (!handles[0] || !handles[1])
+		return FALSE;
+
+	status = WaitForMultipleObjects(2, handles, FALSE, 0);
+
+	if (status != (WAIT_OBJECT_0 + 1))
+	{
+		printf("WaitForMultipleObjects returned 0x%08X\n", (unsigned int) status);
+		return FALSE;
+	}
+
+	/* the permit must have been consumed */
+	if (WaitForMultipleObjects(2, handles, FALSE, 0) != WAIT_TIMEOUT)
+	{
+		printf("WaitForMultipleObjects did not consume the permit\n");
+		return FALSE;
+	}
+
+	CloseHandle(handles[0]);
+	CloseHandle(handles[1]);
+	return TRUE;
+}
+
+static DWORD WINAPI test_semaphore_release_thread(LPVOID arg)
+{
+	HANDLE semaphore = (HANDLE) arg;
+
+	Sleep(50);
+
+	if (!ReleaseSemaphore(semaphore, 1, NULL))
+		return 1;
+
+	Sleep(50);
+	return ReleaseSemaphore(semaphore, 2, NULL) ? 0 : 1;
+}
+
+static BOOL test_semaphore_wait_n(void)
+{
+	LONG previous = -1;
+	HANDLE thread;
+	HANDLE semaphore;
+
+	semaphore = CreateSemaphoreA(NULL, 2, 4, NULL);
+
+	if (!semaphore)
+		return FALSE;
+
+	if (WaitForSemaphoreN(semaphore, 5, 0) != WAIT_FAILED)
+	{
+		printf("WaitForSemaphoreN accepted a count above the maximum\n");
+		return FALSE;
+	}
+
+	if (WaitForSemaphoreN(semaphore, 3, 10) != WAIT_TIMEOUT)
+	{
+		printf("WaitForSemaphoreN took 3 permits out of 2\n");
+		return FALSE;
+	}
+
+	if (WaitForSemaphoreN(semaphore, 2, 0) != WAIT_OBJECT_0)
+	{
+		printf("WaitForSemaphoreN failed to take 2 available permits\n");
+		return FALSE;
+	}
+
+	thread = CreateThread(NULL, 0, test_semaphore_release_thread, semaphore, 0, NULL);
+
+	if (!thread)
+		return FALSE;
+
+	/* only satisfied once both releases happened */
+	if (WaitForSemaphoreN(semaphore, 3, 5000) != WAIT_OBJECT_0)
+	{
+		printf("WaitForSemaphoreN was not woken up by the releases\n");
+		return FALSE;
+	}
+
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+
+	if (!ReleaseSemaphore(semaphore, 1, &previous) || (previous != 0))
+	{
+		printf("WaitForSemaphoreN left %d permits, expected 0\n", (int) previous);
+		return FALSE;
+	}
+
+	CloseHandle(semaphore);
+	return TRUE;
+}
 
 int TestSynchSemaphore(int argc, char* argv[])
 {
@@ -16,6 +198,17 @@ int TestSynchSemaphore(int argc, char* argv[])
 
 	CloseHandle(semaphore);
 
+	if (!test_semaphore_maximum())
+		return -1;
+
+	if (!test_semaphore_large_release())
+		return -1;
+
+	if (!test_semaphore_wait_multiple())
+		return -1;
+
+	if (!test_semaphore_wait_n())
+		return -1;
+
 	return 0;
 }
-
@@ -0,0 +1,153 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/thread.h>
+#include <uzi/handle.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/**
+ * Checks that WaitForMultipleObjectsReady acquires all the signaled handles
+ * at once, objects waited on with a futex and file descriptors alike, and
+ * returns them in handle order from the start index.
+ */
+
+#define TEST_WAIT_READY_HANDLES		8
+
+static HANDLE gHandles[TEST_WAIT_READY_HANDLES];
+
+static DWORD WINAPI TestWaitReady_SetterThread(LPVOID arg)
+{
+	Sleep(10);
+	SetEvent(gHandles[2]);
+	return 0;
+}
+
+static BOOL TestWaitReady_Expect(DWORD dwStartIndex, DWORD dwMilliseconds, DWORD expectedCount,
+		const DWORD* expected, const char* what)
+{
+	DWORD index;
+	DWORD status;
+	DWORD count = 0xFFFF;
+	DWORD indices[TEST_WAIT_READY_HANDLES];
+
+	status = WaitForMultipleObjectsReady(TEST_WAIT_READY_HANDLES, gHandles, dwStartIndex,
+		indices, &count, dwMilliseconds);
+
+	if (status != (expectedCount ? WAIT_OBJECT_0 : WAIT_TIMEOUT))
+	{
+		printf("WaitReady failure: %s: status 0x%08"PRIX32"\n", what, status);
+		return FALSE;
+	}
+
+	if (count != expectedCount)
+	{
+		printf("WaitReady failure: %s: %"PRIu32" ready handles instead of %"PRIu32"\n",
+			what, count, expectedCount);
+		return FALSE;
+	}
+
+	for (index = 0; index < count; index++)
+	{
+		if (indices[index] != expected[index])
+		{
+			printf("WaitReady failure: %s: index %"PRIu32" at position %"PRIu32" instead of %"PRIu32"\n",
+				what, indices[index], index, expected[index]);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+int TestSynchWaitReady(int argc, char* argv[])
+{
+	int fds[2];
+	DWORD index;
+	DWORD count;
+	HANDLE hThread;
+	static const DWORD expectAll[] = { 5, 6, 7, 0, 3 };
+	static const DWORD expectSemaphore[] = { 6 };
+	static const DWORD expectSetter[] = { 2 };
+
+	if (pipe(fds) < 0)
+	{
+		printf("WaitReady failure: pipe failed\n");
+		return -1;
+	}
+
+	for (index = 0; index < TEST_WAIT_READY_HANDLES; index++)
+		gHandles[index] = CreateEventA(NULL, FALSE, FALSE, NULL);
+
+	CloseHandle(gHandles[6]);
+	gHandles[6] = CreateSemaphoreA(NULL, 2, 2, NULL);
+
+	CloseHandle(gHandles[7]);
+	gHandles[7] = CreateFileDescriptorEventA(NULL, FALSE, FALSE, fds[0], UZI_FD_READ);
+
+	for (index = 0; index < TEST_WAIT_READY_HANDLES; index++)
+	{
+		if (!gHandles[index])
+		{
+			printf("WaitReady failure: failed to create handle %"PRIu32"\n", index);
+			return -1;
+		}
+	}
+
+	if (WaitForMultipleObjectsReady(TEST_WAIT_READY_HANDLES, gHandles, 0, NULL, &count, 0) != WAIT_FAILED)
+	{
+		printf("WaitReady failure: accepted a NULL index array\n");
+		return -1;
+	}
+
+	SetEvent(gHandles[0]);
+	SetEvent(gHandles[3]);
+	SetEvent(gHandles[5]);
+
+	if (write(fds[1], "x", 1) != 1)
+	{
+		printf("WaitReady failure: write failed\n");
+		return -1;
+	}
+
+	/* the start index is reduced modulo the handle count */
+	if (!TestWaitReady_Expect(TEST_WAIT_READY_HANDLES + 5, 0, 5, expectAll, "ready set"))
+		return -1;
+
+	/* the pipe stays readable until it is read */
+	if (read(fds[0], &index, 1) != 1)
+	{
+		printf("WaitReady failure: read failed\n");
+		return -1;
+	}
+
+	/* auto-reset events were reset, the semaphore has one count left */
+	if (!TestWaitReady_Expect(1, 0, 1, expectSemaphore, "acquired handles"))
+		return -1;
+
+	if (!TestWaitReady_Expect(0, 10, 0, NULL, "timeout"))
+		return -1;
+
+	if (!(hThread = CreateThread(NULL, 0, TestWaitReady_SetterThread, NULL, 0, NULL)))
+	{
+		printf("WaitReady failure: CreateThread failed\n");
+		return -1;
+	}
+
+	if (!TestWaitReady_Expect(4, INFINITE, 1, expectSetter, "blocking wait"))
+		return -1;
+
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(hThread);
+
+	for (index = 0; index < TEST_WAIT_READY_HANDLES; index++)
+		CloseHandle(gHandles[index]);
+
+	close(fds[0]);
+	close(fds[1]);
+
+	return 0;
+}
@@ -0,0 +1,444 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/sysinfo.h>
+#include <uzi/thread.h>
+#include <uzi/error.h>
+#include <uzi/handle.h>
+
+/**
+ * Besides checking wait set and WaitForManyObjects semantics, this test
+ * prints how long waits on the same set of handles take with
+ * WaitForMultipleObjects, with a wait set and with WaitForManyObjects.
+ * Only correctness makes the test fail, timings depend on the machine.
+ */
+
+#define TEST_WAIT_SET_EVENTS		60
+#define TEST_WAIT_SET_ITERATIONS	20000
+#define TEST_WAIT_MANY_EVENTS		900
+#define TEST_WAIT_MANY_ITERATIONS	5000
+
+static HANDLE gEvents[TEST_WAIT_SET_EVENTS];
+static HANDLE gManyEvents[TEST_WAIT_MANY_EVENTS];
+static DWORD gIndices[TEST_WAIT_MANY_EVENTS];
+
+static DWORD WINAPI TestSynchWaitSet_SetterThread(LPVOID arg)
+{
+	Sleep(50);
+	SetEvent((HANDLE) arg);
+	return 0;
+}
+
+static BOOL TestSynchWaitSet_Expect(HANDLE hWaitSet, DWORD expected, HANDLE hExpected, const char* what)
+{
+	DWORD status;
+	DWORD count = 0;
+	HANDLE signaled[TEST_WAIT_SET_EVENTS];
+
+	status = WaitSetWait(hWaitSet, signaled, TEST_WAIT_SET_EVENTS, &count, expected ? 1000 : 0);
+
+	if (!expected)
+	{
+		if (status != WAIT_TIMEOUT)
+		{
+			printf("WaitSet failure: %s: %"PRIu32" handles reported instead of a timeout\n", what, count);
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	if ((status != WAIT_OBJECT_0) || (count != expected))
+	{
+		printf("WaitSet failure: %s: status 0x%08"PRIX32", %"PRIu32" handles instead of %"PRIu32"\n",
+			what, status, count, expected);
+		return FALSE;
+	}
+
+	if (hExpected && (signaled[0] != hExpected))
+	{
+		printf("WaitSet failure: %s: unexpected handle reported\n", what);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL TestSynchWaitSet_Semantics(HANDLE hWaitSet)
+{
+	HANDLE hThread;
+	HANDLE hSemaphore;
+	HANDLE hManual;
+	HANDLE hDuplicate;
+	HANDLE hClosed;
+
+	if (!TestSynchWaitSet_Expect(hWaitSet, 0, NULL, "empty wait"))
+		return FALSE;
+
+	SetEvent(gEvents[3]);
+	SetEvent(gEvents[17]);
+
+	if (!TestSynchWaitSet_Expect(hWaitSet, 2, NULL, "two events set"))
+		return FALSE;
+
+	/* auto-reset events were consumed by the wait */
+	if (!TestSynchWaitSet_Expect(hWaitSet, 0, NULL, "consumed events"))
+		return FALSE;
+
+	SetLastError(0);
+
+	if (WaitSetAdd(hWaitSet, gEvents[3]) || (GetLastError() != ERROR_ALREADY_EXISTS))
+	{
+		printf("WaitSet failure: a handle was added twice\n");
+		return FALSE;
+	}
+
+	if (!WaitSetRemove(hWaitSet, gEvents[3]))
+	{
+		printf("WaitSet failure: WaitSetRemove failed\n");
+		return FALSE;
+	}
+
+	SetLastError(0);
+
+	if (WaitSetRemove(hWaitSet, gEvents[3]) || (GetLastError() != ERROR_NOT_FOUND))
+	{
+		printf("WaitSet failure: a handle was removed twice\n");
+		return FALSE;
+	}
+
+	SetEvent(gEvents[3]);
+
+	if (!TestSynchWaitSet_Expect(hWaitSet, 0, NULL, "removed event"))
+		return FALSE;
+
+	ResetEvent(gEvents[3]);
+
+	if (!WaitSetAdd(hWaitSet, gEvents[3]))
+	{
+		printf("WaitSet failure: WaitSetAdd failed on a removed handle\n");
+		return FALSE;
+	}
+
+	/* one permit is reported per wait */
+	if (!(hSemaphore = CreateSemaphoreA(NULL, 2, 2, NULL)) || !WaitSetAdd(hWaitSet, hSemaphore))
+		return FALSE;
+
+	if (!TestSynchWaitSet_Expect(hWaitSet, 1, hSemaphore, "semaphore first permit") ||
+			!TestSynchWaitSet_Expect(hWaitSet, 1, hSemaphore, "semaphore second permit") ||
+			!TestSynchWaitSet_Expect(hWaitSet, 0, NULL, "semaphore without permits"))
+		return FALSE;
+
+	WaitSetRemove(hWaitSet, hSemaphore);
+	CloseHandle(hSemaphore);
+
+	/* manual-reset events stay signaled */
+	if (!(hManual = CreateEventA(NULL, TRUE, TRUE, NULL)) || !WaitSetAdd(hWaitSet, hManual))
+		return FALSE;
+
+	if (!TestSynchWaitSet_Expect(hWaitSet, 1, hManual, "manual-reset event") ||
+			!TestSynchWaitSet_Expect(hWaitSet, 1, hManual, "manual-reset event again"))
+		return FALSE;
+
+	/* a handle closed while in the set leaves it, even if its object lives on */
+	if (!DuplicateHandle(NULL, hManual, NULL, &hDuplicate, 0, FALSE, DUPLICATE_SAME_ACCESS))
+		return FALSE;
+
+	CloseHandle(hManual);
+
+	if (!TestSynchWaitSet_Expect(hWaitSet, 0, NULL, "closed handle"))
+		return FALSE;
+
+	CloseHandle(hDuplicate);
+
+	/* removing a closed handle keeps the handle which reused its file descriptor */
+	if (!(hClosed = CreateEventA(NULL, FALSE, FALSE, NULL)) || !WaitSetAdd(hWaitSet, hClosed))
+		return FALSE;
+
+	CloseHandle(hClosed);
+
+	if (!(hManual = CreateEventA(NULL, TRUE, TRUE, NULL)) || !WaitSetAdd(hWaitSet, hManual))
+		return FALSE;
+
+	WaitSetRemove(hWaitSet, hClosed);
+
+	if (!TestSynchWaitSet_Expect(hWaitSet, 1, hManual, "handle reusing a file descriptor"))
+		return FALSE;
+
+	WaitSetRemove(hWaitSet, hManual);
+	CloseHandle(hManual);
+
+	/* blocking wait */
+	if (!(hThread = CreateThread(NULL, 0, TestSynchWaitSet_SetterThread, gEvents[42], 0, NULL)))
+		return FALSE;
+
+	if (!TestSynchWaitSet_Expect(hWaitSet, 1, gEvents[42], "blocking wait"))
+		return FALSE;
+
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(hThread);
+
+	return TRUE;
+}
+
+static BOOL TestSynchWaitSet_Bench(HANDLE hWaitSet)
+{
+	int index;
+	DWORD count;
+	HANDLE signaled;
+	ULONGLONG start;
+	ULONGLONG multipleTime;
+	ULONGLONG waitSetTime;
+	HANDLE hLast = gEvents[TEST_WAIT_SET_EVENTS - 1];
+
+	start = GetTickCount64();
+
+	for (index = 0; index < TEST_WAIT_SET_ITERATIONS; index++)
+	{
+		SetEvent(hLast);
+
+		if (WaitForMultipleObjects(TEST_WAIT_SET_EVENTS, gEvents, FALSE, INFINITE) !=
+				WAIT_OBJECT_0 + TEST_WAIT_SET_EVENTS - 1)
+		{
+			printf("WaitSet failure: WaitForMultipleObjects failed\n");
+			return FALSE;
+		}
+	}
+
+	multipleTime = GetTickCount64() - start;
+	start = GetTickCount64();
+
+	for (index = 0; index < TEST_WAIT_SET_ITERATIONS; index++)
+	{
+		SetEvent(hLast);
+
+		if ((WaitSetWait(hWaitSet, &signaled, 1, &count, INFINITE) != WAIT_OBJECT_0) || (signaled != hLast))
+		{
+			printf("WaitSet failure: WaitSetWait failed\n");
+			return FALSE;
+		}
+	}
+
+	waitSetTime = GetTickCount64() - start;
+
+	printf("WaitSet benchmark: %d waits on %d handles: WaitForMultipleObjects %"PRIu64" ms, wait set %"PRIu64" ms\n",
+		TEST_WAIT_SET_ITERATIONS, TEST_WAIT_SET_EVENTS, multipleTime, waitSetTime);
+
+	return TRUE;
+}
+
+static BOOL TestSynchWaitSet_ExpectMany(DWORD nCount, const HANDLE* lpHandles, DWORD step, DWORD first, const char* what)
+{
+	DWORD index;
+	DWORD status;
+	DWORD count = 0;
+	DWORD expected = 0;
+	BYTE* reported;
+
+	status = WaitForManyObjects(nCount, lpHandles, gIndices, &count, step ? 1000 : 0);
+
+	if (!step)
+	{
+		if (status != WAIT_TIMEOUT)
+		{
+			printf("WaitMany failure: %s: %"PRIu32" handles reported instead of a timeout\n", what, count);
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	for (index = first; index < nCount; index += step)
+		expected++;
+
+	if ((status != WAIT_OBJECT_0) || (count != expected))
+	{
+		printf("WaitMany failure: %s: status 0x%08"PRIX32", %"PRIu32" handles instead of %"PRIu32"\n",
+			what, status, count, expected);
+		return FALSE;
+	}
+
+	if (!(reported = (BYTE*) calloc(nCount, 1)))
+		return FALSE;
+
+	for (index = 0; index < count; index++)
+	{
+		if ((gIndices[index] >= nCount) || (gIndices[index] < first) ||
+				((gIndices[index] - first) % step) || reported[gIndices[index]])
+		{
+			printf("WaitMany failure: %s: unexpected index %"PRIu32"\n", what, gIndices[index]);
+			free(reported);
+			return FALSE;
+		}
+
+		reported[gIndices[index]] = TRUE;
+	}
+
+	free(reported);
+	return TRUE;
+}
+
+static BOOL TestSynchWaitSet_Many(void)
+{
+	DWORD index;
+	DWORD count;
+	HANDLE hDuplicates[2];
+	HANDLE hChanged[2];
+	HANDLE hReplaced;
+	HANDLE* hManual;
+	ULONGLONG start;
+
+	for (index = 0; index < TEST_WAIT_MANY_EVENTS; index++)
+	{
+		if (!(gManyEvents[index] = CreateEventA(NULL, FALSE, FALSE, NULL)))
+		{
+			printf("WaitMany failure: CreateEvent failed\n");
+			return FALSE;
+		}
+	}
+
+	if (!TestSynchWaitSet_ExpectMany(TEST_WAIT_MANY_EVENTS, gManyEvents, 0, 0, "no event set"))
+		return FALSE;
+
+	/* more signaled handles than a single batch */
+	for (index = 5; index < TEST_WAIT_MANY_EVENTS; index += 7)
+		SetEvent(gManyEvents[index]);
+
+	if (!TestSynchWaitSet_ExpectMany(TEST_WAIT_MANY_EVENTS, gManyEvents, 7, 5, "events set") ||
+			!TestSynchWaitSet_ExpectMany(TEST_WAIT_MANY_EVENTS, gManyEvents, 0, 0, "consumed events"))
+		return FALSE;
+
+	/* the array shrinks and its handles move to other indices */
+	SetEvent(gManyEvents[301]);
+
+	if (!TestSynchWaitSet_ExpectMany(TEST_WAIT_MANY_EVENTS - 1, &gManyEvents[1], TEST_WAIT_MANY_EVENTS, 300,
+			"shifted array"))
+		return FALSE;
+
+	SetEvent(gManyEvents[0]);
+
+	if (!TestSynchWaitSet_ExpectMany(TEST_WAIT_MANY_EVENTS - 1, &gManyEvents[1], 0, 0, "handle left the array"))
+		return FALSE;
+
+	if (!TestSynchWaitSet_ExpectMany(TEST_WAIT_MANY_EVENTS, gManyEvents, TEST_WAIT_MANY_EVENTS, 0, "handle back"))
+		return FALSE;
+
+	/* signaled handles which stay signaled are reported once */
+	if (!(hManual = (HANDLE*) calloc(200, sizeof(HANDLE))))
+		return FALSE;
+
+	for (index = 0; index < 200; index++)
+	{
+		if (!(hManual[index] = CreateEventA(NULL, TRUE, TRUE, NULL)))
+			return FALSE;
+	}
+
+	if (!TestSynchWaitSet_ExpectMany(200, hManual, 1, 0, "manual-reset events"))
+		return FALSE;
+
+	for (index = 0; index < 200; index++)
+		CloseHandle(hManual[index]);
+
+	free(hManual);
+
+	hDuplicates[0] = gManyEvents[0];
+	hDuplicates[1] = gManyEvents[0];
+	SetLastError(0);
+
+	if ((WaitForManyObjects(2, hDuplicates, gIndices, &count, 0) != WAIT_FAILED) ||
+			(GetLastError() != ERROR_INVALID_PARAMETER))
+	{
+		printf("WaitMany failure: a handle was accepted twice\n");
+		return FALSE;
+	}
+
+	/* a handle added in place of another one may reuse the file descriptor of a closed handle */
+	if (!(hChanged[0] = CreateEventA(NULL, FALSE, FALSE, NULL)) ||
+			!(hChanged[1] = CreateEventA(NULL, FALSE, FALSE, NULL)))
+		return FALSE;
+
+	if (!TestSynchWaitSet_ExpectMany(2, hChanged, 0, 0, "handles to change"))
+		return FALSE;
+
+	CloseHandle(hChanged[1]);
+	hReplaced = hChanged[0];
+
+	if (!(hChanged[0] = CreateEventA(NULL, TRUE, TRUE, NULL)) ||
+			!(hChanged[1] = CreateEventA(NULL, FALSE, FALSE, NULL)))
+		return FALSE;
+
+	if ((WaitForManyObjects(2, hChanged, gIndices, &count, 100) != WAIT_OBJECT_0) ||
+			(count != 1) || (gIndices[0] != 0))
+	{
+		printf("WaitMany failure: handle reusing a file descriptor not reported\n");
+		return FALSE;
+	}
+
+	CloseHandle(hReplaced);
+	CloseHandle(hChanged[0]);
+	CloseHandle(hChanged[1]);
+
+	start = GetTickCount64();
+
+	for (index = 0; index < TEST_WAIT_MANY_ITERATIONS; index++)
+	{
+		SetEvent(gManyEvents[(index * 13) % TEST_WAIT_MANY_EVENTS]);
+
+		if ((WaitForManyObjects(TEST_WAIT_MANY_EVENTS, gManyEvents, gIndices, &count, INFINITE) != WAIT_OBJECT_0) ||
+				(count != 1) || (gIndices[0] != (index * 13) % TEST_WAIT_MANY_EVENTS))
+		{
+			printf("WaitMany failure: WaitForManyObjects failed\n");
+			return FALSE;
+		}
+	}
+
+	printf("WaitMany benchmark: %d waits on %d handles: %"PRIu64" ms\n",
+		TEST_WAIT_MANY_ITERATIONS, TEST_WAIT_MANY_EVENTS, GetTickCount64() - start);
+
+	for (index = 0; index < TEST_WAIT_MANY_EVENTS; index++)
+		CloseHandle(gManyEvents[index]);
+
+	return TRUE;
+}
+
+int TestSynchWaitSet(int argc, char* argv[])
+{
+	int index;
+	HANDLE hWaitSet;
+
+	if (!(hWaitSet = CreateWaitSet()))
+	{
+		printf("WaitSet failure: CreateWaitSet failed\n");
+		return -1;
+	}
+
+	for (index = 0; index < TEST_WAIT_SET_EVENTS; index++)
+	{
+		if (!(gEvents[index] = CreateEventA(NULL, FALSE, FALSE, NULL)) || !WaitSetAdd(hWaitSet, gEvents[index]))
+		{
+			printf("WaitSet failure: failed to add event %d\n", index);
+			return -1;
+		}
+	}
+
+	if (!TestSynchWaitSet_Semantics(hWaitSet))
+		return -1;
+
+	if (!TestSynchWaitSet_Bench(hWaitSet))
+		return -1;
+
+	for (index = 0; index < TEST_WAIT_SET_EVENTS; index++)
+		CloseHandle(gEvents[index]);
+
+	if (!CloseHandle(hWaitSet))
+	{
+		printf("WaitSet failure: CloseHandle failed\n");
+		return -1;
+	}
+
+	if (!TestSynchWaitSet_Many())
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,173 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/sysinfo.h>
+#include <uzi/thread.h>
+#include <uzi/uzi.h>
+
+/**
+ * Checks spin-then-block waits and their counters, then prints how long a
+ * ping-pong between two threads takes with blocking waits and with spinning
+ * waits. Only correctness makes the test fail.
+ */
+
+#define TEST_WAIT_SPIN_COUNT		4000
+#define TEST_WAIT_SPIN_ROUND_TRIPS	20000
+
+static HANDLE gPing = NULL;
+static HANDLE gPong = NULL;
+
+static DWORD WINAPI TestWaitSpin_PongThread(LPVOID arg)
+{
+	int index;
+
+	for (index = 0; index < TEST_WAIT_SPIN_ROUND_TRIPS; index++)
+	{
+		if (WaitForSingleObject(gPing, INFINITE) != WAIT_OBJECT_0)
+			return 1;
+
+		SetEvent(gPong);
+	}
+
+	return 0;
+}
+
+static BOOL TestWaitSpin_Semantics(void)
+{
+	HANDLE hEvent;
+	UZI_SPIN_STATS before;
+	UZI_SPIN_STATS after;
+	SYSTEM_INFO sysinfo;
+
+	if (SetHandleSpinCount(NULL, TEST_WAIT_SPIN_COUNT))
+	{
+		printf("WaitSpin failure: set the spin count of an invalid handle\n");
+		return FALSE;
+	}
+
+	if (!(hEvent = CreateEventA(NULL, FALSE, TRUE, NULL)))
+	{
+		printf("WaitSpin failure: CreateEvent failed\n");
+		return FALSE;
+	}
+
+	if (!SetHandleSpinCount(hEvent, TEST_WAIT_SPIN_COUNT))
+	{
+		printf("WaitSpin failure: SetHandleSpinCount failed\n");
+		return FALSE;
+	}
+
+	UziGetSpinStats(UZI_HANDLE_TYPE_ALL, &before);
+
+	/* signaled objects are acquired without spinning */
+	if (WaitForSingleObject(hEvent, INFINITE) != WAIT_OBJECT_0)
+	{
+		printf("WaitSpin failure: signaled event not acquired\n");
+		return FALSE;
+	}
+
+	/* nor do waits which cannot block */
+	if (WaitForSingleObject(hEvent, 0) != WAIT_TIMEOUT)
+	{
+		printf("WaitSpin failure: auto-reset event not reset\n");
+		return FALSE;
+	}
+
+	if (WaitForSingleObjectSpin(hEvent, TEST_WAIT_SPIN_COUNT, 10) != WAIT_TIMEOUT)
+	{
+		printf("WaitSpin failure: unsignaled event acquired\n");
+		return FALSE;
+	}
+
+	UziGetSpinStats(UZI_HANDLE_TYPE_EVENT, &after);
+	GetNativeSystemInfo(&sysinfo);
+
+	/* no spinning on a single processor */
+	if ((after.hits != before.hits) ||
+			(after.misses != before.misses + ((sysinfo.dwNumberOfProcessors > 1) ? 1 : 0)))
+	{
+		printf("WaitSpin failure: %"PRIu64" hits and %"PRIu64" misses, expected %"PRIu64" and %"PRIu64"\n",
+			after.hits, after.misses, before.hits, before.misses + 1);
+		return FALSE;
+	}
+
+	CloseHandle(hEvent);
+	return TRUE;
+}
+
+static BOOL TestWaitSpin_Bench(DWORD dwSpinCount)
+{
+	int index;
+	DWORD exitCode;
+	ULONGLONG start;
+	HANDLE hThread;
+	UZI_SPIN_STATS before;
+	UZI_SPIN_STATS after;
+
+	gPing = CreateEventA(NULL, FALSE, FALSE, NULL);
+	gPong = CreateEventA(NULL, FALSE, FALSE, NULL);
+
+	if (!gPing || !gPong)
+	{
+		printf("WaitSpin failure: CreateEvent failed\n");
+		return FALSE;
+	}
+
+	SetHandleSpinCount(gPing, dwSpinCount);
+	SetHandleSpinCount(gPong, dwSpinCount);
+
+	UziGetSpinStats(UZI_HANDLE_TYPE_EVENT, &before);
+	start = GetMonotonicTimeNs();
+
+	if (!(hThread = CreateThread(NULL, 0, TestWaitSpin_PongThread, NULL, 0, NULL)))
+	{
+		printf("WaitSpin failure: CreateThread failed\n");
+		return FALSE;
+	}
+
+	for (index = 0; index < TEST_WAIT_SPIN_ROUND_TRIPS; index++)
+	{
+		SetEvent(gPing);
+
+		if (WaitForSingleObject(gPong, INFINITE) != WAIT_OBJECT_0)
+		{
+			printf("WaitSpin failure: round trip %d failed\n", index);
+			return FALSE;
+		}
+	}
+
+	WaitForSingleObject(hThread, INFINITE);
+	GetExitCodeThread(hThread, &exitCode);
+	CloseHandle(hThread);
+
+	if (exitCode != 0)
+	{
+		printf("WaitSpin failure: ping wait failed\n");
+		return FALSE;
+	}
+
+	UziGetSpinStats(UZI_HANDLE_TYPE_EVENT, &after);
+
+	printf("WaitSpin benchmark: spin count %"PRIu32": %"PRIu64" ns per round trip, %"PRIu64" hits, %"PRIu64" misses\n",
+		dwSpinCount, (GetMonotonicTimeNs() - start) / TEST_WAIT_SPIN_ROUND_TRIPS,
+		after.hits - before.hits, after.misses - before.misses);
+
+	CloseHandle(gPing);
+	CloseHandle(gPong);
+	return TRUE;
+}
+
+int TestSynchWaitSpin(int argc, char* argv[])
+{
+	if (!TestWaitSpin_Semantics())
+		return -1;
+
+	if (!TestWaitSpin_Bench(0))
+		return -1;
+
+	if (!TestWaitSpin_Bench(TEST_WAIT_SPIN_COUNT))
+		return -1;
+
+	return 0;
+}
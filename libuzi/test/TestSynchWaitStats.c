@@ -0,0 +1,217 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/thread.h>
+#include <uzi/uzi.h>
+
+/**
+ * Checks the wait counters of the calling thread: immediate, blocked and
+ * timed out waits on single and multiple handles, their accounting per
+ * handle type, the latency histogram, and that waits of other threads or
+ * waits made while profiling is disabled are not counted.
+ */
+
+static HANDLE gEvents[2];
+
+static DWORD WINAPI TestWaitStats_SetEventsThread(LPVOID arg)
+{
+	/* not counted in the stats of the main thread */
+	WaitForSingleObject(gEvents[1], 0);
+
+	Sleep(10);
+	SetEvent(gEvents[0]);
+	Sleep(10);
+	SetEvent(gEvents[1]);
+	return 0;
+}
+
+static BOOL TestWaitStats_Expect(uint32_t handleType, uint64_t waits, uint64_t immediate,
+		uint64_t blocked, uint64_t timeouts, const char* what)
+{
+	int bucket;
+	uint64_t histogram = 0;
+	UZI_WAIT_STATS stats;
+
+	if (!UziGetWaitStats(handleType, &stats))
+	{
+		printf("WaitStats failure: %s: UziGetWaitStats failed\n", what);
+		return FALSE;
+	}
+
+	for (bucket = 0; bucket < UZI_WAIT_STATS_BUCKETS; bucket++)
+		histogram += stats.latencyHistogram[bucket];
+
+	if ((stats.waits != waits) || (stats.immediate != immediate) ||
+			(stats.blocked != blocked) || (stats.timeouts != timeouts) || (histogram != blocked))
+	{
+		printf("WaitStats failure: %s: %"PRIu64" waits, %"PRIu64" immediate, %"PRIu64" blocked, "
+			"%"PRIu64" timeouts, %"PRIu64" in the histogram\n", what, stats.waits,
+			stats.immediate, stats.blocked, stats.timeouts, histogram);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL TestWaitStats_Single(HANDLE hEvent)
+{
+	UZI_WAIT_STATS stats;
+
+	SetEvent(hEvent);
+
+	if (WaitForSingleObject(hEvent, INFINITE) != WAIT_OBJECT_0)
+	{
+		printf("WaitStats failure: signaled event not acquired\n");
+		return FALSE;
+	}
+
+	if (WaitForSingleObject(hEvent, 0) != WAIT_TIMEOUT)
+	{
+		printf("WaitStats failure: auto-reset event not reset\n");
+		return FALSE;
+	}
+
+	if (!TestWaitStats_Expect(UZI_HANDLE_TYPE_EVENT, 2, 2, 0, 1, "immediate waits"))
+		return FALSE;
+
+	if (WaitForSingleObject(hEvent, 10) != WAIT_TIMEOUT)
+	{
+		printf("WaitStats failure: unsignaled event acquired\n");
+		return FALSE;
+	}
+
+	if (!TestWaitStats_Expect(UZI_HANDLE_TYPE_EVENT, 3, 2, 1, 2, "blocked wait"))
+		return FALSE;
+
+	UziGetWaitStats(UZI_HANDLE_TYPE_EVENT, &stats);
+
+	/* 10 ms or more fall in bucket 14 (8192 to 16383 us) or above */
+	if ((stats.blockedTotal < 10000000) || !(stats.latencyHistogram[14] + stats.latencyHistogram[15]))
+	{
+		printf("WaitStats failure: blocked for %"PRIu64" ns\n", stats.blockedTotal);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL TestWaitStats_Multiple(HANDLE hEvent, HANDLE hSemaphore)
+{
+	DWORD status;
+	HANDLE hThread;
+	HANDLE handles[2];
+
+	handles[0] = hEvent;
+	handles[1] = hSemaphore;
+
+	/* accounted to the signaled handle */
+	if ((status = WaitForMultipleObjects(2, handles, FALSE, INFINITE)) != WAIT_OBJECT_0 + 1)
+	{
+		printf("WaitStats failure: waiting for any handle returned 0x%08"PRIX32"\n", status);
+		return FALSE;
+	}
+
+	if (!TestWaitStats_Expect(UZI_HANDLE_TYPE_SEMAPHORE, 1, 1, 0, 0, "multiple immediate wait"))
+		return FALSE;
+
+	/* and to the first one on timeouts */
+	if ((status = WaitForMultipleObjects(2, handles, FALSE, 0)) != WAIT_TIMEOUT)
+	{
+		printf("WaitStats failure: waiting for any handle returned 0x%08"PRIX32"\n", status);
+		return FALSE;
+	}
+
+	if (!TestWaitStats_Expect(UZI_HANDLE_TYPE_EVENT, 1, 1, 0, 1, "multiple timeout"))
+		return FALSE;
+
+	gEvents[0] = hEvent;
+	gEvents[1] = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+	if (!gEvents[1])
+	{
+		printf("WaitStats failure: CreateEvent failed\n");
+		return FALSE;
+	}
+
+	if (!(hThread = CreateThread(NULL, 0, TestWaitStats_SetEventsThread, NULL, 0, NULL)))
+	{
+		printf("WaitStats failure: CreateThread failed\n");
+		return FALSE;
+	}
+
+	/* one wait, however many times the loop polls */
+	if ((status = WaitForMultipleObjects(2, gEvents, TRUE, INFINITE)) != WAIT_OBJECT_0)
+	{
+		printf("WaitStats failure: waiting for all events returned 0x%08"PRIX32"\n", status);
+		return FALSE;
+	}
+
+	if (!TestWaitStats_Expect(UZI_HANDLE_TYPE_EVENT, 2, 1, 1, 1, "multiple blocked wait"))
+		return FALSE;
+
+	UziSetWaitProfiling(false);
+	WaitForSingleObject(hThread, INFINITE);
+	UziSetWaitProfiling(true);
+
+	CloseHandle(hThread);
+	CloseHandle(gEvents[1]);
+
+	return TestWaitStats_Expect(UZI_HANDLE_TYPE_ALL, 3, 2, 1, 1, "totals");
+}
+
+int TestSynchWaitStats(int argc, char* argv[])
+{
+	HANDLE hEvent;
+	HANDLE hSemaphore;
+	UZI_WAIT_STATS stats;
+
+	if (UziGetWaitStats(UZI_HANDLE_TYPE_ALL, NULL) || UziGetWaitStats(0xFFFF, &stats))
+	{
+		printf("WaitStats failure: UziGetWaitStats accepted invalid parameters\n");
+		return -1;
+	}
+
+	hEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+	hSemaphore = CreateSemaphoreA(NULL, 1, 1, NULL);
+
+	if (!hEvent || !hSemaphore)
+	{
+		printf("WaitStats failure: failed to create handles\n");
+		return -1;
+	}
+
+	/* disabled by default */
+	WaitForSingleObject(hEvent, 0);
+
+	if (!TestWaitStats_Expect(UZI_HANDLE_TYPE_ALL, 0, 0, 0, 0, "profiling disabled"))
+		return -1;
+
+	if (UziSetWaitProfiling(true))
+	{
+		printf("WaitStats failure: profiling enabled by default\n");
+		return -1;
+	}
+
+	if (!TestWaitStats_Single(hEvent))
+		return -1;
+
+	UziResetWaitStats();
+
+	if (!TestWaitStats_Expect(UZI_HANDLE_TYPE_ALL, 0, 0, 0, 0, "reset"))
+		return -1;
+
+	if (!TestWaitStats_Multiple(hEvent, hSemaphore))
+		return -1;
+
+	UziGetWaitStats(UZI_HANDLE_TYPE_ALL, &stats);
+	UziSetWaitProfiling(false);
+
+	printf("WaitStats: %"PRIu64" blocked waits for %"PRIu64" us, %"PRIu64" spurious wakeups\n",
+		stats.blocked, stats.blockedTotal / 1000, stats.spurious);
+
+	CloseHandle(hEvent);
+	CloseHandle(hSemaphore);
+
+	return 0;
+}
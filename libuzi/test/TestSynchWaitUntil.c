@@ -0,0 +1,227 @@
+
+#include <stdio.h>
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/sysinfo.h>
+#include <uzi/thread.h>
+#include <uzi/handle.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/**
+ * Checks waits on absolute deadlines: deadlines in the past, sub-millisecond
+ * deadlines on objects waited on with a futex and on file descriptors, and
+ * that waiting for all objects keeps the whole timeout when they become
+ * signaled at different times.
+ */
+
+#define TEST_WAIT_UNTIL_SHORT_NS	300000ULL
+#define TEST_WAIT_UNTIL_SLACK_NS	50000000ULL
+
+static HANDLE gEvents[2];
+
+static DWORD WINAPI TestWaitUntil_SetEventsThread(LPVOID arg)
+{
+	Sleep(10);
+	SetEvent(gEvents[0]);
+	Sleep(100);
+	SetEvent(gEvents[1]);
+	return 0;
+}
+
+static BOOL TestWaitUntil_Expired(void)
+{
+	HANDLE hEvent;
+	ULONGLONG now;
+
+	if (!(hEvent = CreateEventA(NULL, TRUE, FALSE, NULL)))
+	{
+		printf("WaitUntil failure: CreateEvent failed\n");
+		return FALSE;
+	}
+
+	now = GetMonotonicTimeNs();
+
+	if (WaitForSingleObjectUntil(hEvent, now - 1000000) != WAIT_TIMEOUT)
+	{
+		printf("WaitUntil failure: unsignaled event with a past deadline\n");
+		return FALSE;
+	}
+
+	if (WaitForMultipleObjectsUntil(1, &hEvent, FALSE, 0) != WAIT_TIMEOUT)
+	{
+		printf("WaitUntil failure: unsignaled event with a zero deadline\n");
+		return FALSE;
+	}
+
+	SetEvent(hEvent);
+
+	if (WaitForSingleObjectUntil(hEvent, now - 1000000) != WAIT_OBJECT_0)
+	{
+		printf("WaitUntil failure: signaled event with a past deadline\n");
+		return FALSE;
+	}
+
+	if (WaitForMultipleObjectsUntil(1, &hEvent, TRUE, WAIT_DEADLINE_INFINITE) != WAIT_OBJECT_0)
+	{
+		printf("WaitUntil failure: signaled event with an infinite deadline\n");
+		return FALSE;
+	}
+
+	CloseHandle(hEvent);
+	return TRUE;
+}
+
+static BOOL TestWaitUntil_Precision(const char* name, HANDLE hHandle, BOOL bMultiple)
+{
+	DWORD status;
+	ULONGLONG start;
+	ULONGLONG deadline;
+	ULONGLONG elapsed;
+
+	start = GetMonotonicTimeNs();
+	deadline = start + TEST_WAIT_UNTIL_SHORT_NS;
+
+	if (bMultiple)
+		status = WaitForMultipleObjectsUntil(1, &hHandle, FALSE, deadline);
+	else
+		status = WaitForSingleObjectUntil(hHandle, deadline);
+
+	elapsed = GetMonotonicTimeNs() - start;
+
+	if (status != WAIT_TIMEOUT)
+	{
+		printf("WaitUntil failure: %s wait returned 0x%08"PRIX32"\n", name, status);
+		return FALSE;
+	}
+
+	if (elapsed < TEST_WAIT_UNTIL_SHORT_NS)
+	{
+		printf("WaitUntil failure: %s wait returned before its deadline\n", name);
+		return FALSE;
+	}
+
+	/* loose bound, precision depends on the scheduler */
+	if (elapsed > TEST_WAIT_UNTIL_SHORT_NS + TEST_WAIT_UNTIL_SLACK_NS)
+	{
+		printf("WaitUntil failure: %s wait took %"PRIu64" us\n", name, elapsed / 1000);
+		return FALSE;
+	}
+
+	printf("WaitUntil: %s wait on a %"PRIu64" us deadline took %"PRIu64" us\n",
+		name, TEST_WAIT_UNTIL_SHORT_NS / 1000, elapsed / 1000);
+
+	return TRUE;
+}
+
+static BOOL TestWaitUntil_Deadlines(void)
+{
+	HANDLE hEvent;
+	HANDLE hFdEvent;
+	int fds[2];
+
+	if (!(hEvent = CreateEventA(NULL, FALSE, FALSE, NULL)))
+	{
+		printf("WaitUntil failure: CreateEvent failed\n");
+		return FALSE;
+	}
+
+	if (!TestWaitUntil_Precision("event", hEvent, FALSE))
+		return FALSE;
+
+	if (!TestWaitUntil_Precision("multiple event", hEvent, TRUE))
+		return FALSE;
+
+	CloseHandle(hEvent);
+
+#ifndef _WIN32
+	if (pipe(fds) < 0)
+	{
+		printf("WaitUntil failure: pipe failed\n");
+		return FALSE;
+	}
+
+	if (!(hFdEvent = CreateFileDescriptorEventA(NULL, FALSE, FALSE, fds[0], UZI_FD_READ)))
+	{
+		printf("WaitUntil failure: CreateFileDescriptorEvent failed\n");
+		return FALSE;
+	}
+
+	if (!TestWaitUntil_Precision("file descriptor", hFdEvent, FALSE))
+		return FALSE;
+
+	if (!TestWaitUntil_Precision("multiple file descriptor", hFdEvent, TRUE))
+		return FALSE;
+
+	if (write(fds[1], "x", 1) != 1)
+	{
+		printf("WaitUntil failure: write failed\n");
+		return FALSE;
+	}
+
+	if (WaitForSingleObjectUntil(hFdEvent, GetMonotonicTimeNs() + TEST_WAIT_UNTIL_SHORT_NS) != WAIT_OBJECT_0)
+	{
+		printf("WaitUntil failure: readable file descriptor not signaled\n");
+		return FALSE;
+	}
+
+	CloseHandle(hFdEvent);
+	close(fds[0]);
+	close(fds[1]);
+#endif
+
+	return TRUE;
+}
+
+static BOOL TestWaitUntil_WaitAll(void)
+{
+	DWORD status;
+	HANDLE hThread;
+
+	gEvents[0] = CreateEventA(NULL, TRUE, FALSE, NULL);
+	gEvents[1] = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+	if (!gEvents[0] || !gEvents[1])
+	{
+		printf("WaitUntil failure: CreateEvent failed\n");
+		return FALSE;
+	}
+
+	if (!(hThread = CreateThread(NULL, 0, TestWaitUntil_SetEventsThread, NULL, 0, NULL)))
+	{
+		printf("WaitUntil failure: CreateThread failed\n");
+		return FALSE;
+	}
+
+	/* the remaining time used to shrink faster than the time spent */
+	status = WaitForMultipleObjects(2, gEvents, TRUE, 500);
+
+	if (status != WAIT_OBJECT_0)
+	{
+		printf("WaitUntil failure: waiting for all events returned 0x%08"PRIX32"\n", status);
+		return FALSE;
+	}
+
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(hThread);
+	CloseHandle(gEvents[0]);
+	CloseHandle(gEvents[1]);
+
+	return TRUE;
+}
+
+int TestSynchWaitUntil(int argc, char* argv[])
+{
+	if (!TestWaitUntil_Expired())
+		return -1;
+
+	if (!TestWaitUntil_Deadlines())
+		return -1;
+
+	if (!TestWaitUntil_WaitAll())
+		return -1;
+
+	return 0;
+}
@@ -13,20 +13,34 @@
 int TestAlignment(int, char*[]);
 int TestCpuFeatures(int, char*[]);
 int TestDictionary(int, char*[]);
+int TestHandle(int, char*[]);
+int TestHandlePool(int, char*[]);
 int TestInterlockedAccess(int, char*[]);
 int TestInterlockedSList(int, char*[]);
 int TestInterlockedDList(int, char*[]);
+int TestLockProfiling(int, char*[]);
+int TestQueueLock(int, char*[]);
+int TestStripedLock(int, char*[]);
 int TestSynchInit(int, char*[]);
 int TestSynchEvent(int, char*[]);
 int TestSynchMutex(int, char*[]);
 int TestSynchBarrier(int, char*[]);
+int TestSynchConditionVariable(int, char*[]);
 int TestSynchCritical(int, char*[]);
+int TestSynchCriticalBench(int, char*[]);
 int TestSynchSemaphore(int, char*[]);
+int TestSynchSRWLock(int, char*[]);
 int TestSynchThread(int, char*[]);
 int TestSynchMultipleThreads(int, char*[]);
 int TestSynchTimerQueue(int, char*[]);
 int TestSynchWaitableTimer(int, char*[]);
 int TestSynchWaitableTimerAPC(int, char*[]);
+int TestSynchWaitSet(int, char*[]);
+int TestSynchWaitUntil(int, char*[]);
+int TestSynchWaitReady(int, char*[]);
+int TestSynchWaitSpin(int, char*[]);
+int TestSynchAlertable(int, char*[]);
+int TestSynchWaitStats(int, char*[]);
 
 
 #ifdef __cplusplus
@@ -57,6 +71,14 @@ static functionMapEntry cmakeGeneratedFunctionMapEntries[] = {
     "TestDictionary",
     TestDictionary
   },
+  {
+    "TestHandle",
+    TestHandle
+  },
+  {
+    "TestHandlePool",
+    TestHandlePool
+  },
   {
     "TestInterlockedAccess",
     TestInterlockedAccess
@@ -69,6 +91,18 @@ static functionMapEntry cmakeGeneratedFunctionMapEntries[] = {
     "TestInterlockedDList",
     TestInterlockedDList
   },
+  {
+    "TestLockProfiling",
+    TestLockProfiling
+  },
+  {
+    "TestQueueLock",
+    TestQueueLock
+  },
+  {
+    "TestStripedLock",
+    TestStripedLock
+  },
   {
     "TestSynchInit",
     TestSynchInit
@@ -85,14 +119,26 @@ static functionMapEntry cmakeGeneratedFunctionMapEntries[] = {
     "TestSynchBarrier",
     TestSynchBarrier
   },
+  {
+    "TestSynchConditionVariable",
+    TestSynchConditionVariable
+  },
   {
     "TestSynchCritical",
     TestSynchCritical
   },
+  {
+    "TestSynchCriticalBench",
+    TestSynchCriticalBench
+  },
   {
     "TestSynchSemaphore",
     TestSynchSemaphore
   },
+  {
+    "TestSynchSRWLock",
+    TestSynchSRWLock
+  },
   {
     "TestSynchThread",
     TestSynchThread
@@ -113,6 +159,30 @@ static functionMapEntry cmakeGeneratedFunctionMapEntries[] = {
     "TestSynchWaitableTimerAPC",
     TestSynchWaitableTimerAPC
   },
+  {
+    "TestSynchWaitSet",
+    TestSynchWaitSet
+  },
+  {
+    "TestSynchWaitUntil",
+    TestSynchWaitUntil
+  },
+  {
+    "TestSynchWaitReady",
+    TestSynchWaitReady
+  },
+  {
+    "TestSynchWaitSpin",
+    TestSynchWaitSpin
+  },
+  {
+    "TestSynchAlertable",
+    TestSynchAlertable
+  },
+  {
+    "TestSynchWaitStats",
+    TestSynchWaitStats
+  },
 
   { NULL, NULL } /* NOLINT */
 };
@@ -27,6 +27,7 @@
 #include <uzi/handle.h>
 
 #include <uzi/thread.h>
+#include <uzi/interlocked.h>
 
 #ifndef _WIN32
 
@@ -54,6 +55,9 @@
 
 static wListDictionary* thread_list = NULL;
 
+/* thread object of the calling thread, NULL if not created by CreateThread */
+static __thread WINPR_THREAD* t_CurrentThread = NULL;
+
 static BOOL ThreadCloseHandle(HANDLE handle);
 static void cleanup_handle(void* obj);
 
@@ -140,7 +144,7 @@ static BOOL set_event(WINPR_THREAD* thread)
 	status = (length == 0) ? TRUE : FALSE;
 #else
 
-	if (WaitForSingleObject(thread, 0) != WAIT_OBJECT_0)
+	if (winpr_Handle_Wait((WINPR_HANDLE*) thread, 0) != WAIT_OBJECT_0)
 	{
 		length = write(thread->pipe_fd[1], "-", 1);
 
@@ -226,11 +230,14 @@ static void* thread_launcher(void* arg)
 		goto exit;
 
 	assert(ListDictionary_Contains(thread_list, &thread->thread));
+	t_CurrentThread = thread;
 	rc = fkt(thread->lpParameter);
 exit:
 
 	if (thread)
 	{
+		t_CurrentThread = NULL;
+
 		if (!thread->exited)
 			thread->dwExitCode = (DWORD)(size_t)rc;
 
@@ -302,6 +309,8 @@ HANDLE CreateThread(LPSECURITY_ATTRIBUTES lpThreadAttributes,
 	thread->ops = &ops;
 	thread->pipe_fd[0] = -1;
 	thread->pipe_fd[1] = -1;
+	thread->apc_fd[0] = -1;
+	thread->apc_fd[1] = -1;
 #ifdef HAVE_EVENTFD_H
 	thread->pipe_fd[0] = eventfd(0, EFD_NONBLOCK);
 
@@ -310,6 +319,7 @@ HANDLE CreateThread(LPSECURITY_ATTRIBUTES lpThreadAttributes,
 		goto error_pipefd0;
 	}
 
+	winpr_Handle_TrackFds(HANDLE_TYPE_THREAD, 1);
 #else
 
 	if (pipe(thread->pipe_fd) < 0)
@@ -317,6 +327,8 @@ HANDLE CreateThread(LPSECURITY_ATTRIBUTES lpThreadAttributes,
 		goto error_pipefd0;
 	}
 
+	winpr_Handle_TrackFds(HANDLE_TYPE_THREAD, 2);
+
 	{
 		int flags = fcntl(thread->pipe_fd[0], F_GETFL);
 		fcntl(thread->pipe_fd[0], F_SETFL, flags | O_NONBLOCK);
@@ -340,7 +352,12 @@ HANDLE CreateThread(LPSECURITY_ATTRIBUTES lpThreadAttributes,
 	}
 
 	WINPR_HANDLE_SET_TYPE_AND_MODE(thread, HANDLE_TYPE_THREAD, UZI_FD_READ);
-	handle = (HANDLE) thread;
+	handle = winpr_Handle_Register((WINPR_HANDLE*) thread);
+
+	if (!handle)
+		goto error_register;
+
+	thread->handle = handle;
 
 	if (!thread_list)
 	{
@@ -367,6 +384,8 @@ HANDLE CreateThread(LPSECURITY_ATTRIBUTES lpThreadAttributes,
 
 	return handle;
 error_thread_list:
+	winpr_Handle_Unregister(handle);
+error_register:
 	pthread_cond_destroy(&thread->threadIsReady);
 error_thread_ready:
 	pthread_mutex_destroy(&thread->threadIsReadyMutex);
@@ -375,10 +394,16 @@ error_thread_ready_mutex:
 error_mutex:
 
 	if (thread->pipe_fd[1] >= 0)
+	{
 		close(thread->pipe_fd[1]);
+		winpr_Handle_TrackFds(HANDLE_TYPE_THREAD, -1);
+	}
 
 	if (thread->pipe_fd[0] >= 0)
+	{
 		close(thread->pipe_fd[0]);
+		winpr_Handle_TrackFds(HANDLE_TYPE_THREAD, -1);
+	}
 
 error_pipefd0:
 	free(thread);
@@ -388,6 +413,7 @@ error_pipefd0:
 void cleanup_handle(void* obj)
 {
 	int rc;
+	WINPR_APC* apc;
 	WINPR_THREAD* thread = (WINPR_THREAD*) obj;
 	rc = pthread_cond_destroy(&thread->threadIsReady);
 
@@ -396,10 +422,35 @@ void cleanup_handle(void* obj)
 	rc = pthread_mutex_destroy(&thread->mutex);
 
 	if (thread->pipe_fd[0] >= 0)
+	{
 		close(thread->pipe_fd[0]);
+		winpr_Handle_TrackFds(HANDLE_TYPE_THREAD, -1);
+	}
 
 	if (thread->pipe_fd[1] >= 0)
+	{
 		close(thread->pipe_fd[1]);
+		winpr_Handle_TrackFds(HANDLE_TYPE_THREAD, -1);
+	}
+
+	/* APCs which never ran are discarded with the thread */
+	while ((apc = thread->ApcHead))
+	{
+		thread->ApcHead = apc->Next;
+		free(apc);
+	}
+
+	if (thread->apc_fd[1] >= 0)
+	{
+		if (thread->apc_fd[1] != thread->apc_fd[0])
+		{
+			close(thread->apc_fd[1]);
+			winpr_Handle_TrackFds(HANDLE_TYPE_THREAD, -1);
+		}
+
+		close(thread->apc_fd[0]);
+		winpr_Handle_TrackFds(HANDLE_TYPE_THREAD, -1);
+	}
 
 	if (thread_list && ListDictionary_Contains(thread_list, &thread->thread))
 		ListDictionary_Remove(thread_list, &thread->thread);
@@ -423,7 +474,7 @@ BOOL ThreadCloseHandle(HANDLE handle)
 	{
 		ListDictionary_Lock(thread_list);
 
-		if ((thread->started) && (WaitForSingleObject(thread, 0) != WAIT_OBJECT_0))
+		if ((thread->started) && (winpr_Handle_Wait((WINPR_HANDLE*) thread, 0) != WAIT_OBJECT_0))
 		{
 			thread->detached = TRUE;
 			pthread_detach(thread->thread);
@@ -468,6 +519,7 @@ VOID ExitThread(DWORD dwExitCode)
 		thread->dwExitCode = dwExitCode;
 
 		ListDictionary_Unlock(thread_list);
+		t_CurrentThread = NULL;
 		set_event(thread);
 		rc = thread->dwExitCode;
 
@@ -484,7 +536,7 @@ BOOL GetExitCodeThread(HANDLE hThread, LPDWORD lpExitCode)
 	WINPR_HANDLE* Object;
 	WINPR_THREAD* thread;
 
-	if (!winpr_Handle_GetInfo(hThread, &Type, &Object))
+	if (!winpr_Handle_GetInfo(hThread, &Type, &Object) || (Type != HANDLE_TYPE_THREAD))
 		return FALSE;
 
 	thread = (WINPR_THREAD*) Object;
@@ -507,12 +559,26 @@ HANDLE _GetCurrentThread(VOID)
 	}
 	else
 	{
-		hdl = ListDictionary_GetItemValue(thread_list, &tid);
+		WINPR_THREAD* thread = ListDictionary_GetItemValue(thread_list, &tid);
+
+		if (thread)
+			hdl = thread->handle;
 	}
 
 	return hdl;
 }
 
+static LONG volatile g_ThreadLockIdCounter = 0;
+static __thread LONG t_ThreadLockId = 0;
+
+LONG winpr_GetCurrentThreadLockId(void)
+{
+	if (!t_ThreadLockId)
+		t_ThreadLockId = InterlockedIncrement(&g_ThreadLockIdCounter);
+
+	return t_ThreadLockId;
+}
+
 DWORD GetCurrentThreadId(VOID)
 {
 	pthread_t tid;
@@ -528,7 +594,7 @@ DWORD ResumeThread(HANDLE hThread)
 	WINPR_HANDLE* Object;
 	WINPR_THREAD* thread;
 
-	if (!winpr_Handle_GetInfo(hThread, &Type, &Object))
+	if (!winpr_Handle_GetInfo(hThread, &Type, &Object) || (Type != HANDLE_TYPE_THREAD))
 		return (DWORD) - 1;
 
 	thread = (WINPR_THREAD*) Object;
@@ -573,7 +639,7 @@ BOOL TerminateThread(HANDLE hThread, DWORD dwExitCode)
 	WINPR_HANDLE* Object;
 	WINPR_THREAD* thread;
 
-	if (!winpr_Handle_GetInfo(hThread, &Type, &Object))
+	if (!winpr_Handle_GetInfo(hThread, &Type, &Object) || (Type != HANDLE_TYPE_THREAD))
 		return FALSE;
 
 	thread = (WINPR_THREAD*) Object;
@@ -596,5 +662,155 @@ BOOL TerminateThread(HANDLE hThread, DWORD dwExitCode)
 	return TRUE;
 }
 
+DWORD QueueUserAPC(PAPCFUNC pfnAPC, HANDLE hThread, ULONG_PTR dwData)
+{
+	int fd;
+	ULONG Type;
+	WINPR_APC* apc;
+	WINPR_APC* head;
+	WINPR_HANDLE* Object;
+	WINPR_THREAD* thread;
+
+	if (!winpr_Handle_GetInfo(hThread, &Type, &Object) || (Type != HANDLE_TYPE_THREAD))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return 0;
+	}
+
+	if (!pfnAPC)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+
+	if (!(apc = (WINPR_APC*) malloc(sizeof(WINPR_APC))))
+	{
+		SetLastError(ERROR_NO_SYSTEM_RESOURCES);
+		return 0;
+	}
+
+	thread = (WINPR_THREAD*) Object;
+	apc->pfnAPC = pfnAPC;
+	apc->dwData = dwData;
+
+	do
+	{
+		head = thread->ApcHead;
+		apc->Next = head;
+	}
+	while (InterlockedCompareExchangePointer((PVOID volatile*) &thread->ApcHead, apc, head) != head);
+
+	/* the descriptor is already signaled unless the list was empty */
+	if (head || ((fd = thread->apc_fd[1]) < 0))
+		return 1;
+
+#ifdef HAVE_EVENTFD_H
+	while ((eventfd_write(fd, 1) < 0) && (errno == EINTR));
+#else
+	while ((write(fd, "-", 1) < 0) && (errno == EINTR));
+#endif
+	return 1;
+}
+
+int winpr_Apc_GetWaitFd(void)
+{
+	WINPR_THREAD* thread = t_CurrentThread;
+
+	if (!thread)
+		return -1;
+
+	if (thread->apc_fd[0] >= 0)
+		return thread->apc_fd[0];
+
+#ifdef HAVE_EVENTFD_H
+	if ((thread->apc_fd[0] = eventfd(0, EFD_NONBLOCK)) < 0)
+		return -1;
+
+	winpr_Handle_TrackFds(HANDLE_TYPE_THREAD, 1);
+	/* publish the descriptor before the list is checked */
+	InterlockedExchange((LONG volatile*) &thread->apc_fd[1], thread->apc_fd[0]);
+#else
+	{
+		int fds[2];
+
+		if (pipe(fds) < 0)
+			return -1;
+
+		fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+		winpr_Handle_TrackFds(HANDLE_TYPE_THREAD, 2);
+
+		thread->apc_fd[0] = fds[0];
+		/* publish the descriptor before the list is checked */
+		InterlockedExchange((LONG volatile*) &thread->apc_fd[1], fds[1]);
+	}
+#endif
+	return thread->apc_fd[0];
+}
+
+BOOL winpr_Apc_Pending(void)
+{
+	WINPR_THREAD* thread = t_CurrentThread;
+
+	if (!thread)
+		return FALSE;
+
+	if (thread->apc_fd[0] >= 0)
+	{
+#ifdef HAVE_EVENTFD_H
+		eventfd_t value;
+
+		while ((eventfd_read(thread->apc_fd[0], &value) < 0) && (errno == EINTR));
+#else
+		char buffer[32];
+		ssize_t length;
+
+		do
+		{
+			length = read(thread->apc_fd[0], buffer, sizeof(buffer));
+		}
+		while ((length > 0) || ((length < 0) && (errno == EINTR)));
 #endif
+	}
+
+	/* the descriptor is cleared first: APCs queued from now on signal it again */
+	__sync_synchronize();
+
+	return thread->ApcHead ? TRUE : FALSE;
+}
+
+BOOL winpr_Apc_Run(void)
+{
+	BOOL ran = FALSE;
+	WINPR_APC* apc;
+	WINPR_APC* next;
+	WINPR_APC* list;
+	WINPR_THREAD* thread = t_CurrentThread;
 
+	/* APCs queued by APCs run too */
+	while (winpr_Apc_Pending())
+	{
+		apc = (WINPR_APC*) InterlockedExchangePointer((PVOID volatile*) &thread->ApcHead, NULL);
+
+		/* the list is LIFO, reverse it to run the APCs in queuing order */
+		for (list = NULL; apc; apc = next)
+		{
+			next = apc->Next;
+			apc->Next = list;
+			list = apc;
+		}
+
+		for (apc = list; apc; apc = next)
+		{
+			next = apc->Next;
+			apc->pfnAPC(apc->dwData);
+			free(apc);
+		}
+
+		ran = TRUE;
+	}
+
+	return ran;
+}
+
+#endif
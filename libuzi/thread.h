@@ -31,10 +31,19 @@
 
 typedef void *(*pthread_start_routine)(void *);
 
+struct winpr_apc
+{
+	struct winpr_apc* Next;
+	PAPCFUNC pfnAPC;
+	ULONG_PTR dwData;
+};
+typedef struct winpr_apc WINPR_APC;
+
 struct winpr_thread
 {
 	WINPR_HANDLE_DEF();
 
+	HANDLE handle;
 	BOOL started;
 	int pipe_fd[2];
 	BOOL mainProcess;
@@ -50,6 +59,8 @@ struct winpr_thread
 	pthread_cond_t threadIsReady;
 	LPTHREAD_START_ROUTINE lpStartAddress;
 	LPSECURITY_ATTRIBUTES lpThreadAttributes;
+	WINPR_APC* volatile ApcHead;
+	int apc_fd[2];
 };
 typedef struct winpr_thread WINPR_THREAD;
 
@@ -63,6 +74,35 @@ struct winpr_process
 };
 typedef struct winpr_process WINPR_PROCESS;
 
+/**
+ * Returns a non-zero identifier of the calling thread which fits in a LONG,
+ * unlike pthread_t, so that lock owners can be compared and swapped
+ * atomically. Identifiers are never reused.
+ */
+LONG winpr_GetCurrentThreadLockId(void);
+
+/**
+ * Asynchronous procedure calls
+ *
+ * QueueUserAPC pushes APCs onto a lock-free list of the target thread and
+ * signals a file descriptor which alertable waits of that thread poll
+ * along with the handles they wait on. The descriptor is created by the
+ * thread itself on its first alertable wait: until then, queued APCs are
+ * only found when the thread checks its list.
+ *
+ * winpr_Apc_GetWaitFd returns the descriptor to poll for the calling
+ * thread, or -1 for threads not created by CreateThread, which cannot be
+ * targeted by APCs and whose alertable waits are not alertable.
+ * winpr_Apc_Pending clears the descriptor and tells whether APCs are queued,
+ * winpr_Apc_Run runs them all, in the order they were queued.
+ */
+int winpr_Apc_GetWaitFd(void);
+BOOL winpr_Apc_Pending(void);
+BOOL winpr_Apc_Run(void);
+
+/* SleepEx with bAlertable TRUE */
+DWORD winpr_SleepAlertable(DWORD dwMilliseconds);
+
 #endif
 
 #endif /* WINPR_THREAD_PRIVATE_H */
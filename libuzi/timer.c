@@ -38,6 +38,7 @@
 #ifndef _WIN32
 
 #include "handle.h"
+#include "pool.h"
 
 #define TAG "timer"
 
@@ -106,10 +107,13 @@ BOOL TimerCloseHandle(HANDLE handle)
 #ifdef __linux__
 
 	if (timer->fd != -1)
+	{
 		close(timer->fd);
+		winpr_Handle_TrackFds(HANDLE_TYPE_TIMER, -1);
+	}
 
 #endif
-	free(timer);
+	winpr_ObjectPool_Free(HANDLE_TYPE_TIMER, timer);
 	return TRUE;
 }
 
@@ -171,15 +175,19 @@ int InitializeWaitableTimer(WINPR_TIMER* timer)
 
 		if (timer->fd <= 0)
 		{
-			free(timer);
+			/* the timer is owned by its handle, it is freed by CloseHandle */
+			timer->fd = -1;
 			return -1;
 		}
 
+		winpr_Handle_TrackFds(HANDLE_TYPE_TIMER, 1);
 		status = fcntl(timer->fd, F_SETFL, O_NONBLOCK);
 
 		if (status)
 		{
 			close(timer->fd);
+			timer->fd = -1;
+			winpr_Handle_TrackFds(HANDLE_TYPE_TIMER, -1);
 			return -1;
 		}
 #else
@@ -227,12 +235,11 @@ HANDLE CreateWaitableTimerA(LPSECURITY_ATTRIBUTES lpTimerAttributes, BOOL bManua
 {
 	HANDLE handle = NULL;
 	WINPR_TIMER* timer;
-	timer = (WINPR_TIMER*) calloc(1, sizeof(WINPR_TIMER));
+	timer = (WINPR_TIMER*) winpr_ObjectPool_New(HANDLE_TYPE_TIMER);
 
 	if (timer)
 	{
 		WINPR_HANDLE_SET_TYPE_AND_MODE(timer, HANDLE_TYPE_TIMER, UZI_FD_READ);
-		handle = (HANDLE) timer;
 		timer->fd = -1;
 		timer->lPeriod = 0;
 		timer->bManualReset = bManualReset;
@@ -240,6 +247,10 @@ HANDLE CreateWaitableTimerA(LPSECURITY_ATTRIBUTES lpTimerAttributes, BOOL bManua
 		timer->lpArgToCompletionRoutine = NULL;
 		timer->bInit = FALSE;
 		timer->ops = &ops;
+		handle = winpr_Handle_Register((WINPR_HANDLE*) timer);
+
+		if (!handle)
+			winpr_ObjectPool_Free(HANDLE_TYPE_TIMER, timer);
 	}
 
 	return handle;
@@ -606,7 +617,14 @@ HANDLE CreateTimerQueue(void)
 	if (timerQueue)
 	{
 		WINPR_HANDLE_SET_TYPE_AND_MODE(timerQueue, HANDLE_TYPE_TIMER_QUEUE, UZI_FD_READ);
-		handle = (HANDLE) timerQueue;
+		handle = winpr_Handle_Register((WINPR_HANDLE*) timerQueue);
+
+		if (!handle)
+		{
+			free(timerQueue);
+			return NULL;
+		}
+
 		timerQueue->activeHead = NULL;
 		timerQueue->inactiveHead = NULL;
 		timerQueue->bCancelled = FALSE;
@@ -618,15 +636,20 @@ HANDLE CreateTimerQueue(void)
 
 BOOL DeleteTimerQueueEx(HANDLE TimerQueue, HANDLE CompletionEvent)
 {
+	ULONG Type;
 	void* rvalue;
+	WINPR_HANDLE* Object;
 	WINPR_TIMER_QUEUE* timerQueue;
 	WINPR_TIMER_QUEUE_TIMER* node;
 	WINPR_TIMER_QUEUE_TIMER* nextNode;
 
-	if (!TimerQueue)
+	if (!winpr_Handle_GetInfo(TimerQueue, &Type, &Object) || (Type != HANDLE_TYPE_TIMER_QUEUE))
+		return FALSE;
+
+	if (!winpr_Handle_Unregister(TimerQueue))
 		return FALSE;
 
-	timerQueue = (WINPR_TIMER_QUEUE*) TimerQueue;
+	timerQueue = (WINPR_TIMER_QUEUE*) Object;
 	/* Cancel and delete timer queue timers */
 	pthread_mutex_lock(&(timerQueue->cond_mutex));
 	timerQueue->bCancelled = TRUE;
@@ -660,7 +683,8 @@ BOOL DeleteTimerQueueEx(HANDLE TimerQueue, HANDLE CompletionEvent)
 		while (node)
 		{
 			nextNode = node->next;
-			free(node);
+			winpr_Handle_Unregister(node->handle);
+			winpr_ObjectPool_Free(HANDLE_TYPE_TIMER_QUEUE_TIMER, node);
 			node = nextNode;
 		}
 
@@ -687,22 +711,32 @@ BOOL DeleteTimerQueue(HANDLE TimerQueue)
 BOOL CreateTimerQueueTimer(PHANDLE phNewTimer, HANDLE TimerQueue,
                            WAITORTIMERCALLBACK Callback, PVOID Parameter, DWORD DueTime, DWORD Period, ULONG Flags)
 {
+	ULONG Type;
+	WINPR_HANDLE* Object;
 	struct timespec CurrentTime;
 	WINPR_TIMER_QUEUE* timerQueue;
 	WINPR_TIMER_QUEUE_TIMER* timer;
 
-	if (!TimerQueue)
+	if (!winpr_Handle_GetInfo(TimerQueue, &Type, &Object) || (Type != HANDLE_TYPE_TIMER_QUEUE))
 		return FALSE;
 
 	timespec_gettimeofday(&CurrentTime);
-	timerQueue = (WINPR_TIMER_QUEUE*) TimerQueue;
-	timer = (WINPR_TIMER_QUEUE_TIMER*) malloc(sizeof(WINPR_TIMER_QUEUE_TIMER));
+	timerQueue = (WINPR_TIMER_QUEUE*) Object;
+	timer = (WINPR_TIMER_QUEUE_TIMER*) winpr_ObjectPool_New(HANDLE_TYPE_TIMER_QUEUE_TIMER);
 
 	if (!timer)
 		return FALSE;
 
 	WINPR_HANDLE_SET_TYPE_AND_MODE(timer, HANDLE_TYPE_TIMER_QUEUE_TIMER, UZI_FD_READ);
-	*((UINT_PTR*) phNewTimer) = (UINT_PTR)(HANDLE) timer;
+	timer->handle = winpr_Handle_Register((WINPR_HANDLE*) timer);
+
+	if (!timer->handle)
+	{
+		winpr_ObjectPool_Free(HANDLE_TYPE_TIMER_QUEUE_TIMER, timer);
+		return FALSE;
+	}
+
+	*((UINT_PTR*) phNewTimer) = (UINT_PTR) timer->handle;
 	timespec_copy(&(timer->StartTime), &CurrentTime);
 	timespec_add_ms(&(timer->StartTime), DueTime);
 	timespec_copy(&(timer->ExpirationTime), &(timer->StartTime));
@@ -711,7 +745,7 @@ BOOL CreateTimerQueueTimer(PHANDLE phNewTimer, HANDLE TimerQueue,
 	timer->Period = Period;
 	timer->Callback = Callback;
 	timer->Parameter = Parameter;
-	timer->timerQueue = (WINPR_TIMER_QUEUE*) TimerQueue;
+	timer->timerQueue = timerQueue;
 	timer->FireCount = 0;
 	timer->next = NULL;
 	pthread_mutex_lock(&(timerQueue->cond_mutex));
@@ -723,16 +757,22 @@ BOOL CreateTimerQueueTimer(PHANDLE phNewTimer, HANDLE TimerQueue,
 
 BOOL ChangeTimerQueueTimer(HANDLE TimerQueue, HANDLE Timer, ULONG DueTime, ULONG Period)
 {
+	ULONG Type;
+	WINPR_HANDLE* Object;
 	struct timespec CurrentTime;
 	WINPR_TIMER_QUEUE* timerQueue;
 	WINPR_TIMER_QUEUE_TIMER* timer;
 
-	if (!TimerQueue || !Timer)
+	if (!winpr_Handle_GetInfo(TimerQueue, &Type, &Object) || (Type != HANDLE_TYPE_TIMER_QUEUE))
+		return FALSE;
+
+	timerQueue = (WINPR_TIMER_QUEUE*) Object;
+
+	if (!winpr_Handle_GetInfo(Timer, &Type, &Object) || (Type != HANDLE_TYPE_TIMER_QUEUE_TIMER))
 		return FALSE;
 
 	timespec_gettimeofday(&CurrentTime);
-	timerQueue = (WINPR_TIMER_QUEUE*) TimerQueue;
-	timer = (WINPR_TIMER_QUEUE_TIMER*) Timer;
+	timer = (WINPR_TIMER_QUEUE_TIMER*) Object;
 	pthread_mutex_lock(&(timerQueue->cond_mutex));
 	RemoveTimerQueueTimer(&(timerQueue->activeHead), timer);
 	RemoveTimerQueueTimer(&(timerQueue->inactiveHead), timer);
@@ -750,14 +790,23 @@ BOOL ChangeTimerQueueTimer(HANDLE TimerQueue, HANDLE Timer, ULONG DueTime, ULONG
 
 BOOL DeleteTimerQueueTimer(HANDLE TimerQueue, HANDLE Timer, HANDLE CompletionEvent)
 {
+	ULONG Type;
+	WINPR_HANDLE* Object;
 	WINPR_TIMER_QUEUE* timerQueue;
 	WINPR_TIMER_QUEUE_TIMER* timer;
 
-	if (!TimerQueue || !Timer)
+	if (!winpr_Handle_GetInfo(TimerQueue, &Type, &Object) || (Type != HANDLE_TYPE_TIMER_QUEUE))
+		return FALSE;
+
+	timerQueue = (WINPR_TIMER_QUEUE*) Object;
+
+	if (!winpr_Handle_GetInfo(Timer, &Type, &Object) || (Type != HANDLE_TYPE_TIMER_QUEUE_TIMER))
 		return FALSE;
 
-	timerQueue = (WINPR_TIMER_QUEUE*) TimerQueue;
-	timer = (WINPR_TIMER_QUEUE_TIMER*) Timer;
+	if (!winpr_Handle_Unregister(Timer))
+		return FALSE;
+
+	timer = (WINPR_TIMER_QUEUE_TIMER*) Object;
 	pthread_mutex_lock(&(timerQueue->cond_mutex));
 	/**
 	 * Quote from MSDN regarding CompletionEvent:
@@ -770,9 +819,10 @@ BOOL DeleteTimerQueueTimer(HANDLE TimerQueue, HANDLE Timer, HANDLE CompletionEve
 	 * callback functions to complete (see cond_mutex usage)
 	 */
 	RemoveTimerQueueTimer(&(timerQueue->activeHead), timer);
+	RemoveTimerQueueTimer(&(timerQueue->inactiveHead), timer);
 	pthread_cond_signal(&(timerQueue->cond));
 	pthread_mutex_unlock(&(timerQueue->cond_mutex));
-	free(timer);
+	winpr_ObjectPool_Free(HANDLE_TYPE_TIMER_QUEUE_TIMER, timer);
 
 	if (CompletionEvent && (CompletionEvent != INVALID_HANDLE_VALUE))
 		SetEvent(CompletionEvent);
@@ -1,8 +1,19 @@
 
+#include <uzi/crt.h>
 #include <uzi/synch.h>
+#include <uzi/sysinfo.h>
+#include <uzi/thread.h>
 
 #include <uzi/uzi.h>
 
+#ifndef _WIN32
+#include "lockstats.h"
+
+#define UZI_CALL_SITE()		__builtin_return_address(0)
+#else
+#define UZI_CALL_SITE()		NULL
+#endif
+
 UZI_HANDLE UziCreateEvent(bool manualReset, bool initialState)
 {
 	UZI_HANDLE handle;
@@ -22,9 +33,19 @@ bool UziResetEvent(UZI_HANDLE handle)
 	return ResetEvent((HANDLE) handle) ? true : false;
 }
 
+bool UziSetEvents(uint32_t nCount, const UZI_HANDLE* handles)
+{
+	return SetEvents(nCount, (const HANDLE*) handles) ? true : false;
+}
+
+bool UziResetEvents(uint32_t nCount, const UZI_HANDLE* handles)
+{
+	return ResetEvents(nCount, (const HANDLE*) handles) ? true : false;
+}
+
 bool UziEventIsSet(UZI_HANDLE handle)
 {
-	return (UziWaitSingle(handle, 0) == UZI_WAIT_OBJECT_0) ? true : false;
+	return IsEventSet((HANDLE) handle) ? true : false;
 }
 
 bool UziCloseHandle(UZI_HANDLE handle)
@@ -47,12 +68,185 @@ uint32_t UziWaitMulti(uint32_t nCount, const UZI_HANDLE* handles, bool waitAll,
 	return waitStatus;
 }
 
-bool UziInitCS(UZI_CS* cs, uint32_t spinCount, uint32_t flags)
+uint64_t UziGetMonotonicTimeNs(void)
+{
+	return GetMonotonicTimeNs();
+}
+
+uint32_t UziWaitSingleUntil(UZI_HANDLE handle, uint64_t deadline)
+{
+	return WaitForSingleObjectUntil((HANDLE) handle, deadline);
+}
+
+uint32_t UziWaitMultiUntil(uint32_t nCount, const UZI_HANDLE* handles, bool waitAll, uint64_t deadline)
+{
+	BOOL bWaitAll = waitAll ? TRUE : FALSE;
+	return WaitForMultipleObjectsUntil(nCount, (const HANDLE*) handles, bWaitAll, deadline);
+}
+
+uint32_t UziWaitMany(uint32_t nCount, const UZI_HANDLE* handles, uint32_t* indices,
+	uint32_t* readyCount, uint32_t timeout)
+{
+#ifndef _WIN32
+	return WaitForManyObjects(nCount, (const HANDLE*) handles, (LPDWORD) indices,
+		(LPDWORD) readyCount, timeout);
+#else
+	uint32_t index;
+	uint32_t count;
+	ULONGLONG start = GetTickCount64();
+
+	if (!nCount || !handles || !indices || !readyCount)
+		return UZI_WAIT_FAILED;
+
+	/* no wait sets on Windows, check the handles one by one every millisecond */
+	for (;;)
+	{
+		count = 0;
+
+		for (index = 0; index < nCount; index++)
+		{
+			if (WaitForSingleObject((HANDLE) handles[index], 0) == WAIT_OBJECT_0)
+				indices[count++] = index;
+		}
+
+		*readyCount = count;
+
+		if (count)
+			return UZI_WAIT_OBJECT_0;
+
+		if ((timeout != UZI_INFINITE) && (GetTickCount64() - start >= timeout))
+			return UZI_WAIT_TIMEOUT;
+
+		Sleep(1);
+	}
+#endif
+}
+
+uint32_t UziWaitReady(uint32_t nCount, const UZI_HANDLE* handles, uint32_t startIndex,
+	uint32_t* indices, uint32_t* readyCount, uint32_t timeout)
+{
+#ifndef _WIN32
+	return WaitForMultipleObjectsReady(nCount, (const HANDLE*) handles, startIndex,
+		(LPDWORD) indices, (LPDWORD) readyCount, timeout);
+#else
+	uint32_t pos;
+	uint32_t index;
+	uint32_t count = 0;
+	uint32_t status;
+
+	if (!nCount || !handles || !indices || !readyCount)
+		return UZI_WAIT_FAILED;
+
+	/* wait for one handle, then collect the others without waiting */
+	status = WaitForMultipleObjects(nCount, (const HANDLE*) handles, FALSE, timeout);
+
+	if (status >= WAIT_OBJECT_0 + nCount)
+		return status;
+
+	for (pos = 0; pos < nCount; pos++)
+	{
+		index = (startIndex + pos) % nCount;
+
+		if ((index == status - WAIT_OBJECT_0) ||
+				(WaitForSingleObject((HANDLE) handles[index], 0) == WAIT_OBJECT_0))
+			indices[count++] = index;
+	}
+
+	*readyCount = count;
+	return UZI_WAIT_OBJECT_0;
+#endif
+}
+
+bool UziSetSpinCount(UZI_HANDLE handle, uint32_t spinCount)
+{
+#ifndef _WIN32
+	return SetHandleSpinCount((HANDLE) handle, spinCount) ? true : false;
+#else
+	return false;
+#endif
+}
+
+uint32_t UziWaitSingleSpin(UZI_HANDLE handle, uint32_t spinCount, uint32_t timeout)
+{
+#ifndef _WIN32
+	return WaitForSingleObjectSpin((HANDLE) handle, spinCount, timeout);
+#else
+	return WaitForSingleObject((HANDLE) handle, timeout);
+#endif
+}
+
+#ifdef _WIN32
+
+struct uzi_apc
+{
+	UZI_APC_FUNC fn;
+	uintptr_t param;
+};
+typedef struct uzi_apc UZI_APC;
+
+/* PAPCFUNC is __stdcall on 32-bit Windows, call fn through a trampoline */
+static VOID NTAPI UziAPCTrampoline(ULONG_PTR Parameter)
+{
+	UZI_APC* apc = (UZI_APC*) Parameter;
+	apc->fn(apc->param);
+	free(apc);
+}
+
+#endif
+
+bool UziQueueAPC(UZI_HANDLE thread, UZI_APC_FUNC fn, uintptr_t param)
+{
+#ifndef _WIN32
+	return QueueUserAPC((PAPCFUNC) fn, (HANDLE) thread, (ULONG_PTR) param) ? true : false;
+#else
+	UZI_APC* apc;
+
+	if (!fn || !(apc = (UZI_APC*) malloc(sizeof(UZI_APC))))
+		return false;
+
+	apc->fn = fn;
+	apc->param = param;
+
+	if (!QueueUserAPC(UziAPCTrampoline, (HANDLE) thread, (ULONG_PTR) apc))
+	{
+		free(apc);
+		return false;
+	}
+
+	return true;
+#endif
+}
+
+uint32_t UziWaitSingleEx(UZI_HANDLE handle, uint32_t timeout, bool alertable)
+{
+	return WaitForSingleObjectEx((HANDLE) handle, timeout, alertable ? TRUE : FALSE);
+}
+
+uint32_t UziSleepEx(uint32_t timeout, bool alertable)
+{
+	return SleepEx(timeout, alertable ? TRUE : FALSE);
+}
+
+/* UZI_CS must be able to hold a CRITICAL_SECTION */
+typedef char uzi_cs_size_check[(sizeof(UZI_CS) >= sizeof(CRITICAL_SECTION)) ? 1 : -1];
+
+/* callSite is the caller of the public function, reported by lock profiling */
+static bool winpr_InitCS(UZI_CS* cs, uint32_t spinCount, uint32_t flags, const void* callSite)
 {
 	if (!spinCount)
 		spinCount = 4000;
 
+#ifndef _WIN32
+	return winpr_InitializeCriticalSectionWithCallSite((CRITICAL_SECTION*) cs, spinCount, flags, callSite) ?
+		true : false;
+#else
 	return InitializeCriticalSectionEx((CRITICAL_SECTION*) cs, spinCount, flags) ? true : false;
+#endif
+}
+
+bool UziInitCS(UZI_CS* cs, uint32_t spinCount, uint32_t flags)
+{
+	return winpr_InitCS(cs, spinCount, flags, UZI_CALL_SITE());
 }
 
 void UziEnterCS(UZI_CS* cs)
@@ -74,3 +268,119 @@ void UziDeleteCS(UZI_CS* cs)
 {
 	DeleteCriticalSection((CRITICAL_SECTION*) cs);
 }
+
+/* padded types must fill whole cache lines */
+typedef char uzi_cs_padded_size_check[(sizeof(UZI_CS_PADDED) % UZI_CACHE_LINE_SIZE) ? -1 : 1];
+typedef char uzi_counter_padded_size_check[(sizeof(UZI_COUNTER_PADDED) % UZI_CACHE_LINE_SIZE) ? -1 : 1];
+
+void* UziAlignedAlloc(size_t size)
+{
+	void* ptr;
+
+	size = (size + UZI_CACHE_LINE_SIZE - 1) & ~((size_t) UZI_CACHE_LINE_SIZE - 1);
+
+	if (!size)
+		size = UZI_CACHE_LINE_SIZE;
+
+	ptr = _aligned_malloc(size, UZI_CACHE_LINE_SIZE);
+
+	if (ptr)
+		memset(ptr, 0, size);
+
+	return ptr;
+}
+
+void UziAlignedFree(void* ptr)
+{
+	_aligned_free(ptr);
+}
+
+struct uzi_striped_lock
+{
+	uint32_t mask;
+	UZI_CS_PADDED* stripes;
+};
+
+UZI_STRIPED_LOCK* UziStripedLockNew(uint32_t count, uint32_t spinCount)
+{
+	uint32_t index;
+	uint32_t stripes = 1;
+	UZI_STRIPED_LOCK* striped;
+	const void* callSite = UZI_CALL_SITE();
+
+	if (!count || (count > 0x80000000))
+		return NULL;
+
+	while (stripes < count)
+		stripes <<= 1;
+
+	striped = (UZI_STRIPED_LOCK*) calloc(1, sizeof(UZI_STRIPED_LOCK));
+
+	if (!striped)
+		return NULL;
+
+	striped->mask = stripes - 1;
+	striped->stripes = (UZI_CS_PADDED*) UziAlignedAlloc(stripes * sizeof(UZI_CS_PADDED));
+
+	if (!striped->stripes)
+	{
+		free(striped);
+		return NULL;
+	}
+
+	for (index = 0; index < stripes; index++)
+	{
+		if (!winpr_InitCS(&striped->stripes[index].cs, spinCount, 0, callSite))
+		{
+			while (index--)
+				UziDeleteCS(&striped->stripes[index].cs);
+
+			UziAlignedFree(striped->stripes);
+			free(striped);
+			return NULL;
+		}
+	}
+
+	return striped;
+}
+
+void UziStripedLockFree(UZI_STRIPED_LOCK* striped)
+{
+	uint32_t index;
+
+	if (!striped)
+		return;
+
+	for (index = 0; index <= striped->mask; index++)
+		UziDeleteCS(&striped->stripes[index].cs);
+
+	UziAlignedFree(striped->stripes);
+	free(striped);
+}
+
+uint32_t UziStripedLockCount(const UZI_STRIPED_LOCK* striped)
+{
+	return striped->mask + 1;
+}
+
+UZI_CS* UziStripedLockGet(UZI_STRIPED_LOCK* striped, uint64_t key)
+{
+	/* 64-bit finalizer of MurmurHash3, every key bit affects the stripe */
+	key ^= key >> 33;
+	key *= 0xFF51AFD7ED558CCDULL;
+	key ^= key >> 33;
+	key *= 0xC4CEB9FE1A85EC53ULL;
+	key ^= key >> 33;
+
+	return &striped->stripes[key & striped->mask].cs;
+}
+
+void UziStripedLockEnter(UZI_STRIPED_LOCK* striped, uint64_t key)
+{
+	UziEnterCS(UziStripedLockGet(striped, key));
+}
+
+void UziStripedLockLeave(UZI_STRIPED_LOCK* striped, uint64_t key)
+{
+	UziLeaveCS(UziStripedLockGet(striped, key));
+}
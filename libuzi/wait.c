@@ -22,6 +22,10 @@
 #include "config.h"
 #endif
 
+#if defined(HAVE_PPOLL) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* ppoll */
+#endif
+
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -39,7 +43,10 @@
 
 #include <uzi/crt.h>
 #include <uzi/synch.h>
+#include <uzi/sysinfo.h>
 #include <uzi/platform.h>
+#include <uzi/interlocked.h>
+#include <uzi/uzi.h>
 
 #include "synch.h"
 #include "thread.h"
@@ -56,6 +63,7 @@
 #include <sys/wait.h>
 
 #include "handle.h"
+#include "waitstats.h"
 
 /* clock_gettime is not implemented on OSX prior to 10.12 */
 #ifdef __MACH__
@@ -110,85 +118,74 @@ _mach_safe_clock_gettime(int clk_id, struct timespec *t) {
 #endif
 
 
-static long long ts_difftime(const struct timespec *o,
-							 const struct timespec *n)
+#ifdef HAVE_POLL_H
+static DWORD handle_mode_to_pollevent(ULONG mode)
 {
-	long long oldValue = o->tv_sec * 1000000000LL + o->tv_nsec;
-	long long newValue = n->tv_sec * 1000000000LL + n->tv_nsec;
-	return newValue - oldValue;
+	DWORD event = 0;
+	if (mode & UZI_FD_READ)
+		event |= POLLIN;
+	if (mode & UZI_FD_WRITE)
+		event |= POLLOUT;
+
+	return event;
 }
+#endif
 
 /**
- * Drop in replacement for pthread_mutex_timedlock
- * http://code.google.com/p/android/issues/detail?id=7807
- * http://aleksmaus.blogspot.ca/2011/12/missing-pthreadmutextimedlock-on.html
+ * File descriptors are polled until the deadline with ppoll when available,
+ * keeping its nanosecond precision, and with poll otherwise, which rounds
+ * the remaining time up to the next millisecond.
  */
-#if !defined(HAVE_PTHREAD_MUTEX_TIMEDLOCK)
 
-#include <pthread.h>
+#ifdef HAVE_POLL_H
+static int poll_until(struct pollfd* fds, nfds_t count, const struct timespec* deadline)
+{
+	int status;
+#ifdef HAVE_PPOLL
+	struct timespec remaining;
+
+	do
+	{
+		if (deadline)
+			ts_remaining(deadline, &remaining);
 
-#ifdef ANDROID
-#if (__ANDROID_API__ >= 21)
-#define CONST_NEEDED const
+		status = ppoll(fds, count, deadline ? &remaining : NULL, NULL);
+	}
+	while ((status < 0) && (errno == EINTR));
 #else
-#define CONST_NEEDED
-#endif
-#define STATIC_NEEDED
-#else /* ANDROID */
-#define CONST_NEEDED const
-#define STATIC_NEEDED static
+	/* the timeout is capped, poll again until the deadline */
+	do
+	{
+		status = poll(fds, count, ts_remaining_ms(deadline));
+	}
+	while (((status < 0) && (errno == EINTR)) || (!status && deadline && ts_remaining_ms(deadline)));
 #endif
 
-STATIC_NEEDED int pthread_mutex_timedlock(pthread_mutex_t *mutex, CONST_NEEDED struct timespec *timeout)
+	return status;
+}
+#else
+static struct timeval* select_timeout(const struct timespec* deadline, struct timeval* timeout)
 {
-	struct timespec timenow;
-	struct timespec sleepytime;
-	unsigned long long diff;
-	int retcode;
-	/* This is just to avoid a completely busy wait */
-	clock_gettime(CLOCK_MONOTONIC, &timenow);
-	diff = ts_difftime(&timenow, timeout);
-	sleepytime.tv_sec = diff / 1000000000LL;
-	sleepytime.tv_nsec = diff % 1000000000LL;
-
-	while ((retcode = pthread_mutex_trylock(mutex)) == EBUSY)
-	{
-		clock_gettime(CLOCK_MONOTONIC, &timenow);
-
-		if (ts_difftime(timeout, &timenow) >= 0)
-		{
-			return ETIMEDOUT;
-		}
+	struct timespec remaining;
 
-		nanosleep(&sleepytime, NULL);
-	}
+	if (!deadline)
+		return NULL;
 
-	return retcode;
-}
-#endif
+	ts_remaining(deadline, &remaining);
+	timeout->tv_sec = remaining.tv_sec;
+	timeout->tv_usec = (remaining.tv_nsec + 999) / 1000;
 
-#ifdef HAVE_POLL_H
-static DWORD handle_mode_to_pollevent(ULONG mode)
-{
-	DWORD event = 0;
-	if (mode & UZI_FD_READ)
-		event |= POLLIN;
-	if (mode & UZI_FD_WRITE)
-		event |= POLLOUT;
+	if (timeout->tv_usec >= 1000000)
+	{
+		timeout->tv_sec++;
+		timeout->tv_usec -= 1000000;
+	}
 
-	return event;
+	return timeout;
 }
 #endif
 
-static void ts_add_ms(struct timespec *ts, DWORD dwMilliseconds)
-{
-	ts->tv_sec += dwMilliseconds / 1000L;
-	ts->tv_nsec += (dwMilliseconds % 1000L) * 1000000L;
-	ts->tv_sec += ts->tv_nsec / 1000000000L;
-	ts->tv_nsec = ts->tv_nsec % 1000000000L;
-}
-
-static int waitOnFd(int fd, ULONG mode, DWORD dwMilliseconds)
+static int waitOnFd(int fd, ULONG mode, const struct timespec* deadline)
 {
 	int status;
 #ifdef HAVE_POLL_H
@@ -197,38 +194,27 @@ static int waitOnFd(int fd, ULONG mode, DWORD dwMilliseconds)
 	pollfds.events = handle_mode_to_pollevent(mode);
 	pollfds.revents = 0;
 
-	do
-	{
-		status = poll(&pollfds, 1, dwMilliseconds);
-	}
-	while ((status < 0) && (errno == EINTR));
-
+	status = poll_until(&pollfds, 1, deadline);
 #else
 	struct timeval timeout;
 	fd_set rfds, wfds;
 	fd_set* prfds = NULL;
 	fd_set* pwfds = NULL;
 	fd_set* pefds = NULL;
-	FD_ZERO(&rfds);
-	FD_SET(fd, &rfds);
-	FD_ZERO(&wfds);
-	FD_SET(fd, &wfds);
-	ZeroMemory(&timeout, sizeof(timeout));
 
 	if (mode & WINPR_FD_READ)
 		prfds = &rfds;
 	if (mode & WINPR_FD_WRITE)
 		pwfds = &wfds;
 
-	if ((dwMilliseconds != INFINITE) && (dwMilliseconds != 0))
-	{
-		timeout.tv_sec = dwMilliseconds / 1000;
-		timeout.tv_usec = (dwMilliseconds % 1000) * 1000;
-	}
-
 	do
 	{
-		status = select(fd + 1, prfds, pwfds, pefds, (dwMilliseconds == INFINITE) ? NULL : &timeout);
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		FD_ZERO(&wfds);
+		FD_SET(fd, &wfds);
+
+		status = select(fd + 1, prfds, pwfds, pefds, select_timeout(deadline, &timeout));
 	}
 	while (status < 0 && (errno == EINTR));
 
@@ -236,10 +222,97 @@ static int waitOnFd(int fd, ULONG mode, DWORD dwMilliseconds)
 	return status;
 }
 
+/**
+ * Spin-then-block waits
+ *
+ * A single-object wait with a spin count (set on the handle with
+ * SetHandleSpinCount or given to WaitForSingleObjectSpin) checks the object
+ * state in user space up to that many times, with a CPU pause between
+ * checks, before blocking in the kernel. This saves the context switches
+ * when the object is signaled within a few microseconds, at the price of
+ * burning CPU when it is not. Only objects implementing the Wait operation
+ * can be checked without a system call, the others block right away, as
+ * do all waits on a single processor, where the thread which would signal
+ * the object cannot run while the waiter spins.
+ *
+ * Spins ending with the object acquired count as hits, spins ending in a
+ * kernel wait as misses, per handle type. Waits on objects which are
+ * already signaled do not spin and are not counted.
+ */
+
+struct UZI_CACHE_ALIGNED winpr_spin_stats
+{
+	LONGLONG volatile Hits;
+	LONGLONG volatile Misses;
+};
+typedef struct winpr_spin_stats WINPR_SPIN_STATS;
+
+static WINPR_SPIN_STATS g_SpinStats[HANDLE_TYPE_COUNT];
+static LONG g_SpinProcessors = -1;
+
+static DWORD winpr_Handle_SpinWaitUntil(WINPR_HANDLE* Object, DWORD dwSpinCount, const struct timespec* deadline)
+{
+	DWORD spins;
+	struct timespec nowait = { 0, 0 };
+
+	if (!dwSpinCount || !Object->ops || !Object->ops->Wait)
+		return winpr_Handle_WaitUntil(Object, deadline);
+
+	if (Object->ops->Wait(Object, &nowait) == WAIT_OBJECT_0)
+		return WAIT_OBJECT_0;
+
+	if (ts_is_nowait(deadline))
+		return WAIT_TIMEOUT;
+
+	if (g_SpinProcessors < 0)
+		g_SpinProcessors = (LONG) sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (g_SpinProcessors > 1)
+	{
+		for (spins = 0; spins < dwSpinCount; spins++)
+		{
+			winpr_cpu_relax();
+
+			if (Object->ops->Wait(Object, &nowait) == WAIT_OBJECT_0)
+			{
+				InterlockedExchangeAdd64(&g_SpinStats[Object->Type].Hits, 1);
+				return WAIT_OBJECT_0;
+			}
+		}
+
+		InterlockedExchangeAdd64(&g_SpinStats[Object->Type].Misses, 1);
+	}
+
+	return Object->ops->Wait(Object, deadline);
+}
+
+static DWORD winpr_WaitForSingleObject(WINPR_HANDLE* Object, DWORD dwSpinCount, const struct timespec* deadline)
+{
+	DWORD status;
+	WINPR_WAIT_STATS* stats;
+	struct timespec nowait = { 0, 0 };
+
+	if (!(stats = winpr_WaitStats_Get()))
+		return winpr_Handle_SpinWaitUntil(Object, dwSpinCount, deadline);
+
+	/* a state check first tells immediate waits from blocked ones */
+	status = winpr_Handle_WaitUntil(Object, &nowait);
+
+	if ((status == WAIT_TIMEOUT) && !ts_is_nowait(deadline))
+	{
+		winpr_WaitStats_Blocking(stats);
+		status = winpr_Handle_SpinWaitUntil(Object, dwSpinCount, deadline);
+	}
+
+	winpr_WaitStats_Done(stats, Object->Type, status);
+	return status;
+}
+
 DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds)
 {
 	ULONG Type;
 	WINPR_HANDLE* Object;
+	struct timespec deadline;
 
 	if (!winpr_Handle_GetInfo(hHandle, &Type, &Object))
 	{
@@ -247,41 +320,81 @@ DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds)
 		return WAIT_FAILED;
 	}
 
-	if (Type == HANDLE_TYPE_MUTEX)
+	return winpr_WaitForSingleObject(Object, Object->SpinCount, ts_deadline_ms(&deadline, dwMilliseconds));
+}
+
+DWORD WaitForSingleObjectUntil(HANDLE hHandle, ULONGLONG DeadlineNs)
+{
+	ULONG Type;
+	WINPR_HANDLE* Object;
+	struct timespec deadline;
+
+	if (!winpr_Handle_GetInfo(hHandle, &Type, &Object))
 	{
-		WINPR_MUTEX *mutex;
-		mutex = (WINPR_MUTEX *) Object;
+		SetLastError(ERROR_INVALID_HANDLE);
+		return WAIT_FAILED;
+	}
 
-		if (dwMilliseconds != INFINITE)
-		{
-			int status;
-			struct timespec timeout;
-			clock_gettime(CLOCK_MONOTONIC, &timeout);
-			ts_add_ms(&timeout, dwMilliseconds);
-			status = pthread_mutex_timedlock(&mutex->mutex, &timeout);
-
-			if (ETIMEDOUT == status)
-				return WAIT_TIMEOUT;
-		}
-		else
-		{
-			pthread_mutex_lock(&mutex->mutex);
-		}
+	return winpr_WaitForSingleObject(Object, Object->SpinCount, ts_deadline_ns(&deadline, DeadlineNs));
+}
 
-		return WAIT_OBJECT_0;
+DWORD WaitForSingleObjectSpin(HANDLE hHandle, DWORD dwSpinCount, DWORD dwMilliseconds)
+{
+	ULONG Type;
+	WINPR_HANDLE* Object;
+	struct timespec deadline;
+
+	if (!winpr_Handle_GetInfo(hHandle, &Type, &Object))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return WAIT_FAILED;
 	}
-	else
+
+	return winpr_WaitForSingleObject(Object, dwSpinCount, ts_deadline_ms(&deadline, dwMilliseconds));
+}
+
+BOOL SetHandleSpinCount(HANDLE hHandle, DWORD dwSpinCount)
+{
+	ULONG Type;
+	WINPR_HANDLE* Object;
+
+	if (!winpr_Handle_GetInfo(hHandle, &Type, &Object))
 	{
-		int status;
-		int fd = winpr_Handle_getFd(Object);
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
 
-		if (fd < 0)
-		{
-			SetLastError(ERROR_INVALID_HANDLE);
-			return WAIT_FAILED;
-		}
+	Object->SpinCount = dwSpinCount;
+	return TRUE;
+}
+
+DWORD winpr_Handle_Wait(WINPR_HANDLE* Object, DWORD dwMilliseconds)
+{
+	struct timespec deadline;
+
+	return winpr_Handle_WaitUntil(Object, ts_deadline_ms(&deadline, dwMilliseconds));
+}
+
+DWORD winpr_Handle_WaitUntil(WINPR_HANDLE* Object, const struct timespec* deadline)
+{
+	int fd;
+	int status;
+	DWORD ret;
+
+	if (Object->ops && Object->ops->Wait)
+		return Object->ops->Wait(Object, deadline);
 
-		status = waitOnFd(fd, Object->Mode, dwMilliseconds);
+	fd = winpr_Handle_getFd(Object);
+
+	if (fd < 0)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return WAIT_FAILED;
+	}
+
+	for (;;)
+	{
+		status = waitOnFd(fd, Object->Mode, deadline);
 
 		if (status < 0)
 		{
@@ -292,28 +405,69 @@ DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds)
 		if (status != 1)
 			return WAIT_TIMEOUT;
 
-		return winpr_Handle_cleanup(Object);
+		ret = winpr_Handle_cleanup(Object);
+
+		/* WAIT_TIMEOUT: the object was consumed by another waiter first */
+		if (ret != WAIT_TIMEOUT)
+			return ret;
+
+		winpr_WaitStats_Spurious(winpr_WaitStats_Get(), Object->Type);
+	}
+}
+
+static DWORD winpr_WaitForMultipleObjects_Ready(DWORD nCount, DWORD dwStartIndex, const BOOL* signalled_idx,
+		LPDWORD lpIndices, LPDWORD lpReadyCount)
+{
+	DWORD pos;
+	DWORD index;
+	DWORD count = 0;
+
+	for (pos = 0; pos < nCount; pos++)
+	{
+		index = (dwStartIndex + pos) % nCount;
+
+		if (signalled_idx[index])
+			lpIndices[count++] = index;
 	}
 
-	SetLastError(ERROR_INTERNAL_ERROR);
-	return WAIT_FAILED;
+	*lpReadyCount = count;
+	return WAIT_OBJECT_0;
 }
 
-DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAll, DWORD dwMilliseconds)
+/**
+ * Waits for any of the handles: lpIndices selects whether to return the
+ * first signaled handle or to acquire all the signaled handles and store
+ * their indices, which then come in the order of the handles starting from
+ * dwStartIndex. Handles are checked in that order too.
+ *
+ * alertFd is the APC descriptor of the calling thread for alertable waits,
+ * -1 otherwise. WAIT_IO_COMPLETION is returned once APCs are queued, for the
+ * caller to run them.
+ *
+ * signalled_idx (nCount entries, zeroed by the caller) is required in
+ * lpIndices mode, it marks the handles acquired so far.
+ *
+ * stats are the wait stats of the calling thread, NULL when profiling is
+ * disabled.
+ */
+
+static DWORD winpr_WaitForMultipleObjects_Wait(DWORD nCount, const HANDLE *lpHandles,
+		DWORD dwStartIndex, LPDWORD lpIndices, LPDWORD lpReadyCount, int alertFd,
+		BOOL* signalled_idx, WINPR_WAIT_STATS* stats, const struct timespec* deadline)
 {
-	struct timespec starttime;
-	struct timespec timenow;
-	unsigned long long diff;
-	DWORD signalled;
+	struct timespec nowait = { 0, 0 };
+	DWORD ready = 0;
+	DWORD waitable = 0;
+	DWORD pos;
 	DWORD polled;
 	DWORD *poll_map = NULL;
-	BOOL *signalled_idx = NULL;
 	int fd = -1;
 	int index;
 	int status;
 	ULONG Type;
-	BOOL signal_handled = FALSE;
+	BOOL checked = FALSE;
 	WINPR_HANDLE* Object;
+	const struct timespec* pollDeadline;
 #ifdef HAVE_POLL_H
 	struct pollfd *pollfds;
 #else
@@ -323,25 +477,81 @@ DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAl
 	struct timeval timeout;
 #endif
 
-	if (!nCount || (nCount > MAXIMUM_WAIT_OBJECTS))
-	{
-		return WAIT_FAILED;
-	}
+	dwStartIndex %= nCount;
 
-	if (bWaitAll)
+	if (lpIndices)
 	{
-		signalled_idx = alloca(nCount * sizeof(BOOL));
-		memset(signalled_idx, FALSE, nCount * sizeof(BOOL));
 		poll_map = alloca(nCount * sizeof(DWORD));
 		memset(poll_map, 0, nCount * sizeof(DWORD));
 	}
 
 #ifdef HAVE_POLL_H
-	pollfds = alloca(nCount * sizeof(struct pollfd));
+	pollfds = alloca((nCount + 1) * sizeof(struct pollfd));
 #endif
-	signalled = 0;
 
-	do
+	/**
+	 * Objects implementing the Wait operation are first checked without their
+	 * file descriptor. This acquires the mutexes already owned by the calling
+	 * thread, whose file descriptor is not signaled, and does not create file
+	 * descriptors for objects which are already signaled.
+	 *
+	 * To return the lowest signaled index, the handles without the Wait
+	 * operation which come before such an object have their file descriptor
+	 * checked on the way. The ones after the last such object are left to the
+	 * poll below, which reports them in order.
+	 */
+	for (pos = 0; pos < nCount; pos++)
+	{
+		index = (dwStartIndex + pos) % nCount;
+
+		if (!winpr_Handle_GetInfo(lpHandles[index], &Type, &Object))
+		{
+			SetLastError(ERROR_INVALID_HANDLE);
+			return WAIT_FAILED;
+		}
+
+		if (Object->ops && Object->ops->Wait)
+			waitable = pos + 1;
+	}
+
+	for (pos = 0; pos < waitable; pos++)
+	{
+		index = (dwStartIndex + pos) % nCount;
+
+		if (!winpr_Handle_GetInfo(lpHandles[index], &Type, &Object))
+		{
+			SetLastError(ERROR_INVALID_HANDLE);
+			return WAIT_FAILED;
+		}
+
+		if (!Object->ops || !Object->ops->Wait)
+		{
+			if (lpIndices)
+				continue;
+
+			if (winpr_Handle_WaitUntil(Object, &nowait) != WAIT_OBJECT_0)
+				continue;
+		}
+		else if (Object->ops->Wait(Object, &nowait) != WAIT_OBJECT_0)
+			continue;
+
+		if (!lpIndices)
+			return (WAIT_OBJECT_0 + index);
+
+		signalled_idx[index] = TRUE;
+		ready++;
+	}
+
+	/* the other signaled handles are collected without waiting */
+	if (ready && lpIndices)
+	{
+		if (ready == nCount)
+			return winpr_WaitForMultipleObjects_Ready(nCount, dwStartIndex, signalled_idx, lpIndices, lpReadyCount);
+
+		deadline = &nowait;
+	}
+
+	for (;;)
 	{
 #ifndef HAVE_POLL_H
 		fd_set* prfds = NULL;
@@ -350,16 +560,14 @@ DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAl
 
 		FD_ZERO(&rfds);
 		FD_ZERO(&wfds);
-		ZeroMemory(&timeout, sizeof(timeout));
 #endif
-		if (bWaitAll && (dwMilliseconds != INFINITE))
-			clock_gettime(CLOCK_MONOTONIC, &starttime);
-
 		polled = 0;
 
-		for (index = 0; index < nCount; index++)
+		for (pos = 0; pos < nCount; pos++)
 		{
-			if (bWaitAll)
+			index = (dwStartIndex + pos) % nCount;
+
+			if (poll_map)
 			{
 				if (signalled_idx[index])
 					continue;
@@ -401,29 +609,43 @@ DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAl
 			polled++;
 		}
 
-#ifdef HAVE_POLL_H
+		pollDeadline = deadline;
 
-		do
+		/* profiled waits poll once without waiting, to tell immediate waits from blocked ones */
+		if (stats && !ts_is_nowait(deadline))
 		{
-			status = poll(pollfds, polled, dwMilliseconds);
-		}
-		while (status < 0 && errno == EINTR);
+			if (checked)
+				winpr_WaitStats_Blocking(stats);
+			else
+				pollDeadline = &nowait;
 
-#else
+			checked = TRUE;
+		}
 
-		if ((dwMilliseconds != INFINITE) && (dwMilliseconds != 0))
+#ifdef HAVE_POLL_H
+		if (alertFd >= 0)
 		{
-			timeout.tv_sec = dwMilliseconds / 1000;
-			timeout.tv_usec = (dwMilliseconds % 1000) * 1000;
+			pollfds[polled].fd = alertFd;
+			pollfds[polled].events = POLLIN;
+			pollfds[polled].revents = 0;
 		}
 
-		do
+		status = poll_until(pollfds, polled + ((alertFd >= 0) ? 1 : 0), pollDeadline);
+#else
+		if (alertFd >= 0)
 		{
-			status = select(maxfd + 1, prfds, pwfds, 0,
-					(dwMilliseconds == INFINITE) ? NULL : &timeout);
+			FD_SET(alertFd, &rfds);
+			prfds = &rfds;
+
+			if (alertFd > maxfd)
+				maxfd = alertFd;
 		}
-		while (status < 0 && errno == EINTR);
 
+		status = select(maxfd + 1, prfds, pwfds, 0, select_timeout(pollDeadline, &timeout));
+
+		/* the file descriptor sets are rebuilt on the next iteration */
+		if ((status < 0) && (errno == EINTR))
+			continue;
 #endif
 
 		if (status < 0)
@@ -433,26 +655,30 @@ DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAl
 		}
 
 		if (status == 0)
-			return WAIT_TIMEOUT;
-
-		if (bWaitAll && (dwMilliseconds != INFINITE))
 		{
-			clock_gettime(CLOCK_MONOTONIC, &timenow);
-			diff = ts_difftime(&timenow, &starttime);
+			if (pollDeadline != deadline)
+				continue;
 
-			if (diff / 1000 > dwMilliseconds)
-				return WAIT_TIMEOUT;
-			else
-				dwMilliseconds -= (diff / 1000);
+			if (ready && lpIndices)
+				return winpr_WaitForMultipleObjects_Ready(nCount, dwStartIndex, signalled_idx, lpIndices, lpReadyCount);
+
+			return WAIT_TIMEOUT;
 		}
 
-		signal_handled = FALSE;
+#ifdef HAVE_POLL_H
+		if ((alertFd >= 0) && pollfds[polled].revents && winpr_Apc_Pending())
+			return WAIT_IO_COMPLETION;
+#else
+		if ((alertFd >= 0) && FD_ISSET(alertFd, &rfds) && winpr_Apc_Pending())
+			return WAIT_IO_COMPLETION;
+#endif
+
 		for (index = 0; index < polled; index++)
 		{
 			DWORD idx;
 			BOOL signal_set = FALSE;
 
-			if (bWaitAll)
+			if (poll_map)
 				idx = poll_map[index];
 			else
 				idx = index;
@@ -463,7 +689,7 @@ DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAl
 					return WAIT_FAILED;
 			}
 
-			fd = winpr_Handle_getFd(lpHandles[idx]);
+			fd = winpr_Handle_getFd(Object);
 
 			if (fd == -1)
 			{
@@ -481,37 +707,348 @@ DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAl
 #endif
 			if (signal_set)
 			{
-				DWORD rc = winpr_Handle_cleanup(lpHandles[idx]);
-				if (rc != WAIT_OBJECT_0)
-					return rc;
+				DWORD rc = winpr_Handle_cleanup(Object);
 
-				if (bWaitAll)
+				/* consumed by another waiter first, keep waiting */
+				if (rc == WAIT_TIMEOUT)
 				{
-					signalled_idx[idx] = TRUE;
+					winpr_WaitStats_Spurious(stats, Object->Type);
+					continue;
+				}
 
-					/* Continue checks from last position. */
-					for (; signalled < nCount; signalled++)
-					{
-						if (!signalled_idx[signalled])
-							break;
-					}
+				/* abandoned mutexes are owned too, report them with the others */
+				if (lpIndices && (rc != WAIT_FAILED))
+				{
+					signalled_idx[idx] = TRUE;
+					ready++;
+					continue;
 				}
 
-				if (!bWaitAll)
-					return (WAIT_OBJECT_0 + index);
+				if (rc != WAIT_OBJECT_0)
+					return rc;
+
+				return (WAIT_OBJECT_0 + idx);
+			}
+		}
+
+		if (ready && lpIndices)
+			return winpr_WaitForMultipleObjects_Ready(nCount, dwStartIndex, signalled_idx, lpIndices, lpReadyCount);
+	}
+}
+
+/**
+ * Gives back the handles marked in signalled_idx, acquired by a bWaitAll
+ * wait which did not get all of them: mutexes are released, auto-reset
+ * events set again and semaphore permits returned. Other handles are not
+ * consumed by waits, except the expirations of auto-reset timers, which
+ * are lost.
+ */
+static void winpr_WaitForMultipleObjects_GiveBack(DWORD nCount, const HANDLE* lpHandles,
+		const BOOL* signalled_idx)
+{
+	DWORD index;
+	ULONG Type;
+	WINPR_HANDLE* Object;
+	WINPR_EVENT* event;
+
+	for (index = 0; index < nCount; index++)
+	{
+		if (!signalled_idx[index] || !winpr_Handle_GetInfo(lpHandles[index], &Type, &Object))
+			continue;
+
+		switch (Type)
+		{
+			case HANDLE_TYPE_MUTEX:
+				ReleaseMutex(lpHandles[index]);
+				break;
+
+			case HANDLE_TYPE_SEMAPHORE:
+				ReleaseSemaphore(lpHandles[index], 1, NULL);
+				break;
+
+			case HANDLE_TYPE_EVENT:
+				event = (WINPR_EVENT*) Object;
+
+				if (!event->bManualReset && !event->bAttached)
+					SetEvent(lpHandles[index]);
+
+				break;
+
+			default:
+				break;
+		}
+	}
+}
+
+/**
+ * Waits for all the handles. They are acquired in order without waiting,
+ * and when one is not signaled, the handles already acquired are given back
+ * before blocking on that one alone, which is then held while the others
+ * are acquired again. A wait never blocks holding some of the handles, so
+ * that threads waiting for the same handles in different orders do not
+ * deadlock, and the caller owns either all the handles or none of them.
+ *
+ * signalled_idx (nCount entries, zeroed by the caller) marks the handles
+ * acquired so far.
+ */
+static DWORD winpr_WaitForMultipleObjects_WaitAll(DWORD nCount, const HANDLE* lpHandles, int alertFd,
+		BOOL* signalled_idx, WINPR_WAIT_STATS* stats, const struct timespec* deadline)
+{
+	DWORD index;
+	DWORD status;
+	ULONG Type;
+	WINPR_HANDLE* Object;
+	struct timespec nowait = { 0, 0 };
 
-				if (bWaitAll && (signalled >= nCount))
-					return (WAIT_OBJECT_0);
+	for (;;)
+	{
+		for (index = 0; index < nCount; index++)
+		{
+			if (signalled_idx[index])
+				continue;
 
-				signal_handled = TRUE;
+			if (!winpr_Handle_GetInfo(lpHandles[index], &Type, &Object))
+			{
+				SetLastError(ERROR_INVALID_HANDLE);
+				status = WAIT_FAILED;
+				break;
 			}
+
+			if ((status = winpr_Handle_WaitUntil(Object, &nowait)) != WAIT_OBJECT_0)
+				break;
+
+			signalled_idx[index] = TRUE;
 		}
+
+		if (index >= nCount)
+			return WAIT_OBJECT_0;
+
+		winpr_WaitForMultipleObjects_GiveBack(nCount, lpHandles, signalled_idx);
+		memset(signalled_idx, FALSE, nCount * sizeof(BOOL));
+
+		if ((status != WAIT_TIMEOUT) || ts_is_nowait(deadline))
+			return status;
+
+		winpr_WaitStats_Blocking(stats);
+
+		if (alertFd >= 0)
+			status = winpr_WaitForMultipleObjects_Wait(1, &lpHandles[index], 0, NULL, NULL, alertFd,
+				NULL, NULL, deadline);
+		else
+			status = winpr_Handle_WaitUntil(Object, deadline);
+
+		if (status != WAIT_OBJECT_0)
+			return status;
+
+		signalled_idx[index] = TRUE;
 	}
-	while (bWaitAll || !signal_handled);
+}
 
-	SetLastError(ERROR_INTERNAL_ERROR);
-	return WAIT_FAILED;
+/**
+ * Waits are accounted to the handle which ended them, or to the first one.
+ */
+static DWORD winpr_WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAll,
+		DWORD dwStartIndex, LPDWORD lpIndices, LPDWORD lpReadyCount, int alertFd,
+		const struct timespec* deadline)
+{
+	ULONG Type;
+	DWORD index;
+	DWORD status;
+	WINPR_HANDLE* Object;
+	WINPR_WAIT_STATS* stats;
+	BOOL* signalled_idx = NULL;
+
+	if (!nCount || (nCount > MAXIMUM_WAIT_OBJECTS))
+		return WAIT_FAILED;
+
+	if (bWaitAll || lpIndices)
+	{
+		signalled_idx = alloca(nCount * sizeof(BOOL));
+		memset(signalled_idx, FALSE, nCount * sizeof(BOOL));
+	}
+
+	stats = winpr_WaitStats_Get();
+
+	if (bWaitAll)
+		status = winpr_WaitForMultipleObjects_WaitAll(nCount, lpHandles, alertFd, signalled_idx, stats, deadline);
+	else
+		status = winpr_WaitForMultipleObjects_Wait(nCount, lpHandles, dwStartIndex,
+			lpIndices, lpReadyCount, alertFd, signalled_idx, stats, deadline);
+
+	if (!stats)
+		return status;
+
+	if (lpIndices && (status == WAIT_OBJECT_0) && *lpReadyCount)
+		index = lpIndices[0];
+	else if (!lpIndices && (status < WAIT_OBJECT_0 + nCount))
+		index = status - WAIT_OBJECT_0;
+	else if (!lpIndices && (status >= WAIT_ABANDONED) && (status < WAIT_ABANDONED + nCount))
+		index = status - WAIT_ABANDONED;
+	else
+		index = dwStartIndex % nCount;
+
+	if (!winpr_Handle_GetInfo(lpHandles[index], &Type, &Object))
+		Type = HANDLE_TYPE_NONE;
+
+	winpr_WaitStats_Done(stats, Type, status);
+	return status;
+}
+
+DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAll, DWORD dwMilliseconds)
+{
+	struct timespec deadline;
+
+	return winpr_WaitForMultipleObjects(nCount, lpHandles, bWaitAll, 0, NULL, NULL, -1,
+		ts_deadline_ms(&deadline, dwMilliseconds));
+}
+
+DWORD WaitForMultipleObjectsUntil(DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll, ULONGLONG DeadlineNs)
+{
+	struct timespec deadline;
+
+	return winpr_WaitForMultipleObjects(nCount, lpHandles, bWaitAll, 0, NULL, NULL, -1,
+		ts_deadline_ns(&deadline, DeadlineNs));
+}
+
+static DWORD winpr_WaitForMultipleObjectsAlertable(DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll,
+		int alertFd, DWORD dwMilliseconds)
+{
+	DWORD status;
+	struct timespec deadline;
+
+	/* APCs already queued run without waiting */
+	if (winpr_Apc_Run())
+		return WAIT_IO_COMPLETION;
+
+	status = winpr_WaitForMultipleObjects(nCount, lpHandles, bWaitAll, 0, NULL, NULL, alertFd,
+		ts_deadline_ms(&deadline, dwMilliseconds));
+
+	if (status == WAIT_IO_COMPLETION)
+		winpr_Apc_Run();
+
+	return status;
+}
+
+DWORD WaitForSingleObjectEx(HANDLE hHandle, DWORD dwMilliseconds, BOOL bAlertable)
+{
+	int alertFd;
+
+	if (!bAlertable || ((alertFd = winpr_Apc_GetWaitFd()) < 0))
+		return WaitForSingleObject(hHandle, dwMilliseconds);
+
+	return winpr_WaitForMultipleObjectsAlertable(1, &hHandle, FALSE, alertFd, dwMilliseconds);
+}
+
+DWORD WaitForMultipleObjectsEx(DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll,
+		DWORD dwMilliseconds, BOOL bAlertable)
+{
+	int alertFd;
+
+	if (!bAlertable || ((alertFd = winpr_Apc_GetWaitFd()) < 0))
+		return WaitForMultipleObjects(nCount, lpHandles, bWaitAll, dwMilliseconds);
+
+	return winpr_WaitForMultipleObjectsAlertable(nCount, lpHandles, bWaitAll, alertFd, dwMilliseconds);
+}
+
+DWORD winpr_SleepAlertable(DWORD dwMilliseconds)
+{
+	int alertFd;
+	struct timespec deadline;
+	const struct timespec* pDeadline;
+
+	if ((alertFd = winpr_Apc_GetWaitFd()) < 0)
+	{
+		Sleep(dwMilliseconds);
+		return 0;
+	}
+
+	if (winpr_Apc_Run())
+		return WAIT_IO_COMPLETION;
+
+	pDeadline = ts_deadline_ms(&deadline, dwMilliseconds);
+
+	/* the descriptor may have been signaled by an APC which already ran */
+	while (waitOnFd(alertFd, UZI_FD_READ, pDeadline) == 1)
+	{
+		if (winpr_Apc_Run())
+			return WAIT_IO_COMPLETION;
+	}
+
+	return 0;
+}
+
+DWORD WaitForMultipleObjectsReady(DWORD nCount, const HANDLE* lpHandles, DWORD dwStartIndex,
+		LPDWORD lpIndices, LPDWORD lpReadyCount, DWORD dwMilliseconds)
+{
+	struct timespec deadline;
+
+	if (!lpIndices || !lpReadyCount)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return WAIT_FAILED;
+	}
+
+	*lpReadyCount = 0;
+
+	return winpr_WaitForMultipleObjects(nCount, lpHandles, FALSE, dwStartIndex, lpIndices, lpReadyCount, -1,
+		ts_deadline_ms(&deadline, dwMilliseconds));
+}
+
+#else
+
+/* Time left before the deadline in milliseconds, rounded up */
+static DWORD winpr_deadline_to_ms(ULONGLONG DeadlineNs)
+{
+	ULONGLONG now;
+	ULONGLONG remaining;
+
+	if (DeadlineNs == WAIT_DEADLINE_INFINITE)
+		return INFINITE;
+
+	now = GetMonotonicTimeNs();
+
+	if (DeadlineNs <= now)
+		return 0;
+
+	remaining = (DeadlineNs - now + 999999) / 1000000;
+
+	return (remaining < INFINITE) ? (DWORD) remaining : (INFINITE - 1);
+}
+
+DWORD WaitForSingleObjectUntil(HANDLE hHandle, ULONGLONG DeadlineNs)
+{
+	return WaitForSingleObject(hHandle, winpr_deadline_to_ms(DeadlineNs));
+}
+
+DWORD WaitForMultipleObjectsUntil(DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll, ULONGLONG DeadlineNs)
+{
+	return WaitForMultipleObjects(nCount, lpHandles, bWaitAll, winpr_deadline_to_ms(DeadlineNs));
 }
 
 #endif
 
+bool UziGetSpinStats(uint32_t handleType, UZI_SPIN_STATS* stats)
+{
+#ifndef _WIN32
+	ULONG type;
+
+	if (!stats || (handleType >= HANDLE_TYPE_COUNT))
+		return false;
+
+	stats->hits = 0;
+	stats->misses = 0;
+
+	for (type = 0; type < HANDLE_TYPE_COUNT; type++)
+	{
+		if ((handleType != UZI_HANDLE_TYPE_ALL) && (type != handleType))
+			continue;
+
+		stats->hits += (uint64_t) g_SpinStats[type].Hits;
+		stats->misses += (uint64_t) g_SpinStats[type].Misses;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,959 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Wait Sets
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <uzi/crt.h>
+#include <uzi/synch.h>
+#include <uzi/error.h>
+
+#include "synch.h"
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#define WITH_EPOLL	1
+#else
+#include <poll.h>
+#endif
+
+#include "handle.h"
+
+#define TAG "waitset"
+
+/**
+ * Wait Sets
+ *
+ * WaitForMultipleObjects validates every handle, fetches its file
+ * descriptor and builds a pollfd array on each call, then scans all the
+ * results. A wait set does this once per handle, in WaitSetAdd: the file
+ * descriptor is registered with an epoll instance, and a wait only visits
+ * the descriptors reported ready by epoll_wait. Registrations are level
+ * triggered, so epoll rotates through the ready handles from one wait to
+ * the next.
+ *
+ * Each registered handle has an entry in the set, and epoll reports the
+ * entry index with the generation of the entry, so that a wait racing
+ * with WaitSetRemove does not report a handle which left the set. Ready
+ * handles are consumed like in WaitForMultipleObjects, through their
+ * CleanupHandle operation: an auto-reset event or a semaphore consumed by
+ * another waiter first is skipped, and the wait goes on when no handle was
+ * left. A mutex already owned by the waiting thread is not signaled, wait
+ * sets do not acquire it recursively.
+ *
+ * Without epoll, the wait set polls the registered file descriptors, which
+ * still saves the handle validation and file descriptor lookups, and checks
+ * the results from where the previous wait stopped.
+ */
+
+#define WINPR_WAIT_SET_EVENTS		64
+#define WINPR_WAIT_SET_NO_INDEX		((DWORD) -1)
+
+struct winpr_wait_set_entry
+{
+	HANDLE handle; /* NULL while the entry is free */
+	int fd;
+	ULONG Mode;
+	ULONG Generation;
+	DWORD Index; /* reported with the handle, see WaitForManyObjects */
+	DWORD NextFree;
+	DWORD NextHash;
+};
+typedef struct winpr_wait_set_entry WINPR_WAIT_SET_ENTRY;
+
+struct winpr_wait_set
+{
+	WINPR_HANDLE_DEF();
+
+	int epfd;
+	pthread_mutex_t lock;
+	DWORD count; /* entries in use */
+	DWORD size; /* entries allocated */
+	DWORD freeHead; /* first free entry, size when none */
+	WINPR_WAIT_SET_ENTRY* entries;
+	DWORD* buckets; /* entries by handle, size buckets */
+	DWORD pollStart; /* without epoll, first polled entry checked by the next wait */
+};
+typedef struct winpr_wait_set WINPR_WAIT_SET;
+
+#define WINPR_WAIT_SET_KEY(_index, _generation)	((((UINT64) (_generation)) << 32) | (_index))
+#define WINPR_WAIT_SET_KEY_INDEX(_key)		((DWORD) ((_key) & 0xFFFFFFFF))
+#define WINPR_WAIT_SET_KEY_GENERATION(_key)	((ULONG) ((_key) >> 32))
+
+static BOOL WaitSetIsHandled(HANDLE handle)
+{
+	WINPR_WAIT_SET* waitSet = (WINPR_WAIT_SET*) handle;
+
+	if (!waitSet || (waitSet->Type != HANDLE_TYPE_WAIT_SET))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL WaitSetCloseHandle(HANDLE handle)
+{
+	WINPR_WAIT_SET* waitSet = (WINPR_WAIT_SET*) handle;
+
+	if (!WaitSetIsHandled(handle))
+		return FALSE;
+
+#ifdef WITH_EPOLL
+	if (waitSet->epfd >= 0)
+	{
+		close(waitSet->epfd);
+		winpr_Handle_TrackFds(HANDLE_TYPE_WAIT_SET, -1);
+	}
+#endif
+
+	pthread_mutex_destroy(&waitSet->lock);
+	free(waitSet->entries);
+	free(waitSet->buckets);
+	free(waitSet);
+	return TRUE;
+}
+
+static HANDLE_OPS ops =
+{
+	WaitSetIsHandled,
+	WaitSetCloseHandle,
+	NULL, /* GetFd */
+	NULL /* CleanupHandle */
+};
+
+static WINPR_WAIT_SET* WaitSetFromHandle(HANDLE hWaitSet)
+{
+	ULONG Type;
+	WINPR_HANDLE* Object;
+
+	if (!winpr_Handle_GetInfo(hWaitSet, &Type, &Object) || (Type != HANDLE_TYPE_WAIT_SET))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return NULL;
+	}
+
+	return (WINPR_WAIT_SET*) Object;
+}
+
+/**
+ * Entries are found by handle through a hash table with as many buckets as
+ * there are entries, indexed with the low bits of the handle, which hold
+ * the handle table slot and differ between live handles.
+ */
+static DWORD* WaitSetBucket(WINPR_WAIT_SET* waitSet, HANDLE hHandle)
+{
+	return &waitSet->buckets[((ULONG_PTR) hHandle) & (waitSet->size - 1)];
+}
+
+/* Returns a free entry, called with the lock held */
+static WINPR_WAIT_SET_ENTRY* WaitSetNewEntry(WINPR_WAIT_SET* waitSet, HANDLE hHandle)
+{
+	DWORD index;
+	DWORD size;
+	DWORD* bucket;
+	DWORD* buckets;
+	WINPR_WAIT_SET_ENTRY* entries;
+
+	if (waitSet->freeHead == waitSet->size)
+	{
+		size = waitSet->size ? waitSet->size * 2 : 16;
+		entries = (WINPR_WAIT_SET_ENTRY*) realloc(waitSet->entries, size * sizeof(WINPR_WAIT_SET_ENTRY));
+
+		if (!entries)
+			return NULL;
+
+		waitSet->entries = entries;
+
+		if (!(buckets = (DWORD*) realloc(waitSet->buckets, size * sizeof(DWORD))))
+			return NULL;
+
+		ZeroMemory(&entries[waitSet->size], (size - waitSet->size) * sizeof(WINPR_WAIT_SET_ENTRY));
+
+		for (index = waitSet->size; index < size; index++)
+			entries[index].NextFree = index + 1;
+
+		waitSet->buckets = buckets;
+		waitSet->freeHead = waitSet->size;
+		waitSet->size = size;
+
+		/* rehash the entries in use */
+		for (index = 0; index < size; index++)
+			buckets[index] = WINPR_WAIT_SET_NO_INDEX;
+
+		for (index = 0; index < size; index++)
+		{
+			if (!entries[index].handle)
+				continue;
+
+			bucket = WaitSetBucket(waitSet, entries[index].handle);
+			entries[index].NextHash = *bucket;
+			*bucket = index;
+		}
+	}
+
+	index = waitSet->freeHead;
+	waitSet->freeHead = waitSet->entries[index].NextFree;
+	waitSet->count++;
+
+	bucket = WaitSetBucket(waitSet, hHandle);
+	waitSet->entries[index].handle = hHandle;
+	waitSet->entries[index].NextHash = *bucket;
+	*bucket = index;
+
+	return &waitSet->entries[index];
+}
+
+/* Releases an entry, called with the lock held */
+static void WaitSetFreeEntry(WINPR_WAIT_SET* waitSet, WINPR_WAIT_SET_ENTRY* entry)
+{
+	DWORD index = (DWORD) (entry - waitSet->entries);
+	DWORD* link = WaitSetBucket(waitSet, entry->handle);
+
+	while (*link != index)
+		link = &waitSet->entries[*link].NextHash;
+
+	*link = entry->NextHash;
+
+	entry->handle = NULL;
+	entry->fd = -1;
+	entry->Generation++;
+	entry->NextFree = waitSet->freeHead;
+
+	waitSet->freeHead = index;
+	waitSet->count--;
+}
+
+static WINPR_WAIT_SET_ENTRY* WaitSetFindEntry(WINPR_WAIT_SET* waitSet, HANDLE hHandle)
+{
+	DWORD index;
+
+	if (!waitSet->size)
+		return NULL;
+
+	for (index = *WaitSetBucket(waitSet, hHandle); index != WINPR_WAIT_SET_NO_INDEX;
+			index = waitSet->entries[index].NextHash)
+	{
+		if (waitSet->entries[index].handle == hHandle)
+			return &waitSet->entries[index];
+	}
+
+	return NULL;
+}
+
+/**
+ * Unregisters the file descriptor of an entry and releases it, called with
+ * the lock held. EPOLL_CTL_DEL finds the registration by file descriptor
+ * number: once the handle is closed, its object may have closed the file
+ * descriptor, which drops the registration, and the number may since have
+ * been given to another handle of the set, whose registration must stay.
+ * The number is unregistered for a closed handle only when no other entry
+ * uses it, which still covers objects kept open by a duplicate handle.
+ */
+static void WaitSetDropEntry(WINPR_WAIT_SET* waitSet, WINPR_WAIT_SET_ENTRY* entry)
+{
+#ifdef WITH_EPOLL
+	DWORD index;
+	ULONG Type;
+	WINPR_HANDLE* Object;
+	BOOL registered = TRUE;
+
+	if (!winpr_Handle_GetInfo(entry->handle, &Type, &Object) || (winpr_Handle_getFd(Object) != entry->fd))
+	{
+		for (index = 0; index < waitSet->size; index++)
+		{
+			if (waitSet->entries[index].handle && (&waitSet->entries[index] != entry) &&
+					(waitSet->entries[index].fd == entry->fd))
+			{
+				registered = FALSE;
+				break;
+			}
+		}
+	}
+
+	if (registered)
+		epoll_ctl(waitSet->epfd, EPOLL_CTL_DEL, entry->fd, NULL);
+#endif
+
+	WaitSetFreeEntry(waitSet, entry);
+}
+
+#ifdef WITH_EPOLL
+static uint32_t WaitSetModeToEpollEvents(ULONG mode)
+{
+	uint32_t events = 0;
+
+	if (mode & UZI_FD_READ)
+		events |= EPOLLIN;
+	if (mode & UZI_FD_WRITE)
+		events |= EPOLLOUT;
+
+	return events;
+}
+#else
+static short WaitSetModeToPollEvents(ULONG mode)
+{
+	short events = 0;
+
+	if (mode & UZI_FD_READ)
+		events |= POLLIN;
+	if (mode & UZI_FD_WRITE)
+		events |= POLLOUT;
+
+	return events;
+}
+#endif
+
+/**
+ * Resolves the key reported for a ready file descriptor, returns the handle
+ * and its index, or NULL if it left the set. A handle closed while in the set is removed
+ * from it. Called with the lock held.
+ */
+static HANDLE WaitSetResolveKey(WINPR_WAIT_SET* waitSet, UINT64 key, WINPR_HANDLE** pObject, DWORD* pIndex)
+{
+	ULONG Type;
+	WINPR_WAIT_SET_ENTRY* entry;
+	DWORD index = WINPR_WAIT_SET_KEY_INDEX(key);
+
+	if (index >= waitSet->size)
+		return NULL;
+
+	entry = &waitSet->entries[index];
+
+	if (!entry->handle || (entry->Generation != WINPR_WAIT_SET_KEY_GENERATION(key)))
+		return NULL;
+
+	if (!winpr_Handle_GetInfo(entry->handle, &Type, pObject))
+	{
+		WaitSetDropEntry(waitSet, entry);
+		return NULL;
+	}
+
+	*pIndex = entry->Index;
+	return entry->handle;
+}
+
+/**
+ * Waits for ready file descriptors and stores the keys of their entries,
+ * returns the number of keys, 0 on timeout or -1 on failure.
+ */
+#ifdef WITH_EPOLL
+static int WaitSetPoll(WINPR_WAIT_SET* waitSet, UINT64* keys, DWORD nCount, int timeout)
+{
+	int index;
+	int status;
+	struct epoll_event events[WINPR_WAIT_SET_EVENTS];
+
+	if (nCount > WINPR_WAIT_SET_EVENTS)
+		nCount = WINPR_WAIT_SET_EVENTS;
+
+	do
+	{
+		status = epoll_wait(waitSet->epfd, events, (int) nCount, timeout);
+	}
+	while ((status < 0) && (errno == EINTR));
+
+	for (index = 0; index < status; index++)
+		keys[index] = events[index].data.u64;
+
+	return status;
+}
+#else
+static int WaitSetPoll(WINPR_WAIT_SET* waitSet, UINT64* keys, DWORD nCount, int timeout)
+{
+	DWORD index;
+	DWORD start;
+	DWORD polled = 0;
+	int status;
+	int count = 0;
+	UINT64 stackKeys[WINPR_WAIT_SET_EVENTS];
+	struct pollfd stackfds[WINPR_WAIT_SET_EVENTS];
+	UINT64* pollKeys = stackKeys;
+	struct pollfd* pollfds = stackfds;
+
+	pthread_mutex_lock(&waitSet->lock);
+
+	if (waitSet->count > WINPR_WAIT_SET_EVENTS)
+	{
+		pollfds = (struct pollfd*) calloc(waitSet->count, sizeof(struct pollfd));
+		pollKeys = (UINT64*) calloc(waitSet->count, sizeof(UINT64));
+
+		if (!pollfds || !pollKeys)
+		{
+			pthread_mutex_unlock(&waitSet->lock);
+			free(pollfds);
+			free(pollKeys);
+			return -1;
+		}
+	}
+
+	for (index = 0; index < waitSet->size; index++)
+	{
+		WINPR_WAIT_SET_ENTRY* entry = &waitSet->entries[index];
+
+		if (!entry->handle)
+			continue;
+
+		pollfds[polled].fd = entry->fd;
+		pollfds[polled].events = WaitSetModeToPollEvents(entry->Mode);
+		pollKeys[polled] = WINPR_WAIT_SET_KEY(index, entry->Generation);
+		polled++;
+	}
+
+	pthread_mutex_unlock(&waitSet->lock);
+
+	do
+	{
+		status = poll(pollfds, polled, timeout);
+	}
+	while ((status < 0) && (errno == EINTR));
+
+	/* start after the last handle reported, like epoll rotates ready handles */
+	start = polled ? (waitSet->pollStart % polled) : 0;
+
+	for (index = 0; (status > 0) && (index < polled) && (count < (int) nCount); index++)
+	{
+		DWORD position = (start + index) % polled;
+
+		if (pollfds[position].revents & (pollfds[position].events | POLLHUP | POLLERR | POLLNVAL))
+		{
+			keys[count++] = pollKeys[position];
+			waitSet->pollStart = position + 1;
+		}
+	}
+
+	if (pollfds != stackfds)
+	{
+		free(pollfds);
+		free(pollKeys);
+	}
+
+	return (status < 0) ? -1 : count;
+}
+#endif
+
+HANDLE CreateWaitSet(void)
+{
+	HANDLE handle;
+	WINPR_WAIT_SET* waitSet;
+
+	waitSet = (WINPR_WAIT_SET*) calloc(1, sizeof(WINPR_WAIT_SET));
+
+	if (!waitSet)
+		return NULL;
+
+	waitSet->epfd = -1;
+	waitSet->ops = &ops;
+
+	if (pthread_mutex_init(&waitSet->lock, NULL) != 0)
+	{
+		free(waitSet);
+		return NULL;
+	}
+
+	WINPR_HANDLE_SET_TYPE_AND_MODE(waitSet, HANDLE_TYPE_WAIT_SET, 0);
+
+#ifdef WITH_EPOLL
+	waitSet->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (waitSet->epfd < 0)
+	{
+		SetLastError(ERROR_NO_SYSTEM_RESOURCES);
+		WaitSetCloseHandle(waitSet);
+		return NULL;
+	}
+
+	winpr_Handle_TrackFds(HANDLE_TYPE_WAIT_SET, 1);
+#endif
+
+	handle = winpr_Handle_Register((WINPR_HANDLE*) waitSet);
+
+	if (!handle)
+		WaitSetCloseHandle(waitSet);
+
+	return handle;
+}
+
+/**
+ * Adds a handle to the set with the given index, or changes the index of a
+ * handle already in the set. pPrevious receives the previous index of the
+ * handle, or WINPR_WAIT_SET_NO_INDEX if it was not in the set.
+ */
+static BOOL winpr_WaitSet_Add(WINPR_WAIT_SET* waitSet, HANDLE hHandle, DWORD index, DWORD* pPrevious)
+{
+	int fd;
+	ULONG Type;
+	WINPR_HANDLE* Object;
+	WINPR_WAIT_SET_ENTRY* entry;
+#ifdef WITH_EPOLL
+	struct epoll_event event;
+#endif
+
+	*pPrevious = WINPR_WAIT_SET_NO_INDEX;
+
+	if (!winpr_Handle_GetInfo(hHandle, &Type, &Object) || (Type == HANDLE_TYPE_WAIT_SET))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+
+	/* creates the file descriptor of objects which create it on demand */
+	if ((fd = winpr_Handle_getFd(Object)) < 0)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&waitSet->lock);
+
+	if ((entry = WaitSetFindEntry(waitSet, hHandle)))
+	{
+		*pPrevious = entry->Index;
+		entry->Index = index;
+		pthread_mutex_unlock(&waitSet->lock);
+		return TRUE;
+	}
+
+	if (!(entry = WaitSetNewEntry(waitSet, hHandle)))
+	{
+		pthread_mutex_unlock(&waitSet->lock);
+		SetLastError(ERROR_NO_SYSTEM_RESOURCES);
+		return FALSE;
+	}
+
+	entry->fd = fd;
+	entry->Mode = Object->Mode;
+	entry->Index = index;
+
+#ifdef WITH_EPOLL
+	ZeroMemory(&event, sizeof(event));
+	event.events = WaitSetModeToEpollEvents(entry->Mode);
+	event.data.u64 = WINPR_WAIT_SET_KEY(entry - waitSet->entries, entry->Generation);
+
+	if (epoll_ctl(waitSet->epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+	{
+		WaitSetFreeEntry(waitSet, entry);
+		pthread_mutex_unlock(&waitSet->lock);
+		SetLastError(ERROR_INTERNAL_ERROR);
+		return FALSE;
+	}
+#endif
+
+	pthread_mutex_unlock(&waitSet->lock);
+	return TRUE;
+}
+
+static BOOL winpr_WaitSet_Remove(WINPR_WAIT_SET* waitSet, HANDLE hHandle)
+{
+	WINPR_WAIT_SET_ENTRY* entry;
+
+	pthread_mutex_lock(&waitSet->lock);
+
+	if (!hHandle || !(entry = WaitSetFindEntry(waitSet, hHandle)))
+	{
+		pthread_mutex_unlock(&waitSet->lock);
+		SetLastError(ERROR_NOT_FOUND);
+		return FALSE;
+	}
+
+	WaitSetDropEntry(waitSet, entry);
+	pthread_mutex_unlock(&waitSet->lock);
+	return TRUE;
+}
+
+/**
+ * Waits for at most nCount (up to WINPR_WAIT_SET_EVENTS) signaled handles,
+ * storing the handles and their indices. When a seen bitmap is given, the
+ * handles whose index is marked in it are neither consumed nor reported,
+ * and the indices reported are marked. pbMore is set when the kernel may
+ * have more ready file descriptors to report: it filled the batch, none of
+ * which was already seen.
+ */
+static DWORD winpr_WaitSet_Wait(WINPR_WAIT_SET* waitSet, HANDLE* lpHandles, DWORD* lpIndices,
+		DWORD nCount, LPDWORD lpSignaledCount, BYTE* seen, BOOL* pbMore, DWORD dwMilliseconds)
+{
+	int index;
+	int status;
+	int timeout;
+	DWORD signaled;
+	DWORD ready;
+	struct timespec deadline;
+	const struct timespec* pDeadline;
+	UINT64 keys[WINPR_WAIT_SET_EVENTS];
+	WINPR_HANDLE* objects[WINPR_WAIT_SET_EVENTS];
+	HANDLE handles[WINPR_WAIT_SET_EVENTS];
+	DWORD indices[WINPR_WAIT_SET_EVENTS];
+
+	*lpSignaledCount = 0;
+	*pbMore = FALSE;
+
+	if (nCount > WINPR_WAIT_SET_EVENTS)
+		nCount = WINPR_WAIT_SET_EVENTS;
+
+	pDeadline = ts_deadline_ms(&deadline, dwMilliseconds);
+	timeout = ts_remaining_ms(pDeadline);
+
+	for (;;)
+	{
+		status = WaitSetPoll(waitSet, keys, nCount, timeout);
+
+		if (status < 0)
+		{
+			SetLastError(ERROR_INTERNAL_ERROR);
+			return WAIT_FAILED;
+		}
+
+		/* the timeout is capped, poll again until the deadline */
+		if (status == 0)
+		{
+			if (!(timeout = ts_remaining_ms(pDeadline)))
+				return WAIT_TIMEOUT;
+
+			continue;
+		}
+
+		*pbMore = (status == (int) nCount) ? TRUE : FALSE;
+
+		ready = 0;
+		pthread_mutex_lock(&waitSet->lock);
+
+		for (index = 0; index < status; index++)
+		{
+			handles[ready] = WaitSetResolveKey(waitSet, keys[index], &objects[ready], &indices[ready]);
+
+			if (!handles[ready])
+				continue;
+
+			if (seen && (seen[indices[ready] / 8] & (1 << (indices[ready] % 8))))
+			{
+				*pbMore = FALSE;
+				continue;
+			}
+
+			ready++;
+		}
+
+		pthread_mutex_unlock(&waitSet->lock);
+
+		signaled = 0;
+
+		for (index = 0; index < (int) ready; index++)
+		{
+			DWORD rc = winpr_Handle_cleanup(objects[index]);
+
+			/* consumed by another waiter first */
+			if (rc == WAIT_TIMEOUT)
+				continue;
+
+			/* report the handles already consumed before the failure */
+			if (rc != WAIT_OBJECT_0)
+			{
+				if (signaled)
+					break;
+
+				return rc;
+			}
+
+			if (seen)
+				seen[indices[index] / 8] |= (1 << (indices[index] % 8));
+
+			lpHandles[signaled] = handles[index];
+
+			if (lpIndices)
+				lpIndices[signaled] = indices[index];
+
+			signaled++;
+		}
+
+		if (signaled)
+		{
+			*lpSignaledCount = signaled;
+			return WAIT_OBJECT_0;
+		}
+
+		if (pDeadline && !(timeout = ts_remaining_ms(pDeadline)))
+			return WAIT_TIMEOUT;
+	}
+}
+
+BOOL WaitSetAdd(HANDLE hWaitSet, HANDLE hHandle)
+{
+	DWORD previous;
+	WINPR_WAIT_SET* waitSet;
+
+	if (!(waitSet = WaitSetFromHandle(hWaitSet)))
+		return FALSE;
+
+	if (!winpr_WaitSet_Add(waitSet, hHandle, 0, &previous))
+		return FALSE;
+
+	if (previous != WINPR_WAIT_SET_NO_INDEX)
+	{
+		SetLastError(ERROR_ALREADY_EXISTS);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL WaitSetRemove(HANDLE hWaitSet, HANDLE hHandle)
+{
+	WINPR_WAIT_SET* waitSet;
+
+	if (!(waitSet = WaitSetFromHandle(hWaitSet)))
+		return FALSE;
+
+	return winpr_WaitSet_Remove(waitSet, hHandle);
+}
+
+DWORD WaitSetWait(HANDLE hWaitSet, HANDLE* lpHandles, DWORD nCount,
+		LPDWORD lpSignaledCount, DWORD dwMilliseconds)
+{
+	BOOL bMore;
+	WINPR_WAIT_SET* waitSet;
+
+	if (!(waitSet = WaitSetFromHandle(hWaitSet)))
+		return WAIT_FAILED;
+
+	if (!lpHandles || !nCount || !lpSignaledCount)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return WAIT_FAILED;
+	}
+
+	return winpr_WaitSet_Wait(waitSet, lpHandles, NULL, nCount, lpSignaledCount,
+		NULL, &bMore, dwMilliseconds);
+}
+
+/**
+ * Waits on many objects
+ *
+ * WaitForManyObjects keeps one wait set per thread, registered with the
+ * handles of the previous call: the handles of a new call are compared
+ * with the registered ones, and only the handles which changed are added
+ * to or removed from the set, without any system call for the others.
+ * Waiting on the same handles over and over, like an event loop does,
+ * costs a pointer comparison per handle and a system call per batch of
+ * ready handles.
+ *
+ * Ready handles are collected in batches of WINPR_WAIT_SET_EVENTS. The
+ * first batch waits, the next ones only check, until the kernel has no
+ * more ready handles to report or reports one already collected (epoll
+ * reports level-triggered handles again once it went through all of them).
+ * A seen bitmap keeps a handle which stays signaled from being reported or
+ * consumed twice.
+ *
+ * The handles of a call are not validated again when they did not change,
+ * a handle closed since the previous call is never reported.
+ */
+
+struct winpr_wait_many
+{
+	HANDLE hWaitSet;
+	WINPR_WAIT_SET* waitSet;
+	DWORD count; /* handles registered */
+	DWORD size; /* capacity of handles and seen */
+	HANDLE* handles; /* registered handle of each index, NULL if none */
+	BYTE* seen;
+};
+typedef struct winpr_wait_many WINPR_WAIT_MANY;
+
+static pthread_once_t g_WaitManyKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_WaitManyKey;
+static __thread WINPR_WAIT_MANY* t_WaitMany = NULL;
+
+static void winpr_WaitMany_Free(void* arg)
+{
+	WINPR_WAIT_MANY* waitMany = (WINPR_WAIT_MANY*) arg;
+
+	if (!waitMany)
+		return;
+
+	if (waitMany->hWaitSet)
+		CloseHandle(waitMany->hWaitSet);
+
+	free(waitMany->handles);
+	free(waitMany->seen);
+	free(waitMany);
+}
+
+static void winpr_WaitMany_InitKey(void)
+{
+	pthread_key_create(&g_WaitManyKey, winpr_WaitMany_Free);
+}
+
+static WINPR_WAIT_MANY* winpr_WaitMany_Get(DWORD nCount)
+{
+	DWORD size;
+	HANDLE* handles;
+	BYTE* seen;
+	WINPR_WAIT_MANY* waitMany = t_WaitMany;
+
+	if (!waitMany)
+	{
+		pthread_once(&g_WaitManyKeyOnce, winpr_WaitMany_InitKey);
+
+		if (!(waitMany = (WINPR_WAIT_MANY*) calloc(1, sizeof(WINPR_WAIT_MANY))))
+			return NULL;
+
+		if (!(waitMany->hWaitSet = CreateWaitSet()))
+		{
+			free(waitMany);
+			return NULL;
+		}
+
+		waitMany->waitSet = WaitSetFromHandle(waitMany->hWaitSet);
+		t_WaitMany = waitMany;
+		pthread_setspecific(g_WaitManyKey, waitMany);
+	}
+
+	if (nCount > waitMany->size)
+	{
+		size = waitMany->size ? waitMany->size : 64;
+
+		while (size < nCount)
+			size *= 2;
+
+		if (!(handles = (HANDLE*) realloc(waitMany->handles, size * sizeof(HANDLE))))
+			return NULL;
+
+		waitMany->handles = handles;
+		ZeroMemory(&handles[waitMany->size], (size - waitMany->size) * sizeof(HANDLE));
+
+		if (!(seen = (BYTE*) realloc(waitMany->seen, (size + 7) / 8)))
+			return NULL;
+
+		waitMany->seen = seen;
+		ZeroMemory(seen, (size + 7) / 8);
+		waitMany->size = size;
+	}
+
+	return waitMany;
+}
+
+/**
+ * Registers the handles of a call, only updating the indices which changed.
+ * All the handles which left their index are removed before any handle is
+ * added, as a closed handle may have left its file descriptor number to a
+ * new one.
+ */
+static BOOL winpr_WaitMany_Update(WINPR_WAIT_MANY* waitMany, DWORD nCount, const HANDLE* lpHandles)
+{
+	DWORD index;
+	DWORD previous;
+
+	for (index = 0; index < waitMany->count; index++)
+	{
+		if (!waitMany->handles[index])
+			continue;
+
+		if ((index < nCount) && (waitMany->handles[index] == lpHandles[index]))
+			continue;
+
+		winpr_WaitSet_Remove(waitMany->waitSet, waitMany->handles[index]);
+		waitMany->handles[index] = NULL;
+	}
+
+	waitMany->count = nCount;
+
+	for (index = 0; index < nCount; index++)
+	{
+		if (waitMany->handles[index])
+			continue;
+
+		if (!winpr_WaitSet_Add(waitMany->waitSet, lpHandles[index], index, &previous))
+			return FALSE;
+
+		/* the same handle twice in the array */
+		if (previous != WINPR_WAIT_SET_NO_INDEX)
+		{
+			winpr_WaitSet_Add(waitMany->waitSet, lpHandles[index], previous, &previous);
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return FALSE;
+		}
+
+		waitMany->handles[index] = lpHandles[index];
+	}
+
+	return TRUE;
+}
+
+DWORD WaitForManyObjects(DWORD nCount, const HANDLE* lpHandles, LPDWORD lpIndices,
+		LPDWORD lpReadyCount, DWORD dwMilliseconds)
+{
+	DWORD index;
+	DWORD count;
+	DWORD total;
+	DWORD status;
+	BOOL bMore;
+	WINPR_WAIT_MANY* waitMany;
+	HANDLE handles[WINPR_WAIT_SET_EVENTS];
+
+	if (!nCount || !lpHandles || !lpIndices || !lpReadyCount)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return WAIT_FAILED;
+	}
+
+	*lpReadyCount = 0;
+
+	if (!(waitMany = winpr_WaitMany_Get(nCount)))
+	{
+		SetLastError(ERROR_NO_SYSTEM_RESOURCES);
+		return WAIT_FAILED;
+	}
+
+	if (!winpr_WaitMany_Update(waitMany, nCount, lpHandles))
+		return WAIT_FAILED;
+
+	status = winpr_WaitSet_Wait(waitMany->waitSet, handles, lpIndices, nCount,
+		&total, waitMany->seen, &bMore, dwMilliseconds);
+
+	if (status != WAIT_OBJECT_0)
+		return status;
+
+	/* collect the other ready handles without waiting */
+	while (bMore && (total < nCount))
+	{
+		status = winpr_WaitSet_Wait(waitMany->waitSet, handles, &lpIndices[total], nCount - total,
+			&count, waitMany->seen, &bMore, 0);
+
+		if (status != WAIT_OBJECT_0)
+			break;
+
+		total += count;
+	}
+
+	for (index = 0; index < total; index++)
+		waitMany->seen[lpIndices[index] / 8] &= ~(1 << (lpIndices[index] % 8));
+
+	*lpReadyCount = total;
+	return WAIT_OBJECT_0;
+}
+
+#endif
@@ -0,0 +1,183 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Wait Profiling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <uzi/uzi.h>
+#include <uzi/wtypes.h>
+#include <uzi/synch.h>
+#include <uzi/sysinfo.h>
+
+#ifndef _WIN32
+
+#include <pthread.h>
+
+#include "waitstats.h"
+
+static BOOL g_WaitProfiling = FALSE;
+
+static pthread_once_t g_WaitStatsKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_WaitStatsKey;
+static __thread WINPR_WAIT_STATS* t_WaitStats = NULL;
+
+static void winpr_WaitStats_InitKey(void)
+{
+	pthread_key_create(&g_WaitStatsKey, free);
+}
+
+WINPR_WAIT_STATS* winpr_WaitStats_Get(void)
+{
+	WINPR_WAIT_STATS* stats;
+
+	if (!g_WaitProfiling)
+		return NULL;
+
+	if (!(stats = t_WaitStats))
+	{
+		pthread_once(&g_WaitStatsKeyOnce, winpr_WaitStats_InitKey);
+
+		if (!(stats = (WINPR_WAIT_STATS*) calloc(1, sizeof(WINPR_WAIT_STATS))))
+			return NULL;
+
+		t_WaitStats = stats;
+		pthread_setspecific(g_WaitStatsKey, stats);
+	}
+
+	return stats;
+}
+
+void winpr_WaitStats_Blocking(WINPR_WAIT_STATS* stats)
+{
+	/* the bWaitAll loop blocks several times in the same wait */
+	if (stats && !stats->BlockStart)
+		stats->BlockStart = GetMonotonicTimeNs();
+}
+
+void winpr_WaitStats_Spurious(WINPR_WAIT_STATS* stats, ULONG Type)
+{
+	if (stats && (Type < HANDLE_TYPE_COUNT))
+		stats->Types[Type].Spurious++;
+}
+
+void winpr_WaitStats_Done(WINPR_WAIT_STATS* stats, ULONG Type, DWORD status)
+{
+	int bucket = 0;
+	ULONGLONG blockStart;
+	ULONGLONG latency;
+	WINPR_WAIT_TYPE_STATS* typeStats;
+
+	if (!stats)
+		return;
+
+	blockStart = stats->BlockStart;
+	stats->BlockStart = 0;
+
+	if (Type >= HANDLE_TYPE_COUNT)
+		return;
+
+	typeStats = &stats->Types[Type];
+	typeStats->Waits++;
+
+	if (status == WAIT_TIMEOUT)
+		typeStats->Timeouts++;
+
+	if (!blockStart)
+	{
+		typeStats->Immediate++;
+		return;
+	}
+
+	latency = GetMonotonicTimeNs() - blockStart;
+	typeStats->Blocked++;
+	typeStats->BlockedTotal += latency;
+
+	latency /= 1000;
+
+	while (latency && (bucket < UZI_WAIT_STATS_BUCKETS - 1))
+	{
+		latency >>= 1;
+		bucket++;
+	}
+
+	typeStats->LatencyHistogram[bucket]++;
+}
+
+#endif
+
+bool UziSetWaitProfiling(bool enabled)
+{
+#ifndef _WIN32
+	BOOL previous = g_WaitProfiling;
+
+	g_WaitProfiling = enabled ? TRUE : FALSE;
+	return previous ? true : false;
+#else
+	return false;
+#endif
+}
+
+bool UziGetWaitStats(uint32_t handleType, UZI_WAIT_STATS* stats)
+{
+#ifndef _WIN32
+	ULONG type;
+	int bucket;
+	const WINPR_WAIT_TYPE_STATS* typeStats;
+
+	if (!stats || (handleType >= HANDLE_TYPE_COUNT))
+		return false;
+
+	memset(stats, 0, sizeof(UZI_WAIT_STATS));
+
+	/* threads which did not wait while profiling have no stats yet */
+	if (!t_WaitStats)
+		return true;
+
+	for (type = 0; type < HANDLE_TYPE_COUNT; type++)
+	{
+		if ((handleType != UZI_HANDLE_TYPE_ALL) && (type != handleType))
+			continue;
+
+		typeStats = &t_WaitStats->Types[type];
+		stats->waits += typeStats->Waits;
+		stats->immediate += typeStats->Immediate;
+		stats->blocked += typeStats->Blocked;
+		stats->timeouts += typeStats->Timeouts;
+		stats->spurious += typeStats->Spurious;
+		stats->blockedTotal += typeStats->BlockedTotal;
+
+		for (bucket = 0; bucket < UZI_WAIT_STATS_BUCKETS; bucket++)
+			stats->latencyHistogram[bucket] += typeStats->LatencyHistogram[bucket];
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void UziResetWaitStats(void)
+{
+#ifndef _WIN32
+	if (t_WaitStats)
+		memset(t_WaitStats, 0, sizeof(WINPR_WAIT_STATS));
+#endif
+}
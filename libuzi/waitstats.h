@@ -0,0 +1,71 @@
+/**
+ * WinPR: Windows Portable Runtime
+ * Wait Profiling
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WINPR_WAITSTATS_PRIVATE_H
+#define WINPR_WAITSTATS_PRIVATE_H
+
+#include <uzi/uzi.h>
+#include <uzi/wtypes.h>
+
+#ifndef _WIN32
+
+#include "handle.h"
+
+/**
+ * Wait Profiling
+ *
+ * While profiling is enabled with UziSetWaitProfiling, every thread which
+ * waits on a handle gets a stats block, allocated on its first wait and
+ * freed when it exits. Only the owning thread reads and writes it, so the
+ * counters are plain integers. With profiling disabled, waits only pay for
+ * a flag check.
+ *
+ * A wait is immediate when the first check of its handles returned, and
+ * blocked otherwise, from the time it started spinning or polling to the
+ * time it returned. Times are in nanoseconds.
+ */
+
+struct winpr_wait_type_stats
+{
+	ULONGLONG Waits;
+	ULONGLONG Immediate;
+	ULONGLONG Blocked;
+	ULONGLONG Timeouts;
+	ULONGLONG Spurious;
+	ULONGLONG BlockedTotal;
+	ULONGLONG LatencyHistogram[UZI_WAIT_STATS_BUCKETS];
+};
+typedef struct winpr_wait_type_stats WINPR_WAIT_TYPE_STATS;
+
+struct winpr_wait_stats
+{
+	ULONGLONG BlockStart; /* when the current wait blocked, 0 if it did not */
+	WINPR_WAIT_TYPE_STATS Types[HANDLE_TYPE_COUNT];
+};
+typedef struct winpr_wait_stats WINPR_WAIT_STATS;
+
+/* Returns the stats of the calling thread, NULL when profiling is disabled */
+WINPR_WAIT_STATS* winpr_WaitStats_Get(void);
+
+/* The functions below accept NULL stats and do nothing then */
+void winpr_WaitStats_Blocking(WINPR_WAIT_STATS* stats);
+void winpr_WaitStats_Spurious(WINPR_WAIT_STATS* stats, ULONG Type);
+void winpr_WaitStats_Done(WINPR_WAIT_STATS* stats, ULONG Type, DWORD status);
+
+#endif
+
+#endif /* WINPR_WAITSTATS_PRIVATE_H */